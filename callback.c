@@ -4,17 +4,48 @@
  */
 
 #include <stddef.h>
+#include <string.h>
 
 #include "putty.h"
 
+/*
+ * Each queued callback lives on two lists: the run queue, in the
+ * order it was queued, and a chain in a small hash table indexed by
+ * its 'owner', which is the context pointer that
+ * delete_callbacks_for_context will be called with when the owning
+ * object goes away. That's just ctx for an ordinary callback, but for
+ * an idempotent one, ctx points at the IdempotentCallback structure,
+ * so the owner is the context _that_ contains.
+ *
+ * delete_callbacks_for_context is called every time almost anything
+ * is freed, usually with nothing queued for it, so it's worth not
+ * having to scan the whole queue to find that out.
+ */
 struct callback {
-    struct callback *next;
+    struct callback *next, *prev;      /* run queue */
+    struct callback *hnext, **hprevp;  /* hash chain */
 
     toplevel_callback_fn_t fn;
     void *ctx;
+    void *owner;
 };
 
-static struct callback *cbcurr = NULL, *cbhead = NULL, *cbtail = NULL;
+/* The run queue is circular, through this sentinel. */
+static struct callback cbqueue = { &cbqueue, &cbqueue };
+static struct callback *cbcurr = NULL;
+
+static struct callback **cbhash;
+static size_t cbhash_size, cbqueued;
+
+/*
+ * Nodes are recycled through a free list rather than going back to
+ * the allocator every time, since a busy session queues and runs
+ * thousands of callbacks a second. We keep enough spare nodes to
+ * absorb a large burst, and free any beyond that.
+ */
+#define CALLBACK_POOL_MAX 1024
+static struct callback *cbfree;
+static size_t cbfree_count;
 
 static toplevel_callback_notify_fn_t notify_frontend = NULL;
 static void *notify_ctx = NULL;
@@ -41,41 +72,95 @@ void queue_idempotent_callback(struct IdempotentCallback *ic)
     queue_toplevel_callback(run_idempotent_callback, ic);
 }
 
+static inline size_t cbhash_index(void *owner)
+{
+    size_t h = (uintptr_t)owner;
+    h ^= h >> 7;
+    h ^= h >> 15;
+    return h & (cbhash_size - 1);
+}
+
+static void cbhash_insert(struct callback *cb)
+{
+    struct callback **bucket = &cbhash[cbhash_index(cb->owner)];
+    cb->hnext = *bucket;
+    if (cb->hnext)
+        cb->hnext->hprevp = &cb->hnext;
+    cb->hprevp = bucket;
+    *bucket = cb;
+}
+
+static void cbhash_grow(void)
+{
+    size_t newsize = cbhash_size ? cbhash_size * 2 : 64;
+    sfree(cbhash);
+    cbhash = snewn(newsize, struct callback *);
+    memset(cbhash, 0, newsize * sizeof(*cbhash));
+    cbhash_size = newsize;
+
+    for (struct callback *cb = cbqueue.next; cb != &cbqueue; cb = cb->next)
+        cbhash_insert(cb);
+}
+
+static struct callback *callback_new(void)
+{
+    struct callback *cb = cbfree;
+    if (cb) {
+        cbfree = cb->next;
+        cbfree_count--;
+    } else {
+        cb = snew(struct callback);
+    }
+    return cb;
+}
+
+/* Take a node out of both the run queue and the hash. */
+static void callback_unlink(struct callback *cb)
+{
+    cb->prev->next = cb->next;
+    cb->next->prev = cb->prev;
+    *cb->hprevp = cb->hnext;
+    if (cb->hnext)
+        cb->hnext->hprevp = cb->hprevp;
+    cbqueued--;
+}
+
+static void callback_free(struct callback *cb)
+{
+    if (cbfree_count < CALLBACK_POOL_MAX) {
+        cb->next = cbfree;
+        cbfree = cb;
+        cbfree_count++;
+    } else {
+        sfree(cb);
+    }
+}
+
 void delete_callbacks_for_context(void *ctx)
 {
-    struct callback *newhead, *newtail;
-
-    newhead = newtail = NULL;
-    while (cbhead) {
-        struct callback *cb = cbhead;
-        cbhead = cbhead->next;
-        if (cb->ctx == ctx ||
-            (cb->fn == run_idempotent_callback &&
-             ((struct IdempotentCallback *)cb->ctx)->ctx == ctx)) {
-            sfree(cb);
-        } else {
-            if (!newhead)
-                newhead = cb;
-            else
-                newtail->next = cb;
-
-            newtail = cb;
+    struct callback *cb, *next;
+
+    if (!cbqueued)
+        return;
+
+    for (cb = cbhash[cbhash_index(ctx)]; cb; cb = next) {
+        next = cb->hnext;
+        if (cb->owner == ctx) {
+            callback_unlink(cb);
+            callback_free(cb);
         }
     }
-
-    cbhead = newhead;
-    cbtail = newtail;
-    if (newtail)
-        newtail->next = NULL;
 }
 
 void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx)
 {
     struct callback *cb;
 
-    cb = snew(struct callback);
+    cb = callback_new();
     cb->fn = fn;
     cb->ctx = ctx;
+    cb->owner = (fn == run_idempotent_callback ?
+                 ((struct IdempotentCallback *)ctx)->ctx : ctx);
 
     /*
      * If the front end has requested notification of pending
@@ -88,38 +173,39 @@ void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx)
      * a constant stream of needless re-notifications if the last
      * callback keeps re-scheduling itself.
      */
-    if (notify_frontend && !cbhead && !cbcurr)
+    if (notify_frontend && !cbqueued && !cbcurr)
         notify_frontend(notify_ctx);
 
-    if (cbtail)
-        cbtail->next = cb;
-    else
-        cbhead = cb;
-    cbtail = cb;
-    cb->next = NULL;
+    if (cbqueued >= 2 * cbhash_size)
+        cbhash_grow();
+
+    cb->prev = cbqueue.prev;
+    cb->next = &cbqueue;
+    cbqueue.prev->next = cb;
+    cbqueue.prev = cb;
+    cbhash_insert(cb);
+    cbqueued++;
 }
 
 bool run_toplevel_callbacks(void)
 {
     bool done_something = false;
 
-    if (cbhead) {
+    if (cbqueued) {
         /*
          * Transfer the head callback into cbcurr to indicate that
          * it's being executed. Then operations which transform the
          * queue, like delete_callbacks_for_context, can proceed as if
          * it's not there.
          */
-        cbcurr = cbhead;
-        cbhead = cbhead->next;
-        if (!cbhead)
-            cbtail = NULL;
+        cbcurr = cbqueue.next;
+        callback_unlink(cbcurr);
 
         /*
          * Now run the callback, and then clear it out of cbcurr.
          */
         cbcurr->fn(cbcurr->ctx);
-        sfree(cbcurr);
+        callback_free(cbcurr);
         cbcurr = NULL;
 
         done_something = true;
@@ -127,7 +213,22 @@ bool run_toplevel_callbacks(void)
     return done_something;
 }
 
+bool run_toplevel_callbacks_batch(void)
+{
+    unsigned long start = GETTICKCOUNT();
+    bool done_something = false;
+
+    for (unsigned n = 0; n < CALLBACK_BATCH_MAX; n++) {
+        if (!run_toplevel_callbacks())
+            break;
+        done_something = true;
+        if (GETTICKCOUNT() - start >= CALLBACK_BATCH_TICKS)
+            break;
+    }
+    return done_something;
+}
+
 bool toplevel_callback_pending(void)
 {
-    return cbcurr != NULL || cbhead != NULL;
+    return cbcurr != NULL || cbqueued != 0;
 }
@@ -463,6 +463,8 @@ static void kexlist_handler(union control *ctrl, dlgparam *dlg,
         static const struct { const char *s; int k; } kexes[] = {
             { "Diffie-Hellman group 1",         KEX_DHGROUP1 },
             { "Diffie-Hellman group 14",        KEX_DHGROUP14 },
+            { "Diffie-Hellman group 16",        KEX_DHGROUP16 },
+            { "Diffie-Hellman group 18",        KEX_DHGROUP18 },
             { "Diffie-Hellman group exchange",  KEX_DHGEX },
             { "RSA-based key exchange",         KEX_RSA },
             { "ECDH key exchange",              KEX_ECDH },
@@ -2198,6 +2200,15 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           'p', HELPCTX(connection_tcpkeepalive),
                           conf_checkbox_handler,
                           I(CONF_tcp_keepalives));
+            ctrl_editbox(s, "Milliseconds before also trying the next "
+                         "address (0 to wait)", NO_SHORTCUT, 20,
+                         HELPCTX(connection_delay),
+                         conf_editbox_handler, I(CONF_connect_delay),
+                         I(-1));
+            ctrl_editbox(s, "Seconds to remember host name lookups",
+                         NO_SHORTCUT, 20, HELPCTX(connection_namecache),
+                         conf_editbox_handler, I(CONF_name_cache_time),
+                         I(-1));
 #ifndef NO_IPV6
             s = ctrl_getset(b, "Connection", "ipversion",
                           "Internet protocol version");
@@ -2463,6 +2474,11 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           HELPCTX(ssh_compress),
                           conf_checkbox_handler,
                           I(CONF_compression));
+            ctrl_editbox(s, "Seconds between statistics in Event Log "
+                         "(0 to turn off)", 't', 20,
+                         HELPCTX(ssh_stats),
+                         conf_editbox_handler,
+                         I(CONF_ssh_stats_interval), I(-1));
         }
 
         if (!midsession) {
@@ -2512,6 +2528,10 @@ void setup_config_box(struct controlbox *b, bool midsession,
                               HELPCTX(ssh_kexlist),
                               kexlist_handler, P(NULL));
             c->listbox.height = KEX_MAX;
+            ctrl_checkbox(s, "Guess the server's key exchange method",
+                          NO_SHORTCUT, HELPCTX(ssh_kex_guess),
+                          conf_checkbox_handler,
+                          I(CONF_ssh_kex_guess));
 #ifndef NO_GSSAPI
             ctrl_checkbox(s, "Attempt GSSAPI key exchange",
                           'k', HELPCTX(ssh_gssapi),
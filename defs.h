@@ -78,6 +78,7 @@ typedef struct handle_sink handle_sink;
 typedef struct IdempotentCallback IdempotentCallback;
 
 typedef struct SockAddr SockAddr;
+typedef struct NameLookup NameLookup;
 
 typedef struct Socket Socket;
 typedef struct Plug Plug;
@@ -110,12 +111,15 @@ typedef struct EdwardsCurve EdwardsCurve;
 typedef struct EdwardsPoint EdwardsPoint;
 
 typedef struct SshServerConfig SshServerConfig;
+typedef struct SshServerStats SshServerStats;
+typedef struct SshStats SshStats;
 typedef struct SftpServer SftpServer;
 typedef struct SftpServerVtable SftpServerVtable;
 
 typedef struct Channel Channel;
 typedef struct SshChannel SshChannel;
 typedef struct mainchan mainchan;
+typedef struct SubsysChannel SubsysChannel;
 
 typedef struct ssh_sharing_state ssh_sharing_state;
 typedef struct ssh_sharing_connstate ssh_sharing_connstate;
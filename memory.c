@@ -10,6 +10,26 @@
 #include "puttymem.h"
 #include "misc.h"
 
+MemStats mem_stats;
+
+/*
+ * safemalloc and friends are called from other threads as well as
+ * the main one (on Unix, by the resolver threads in uxnet.c and the
+ * background workers in uxsftp.c), so their counters are updated
+ * atomically where the compiler can do that without a library call.
+ * Nothing is ordered by them, so relaxed ordering is enough. The
+ * slab and arena counters are left alone, because those allocators
+ * are only used from the main thread.
+ */
+#if defined __GCC_ATOMIC_LLONG_LOCK_FREE && __GCC_ATOMIC_LLONG_LOCK_FREE == 2
+#define MEMSTAT_INC(field) \
+    ((void)__atomic_fetch_add(&mem_stats.field, 1, __ATOMIC_RELAXED))
+#define MEMSTAT_GET(field) __atomic_load_n(&mem_stats.field, __ATOMIC_RELAXED)
+#else
+#define MEMSTAT_INC(field) ((void)mem_stats.field++)
+#define MEMSTAT_GET(field) (mem_stats.field)
+#endif
+
 void *safemalloc(size_t factor1, size_t factor2, size_t addend)
 {
     if (factor1 > SIZE_MAX / factor2)
@@ -35,6 +55,7 @@ void *safemalloc(size_t factor1, size_t factor2, size_t addend)
     if (!p)
         goto fail;
 
+    MEMSTAT_INC(mallocs);
     return p;
 
   fail:
@@ -55,12 +76,14 @@ void *saferealloc(void *ptr, size_t n, size_t size)
 #else
             p = malloc(size);
 #endif
+            MEMSTAT_INC(mallocs);
         } else {
 #ifdef MINEFIELD
             p = minefield_c_realloc(ptr, size);
 #else
             p = realloc(ptr, size);
 #endif
+            MEMSTAT_INC(reallocs);
         }
     }
 
@@ -78,6 +101,7 @@ void safefree(void *ptr)
 #else
         free(ptr);
 #endif
+        MEMSTAT_INC(frees);
     }
 }
 
@@ -132,3 +156,254 @@ void *safegrowarray(void *ptr, size_t *allocated, size_t eltsize,
     *allocated = newsize;
     return toret;
 }
+
+/* ----------------------------------------------------------------------
+ * Slab allocator. Size classes are the powers of two from
+ * 2^SLAB_MIN_SHIFT to 2^SLAB_MAX_SHIFT, counting the header. The
+ * biggest class comfortably holds a maximum-size SSH-2 packet.
+ */
+#define SLAB_MIN_SHIFT 5
+#define SLAB_MAX_SHIFT 17
+#define SLAB_NCLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_BIG (-1)
+
+/*
+ * Each free list keeps at most SLAB_CACHE_BYTES worth of blocks, but
+ * always at least SLAB_CACHE_MIN of them.
+ */
+#define SLAB_CACHE_BYTES 262144
+#define SLAB_CACHE_MIN 4
+
+typedef union SlabHeader SlabHeader;
+union SlabHeader {
+    struct {
+        size_t size;                   /* as passed to slab_alloc */
+        int class;                     /* or SLAB_BIG */
+        SlabHeader *next;              /* on a free list */
+    } h;
+    /* make sure what comes after us is aligned well enough for
+     * anything we might be asked to store in it */
+    long double ld;
+    uintmax_t um;
+    void *vp;
+    void (*fp)(void);
+};
+
+struct SlabClass {
+    SlabHeader *free;
+    size_t nfree, maxfree;
+    uint64_t allocs, reuses;
+    size_t live;
+};
+static struct SlabClass slab_classes[SLAB_NCLASSES];
+
+static int slab_class(size_t total)
+{
+    for (int i = 0; i < SLAB_NCLASSES; i++)
+        if (total <= (size_t)1 << (SLAB_MIN_SHIFT + i))
+            return i;
+    return SLAB_BIG;
+}
+
+void *slab_alloc(size_t size)
+{
+    SlabHeader *hdr;
+    int class = (size <= ((size_t)1 << SLAB_MAX_SHIFT) - sizeof(SlabHeader) ?
+                 slab_class(size + sizeof(SlabHeader)) : SLAB_BIG);
+
+    mem_stats.slab_allocs++;
+
+    if (class == SLAB_BIG) {
+        hdr = safemalloc(1, sizeof(SlabHeader), size);
+    } else {
+        struct SlabClass *sc = &slab_classes[class];
+        sc->allocs++;
+        sc->live++;
+        if (sc->free) {
+            hdr = sc->free;
+            sc->free = hdr->h.next;
+            sc->nfree--;
+            sc->reuses++;
+            mem_stats.slab_reuses++;
+        } else {
+            hdr = safemalloc(1, (size_t)1 << (SLAB_MIN_SHIFT + class), 0);
+        }
+    }
+
+    hdr->h.size = size;
+    hdr->h.class = class;
+    hdr->h.next = NULL;
+    return hdr + 1;
+}
+
+size_t slab_good_size(size_t size)
+{
+    if (size > ((size_t)1 << SLAB_MAX_SHIFT) - sizeof(SlabHeader))
+        return size;
+    int class = slab_class(size + sizeof(SlabHeader));
+    return ((size_t)1 << (SLAB_MIN_SHIFT + class)) - sizeof(SlabHeader);
+}
+
+void slab_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    SlabHeader *hdr = (SlabHeader *)ptr - 1;
+    smemclr(ptr, hdr->h.size);
+
+    if (hdr->h.class == SLAB_BIG) {
+        sfree(hdr);
+        return;
+    }
+
+    struct SlabClass *sc = &slab_classes[hdr->h.class];
+    sc->live--;
+
+#ifndef MINEFIELD
+    /* (Under Minefield, recycling blocks would hide use-after-free.) */
+    if (!sc->maxfree) {
+        sc->maxfree = SLAB_CACHE_BYTES >> (SLAB_MIN_SHIFT + hdr->h.class);
+        if (sc->maxfree < SLAB_CACHE_MIN)
+            sc->maxfree = SLAB_CACHE_MIN;
+    }
+    if (sc->nfree < sc->maxfree) {
+        hdr->h.next = sc->free;
+        sc->free = hdr;
+        sc->nfree++;
+        return;
+    }
+#endif
+
+    sfree(hdr);
+}
+
+/* ----------------------------------------------------------------------
+ * Arenas.
+ */
+#define ARENA_CHUNK_SIZE (16384 - sizeof(SlabHeader))
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size, used;
+};
+
+struct MemArena {
+    const char *name;
+    ArenaChunk *chunks;                /* the current one first */
+    size_t nchunks;
+    uint64_t allocs, bytes;
+    MemArena *next, *prev;             /* list of all live arenas */
+};
+
+static MemArena *arenas;
+
+/* Round a size up so that whatever follows it is aligned */
+static inline size_t arena_round(size_t size)
+{
+    size_t align = sizeof(SlabHeader);
+    return (size + align - 1) / align * align;
+}
+
+MemArena *arena_new(const char *name)
+{
+    MemArena *arena = snew(MemArena);
+    arena->name = name;
+    arena->chunks = NULL;
+    arena->nchunks = 0;
+    arena->allocs = arena->bytes = 0;
+    arena->prev = NULL;
+    arena->next = arenas;
+    if (arenas)
+        arenas->prev = arena;
+    arenas = arena;
+    return arena;
+}
+
+void *arena_alloc(MemArena *arena, size_t factor1, size_t factor2)
+{
+    if (factor2 && factor1 > SIZE_MAX / factor2)
+        out_of_memory();
+    size_t size = factor1 * factor2;
+    if (size > SIZE_MAX - 2 * sizeof(SlabHeader))
+        out_of_memory();
+    size = arena_round(size ? size : 1);
+
+    ArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t hdrsize = arena_round(sizeof(ArenaChunk));
+        size_t chunksize = ARENA_CHUNK_SIZE - hdrsize;
+        if (chunksize < size)
+            chunksize = size;
+        chunk = slab_alloc(hdrsize + chunksize);
+        chunk->size = hdrsize + chunksize;
+        chunk->used = hdrsize;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->nchunks++;
+    }
+
+    void *toret = (char *)chunk + chunk->used;
+    chunk->used += size;
+    arena->allocs++;
+    arena->bytes += size;
+    mem_stats.arena_allocs++;
+    return toret;
+}
+
+void arena_clear(MemArena *arena)
+{
+    while (arena->chunks) {
+        ArenaChunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        slab_free(chunk);
+    }
+    arena->nchunks = 0;
+}
+
+void arena_free(MemArena *arena)
+{
+    arena_clear(arena);
+    if (arena->prev)
+        arena->prev->next = arena->next;
+    else
+        arenas = arena->next;
+    if (arena->next)
+        arena->next->prev = arena->prev;
+    sfree(arena);
+}
+
+void memstats_get(MemStats *out)
+{
+    out->mallocs = MEMSTAT_GET(mallocs);
+    out->reallocs = MEMSTAT_GET(reallocs);
+    out->frees = MEMSTAT_GET(frees);
+    out->slab_allocs = mem_stats.slab_allocs;
+    out->slab_reuses = mem_stats.slab_reuses;
+    out->arena_allocs = mem_stats.arena_allocs;
+}
+
+void memstats_dump(strbuf *out)
+{
+    MemStats ms;
+    memstats_get(&ms);
+
+    strbuf_catf(out, "system: %"PRIu64" mallocs, %"PRIu64" reallocs, "
+                "%"PRIu64" frees\n", ms.mallocs, ms.reallocs, ms.frees);
+    strbuf_catf(out, "slab: %"PRIu64" allocs, %"PRIu64" from free lists\n",
+                mem_stats.slab_allocs, mem_stats.slab_reuses);
+    for (int i = 0; i < SLAB_NCLASSES; i++) {
+        struct SlabClass *sc = &slab_classes[i];
+        if (!sc->allocs)
+            continue;
+        strbuf_catf(out, "  %7"SIZEu" bytes: %"PRIu64" allocs, "
+                    "%"PRIu64" reused, %"SIZEu" live, %"SIZEu" free\n",
+                    (size_t)1 << (SLAB_MIN_SHIFT + i), sc->allocs,
+                    sc->reuses, sc->live, sc->nfree);
+    }
+    for (MemArena *arena = arenas; arena; arena = arena->next)
+        strbuf_catf(out, "arena %s: %"PRIu64" allocs, %"PRIu64" bytes, "
+                    "%"SIZEu" chunks held\n", arena->name, arena->allocs,
+                    arena->bytes, arena->nchunks);
+}
@@ -110,6 +110,7 @@ struct bufchain_granule;
 struct bufchain_tag {
     struct bufchain_granule *head, *tail;
     size_t buffersize;           /* current amount of buffered data */
+    size_t granule, max_granule; /* size of the next granule, and limit */
 
     void (*queue_idempotent_callback)(IdempotentCallback *ic);
     IdempotentCallback *ic;
@@ -118,8 +119,14 @@ struct bufchain_tag {
 void bufchain_init(bufchain *ch);
 void bufchain_clear(bufchain *ch);
 size_t bufchain_size(bufchain *ch);
+void bufchain_set_max_granule(bufchain *ch, size_t max_granule);
 void bufchain_add(bufchain *ch, const void *data, size_t len);
 ptrlen bufchain_prefix(bufchain *ch);
+/* Fill in up to maxiov spans from the start of the chain, in order,
+ * and return how many were filled in. BUFCHAIN_MAX_IOV is a sensible
+ * number to ask for at once when feeding writev or similar. */
+size_t bufchain_prefix_iov(bufchain *ch, ptrlen *iov, size_t maxiov);
+#define BUFCHAIN_MAX_IOV 16
 void bufchain_consume(bufchain *ch, size_t len);
 void bufchain_fetch(bufchain *ch, void *data, size_t len);
 void bufchain_fetch_consume(bufchain *ch, void *data, size_t len);
@@ -40,6 +40,9 @@ struct SocketVtable {
 typedef union { void *p; int i; } accept_ctx_t;
 typedef Socket *(*accept_fn_t)(accept_ctx_t ctx, Plug *plug);
 
+typedef void (*namelookup_callback_fn_t)(
+    void *ctx, SockAddr *addr, char *canonicalname);
+
 struct Plug {
     const struct PlugVtable *vt;
 };
@@ -119,6 +122,11 @@ Socket *new_listener(const char *srcaddr, int port, Plug *plug,
 SockAddr *name_lookup(const char *host, int port, char **canonicalname,
                       Conf *conf, int addressfamily, LogContext *logctx,
                       const char *lookup_reason_for_logging);
+/* As name_lookup, but asynchronous: see sk_namelookup_async below. */
+NameLookup *name_lookup_async(const char *host, int port, Conf *conf,
+                              int addressfamily, LogContext *logctx,
+                              const char *lookup_reason_for_logging,
+                              namelookup_callback_fn_t callback, void *ctx);
 
 /* platform-dependent callback from new_connection() */
 /* (same caveat about addr as new_connection()) */
@@ -134,6 +142,26 @@ void sk_cleanup(void);                 /* called just before program exit */
 
 SockAddr *sk_namelookup(const char *host, char **canonicalname, int address_family);
 SockAddr *sk_nonamelookup(const char *host);
+
+/*
+ * Look up a host name without blocking the caller. The callback is
+ * always called later from a toplevel callback, never from inside
+ * sk_namelookup_async itself. It takes ownership of the SockAddr,
+ * which may be an error (check with sk_addr_error), and of the
+ * canonical name, which is NULL if the lookup failed.
+ *
+ * A successful lookup is remembered, and another lookup of the same
+ * host within 'cache_time' seconds reuses it; 0 means always ask
+ * afresh. Passing address_family ADDRTYPE_NAME does no lookup at
+ * all, just as sk_nonamelookup doesn't.
+ *
+ * sk_namelookup_cancel may be called at any time until the callback
+ * has been called, and ensures it never will be.
+ */
+NameLookup *sk_namelookup_async(const char *host, int address_family,
+                                int cache_time,
+                                namelookup_callback_fn_t callback, void *ctx);
+void sk_namelookup_cancel(NameLookup *nl);
 void sk_getaddr(SockAddr *addr, char *buf, int buflen);
 bool sk_addr_needs_port(SockAddr *addr);
 bool sk_hostname_is_local(const char *name);
@@ -150,9 +178,14 @@ void sk_addr_free(SockAddr *addr);
 SockAddr *sk_addr_dup(SockAddr *addr);
 
 /* NB, control of 'addr' is passed via sk_new, which takes responsibility
- * for freeing it, as for new_connection() */
+ * for freeing it, as for new_connection().
+ *
+ * If 'addr' has several addresses and connect_delay is positive, an
+ * implementation may start trying the next address if the current
+ * attempt hasn't finished within that many milliseconds, and keep
+ * whichever connects first. Zero means try them one at a time. */
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
-               bool nodelay, bool keepalive, Plug *p);
+               bool nodelay, bool keepalive, int connect_delay, Plug *p);
 
 Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
                        bool local_host_only, int address_family);
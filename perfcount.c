@@ -0,0 +1,82 @@
+/*
+ * Lightweight per-layer cost accounting. See perfcount.h.
+ */
+
+#include <string.h>
+
+#include "defs.h"
+#include "perfcount.h"
+
+#ifdef PERF_HAVE_CYCLE_COUNTER
+const char *const perf_tick_unit = "cycles";
+#else
+const char *const perf_tick_unit = "ticks";
+#endif
+
+bool perf_enabled;
+PerfLayerStats perf_stats[PERF_NLAYERS];
+
+#define PERF_NAME_DECL(name, desc) desc,
+const char *const perf_layer_names[PERF_NLAYERS] = {
+    PERF_LAYERS(PERF_NAME_DECL)
+};
+#undef PERF_NAME_DECL
+
+/*
+ * The stack of layers we're currently inside. Layers don't nest very
+ * deeply (connection -> BPP -> cipher is the usual worst case), so if
+ * it does overflow, we just stop tracking the excess levels and go on
+ * charging the time to the deepest one we recorded.
+ */
+#define PERF_STACK_MAX 16
+static PerfLayer perf_stack[PERF_STACK_MAX];
+static unsigned perf_depth, perf_overflow;
+static uint64_t perf_last;
+
+static inline PerfLayer perf_current(void)
+{
+    return perf_depth ? perf_stack[perf_depth - 1] : PERF_OTHER;
+}
+
+static inline void perf_charge(void)
+{
+    uint64_t now = perf_timestamp();
+    perf_stats[perf_current()].ticks += now - perf_last;
+    perf_last = now;
+}
+
+void perf_start(void)
+{
+    memset(perf_stats, 0, sizeof(perf_stats));
+    perf_depth = perf_overflow = 0;
+    perf_last = perf_timestamp();
+    perf_enabled = true;
+}
+
+void perf_stop(void)
+{
+    if (!perf_enabled)
+        return;
+    perf_charge();
+    perf_enabled = false;
+}
+
+void perf_enter_internal(PerfLayer layer, size_t bytes)
+{
+    perf_charge();
+    perf_stats[layer].calls++;
+    perf_stats[layer].bytes += bytes;
+    if (perf_depth < PERF_STACK_MAX)
+        perf_stack[perf_depth++] = layer;
+    else
+        perf_overflow++;
+}
+
+void perf_leave_internal(PerfLayer layer)
+{
+    perf_charge();
+    if (perf_overflow)
+        perf_overflow--;
+    else if (perf_depth && perf_stack[perf_depth - 1] == layer)
+        perf_depth--;
+}
@@ -0,0 +1,100 @@
+/*
+ * perfcount.h: lightweight cost accounting for the hot paths of the
+ * SSH data pipeline.
+ *
+ * Each layer of the stack that handles bulk data (connection layer,
+ * binary packet protocol, cipher, MAC, compression, socket) brackets
+ * its work with perf_enter() and perf_leave(). When accounting is
+ * switched on, the time between each such transition is charged to
+ * whichever layer was innermost at the time, so nested layers are
+ * measured exclusively: the BPP's figure doesn't include the cipher
+ * work it calls out to. Time spent blocked in the event loop's poll()
+ * is charged to 'idle', and anything else outside all the brackets
+ * (callback dispatch, the application) is charged to 'other'.
+ *
+ * When accounting is switched off, which it is unless a benchmark
+ * turns it on, each bracket costs one test of a global flag.
+ *
+ * Time is measured in cycles of the timestamp counter where the
+ * compiler gives us a cheap way to read it, and in clock() ticks
+ * otherwise; perf_tick_unit says which. The timestamp counter runs
+ * whether or not we're on the CPU, so those are wall-clock figures:
+ * anything that blocks inside a bracket is charged to that layer,
+ * which is why the wait for events has a layer of its own.
+ *
+ * PERF_HAVE_CYCLE_COUNTER is defined when the timestamp counter is
+ * used, for code that wants to take timestamps even when accounting
+ * is off and so can only afford to if they're cheap.
+ */
+
+#ifndef PUTTY_PERFCOUNT_H
+#define PUTTY_PERFCOUNT_H
+
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386))
+#include <x86intrin.h>
+#define PERF_HAVE_CYCLE_COUNTER
+static inline uint64_t perf_timestamp(void) { return __rdtsc(); }
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PERF_HAVE_CYCLE_COUNTER
+static inline uint64_t perf_timestamp(void) { return __rdtsc(); }
+#else
+static inline uint64_t perf_timestamp(void) { return clock(); }
+#endif
+
+#define PERF_LAYERS(X)                                  \
+    X(OTHER, "other")                                   \
+    X(CONNECTION, "connection")                         \
+    X(BPP, "bpp")                                       \
+    X(CIPHER, "cipher")                                 \
+    X(MAC, "mac")                                       \
+    X(COMPRESS, "compression")                          \
+    X(SOCKET, "socket")                                 \
+    X(IDLE, "idle")                                     \
+    /* end of list */
+
+#define PERF_ENUM_DECL(name, desc) PERF_##name,
+typedef enum PerfLayer { PERF_LAYERS(PERF_ENUM_DECL) PERF_NLAYERS } PerfLayer;
+#undef PERF_ENUM_DECL
+
+typedef struct PerfLayerStats {
+    uint64_t ticks;        /* exclusive time spent in this layer */
+    uint64_t bytes;        /* data handed to this layer to process */
+    uint64_t calls;        /* number of times the layer was entered */
+} PerfLayerStats;
+
+extern bool perf_enabled;
+extern PerfLayerStats perf_stats[PERF_NLAYERS];
+extern const char *const perf_layer_names[PERF_NLAYERS];
+extern const char *const perf_tick_unit;
+
+/* Zero all the counters and start accounting. */
+void perf_start(void);
+/* Charge the time since the last transition, and stop accounting. */
+void perf_stop(void);
+
+void perf_enter_internal(PerfLayer layer, size_t bytes);
+void perf_leave_internal(PerfLayer layer);
+
+static inline void perf_enter(PerfLayer layer, size_t bytes)
+{
+    if (perf_enabled)
+        perf_enter_internal(layer, bytes);
+}
+
+static inline void perf_leave(PerfLayer layer)
+{
+    if (perf_enabled)
+        perf_leave_internal(layer);
+}
+
+/* For layers that only find out how much data they handled afterwards */
+static inline void perf_count_bytes(PerfLayer layer, size_t bytes)
+{
+    if (perf_enabled)
+        perf_stats[layer].bytes += bytes;
+}
+
+#endif /* PUTTY_PERFCOUNT_H */
@@ -44,6 +44,17 @@ typedef struct PortForwarding {
     strbuf *socksbuf;
     size_t socksbuf_consumed;
 
+    /*
+     * For a connection the server has asked us to make, the lookup
+     * of the destination's address while that's in progress, and
+     * anything the server sends before we have a socket to send it
+     * on to.
+     */
+    NameLookup *lookup;
+    Conf *conf;
+    bufchain pending;
+    bool pending_eof;
+
     Plug plug;
     Channel chan;
 } PortForwarding;
@@ -65,8 +76,13 @@ struct PortListener {
 static struct PortForwarding *new_portfwd_state(void)
 {
     struct PortForwarding *pf = snew(struct PortForwarding);
+    pf->s = NULL;
     pf->hostname = NULL;
     pf->socksbuf = NULL;
+    pf->lookup = NULL;
+    pf->conf = NULL;
+    bufchain_init(&pf->pending);
+    pf->pending_eof = false;
     return pf;
 }
 
@@ -77,6 +93,11 @@ static void free_portfwd_state(struct PortForwarding *pf)
     sfree(pf->hostname);
     if (pf->socksbuf)
         strbuf_free(pf->socksbuf);
+    if (pf->lookup)
+        sk_namelookup_cancel(pf->lookup);
+    if (pf->conf)
+        conf_free(pf->conf);
+    bufchain_clear(&pf->pending);
     sfree(pf);
 }
 
@@ -611,7 +632,8 @@ static void pfd_close(struct PortForwarding *pf)
     if (!pf)
         return;
 
-    sk_close(pf->s);
+    if (pf->s)
+        sk_close(pf->s);
     free_portfwd_state(pf);
 }
 
@@ -632,7 +654,8 @@ static void pfd_set_input_wanted(Channel *chan, bool wanted)
     assert(chan->vt == &PortForwarding_channelvt);
     PortForwarding *pf = container_of(chan, PortForwarding, chan);
     pf->input_wanted = wanted;
-    sk_set_frozen(pf->s, !pf->input_wanted);
+    if (pf->s)
+        sk_set_frozen(pf->s, !pf->input_wanted);
 }
 
 static void pfd_chan_free(Channel *chan)
@@ -650,6 +673,10 @@ static size_t pfd_send(
 {
     assert(chan->vt == &PortForwarding_channelvt);
     PortForwarding *pf = container_of(chan, PortForwarding, chan);
+    if (!pf->s) {
+        bufchain_add(&pf->pending, data, len);
+        return bufchain_size(&pf->pending);
+    }
     return sk_write(pf->s, data, len);
 }
 
@@ -657,6 +684,10 @@ static void pfd_send_eof(Channel *chan)
 {
     assert(chan->vt == &PortForwarding_channelvt);
     PortForwarding *pf = container_of(chan, PortForwarding, chan);
+    if (!pf->s) {
+        pf->pending_eof = true;
+        return;
+    }
     sk_write_eof(pf->s);
 }
 
@@ -1120,37 +1151,67 @@ bool portfwdmgr_unlisten(PortFwdManager *mgr, const char *host, int port)
     return true;
 }
 
+/*
+ * Called when we've looked up the destination of a connection the
+ * server asked us to make.
+ */
+static void pfd_resolved(void *ctx, SockAddr *addr, char *realhost)
+{
+    struct PortForwarding *pf = (struct PortForwarding *)ctx;
+    const char *err;
+
+    pf->lookup = NULL;
+
+    if ((err = sk_addr_error(addr)) != NULL) {
+        char *msg = dupstr(err);
+        sk_addr_free(addr);
+        sfree(realhost);
+        sshfwd_initiate_close(pf->c, msg);
+        sfree(msg);
+        return;
+    }
+
+    pf->s = new_connection(addr, realhost, pf->port,
+                           false, true, false, false, &pf->plug, pf->conf);
+    sfree(realhost);
+    if ((err = sk_socket_error(pf->s)) != NULL) {
+        sshfwd_initiate_close(pf->c, err);
+        return;
+    }
+
+    sk_set_frozen(pf->s, !pf->input_wanted);
+
+    /* Pass on anything the server has sent while we were waiting. */
+    if (bufchain_size(&pf->pending)) {
+        size_t before = bufchain_size(&pf->pending), after = 0;
+        while (bufchain_size(&pf->pending) > 0) {
+            ptrlen data = bufchain_prefix(&pf->pending);
+            after = sk_write(pf->s, data.ptr, data.len);
+            bufchain_consume(&pf->pending, data.len);
+        }
+        if (after < before)
+            sshfwd_unthrottle(pf->c, after);
+    }
+    if (pf->pending_eof)
+        sk_write_eof(pf->s);
+}
+
 /*
  * Called when receiving a PORT OPEN from the server to make a
  * connection to a destination host.
  *
- * On success, returns NULL and fills in *pf_ret. On error, returns a
- * dynamically allocated error message string.
+ * The destination's address is looked up in the background, so that
+ * a slow DNS doesn't hold up everything else going on in the session
+ * while it answers. So this always succeeds, and returns NULL; if
+ * the lookup or the connection fails, we find out later, and close
+ * the channel then.
  */
 char *portfwdmgr_connect(PortFwdManager *mgr, Channel **chan_ret,
                          char *hostname, int port, SshChannel *c,
                          int addressfamily)
 {
-    SockAddr *addr;
-    const char *err;
-    char *dummy_realhost = NULL;
     struct PortForwarding *pf;
 
-    /*
-     * Try to find host.
-     */
-    addr = name_lookup(hostname, port, &dummy_realhost, mgr->conf,
-                       addressfamily, NULL, NULL);
-    if ((err = sk_addr_error(addr)) != NULL) {
-        char *err_ret = dupstr(err);
-        sk_addr_free(addr);
-        sfree(dummy_realhost);
-        return err_ret;
-    }
-
-    /*
-     * Open socket.
-     */
     pf = new_portfwd_state();
     *chan_ret = &pf->chan;
     pf->plug.vt = &PortForwarding_plugvt;
@@ -1161,17 +1222,11 @@ char *portfwdmgr_connect(PortFwdManager *mgr, Channel **chan_ret,
     pf->c = c;
     pf->cl = mgr->cl;
     pf->socks_state = SOCKS_NONE;
+    pf->port = port;
+    pf->conf = conf_copy(mgr->conf);
 
-    pf->s = new_connection(addr, dummy_realhost, port,
-                           false, true, false, false, &pf->plug, mgr->conf);
-    sfree(dummy_realhost);
-    if ((err = sk_socket_error(pf->s)) != NULL) {
-        char *err_ret = dupstr(err);
-        sk_close(pf->s);
-        free_portfwd_state(pf);
-        *chan_ret = NULL;
-        return err_ret;
-    }
+    pf->lookup = name_lookup_async(hostname, port, pf->conf, addressfamily,
+                                   NULL, NULL, pfd_resolved, pf);
 
     return NULL;
 }
@@ -83,7 +83,10 @@ static void sk_proxy_close (Socket *s)
 {
     ProxySocket *ps = container_of(s, ProxySocket, sock);
 
-    sk_close(ps->sub_socket);
+    if (ps->lookup)
+        sk_namelookup_cancel(ps->lookup);
+    if (ps->sub_socket)
+        sk_close(ps->sub_socket);
     sk_addr_free(ps->remote_addr);
     sfree(ps);
 }
@@ -371,6 +374,31 @@ SockAddr *name_lookup(const char *host, int port, char **canonicalname,
     }
 }
 
+NameLookup *name_lookup_async(const char *host, int port, Conf *conf,
+                              int addressfamily, LogContext *logctx,
+                              const char *reason,
+                              namelookup_callback_fn_t callback, void *ctx)
+{
+    if (conf_get_int(conf, CONF_proxy_type) != PROXY_NONE &&
+        do_proxy_dns(conf) &&
+        proxy_for_destination(NULL, host, port, conf)) {
+
+        if (logctx)
+            logeventf(logctx, "Leaving host lookup to proxy of \"%s\""
+                      " (for %s)", host, reason);
+
+        addressfamily = ADDRTYPE_NAME;
+    } else {
+        if (logctx)
+            logevent_and_free(
+                logctx, dns_log_msg(host, addressfamily, reason));
+    }
+
+    return sk_namelookup_async(host, addressfamily,
+                               conf_get_int(conf, CONF_name_cache_time),
+                               callback, ctx);
+}
+
 static const struct SocketVtable ProxySocket_sockvt = {
     sk_proxy_plug,
     sk_proxy_close,
@@ -390,6 +418,55 @@ static const struct PlugVtable ProxySocket_plugvt = {
     plug_proxy_accepting
 };
 
+/*
+ * Called when we've found out the proxy's address, to connect to it
+ * and start negotiating.
+ */
+static void proxy_resolved(void *ctx, SockAddr *proxy_addr,
+                           char *proxy_canonical_name)
+{
+    ProxySocket *ps = (ProxySocket *)ctx;
+    const char *err;
+
+    ps->lookup = NULL;
+    sfree(proxy_canonical_name);
+
+    if (sk_addr_error(proxy_addr) != NULL) {
+        ps->error = "Proxy error: Unable to resolve proxy host name";
+        sk_addr_free(proxy_addr);
+        plug_closing(ps->plug, ps->error, 0, false);
+        return;
+    }
+
+    {
+        char addrbuf[256], *logmsg;
+        sk_getaddr(proxy_addr, addrbuf, lenof(addrbuf));
+        logmsg = dupprintf("Connecting to %s proxy at %s port %d",
+                           ps->proxy_type, addrbuf,
+                           conf_get_int(ps->conf, CONF_proxy_port));
+        plug_log(ps->plug, PLUGLOG_PROXY_MSG, NULL, 0, logmsg, 0);
+        sfree(logmsg);
+    }
+
+    /* create the actual socket we will be using,
+     * connected to our proxy server and port.
+     */
+    ps->sub_socket = sk_new(proxy_addr,
+                            conf_get_int(ps->conf, CONF_proxy_port),
+                            ps->privport, ps->oobinline,
+                            ps->nodelay, ps->keepalive,
+                            conf_get_int(ps->conf, CONF_connect_delay),
+                            &ps->plugimpl);
+    if ((err = sk_socket_error(ps->sub_socket)) != NULL) {
+        plug_closing(ps->plug, err, 0, false);
+        return;
+    }
+
+    /* start the proxy negotiation process... */
+    sk_set_frozen(ps->sub_socket, false);
+    ps->negotiate(ps, PROXY_CHANGE_NEW);
+}
+
 Socket *new_connection(SockAddr *addr, const char *hostname,
                        int port, bool privport,
                        bool oobinline, bool nodelay, bool keepalive,
@@ -399,8 +476,6 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
         proxy_for_destination(addr, hostname, port, conf))
     {
         ProxySocket *ret;
-        SockAddr *proxy_addr;
-        char *proxy_canonical_name;
         const char *proxy_type;
         Socket *sret;
         int type;
@@ -428,6 +503,7 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
         bufchain_init(&ret->pending_oob_output_data);
 
         ret->sub_socket = NULL;
+        ret->lookup = NULL;
         ret->state = PROXY_STATE_NEW;
         ret->negotiate = NULL;
 
@@ -468,45 +544,23 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
         }
 
         /* look-up proxy */
-        proxy_addr = sk_namelookup(conf_get_str(conf, CONF_proxy_host),
-                                   &proxy_canonical_name,
-                                   conf_get_int(conf, CONF_addressfamily));
-        if (sk_addr_error(proxy_addr) != NULL) {
-            ret->error = "Proxy error: Unable to resolve proxy host name";
-            sk_addr_free(proxy_addr);
-            return &ret->sock;
-        }
-        sfree(proxy_canonical_name);
-
-        {
-            char addrbuf[256], *logmsg;
-            sk_getaddr(proxy_addr, addrbuf, lenof(addrbuf));
-            logmsg = dupprintf("Connecting to %s proxy at %s port %d",
-                               proxy_type, addrbuf,
-                               conf_get_int(conf, CONF_proxy_port));
-            plug_log(plug, PLUGLOG_PROXY_MSG, NULL, 0, logmsg, 0);
-            sfree(logmsg);
-        }
-
-        /* create the actual socket we will be using,
-         * connected to our proxy server and port.
-         */
-        ret->sub_socket = sk_new(proxy_addr,
-                                 conf_get_int(conf, CONF_proxy_port),
-                                 privport, oobinline,
-                                 nodelay, keepalive, &ret->plugimpl);
-        if (sk_socket_error(ret->sub_socket) != NULL)
-            return &ret->sock;
-
-        /* start the proxy negotiation process... */
-        sk_set_frozen(ret->sub_socket, false);
-        ret->negotiate(ret, PROXY_CHANGE_NEW);
+        ret->proxy_type = proxy_type;
+        ret->privport = privport;
+        ret->oobinline = oobinline;
+        ret->nodelay = nodelay;
+        ret->keepalive = keepalive;
+        ret->lookup = sk_namelookup_async(
+            conf_get_str(conf, CONF_proxy_host),
+            conf_get_int(conf, CONF_addressfamily),
+            conf_get_int(conf, CONF_name_cache_time),
+            proxy_resolved, ret);
 
         return &ret->sock;
     }
 
     /* no proxy, so just return the direct socket */
-    return sk_new(addr, port, privport, oobinline, nodelay, keepalive, plug);
+    return sk_new(addr, port, privport, oobinline, nodelay, keepalive,
+                  conf_get_int(conf, CONF_connect_delay), plug);
 }
 
 Socket *new_listener(const char *srcaddr, int port, Plug *plug,
@@ -77,6 +77,12 @@ struct ProxySocket {
     /* configuration, used to look up proxy settings */
     Conf *conf;
 
+    /* the lookup of the proxy's own host name, while it's in progress,
+     * and what we'll need to connect to it once it's done */
+    NameLookup *lookup;
+    const char *proxy_type;
+    bool privport, oobinline, nodelay, keepalive;
+
     /* CHAP transient data */
     int chap_num_attributes;
     int chap_num_attributes_processed;
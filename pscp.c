@@ -40,6 +40,9 @@ static bool main_cmd_is_sftp = false;
 static bool fallback_cmd_is_sftp = false;
 static bool using_sftp = false;
 static bool uploading = false;
+static int nstripes = 1;
+static bool hash_files = false;
+static SftpStripes *stripes;
 
 static Backend *backend;
 static Conf *conf;
@@ -83,6 +86,7 @@ static const SeatVtable pscp_seat_vt = {
     nullseat_set_trust_status_vacuously,
     cmdline_seat_verbose,
     nullseat_interactive_no,
+    nullseat_kex_finished,
 };
 static Seat pscp_seat[1] = {{ &pscp_seat_vt }};
 
@@ -675,6 +679,16 @@ static struct scp_sftp_dirstack {
     char *dirpath;
     char *wildcard;
     bool matched_something;     /* wildcard match set was non-empty */
+
+    /*
+     * In a recursive copy, the directory's contents come from a
+     * manifest made by fxp_walk instead of 'names': entries[entpos]
+     * to entries[entend]. The item for the top of the tree owns the
+     * walk; the ones for its subdirectories share it.
+     */
+    struct fxp_walk *walk;
+    const struct fxp_walk_entry *entries;
+    size_t entpos, entend;
 } *scp_sftp_dirstack_head;
 static char *scp_sftp_remotepath, *scp_sftp_currentname;
 static char *scp_sftp_wildcard;
@@ -810,30 +824,53 @@ int scp_send_filedata(char *data, int len)
             return 1;
         }
 
-        while (!xfer_upload_ready(scp_sftp_xfer)) {
-            if (toplevel_callback_pending()) {
-                /* If we have pending callbacks, they might make
-                 * xfer_upload_ready start to return true. So we should
-                 * run them and then re-check xfer_upload_ready, before
-                 * we go as far as waiting for an entire packet to
-                 * arrive. */
-                run_toplevel_callbacks();
-                continue;
-            }
-            pktin = sftp_recv();
-            ret = xfer_upload_gotpkt(scp_sftp_xfer, pktin);
-            if (ret <= 0) {
-                tell_user(stderr, "error while writing: %s", fxp_error());
-                if (ret == INT_MIN)        /* pktin not even freed */
-                    sfree(pktin);
-                errs++;
-                return 1;
+        /*
+         * Send the block as a run of FXP_WRITEs each as big as the
+         * server will take.
+         */
+        while (len > 0) {
+            int thislen;
+
+            while (!xfer_upload_ready(scp_sftp_xfer)) {
+                if (toplevel_callback_pending()) {
+                    /* If we have pending callbacks, they might make
+                     * xfer_upload_ready start to return true. So we
+                     * should run them and then re-check
+                     * xfer_upload_ready, before we go as far as
+                     * waiting for an entire packet to arrive. */
+                    run_toplevel_callbacks();
+                    continue;
+                }
+                if (xfer_done(scp_sftp_xfer)) {
+                    /* No replies outstanding, but the send buffer
+                     * hasn't drained (perhaps because of a key
+                     * exchange): run the network until it does. */
+                    if (ssh_sftp_loop_iteration() < 0) {
+                        tell_user(stderr, "error while writing: "
+                                  "connection lost");
+                        errs++;
+                        return 1;
+                    }
+                    continue;
+                }
+                pktin = sftp_recv();
+                ret = xfer_upload_gotpkt(scp_sftp_xfer, pktin);
+                if (ret <= 0) {
+                    tell_user(stderr, "error while writing: %s",
+                              fxp_error());
+                    if (ret == INT_MIN)    /* pktin not even freed */
+                        sfree(pktin);
+                    errs++;
+                    return 1;
+                }
             }
-        }
-
-        xfer_upload_data(scp_sftp_xfer, data, len);
 
-        scp_sftp_fileoffset += len;
+            thislen = min(len, (int)fxp_max_write_len());
+            xfer_upload_data(scp_sftp_xfer, data, thislen);
+            scp_sftp_fileoffset += thislen;
+            data += thislen;
+            len -= thislen;
+        }
         return 0;
     } else {
         int bufsize = backend_send(backend, data, len);
@@ -1098,11 +1135,13 @@ struct scp_sink_action {
 int scp_get_sink_action(struct scp_sink_action *act)
 {
     if (using_sftp) {
-        char *fname;
+        char *fname = NULL;
         bool must_free_fname;
         struct fxp_attrs attrs;
         struct sftp_packet *pktin;
         struct sftp_request *req;
+        const struct fxp_walk_entry *entry = NULL;
+        const char *errmsg;
         bool ret;
 
         if (!scp_sftp_dirstack_head) {
@@ -1123,22 +1162,39 @@ int scp_get_sink_action(struct scp_sink_action *act)
         } else {
             /*
              * We're now in the middle of stepping through a list
-             * of names returned from fxp_readdir(); so let's carry
-             * on.
+             * of names returned from fxp_readdir(), or a directory
+             * in a walked tree; so let's carry on.
              */
             struct scp_sftp_dirstack *head = scp_sftp_dirstack_head;
-            while (head->namepos < head->namelen &&
-                   (is_dots(head->names[head->namepos].filename) ||
-                    (head->wildcard &&
-                     !wc_match(head->wildcard,
-                               head->names[head->namepos].filename))))
-                head->namepos++;       /* skip . and .. */
-            if (head->namepos < head->namelen) {
-                head->matched_something = true;
-                fname = dupcat(head->dirpath, "/",
-                               head->names[head->namepos++].filename);
-                must_free_fname = true;
+            if (head->entries) {
+                while (head->entpos < head->entend &&
+                       head->entries[head->entpos].rejected) {
+                    with_stripctrl(san, head->entries[head->entpos].name)
+                        tell_user(stderr, "ignoring potentially dangerous "
+                                  "server-supplied filename '%s'", san);
+                    head->entpos = head->entries[head->entpos].end;
+                }
+                if (head->entpos < head->entend) {
+                    entry = &head->entries[head->entpos];
+                    head->entpos = entry->end;
+                    fname = dupstr(entry->path);
+                    must_free_fname = true;
+                }
             } else {
+                while (head->namepos < head->namelen &&
+                       (is_dots(head->names[head->namepos].filename) ||
+                        (head->wildcard &&
+                         !wc_match(head->wildcard,
+                                   head->names[head->namepos].filename))))
+                    head->namepos++;   /* skip . and .. */
+                if (head->namepos < head->namelen) {
+                    head->matched_something = true;
+                    fname = dupcat(head->dirpath, "/",
+                                   head->names[head->namepos++].filename);
+                    must_free_fname = true;
+                }
+            }
+            if (!fname) {
                 /*
                  * We've come to the end of the list; pop it off
                  * the stack and return an ENDDIR action (or RETRY
@@ -1159,6 +1215,8 @@ int scp_get_sink_action(struct scp_sink_action *act)
 
                 sfree(head->dirpath);
                 sfree(head->names);
+                if (head->walk)
+                    fxp_walk_cleanup(head->walk);
                 scp_sftp_dirstack_head = head->next;
                 sfree(head);
 
@@ -1167,17 +1225,24 @@ int scp_get_sink_action(struct scp_sink_action *act)
         }
 
         /*
-         * Now we have a filename. Stat it, and see if it's a file
-         * or a directory.
+         * Now we have a filename. Stat it (unless the walk already
+         * did), and see if it's a file or a directory.
          */
-        req = fxp_stat_send(fname);
-        pktin = sftp_wait_for_reply(req);
-        ret = fxp_stat_recv(pktin, req, &attrs);
+        if (entry) {
+            attrs = entry->attrs;
+            ret = entry->is_dir || !entry->error;
+            errmsg = entry->error;
+        } else {
+            req = fxp_stat_send(fname);
+            pktin = sftp_wait_for_reply(req);
+            ret = fxp_stat_recv(pktin, req, &attrs);
+            errmsg = fxp_error();
+        }
 
         if (!ret || !(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
             with_stripctrl(san, fname)
                 tell_user(stderr, "unable to identify %s: %s", san,
-                          ret ? "file type not supplied" : fxp_error());
+                          ret ? "file type not supplied" : errmsg);
             if (must_free_fname) sfree(fname);
             errs++;
             return 1;
@@ -1189,6 +1254,8 @@ int scp_get_sink_action(struct scp_sink_action *act)
             size_t nnames, namesize;
             struct fxp_name *ournames;
             struct fxp_names *names;
+            struct fxp_walk *walk = NULL;
+            const struct fxp_walk_entry *entries = NULL;
 
             /*
              * It's a directory. If we're not in recursive mode,
@@ -1216,87 +1283,133 @@ int scp_get_sink_action(struct scp_sink_action *act)
             }
 
             /*
-             * Otherwise, the fun begins. We must fxp_opendir() the
-             * directory, slurp the filenames into memory, return
-             * SCP_SINK_DIR (unless this is a wildcard match), and
-             * set targetisdir. The next time we're called, we will
-             * run through the list of filenames one by one,
-             * matching them against a wildcard if present.
+             * Otherwise, the fun begins. If we're copying the whole
+             * directory, we find out everything in it with fxp_walk,
+             * which lists all its subdirectories at once rather than
+             * each one as we get to it. (If we're already inside a
+             * tree we walked, this directory is in its manifest.)
+             * Then we return SCP_SINK_DIR and set targetisdir, and
+             * the next time we're called we will run through the
+             * directory's entries one by one.
+             *
+             * If we're just scanning the directory for names
+             * matching a wildcard, we must fxp_opendir() it and
+             * slurp the filenames into memory instead.
              *
              * If targetisdir is _already_ set (meaning we're
              * already in the middle of going through another such
              * list), we must push the other (target,namelist) pair
              * on a stack.
              */
-            req = fxp_opendir_send(fname);
-            pktin = sftp_wait_for_reply(req);
-            dirhandle = fxp_opendir_recv(pktin, req);
+            nnames = 0;
+            ournames = NULL;
+            if (entry) {
+                entries = scp_sftp_dirstack_head->entries;
+            } else if (!scp_sftp_wildcard) {
+                size_t nentries;
+
+                walk = sftp_walk_tree(fname, &attrs);
+                if (!walk)
+                    seat_connection_fatal(
+                        pscp_seat, "unable to understand SFTP response "
+                        "packet from server: %s", fxp_error());
+                entries = fxp_walk_entries(walk, &nentries);
+                entry = &entries[0];
+            }
 
-            if (!dirhandle) {
+            if (entry && entry->error) {
                 with_stripctrl(san, fname)
-                    tell_user(stderr, "pscp: unable to open directory %s: %s",
-                              san, fxp_error());
+                    tell_user(stderr, entry->opened ?
+                              "pscp: reading directory %s: %s" :
+                              "pscp: unable to open directory %s: %s",
+                              san, entry->error);
+                if (walk)
+                    fxp_walk_cleanup(walk);
                 if (must_free_fname) sfree(fname);
                 errs++;
                 return 1;
             }
-            nnames = namesize = 0;
-            ournames = NULL;
-            while (1) {
-                int i;
 
-                req = fxp_readdir_send(dirhandle);
+            if (!entry) {
+                req = fxp_opendir_send(fname);
                 pktin = sftp_wait_for_reply(req);
-                names = fxp_readdir_recv(pktin, req);
+                dirhandle = fxp_opendir_recv(pktin, req);
 
-                if (names == NULL) {
-                    if (fxp_error_type() == SSH_FX_EOF)
-                        break;
+                if (!dirhandle) {
                     with_stripctrl(san, fname)
-                        tell_user(stderr, "pscp: reading directory %s: %s",
-                                  san, fxp_error());
-
-                    req = fxp_close_send(dirhandle);
-                    pktin = sftp_wait_for_reply(req);
-                    fxp_close_recv(pktin, req);
-
+                        tell_user(stderr, "pscp: unable to open "
+                                  "directory %s: %s", san, fxp_error());
                     if (must_free_fname) sfree(fname);
-                    sfree(ournames);
                     errs++;
                     return 1;
                 }
-                if (names->nnames == 0) {
+                nnames = namesize = 0;
+                ournames = NULL;
+                while (1) {
+                    int i;
+
+                    req = fxp_readdir_send(dirhandle);
+                    pktin = sftp_wait_for_reply(req);
+                    names = fxp_readdir_recv(pktin, req);
+
+                    if (names == NULL) {
+                        if (fxp_error_type() == SSH_FX_EOF)
+                            break;
+                        with_stripctrl(san, fname)
+                            tell_user(stderr, "pscp: reading "
+                                      "directory %s: %s", san, fxp_error());
+
+                        req = fxp_close_send(dirhandle);
+                        pktin = sftp_wait_for_reply(req);
+                        fxp_close_recv(pktin, req);
+
+                        if (must_free_fname) sfree(fname);
+                        sfree(ournames);
+                        errs++;
+                        return 1;
+                    }
+                    if (names->nnames == 0) {
+                        fxp_free_names(names);
+                        break;
+                    }
+                    sgrowarrayn(ournames, namesize, nnames, names->nnames);
+                    for (i = 0; i < names->nnames; i++) {
+                        if (!strcmp(names->names[i].filename, ".") ||
+                            !strcmp(names->names[i].filename, "..")) {
+                            /*
+                             * . and .. are normal consequences of
+                             * reading a directory, and aren't worth
+                             * complaining about.
+                             */
+                        } else if (!vet_filename(names->names[i].filename)) {
+                            with_stripctrl(san, names->names[i].filename)
+                                tell_user(stderr, "ignoring potentially "
+                                          "dangerous server-supplied "
+                                          "filename '%s'", san);
+                        } else
+                            ournames[nnames++] = names->names[i];
+                    }
+                    names->nnames = 0;         /* prevent free_names */
                     fxp_free_names(names);
-                    break;
                 }
-                sgrowarrayn(ournames, namesize, nnames, names->nnames);
-                for (i = 0; i < names->nnames; i++) {
-                    if (!strcmp(names->names[i].filename, ".") ||
-                        !strcmp(names->names[i].filename, "..")) {
-                        /*
-                         * . and .. are normal consequences of
-                         * reading a directory, and aren't worth
-                         * complaining about.
-                         */
-                    } else if (!vet_filename(names->names[i].filename)) {
-                        with_stripctrl(san, names->names[i].filename)
-                            tell_user(stderr, "ignoring potentially dangerous "
-                                      "server-supplied filename '%s'", san);
-                    } else
-                        ournames[nnames++] = names->names[i];
-                }
-                names->nnames = 0;             /* prevent free_names */
-                fxp_free_names(names);
+                req = fxp_close_send(dirhandle);
+                pktin = sftp_wait_for_reply(req);
+                fxp_close_recv(pktin, req);
             }
-            req = fxp_close_send(dirhandle);
-            pktin = sftp_wait_for_reply(req);
-            fxp_close_recv(pktin, req);
 
             newitem = snew(struct scp_sftp_dirstack);
             newitem->next = scp_sftp_dirstack_head;
             newitem->names = ournames;
             newitem->namepos = 0;
             newitem->namelen = nnames;
+            newitem->walk = walk;
+            newitem->entries = entries;
+            if (entries) {
+                newitem->entpos = entry - entries + 1;
+                newitem->entend = entry->end;
+            } else {
+                newitem->entpos = newitem->entend = 0;
+            }
             if (must_free_fname)
                 newitem->dirpath = fname;
             else
@@ -1505,6 +1618,35 @@ int scp_recv_filedata(char *data, int len)
     }
 }
 
+/*
+ * Try to receive the file we're about to accept over several striped
+ * SFTP sessions, instead of scp_accept_filexfer / scp_recv_filedata.
+ * If that returns STRIPED_UNAVAILABLE, the caller should go on and
+ * do it the normal way.
+ */
+static StripedResult scp_recv_file_striped(
+    WFile *f, uint64_t size,
+    sftp_stripes_progress_fn_t progress, void *progress_ctx)
+{
+    const char *err;
+    StripedResult sr;
+
+    if (!using_sftp || nstripes < 2)
+        return STRIPED_UNAVAILABLE;
+
+    if (!stripes)
+        stripes = sftp_stripes_new(backend, nstripes);
+    sr = sftp_striped_download(stripes, scp_sftp_currentname, f, 0, size,
+                               progress, progress_ctx, &err);
+    if (sr == STRIPED_FAILED) {
+        tell_user(stderr, "pscp: error while reading: %s", err);
+        errs++;
+    }
+    if (sr != STRIPED_UNAVAILABLE)
+        sfree(scp_sftp_currentname);
+    return sr;
+}
+
 int scp_finish_filerecv(void)
 {
     if (using_sftp) {
@@ -1577,6 +1719,7 @@ static void source(const char *src)
     RFile *f;
     int attr;
     uint64_t i;
+    char *transbuf;
     uint64_t stat_bytes;
     time_t stat_starttime, stat_lasttime;
 
@@ -1644,9 +1787,9 @@ static void source(const char *src)
     stat_starttime = time(NULL);
     stat_lasttime = 0;
 
-#define PSCP_SEND_BLOCK 4096
+#define PSCP_SEND_BLOCK (1024 * 1024)
+    transbuf = snewn(PSCP_SEND_BLOCK, char);
     for (i = 0; i < size; i += PSCP_SEND_BLOCK) {
-        char transbuf[PSCP_SEND_BLOCK];
         int j, k = PSCP_SEND_BLOCK;
 
         if (i + k > size)
@@ -1667,6 +1810,7 @@ static void source(const char *src)
         }
 
     }
+    sfree(transbuf);
     close_rfile(f);
 
     (void) scp_send_finish();
@@ -1722,6 +1866,22 @@ static void rsource(const char *src)
 /*
  * Execute the sink part of the SCP protocol.
  */
+struct sink_stats {
+    const char *name;
+    uint64_t size;
+    time_t starttime, lasttime;
+};
+
+static void sink_stripe_progress(void *vctx, uint64_t done)
+{
+    struct sink_stats *st = (struct sink_stats *)vctx;
+
+    if (time(NULL) > st->lasttime || done == st->size) {
+        st->lasttime = time(NULL);
+        print_stats(st->name, st->size, done, st->starttime, st->lasttime);
+    }
+}
+
 static void sink(const char *targ, const char *src)
 {
     char *destfname;
@@ -1729,6 +1889,8 @@ static void sink(const char *targ, const char *src)
     bool exists;
     int attr;
     WFile *f;
+    SftpWriteQueue *wq;
+    char *hash;
     uint64_t received;
     bool wrerror = false;
     uint64_t stat_bytes;
@@ -1875,43 +2037,67 @@ static void sink(const char *targ, const char *src)
             continue;
         }
 
-        if (scp_accept_filexfer()) {
-            sfree(destfname);
-            close_wfile(f);
-            goto out;
-        }
-
         stat_bytes = 0;
         stat_starttime = time(NULL);
         stat_lasttime = 0;
         stat_name = stripctrl_string(
             string_scc, stripslashes(destfname, true));
 
+        {
+            struct sink_stats st;
+            StripedResult sr;
+
+            st.name = stat_name;
+            st.size = act.size;
+            st.starttime = stat_starttime;
+            st.lasttime = stat_lasttime;
+            sr = scp_recv_file_striped(
+                f, act.size, statistics ? sink_stripe_progress : NULL, &st);
+            if (sr != STRIPED_UNAVAILABLE) {
+                if (act.settime)
+                    set_file_times(f, act.mtime, act.atime);
+                close_wfile(f);
+                sfree(stat_name);
+                sfree(destfname);
+                continue;
+            }
+        }
+
+        if (scp_accept_filexfer()) {
+            sfree(stat_name);
+            sfree(destfname);
+            close_wfile(f);
+            goto out;
+        }
+
+        wq = sftp_wq_new(f, hash_files);
         received = 0;
         while (received < act.size) {
-            char transbuf[32768];
+            char *transbuf;
             uint64_t blksize;
             int read;
             blksize = 32768;
             if (blksize > act.size - received)
                 blksize = act.size - received;
+            transbuf = snewn(blksize, char);
             read = scp_recv_filedata(transbuf, (int)blksize);
             if (read <= 0)
                 bump("Lost connection");
-            if (wrerror) {
-                received += read;
-                continue;
-            }
-            if (write_to_file(f, transbuf, read) != (int)read) {
+            if (!wrerror && sftp_wq_failed(wq)) {
                 wrerror = true;
                 /* FIXME: in sftp we can actually abort the transfer */
                 if (statistics)
                     printf("\r%-25.25s | %50s\n",
                            stat_name,
                            "Write error.. waiting for end of file");
+            }
+            if (wrerror) {
+                sfree(transbuf);
                 received += read;
                 continue;
             }
+            /* The write queue takes over transbuf */
+            sftp_wq_write(wq, transbuf, read);
             if (statistics) {
                 stat_bytes += read;
                 if (time(NULL) > stat_lasttime ||
@@ -1923,6 +2109,8 @@ static void sink(const char *targ, const char *src)
             }
             received += read;
         }
+        if (!sftp_wq_finish(wq, &hash))
+            wrerror = true;
         if (act.settime) {
             set_file_times(f, act.mtime, act.atime);
         }
@@ -1931,9 +2119,15 @@ static void sink(const char *targ, const char *src)
         if (wrerror) {
             with_stripctrl(san, destfname)
                 run_err("%s: Write error", san);
+            sfree(hash);
             sfree(destfname);
             continue;
         }
+        if (hash) {
+            with_stripctrl(san, destfname)
+                printf("%s  %s\n", hash, san);
+            sfree(hash);
+        }
         (void) scp_finish_filerecv();
         sfree(stat_name);
         sfree(destfname);
@@ -2199,6 +2393,10 @@ static void usage(void)
     printf("  -unsafe   allow server-side wildcards (DANGEROUS)\n");
     printf("  -sftp     force use of SFTP protocol\n");
     printf("  -scp      force use of SCP protocol\n");
+    printf("  -stripes n\n");
+    printf("            with SFTP, download large files over n channels"
+           " at once\n");
+    printf("  -hash     print a SHA-256 hash of each file downloaded\n");
     printf("  -sshlog file\n");
     printf("  -sshrawlog file\n");
     printf("            log protocol details to a file\n");
@@ -2288,6 +2486,13 @@ int psftp_main(int argc, char *argv[])
             try_scp = false; try_sftp = true;
         } else if (strcmp(argv[i], "-scp") == 0) {
             try_scp = true; try_sftp = false;
+        } else if (strcmp(argv[i], "-stripes") == 0 && i + 1 < argc) {
+            nstripes = atoi(argv[++i]);
+            if (nstripes < 1 || nstripes > SFTP_MAX_STRIPES)
+                cmdline_error("-stripes expects a number from 1 to %d",
+                              SFTP_MAX_STRIPES);
+        } else if (strcmp(argv[i], "-hash") == 0) {
+            hash_files = true;
         } else if (strcmp(argv[i], "-sanitise-stderr") == 0) {
             sanitise_stderr = true;
         } else if (strcmp(argv[i], "-no-sanitise-stderr") == 0) {
@@ -2303,6 +2508,16 @@ int psftp_main(int argc, char *argv[])
     argv += i;
     backend = NULL;
 
+    /*
+     * The hash is worked out as the file is written in order, which
+     * a striped download doesn't do.
+     */
+    if (hash_files && nstripes > 1) {
+        fprintf(stderr, "pscp: -hash and -stripes cannot be used "
+                "together; ignoring -stripes\n");
+        nstripes = 1;
+    }
+
     stdio_sink_init(&stderr_ss, stderr);
     stderr_bs = BinarySink_UPCAST(&stderr_ss);
     if (sanitise_stderr) {
@@ -2330,6 +2545,10 @@ int psftp_main(int argc, char *argv[])
             tolocal(argc, argv);
     }
 
+    if (stripes) {
+        sftp_stripes_free(stripes);
+        stripes = NULL;
+    }
     if (backend && backend_connected(backend)) {
         char ch;
         backend_special(backend, SS_EOF, 0);
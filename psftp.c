@@ -26,6 +26,7 @@ const char *const appname = "PSFTP";
 static int psftp_connect(char *userhost, char *user, int portnumber);
 static int do_sftp_init(void);
 static void do_sftp_cleanup(void);
+static void free_stripes(void);
 
 /* ----------------------------------------------------------------------
  * sftp client state.
@@ -36,6 +37,10 @@ static LogContext *psftp_logctx = NULL;
 static Backend *backend;
 static Conf *conf;
 static bool sent_eof = false;
+static int nstripes = 1;
+static bool compress_files = false;
+static bool hash_files = false;
+static SftpStripes *stripes;
 
 /* ------------------------------------------------------------
  * Seat vtable.
@@ -65,6 +70,7 @@ static const SeatVtable psftp_seat_vt = {
     nullseat_set_trust_status_vacuously,
     cmdline_seat_verbose,
     nullseat_interactive_yes,
+    nullseat_kex_finished,
 };
 static Seat psftp_seat[1] = {{ &psftp_seat_vt }};
 
@@ -212,6 +218,106 @@ char *canonify(const char *name)
     }
 }
 
+/*
+ * Send a request for each of n things, keeping up to PIPELINE_DEPTH
+ * of them in flight at once, and pass each reply to 'recv' (in
+ * whatever order they arrive) along with the index of the thing it
+ * was for. 'recv' must not wait for any replies of its own.
+ */
+#define PIPELINE_DEPTH 256
+typedef struct sftp_request *(*pipeline_send_fn_t)(void *ctx, size_t i);
+typedef void (*pipeline_recv_fn_t)(void *ctx, size_t i,
+                                   struct sftp_packet *pktin,
+                                   struct sftp_request *req);
+static void sftp_pipeline(size_t n, pipeline_send_fn_t send,
+                          pipeline_recv_fn_t recv, void *ctx)
+{
+    size_t *indices = snewn(n, size_t);
+    size_t sent = 0, done = 0;
+
+    while (done < n) {
+        struct sftp_packet *pktin;
+        struct sftp_request *rreq;
+
+        while (sent < n && sent - done < PIPELINE_DEPTH) {
+            struct sftp_request *req = send(ctx, sent);
+            indices[sent] = sent;
+            sftp_register(req);
+            fxp_set_userdata(req, &indices[sent]);
+            sent++;
+        }
+
+        pktin = sftp_recv();
+        if (pktin == NULL) {
+            seat_connection_fatal(
+                psftp_seat, "did not receive SFTP response packet "
+                "from server");
+        }
+        rreq = sftp_find_request(pktin);
+        if (!rreq || !fxp_get_userdata(rreq)) {
+            seat_connection_fatal(
+                psftp_seat,
+                "unable to understand SFTP response packet from server: %s",
+                fxp_error());
+        }
+        recv(ctx, *(size_t *)fxp_get_userdata(rreq), pktin, rreq);
+        done++;
+    }
+
+    sfree(indices);
+}
+
+struct canonify_many_ctx {
+    char **names, **fullnames, **results;
+};
+
+static struct sftp_request *canonify_many_send(void *vctx, size_t i)
+{
+    struct canonify_many_ctx *ctx = (struct canonify_many_ctx *)vctx;
+    const char *name = ctx->names[i];
+
+    if (name[0] == '/')
+        ctx->fullnames[i] = dupstr(name);
+    else
+        ctx->fullnames[i] = dupcat(pwd, (strendswith(pwd, "/") ? "" : "/"),
+                                   name);
+    return fxp_realpath_send(ctx->fullnames[i]);
+}
+
+static void canonify_many_recv(void *vctx, size_t i, struct sftp_packet *pktin,
+                               struct sftp_request *req)
+{
+    struct canonify_many_ctx *ctx = (struct canonify_many_ctx *)vctx;
+    ctx->results[i] = fxp_realpath_recv(pktin, req);
+}
+
+/*
+ * Replace each of n names with its canonify()ed version, asking the
+ * server about all of them at once. Any it can't resolve go through
+ * canonify() itself afterwards, for its fallbacks.
+ */
+static void canonify_many(char **names, size_t n)
+{
+    struct canonify_many_ctx ctx[1];
+
+    ctx->names = names;
+    ctx->fullnames = snewn(n, char *);
+    ctx->results = snewn(n, char *);
+    sftp_pipeline(n, canonify_many_send, canonify_many_recv, ctx);
+
+    for (size_t i = 0; i < n; i++) {
+        char *canonname = ctx->results[i];
+        if (!canonname)
+            canonname = canonify(names[i]);
+        sfree(names[i]);
+        names[i] = canonname;
+        sfree(ctx->fullnames[i]);
+    }
+
+    sfree(ctx->fullnames);
+    sfree(ctx->results);
+}
+
 static int bare_name_compare(const void *av, const void *bv)
 {
     const char **a = (const char **) av;
@@ -227,188 +333,148 @@ static void not_connected(void)
 /* ----------------------------------------------------------------------
  * The meat of the `get' and `put' commands.
  */
-bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
+/*
+ * Helpers for reget and reput, which check the data already at the
+ * destination against the source (see sftp_check_blocks) and then
+ * transfer again each run of blocks that turned out to differ.
+ */
+static bool sftp_refetch_runs(struct fxp_handle *fh, WFile *file,
+                              const uint64_t *runs, size_t nruns)
 {
-    struct fxp_handle *fh;
-    struct sftp_packet *pktin;
-    struct sftp_request *req;
-    struct fxp_xfer *xfer;
-    uint64_t offset;
-    WFile *file;
-    bool toret, shown_err = false;
-    struct fxp_attrs attrs;
+    bool ok = true;
 
-    /*
-     * In recursive mode, see if we're dealing with a directory.
-     * (If we're not in recursive mode, we need not even check: the
-     * subsequent FXP_OPEN will return a usable error message.)
-     */
-    if (recurse) {
-        bool result;
+    for (size_t i = 0; ok && i < nruns; i++) {
+        uint64_t pos = runs[2*i];
+        struct fxp_xfer *xfer =
+            xfer_download_init_range(fh, pos, runs[2*i+1]);
 
-        req = fxp_stat_send(fname);
-        pktin = sftp_wait_for_reply(req);
-        result = fxp_stat_recv(pktin, req, &attrs);
+        while (!xfer_done(xfer)) {
+            struct sftp_packet *pktin;
+            void *vbuf;
+            int retd, len;
 
-        if (result &&
-            (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) &&
-            (attrs.permissions & 0040000)) {
-
-            struct fxp_handle *dirhandle;
-            size_t nnames, namesize;
-            struct fxp_name **ournames;
-            struct fxp_names *names;
-            int i;
+            xfer_download_queue(xfer);
+            pktin = sftp_recv();
+            retd = xfer_download_gotpkt(xfer, pktin);
+            if (retd <= 0) {
+                if (ok)
+                    printf("error while reading: %s\n", fxp_error());
+                if (retd == INT_MIN)        /* pktin not even freed */
+                    sfree(pktin);
+                ok = false;
+            }
 
-            /*
-             * First, attempt to create the destination directory,
-             * unless it already exists.
-             */
-            if (file_type(outfname) != FILE_TYPE_DIRECTORY &&
-                !create_directory(outfname)) {
-                with_stripctrl(san, outfname)
-                    printf("%s: Cannot create directory\n", san);
-                return false;
+            while (xfer_download_data(xfer, &vbuf, &len)) {
+                if (ok && write_to_file_at(file, pos, vbuf, len) < len) {
+                    printf("error while writing local file\n");
+                    ok = false;
+                    xfer_set_error(xfer);
+                }
+                pos += len;
+                sfree(vbuf);
             }
+        }
 
-            /*
-             * Now get the list of filenames in the remote
-             * directory.
-             */
-            req = fxp_opendir_send(fname);
-            pktin = sftp_wait_for_reply(req);
-            dirhandle = fxp_opendir_recv(pktin, req);
+        xfer_cleanup(xfer);
+    }
 
-            if (!dirhandle) {
-                with_stripctrl(san, fname)
-                    printf("%s: unable to open directory: %s\n",
-                           san, fxp_error());
-                return false;
-            }
-            nnames = namesize = 0;
-            ournames = NULL;
-            while (1) {
-                int i;
+    return ok;
+}
 
-                req = fxp_readdir_send(dirhandle);
-                pktin = sftp_wait_for_reply(req);
-                names = fxp_readdir_recv(pktin, req);
+static bool sftp_resend_runs(RFile *file, struct fxp_handle *fh,
+                             const uint64_t *runs, size_t nruns)
+{
+    int writelen = fxp_max_write_len();
+    char *buffer = snewn(writelen, char);
+    bool ok = true;
 
-                if (names == NULL) {
-                    if (fxp_error_type() == SSH_FX_EOF)
-                        break;
-                    with_stripctrl(san, fname)
-                        printf("%s: reading directory: %s\n",
-                               san, fxp_error());
+    for (size_t i = 0; ok && i < nruns; i++) {
+        uint64_t pos = runs[2*i], end = runs[2*i+1];
+        struct fxp_xfer *xfer = xfer_upload_init(fh, pos);
 
-                    req = fxp_close_send(dirhandle);
-                    pktin = sftp_wait_for_reply(req);
-                    fxp_close_recv(pktin, req);
+        if (seek_file((WFile *)file, pos, FROM_START) != 0) {
+            printf("error while reading local file\n");
+            ok = false;
+        }
 
-                    sfree(ournames);
-                    return false;
-                }
-                if (names->nnames == 0) {
-                    fxp_free_names(names);
+        while ((ok && pos < end) || !xfer_done(xfer)) {
+            while (ok && pos < end && xfer_upload_ready(xfer)) {
+                int len = (end - pos < writelen ? end - pos : writelen);
+                len = read_from_file(file, buffer, len);
+                if (len <= 0) {
+                    printf("error while reading local file\n");
+                    ok = false;
                     break;
                 }
-                sgrowarrayn(ournames, namesize, nnames, names->nnames);
-                for (i = 0; i < names->nnames; i++)
-                    if (strcmp(names->names[i].filename, ".") &&
-                        strcmp(names->names[i].filename, "..")) {
-                        if (!vet_filename(names->names[i].filename)) {
-                            with_stripctrl(san, names->names[i].filename)
-                                printf("ignoring potentially dangerous server-"
-                                       "supplied filename '%s'\n", san);
-                        } else {
-                            ournames[nnames++] =
-                                fxp_dup_name(&names->names[i]);
-                        }
-                    }
-                fxp_free_names(names);
+                xfer_upload_data(xfer, buffer, len);
+                pos += len;
             }
-            req = fxp_close_send(dirhandle);
-            pktin = sftp_wait_for_reply(req);
-            fxp_close_recv(pktin, req);
 
-            /*
-             * Sort the names into a clear order. This ought to
-             * make things more predictable when we're doing a
-             * reget of the same directory, just in case two
-             * readdirs on the same remote directory return a
-             * different order.
-             */
-            if (nnames > 0)
-                qsort(ournames, nnames, sizeof(*ournames), sftp_name_compare);
-
-            /*
-             * If we're in restart mode, find the last filename on
-             * this list that already exists. We may have to do a
-             * reget on _that_ file, but shouldn't have to do
-             * anything on the previous files.
-             *
-             * If none of them exists, of course, we start at 0.
-             */
-            i = 0;
-            if (restart) {
-                while (i < nnames) {
-                    char *nextoutfname;
-                    bool nonexistent;
-                    nextoutfname = dir_file_cat(outfname,
-                                                ournames[i]->filename);
-                    nonexistent = (file_type(nextoutfname) ==
-                                   FILE_TYPE_NONEXISTENT);
-                    sfree(nextoutfname);
-                    if (nonexistent)
-                        break;
-                    i++;
+            if (!xfer_done(xfer)) {
+                struct sftp_packet *pktin = sftp_recv();
+                int ret = xfer_upload_gotpkt(xfer, pktin);
+                if (ret <= 0) {
+                    if (ret == INT_MIN)        /* pktin not even freed */
+                        sfree(pktin);
+                    if (ok)
+                        printf("error while writing: %s\n", fxp_error());
+                    ok = false;
                 }
-                if (i > 0)
-                    i--;
+            } else if (ok && pos < end && ssh_sftp_loop_iteration() < 0) {
+                /* Waiting for the send buffer to drain, as in
+                 * sftp_put_file. */
+                printf("error while writing: connection lost\n");
+                ok = false;
             }
+        }
 
-            /*
-             * Now we're ready to recurse. Starting at ournames[i]
-             * and continuing on to the end of the list, we
-             * construct a new source and target file name, and
-             * call sftp_get_file again.
-             */
-            for (; i < nnames; i++) {
-                char *nextfname, *nextoutfname;
-                bool retd;
-
-                nextfname = dupcat(fname, "/", ournames[i]->filename);
-                nextoutfname = dir_file_cat(outfname, ournames[i]->filename);
-                retd = sftp_get_file(
-                    nextfname, nextoutfname, recurse, restart);
-                restart = false;       /* after first partial file, do full */
-                sfree(nextoutfname);
-                sfree(nextfname);
-                if (!retd) {
-                    for (i = 0; i < nnames; i++) {
-                        fxp_free_name(ournames[i]);
-                    }
-                    sfree(ournames);
-                    return false;
-                }
-            }
+        xfer_cleanup(xfer);
+    }
 
-            /*
-             * Done this recursion level. Free everything.
-             */
-            for (i = 0; i < nnames; i++) {
-                fxp_free_name(ournames[i]);
-            }
-            sfree(ournames);
+    sfree(buffer);
+    return ok;
+}
 
-            return true;
-        }
+/*
+ * Report the outcome of sftp_check_blocks for reget or reput.
+ */
+static void sftp_report_check(const char *cmd, bool checked, size_t nruns,
+                              const uint64_t *runs)
+{
+    uint64_t total = 0;
+
+    if (!checked) {
+        printf("%s: server cannot verify existing data, trusting it\n",
+               cmd);
+        return;
     }
+    for (size_t i = 0; i < nruns; i++)
+        total += runs[2*i+1] - runs[2*i];
+    if (total == 0)
+        printf("%s: existing data verified\n", cmd);
+    else
+        printf("%s: %"PRIu64" bytes of existing data differ, "
+               "transferring them again\n", cmd, total);
+}
 
-    req = fxp_stat_send(fname);
-    pktin = sftp_wait_for_reply(req);
-    if (!fxp_stat_recv(pktin, req, &attrs))
-        attrs.flags = 0;
+/*
+ * Download one file, whose attributes we already know (or have
+ * given up on, in which case attrs->flags is zero).
+ */
+static bool sftp_get_regular_file(const char *fname, const char *outfname,
+                                  const struct fxp_attrs *attrsp,
+                                  bool restart)
+{
+    struct fxp_handle *fh;
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    struct fxp_xfer *xfer;
+    SftpWriteQueue *wq;
+    uint64_t offset;
+    WFile *file;
+    bool toret, shown_err = false, shown_werr = false;
+    char *hash;
+    struct fxp_attrs attrs = *attrsp;
 
     req = fxp_open_send(fname, SSH_FXF_READ, NULL);
     pktin = sftp_wait_for_reply(req);
@@ -451,6 +517,36 @@ bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
 
         offset = get_file_posn(file);
         printf("reget: restarting at file position %"PRIu64"\n", offset);
+
+        if (offset > 0) {
+            uint64_t length = offset, *runs = NULL;
+            size_t nruns = 0;
+            bool checked = false;
+            RFile *rfile;
+
+            if ((attrs.flags & SSH_FILEXFER_ATTR_SIZE) &&
+                attrs.size < length)
+                length = attrs.size;
+            rfile = open_existing_file(outfname, NULL, NULL, NULL, NULL);
+            if (rfile) {
+                checked = sftp_check_blocks(rfile, fh, length,
+                                            &runs, &nruns);
+                close_rfile(rfile);
+            }
+            sftp_report_check("reget", checked, nruns, runs);
+            if (checked) {
+                bool ok = sftp_refetch_runs(fh, file, runs, nruns);
+                sfree(runs);
+                seek_file(file, offset, FROM_START);
+                if (!ok) {
+                    close_wfile(file);
+                    req = fxp_close_send(fh);
+                    pktin = sftp_wait_for_reply(req);
+                    fxp_close_recv(pktin, req);
+                    return false;
+                }
+            }
+        }
     } else {
         offset = 0;
     }
@@ -460,16 +556,40 @@ bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
             printf("remote:%s => local:%s\n", san, sano);
     }
 
+    if (nstripes > 1 && (attrs.flags & SSH_FILEXFER_ATTR_SIZE)) {
+        const char *err;
+        StripedResult sr;
+
+        if (!stripes)
+            stripes = sftp_stripes_new(backend, nstripes);
+        sr = sftp_striped_download(stripes, fname, file, offset, attrs.size,
+                                   NULL, NULL, &err);
+        if (sr != STRIPED_UNAVAILABLE) {
+            if (sr == STRIPED_FAILED)
+                printf("error while reading: %s\n", err);
+            close_wfile(file);
+            req = fxp_close_send(fh);
+            pktin = sftp_wait_for_reply(req);
+            fxp_close_recv(pktin, req);
+            return sr == STRIPED_DONE;
+        }
+    }
+
     /*
      * FIXME: we can use FXP_FSTAT here to get the file size, and
      * thus put up a progress bar.
      */
     toret = true;
+    wq = sftp_wq_new(file, hash_files);
+    if (offset > 0)
+        sftp_wq_hash_existing(wq, outfname, offset);
     xfer = xfer_download_init(fh, offset);
+    if (compress_files &&
+        fxp_has_extension("compressed-read@putty.projects.tartarus.org"))
+        xfer_set_compressed(xfer);
     while (!xfer_done(xfer)) {
         void *vbuf;
         int retd, len;
-        int wpos, wlen;
 
         xfer_download_queue(xfer);
         pktin = sftp_recv();
@@ -485,30 +605,35 @@ bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
         }
 
         while (xfer_download_data(xfer, &vbuf, &len)) {
-            unsigned char *buf = (unsigned char *)vbuf;
-
-            wpos = 0;
-            while (wpos < len) {
-                wlen = write_to_file(file, buf + wpos, len - wpos);
-                if (wlen <= 0) {
-                    printf("error while writing local file\n");
-                    toret = false;
-                    xfer_set_error(xfer);
-                    break;
-                }
-                wpos += wlen;
-            }
-            if (wpos < len) {          /* we had an error */
-                toret = false;
-                xfer_set_error(xfer);
-            }
+            if (!sftp_wq_failed(wq))
+                sftp_wq_write(wq, vbuf, len);
+            else
+                sfree(vbuf);
+        }
 
-            sfree(vbuf);
+        if (sftp_wq_failed(wq) && !shown_werr) {
+            printf("error while writing local file\n");
+            shown_werr = true;
+            toret = false;
+            xfer_set_error(xfer);
         }
     }
 
     xfer_cleanup(xfer);
 
+    if (!sftp_wq_finish(wq, &hash)) {
+        if (!shown_werr)
+            printf("error while writing local file\n");
+        toret = false;
+    }
+    if (hash) {
+        if (toret) {
+            with_stripctrl(sano, outfname)
+                printf("%s  %s\n", hash, sano);
+        }
+        sfree(hash);
+    }
+
     close_wfile(file);
 
     req = fxp_close_send(fh);
@@ -518,7 +643,146 @@ bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
     return toret;
 }
 
-bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
+/*
+ * Download the directory at entries[idx] of a manifest from
+ * sftp_walk_tree, and everything inside it, into outfname.
+ */
+static bool sftp_get_tree(const struct fxp_walk_entry *entries, size_t idx,
+                          const char *outfname, bool restart)
+{
+    const struct fxp_walk_entry *dir = &entries[idx];
+    size_t i;
+
+    /*
+     * First, attempt to create the destination directory, unless it
+     * already exists.
+     */
+    if (file_type(outfname) != FILE_TYPE_DIRECTORY &&
+        !create_directory(outfname)) {
+        with_stripctrl(san, outfname)
+            printf("%s: Cannot create directory\n", san);
+        return false;
+    }
+
+    if (dir->error) {
+        with_stripctrl(san, dir->path)
+            printf(dir->opened ? "%s: reading directory: %s\n" :
+                   "%s: unable to open directory: %s\n", san, dir->error);
+        return false;
+    }
+
+    /*
+     * If we're in restart mode, find the last entry in this
+     * directory that already exists. We may have to do a reget on
+     * _that_ file, but shouldn't have to do anything on the previous
+     * files. (The walk sorted the names, so a reget of the same
+     * directory should go through them in the same order as the
+     * original get did.)
+     *
+     * If none of them exists, of course, we start at the first.
+     */
+    i = idx + 1;
+    if (restart) {
+        size_t prev = i;
+
+        for (; i < dir->end; prev = i, i = entries[i].end) {
+            char *nextoutfname;
+            bool nonexistent;
+
+            if (entries[i].rejected)
+                continue;
+            nextoutfname = dir_file_cat(outfname, entries[i].name);
+            nonexistent = (file_type(nextoutfname) == FILE_TYPE_NONEXISTENT);
+            sfree(nextoutfname);
+            if (nonexistent)
+                break;
+        }
+        i = prev;
+    }
+
+    /*
+     * Now we're ready to recurse. Starting at that entry and
+     * continuing to the end of the directory, we construct a new
+     * target file name for each entry and fetch it.
+     */
+    for (; i < dir->end; i = entries[i].end) {
+        const struct fxp_walk_entry *e = &entries[i];
+        char *nextoutfname;
+        bool retd;
+
+        if (e->rejected) {
+            with_stripctrl(san, e->name)
+                printf("ignoring potentially dangerous server-"
+                       "supplied filename '%s'\n", san);
+            continue;
+        }
+
+        nextoutfname = dir_file_cat(outfname, e->name);
+        if (e->is_dir) {
+            retd = sftp_get_tree(entries, i, nextoutfname, restart);
+        } else {
+            struct fxp_attrs attrs = e->attrs;
+            if (e->error)
+                attrs.flags = 0;
+            retd = sftp_get_regular_file(e->path, nextoutfname,
+                                         &attrs, restart);
+        }
+        restart = false;               /* after first partial file, do full */
+        sfree(nextoutfname);
+        if (!retd)
+            return false;
+    }
+
+    return true;
+}
+
+bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
+{
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    struct fxp_attrs attrs;
+
+    req = fxp_stat_send(fname);
+    pktin = sftp_wait_for_reply(req);
+    if (!fxp_stat_recv(pktin, req, &attrs))
+        attrs.flags = 0;
+
+    /*
+     * In recursive mode, see if we're dealing with a directory. If
+     * so, find out everything that's in it before we start, with
+     * lots of requests in flight at once, rather than one directory
+     * at a time in between the downloads.
+     */
+    if (recurse &&
+        (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) &&
+        (attrs.permissions & 0040000)) {
+        struct fxp_walk *walk;
+        const struct fxp_walk_entry *entries;
+        size_t nentries;
+        bool toret;
+
+        walk = sftp_walk_tree(fname, &attrs);
+        if (!walk)
+            seat_connection_fatal(
+                psftp_seat, "unable to understand SFTP response packet "
+                "from server: %s", fxp_error());
+        entries = fxp_walk_entries(walk, &nentries);
+        toret = sftp_get_tree(entries, 0, outfname, restart);
+        fxp_walk_cleanup(walk);
+        return toret;
+    }
+
+    return sftp_get_regular_file(fname, outfname, &attrs, restart);
+}
+
+/*
+ * Amount of the local file to read in one go when uploading. Each
+ * block goes out as several FXP_WRITEs of fxp_max_write_len().
+ */
+#define UPLOAD_READ_BLOCK (1024 * 1024)
+
+bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart,
+                   bool delta)
 {
     struct fxp_handle *fh;
     struct fxp_xfer *xfer;
@@ -526,9 +790,13 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
     struct sftp_request *req;
     uint64_t offset;
     RFile *file;
-    bool err = false, eof;
+    uint64_t size;
+    bool err = false, eof, readable = false;
     struct fxp_attrs attrs;
     long permissions;
+    char *buffer;
+    int bufpos, buflen, writelen;
+    SftpCompressQueue *zq = NULL;
 
     /*
      * In recursive mode, see if we're dealing with a directory.
@@ -627,7 +895,8 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
 
             nextfname = dir_file_cat(fname, ournames[i]);
             nextoutfname = dupcat(outfname, "/", ournames[i]);
-            retd = sftp_put_file(nextfname, nextoutfname, recurse, restart);
+            retd = sftp_put_file(nextfname, nextoutfname, recurse, restart,
+                                 delta);
             restart = false;           /* after first partial file, do full */
             sfree(nextoutfname);
             sfree(nextfname);
@@ -651,22 +920,63 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
         return true;
     }
 
-    file = open_existing_file(fname, NULL, NULL, NULL, &permissions);
+    file = open_existing_file(fname, &size, NULL, NULL, &permissions);
     if (!file) {
         printf("local: unable to open %s\n", fname);
         return false;
     }
     attrs.flags = 0;
     PUT_PERMISSIONS(attrs, permissions);
+
+    if (delta && !restart) {
+        uint64_t literal;
+        const char *error;
+
+        switch (sftp_delta_upload(file, outfname, &attrs, &literal, &error)) {
+          case DELTA_DONE:
+            printf("local:%s => remote:%s (delta: sent %"PRIu64
+                   " of %"PRIu64" bytes)\n", fname, outfname, literal, size);
+            close_rfile(file);
+            return true;
+          case DELTA_FAILED:
+            printf("%s: delta transfer: %s\n", outfname, error);
+            close_rfile(file);
+            return false;
+          case DELTA_MISMATCH:
+            printf("%s: delta transfer did not verify, "
+                   "sending whole file\n", outfname);
+            break;
+          case DELTA_UNAVAILABLE:
+            break;
+        }
+        seek_file((WFile *)file, 0, FROM_START);
+    }
+
     if (restart) {
-        req = fxp_open_send(outfname, SSH_FXF_WRITE, &attrs);
+        /*
+         * If the server can hash what's there, ask for read access
+         * too so that it can. But a file we may write and not read
+         * can still be resumed, just without checking it.
+         */
+        readable = fxp_has_extension("check-file-handle");
+        req = fxp_open_send(outfname,
+                            SSH_FXF_WRITE | (readable ? SSH_FXF_READ : 0),
+                            &attrs);
+        pktin = sftp_wait_for_reply(req);
+        fh = fxp_open_recv(pktin, req);
+        if (!fh && readable) {
+            readable = false;
+            req = fxp_open_send(outfname, SSH_FXF_WRITE, &attrs);
+            pktin = sftp_wait_for_reply(req);
+            fh = fxp_open_recv(pktin, req);
+        }
     } else {
         req = fxp_open_send(outfname,
                             SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
                             &attrs);
+        pktin = sftp_wait_for_reply(req);
+        fh = fxp_open_recv(pktin, req);
     }
-    pktin = sftp_wait_for_reply(req);
-    fh = fxp_open_recv(pktin, req);
 
     if (!fh) {
         close_rfile(file);
@@ -695,6 +1005,23 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
         offset = attrs.size;
         printf("reput: restarting at file position %"PRIu64"\n", offset);
 
+        if (offset > 0) {
+            uint64_t *runs = NULL;
+            size_t nruns = 0;
+            bool checked = readable &&
+                sftp_check_blocks(file, fh, min(offset, size),
+                                  &runs, &nruns);
+            sftp_report_check("reput", checked, nruns, runs);
+            if (checked) {
+                bool ok = sftp_resend_runs(file, fh, runs, nruns);
+                sfree(runs);
+                if (!ok) {
+                    err = true;
+                    goto cleanup;
+                }
+            }
+        }
+
         if (seek_file((WFile *)file, offset, FROM_START) != 0)
             seek_file((WFile *)file, 0, FROM_END);    /* *shrug* */
     } else {
@@ -707,24 +1034,54 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
      * FIXME: we can use FXP_FSTAT here to get the file size, and
      * thus put up a progress bar.
      */
+    /*
+     * Read the local file in large blocks, and send each one as a
+     * run of FXP_WRITEs as big as the server will accept.
+     */
     xfer = xfer_upload_init(fh, offset);
     eof = false;
-    while ((!err && !eof) || !xfer_done(xfer)) {
-        char buffer[4096];
+    buffer = snewn(UPLOAD_READ_BLOCK, char);
+    bufpos = buflen = 0;
+    writelen = fxp_max_write_len();
+    if (compress_files &&
+        fxp_has_extension("compressed-write@putty.projects.tartarus.org"))
+        zq = sftp_zq_new();
+    while ((!err && (!eof || (zq && !sftp_zq_empty(zq)))) ||
+           !xfer_done(xfer)) {
         int len, ret;
 
-        while (xfer_upload_ready(xfer) && !err && !eof) {
-            len = read_from_file(file, buffer, sizeof(buffer));
-            if (len == -1) {
-                printf("error while reading local file\n");
-                err = true;
-            } else if (len == 0) {
-                eof = true;
-            } else {
-                xfer_upload_data(xfer, buffer, len);
+        while (!err && !eof &&
+               (zq ? !sftp_zq_full(zq) : xfer_upload_ready(xfer))) {
+            if (bufpos == buflen) {
+                len = read_from_file(file, buffer, UPLOAD_READ_BLOCK);
+                if (len == -1) {
+                    printf("error while reading local file\n");
+                    err = true;
+                } else if (len == 0) {
+                    eof = true;
+                } else {
+                    bufpos = 0;
+                    buflen = len;
+                }
+                continue;
             }
+            len = min(buflen - bufpos, writelen);
+            if (zq)
+                sftp_zq_submit(zq, buffer + bufpos, len);
+            else
+                xfer_upload_data(xfer, buffer + bufpos, len);
+            bufpos += len;
         }
 
+        /*
+         * Send whatever the compressor has finished. If no writes
+         * are outstanding, there's no reply to wait for, so we might
+         * as well wait for the compressor instead.
+         */
+        while (zq && !err && xfer_upload_ready(xfer) &&
+               sftp_zq_send(zq, xfer, xfer_done(xfer)))
+            continue;
+
         if (toplevel_callback_pending() && !err && !eof) {
             /* If we have pending callbacks, they might make
              * xfer_upload_ready start to return true. So we should
@@ -746,10 +1103,25 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
                     err = true;
                 }
             }
+        } else if (!err && (!eof || (zq && !sftp_zq_empty(zq)))) {
+            /*
+             * Every write has been answered, but our send buffer
+             * still isn't empty (e.g. because the SSH layer is
+             * holding packets back during a key exchange). There's
+             * no reply coming to wait for, so just run the network
+             * until the buffer drains.
+             */
+            if (ssh_sftp_loop_iteration() < 0) {
+                printf("error while writing: connection lost\n");
+                err = true;
+            }
         }
     }
 
     xfer_cleanup(xfer);
+    sfree(buffer);
+    if (zq)
+        sftp_zq_free(zq);
 
   cleanup:
     req = fxp_close_send(fh);
@@ -934,7 +1306,8 @@ bool wildcard_iterate(char *filename, bool (*func)(void *, char *), void *ctx)
 
     if (is_wc) {
         SftpWildcardMatcher *swcm = sftp_begin_wildcard_matching(filename);
-        bool matched = false;
+        char **names = NULL;
+        size_t nnames = 0, namesize = 0;
         sfree(unwcfname);
 
         if (!swcm)
@@ -942,21 +1315,30 @@ bool wildcard_iterate(char *filename, bool (*func)(void *, char *), void *ctx)
 
         toret = true;
 
+        /*
+         * Collect all the matching names first, so that we can
+         * canonify them all at once, and so that we aren't still
+         * reading the directory while we change things in it.
+         */
         while ( (newname = sftp_wildcard_get_filename(swcm)) != NULL ) {
-            cname = canonify(newname);
-            sfree(newname);
-            matched = true;
-            if (!func(ctx, cname))
-                toret = false;
-            sfree(cname);
+            sgrowarray(names, namesize, nnames);
+            names[nnames++] = newname;
         }
 
-        if (!matched) {
+        sftp_finish_wildcard_matching(swcm);
+
+        if (!nnames) {
             /* Politely warn the user that nothing matched. */
             printf("%s: nothing matched\n", filename);
         }
 
-        sftp_finish_wildcard_matching(swcm);
+        canonify_many(names, nnames);
+        for (size_t i = 0; i < nnames; i++) {
+            if (!func(ctx, names[i]))
+                toret = false;
+            sfree(names[i]);
+        }
+        sfree(names);
     } else {
         cname = canonify(unwcfname);
         toret = func(ctx, cname);
@@ -1010,6 +1392,7 @@ int sftp_cmd_close(struct sftp_command *cmd)
         return 0;
     }
 
+    free_stripes();
     if (backend_connected(backend)) {
         char ch;
         backend_special(backend, SS_EOF, 0);
@@ -1198,6 +1581,22 @@ int sftp_cmd_pwd(struct sftp_command *cmd)
     return 1;
 }
 
+/*
+ * Write the SSH connection statistics to the Event Log.
+ */
+int sftp_cmd_stats(struct sftp_command *cmd)
+{
+    if (!backend) {
+        not_connected();
+        return 0;
+    }
+
+    backend_special(backend, SS_STATS, 0);
+    if (!cmdline_verbose())
+        printf("Statistics written to the Event Log (use -v to see it)\n");
+    return 1;
+}
+
 /*
  * Get a file and save it at the local end. We have three very
  * similar commands here. The basic one is `get'; `reget' differs
@@ -1320,7 +1719,7 @@ int sftp_general_put(struct sftp_command *cmd, bool restart, bool multiple)
     char *fname, *wfname, *origoutfname, *outfname;
     int i;
     int toret;
-    bool recurse = false;
+    bool recurse = false, delta = false;
 
     if (!backend) {
         not_connected();
@@ -1335,6 +1734,8 @@ int sftp_general_put(struct sftp_command *cmd, bool restart, bool multiple)
             break;
         } else if (!strcmp(cmd->words[i], "-r")) {
             recurse = true;
+        } else if (!strcmp(cmd->words[i], "-d") && !restart) {
+            delta = true;
         } else {
             printf("%s: unrecognised option '%s'\n", cmd->words[0], cmd->words[i]);
             return 0;
@@ -1373,7 +1774,7 @@ int sftp_general_put(struct sftp_command *cmd, bool restart, bool multiple)
                 origoutfname = stripslashes(wfname, true);
 
             outfname = canonify(origoutfname);
-            toret = sftp_put_file(wfname, outfname, recurse, restart);
+            toret = sftp_put_file(wfname, outfname, recurse, restart, delta);
             sfree(outfname);
 
             if (wcm) {
@@ -1447,12 +1848,100 @@ int sftp_cmd_mkdir(struct sftp_command *cmd)
     return ret;
 }
 
+/*
+ * If the server supports our batch extension, rmdir, rm, mv and chmod
+ * queue up their operations in 'batch' instead of sending each one
+ * and waiting for the reply. Each operation comes with the messages
+ * to print about it when its result comes back: 'failed' is followed
+ * by the error.
+ */
+#define BATCH_MAX_OPS 1024
+#define BATCH_MAX_BYTES 131072
+struct batch_msgs {
+    char *failed, *succeeded;
+};
+static struct fxp_batch *batch;
+static struct batch_msgs *batch_msgs;
+static size_t batch_msgsize;
+static bool batch_ok;
+
+static void sftp_batch_begin(void)
+{
+    if (fxp_has_extension("batch@putty.projects.tartarus.org"))
+        batch = fxp_batch_new();
+    batch_ok = true;
+}
+
+static void sftp_batch_flush(void)
+{
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    size_t n = fxp_batch_count(batch);
+    bool result;
+
+    if (!n)
+        return;
+
+    req = fxp_batch_send(batch);
+    pktin = sftp_wait_for_reply(req);
+    result = fxp_batch_recv(pktin, req, batch);
+
+    /* If the whole batch failed, so did each operation, for the same
+     * reason. */
+    for (size_t i = 0; i < n; i++) {
+        if (result && fxp_batch_result(batch, i)) {
+            printf("%s\n", batch_msgs[i].succeeded);
+        } else {
+            printf("%s: %s\n", batch_msgs[i].failed, fxp_error());
+            batch_ok = false;
+        }
+        sfree(batch_msgs[i].failed);
+        sfree(batch_msgs[i].succeeded);
+    }
+    fxp_batch_clear(batch);
+}
+
+/* Call after adding an operation to 'batch'. Takes ownership of the
+ * messages. */
+static void sftp_batch_added(char *failed, char *succeeded)
+{
+    size_t n = fxp_batch_count(batch);
+
+    sgrowarray(batch_msgs, batch_msgsize, n - 1);
+    batch_msgs[n - 1].failed = failed;
+    batch_msgs[n - 1].succeeded = succeeded;
+
+    if (n >= BATCH_MAX_OPS || fxp_batch_size(batch) >= BATCH_MAX_BYTES)
+        sftp_batch_flush();
+}
+
+/* Returns false if anything in the batch failed. */
+static bool sftp_batch_end(void)
+{
+    if (batch) {
+        sftp_batch_flush();
+        fxp_batch_free(batch);
+        batch = NULL;
+        sfree(batch_msgs);
+        batch_msgs = NULL;
+        batch_msgsize = 0;
+    }
+    return batch_ok;
+}
+
 static bool sftp_action_rmdir(void *vctx, char *dir)
 {
     struct sftp_packet *pktin;
     struct sftp_request *req;
     bool result;
 
+    if (batch) {
+        fxp_batch_rmdir(batch, dir);
+        sftp_batch_added(dupprintf("rmdir %s", dir),
+                         dupprintf("rmdir %s: OK", dir));
+        return true;
+    }
+
     req = fxp_rmdir_send(dir);
     pktin = sftp_wait_for_reply(req);
     result = fxp_rmdir_recv(pktin, req);
@@ -1482,8 +1971,10 @@ int sftp_cmd_rmdir(struct sftp_command *cmd)
     }
 
     ret = 1;
+    sftp_batch_begin();
     for (i = 1; i < cmd->nwords; i++)
         ret &= wildcard_iterate(cmd->words[i], sftp_action_rmdir, NULL);
+    ret &= sftp_batch_end();
 
     return ret;
 }
@@ -1494,6 +1985,13 @@ static bool sftp_action_rm(void *vctx, char *fname)
     struct sftp_request *req;
     bool result;
 
+    if (batch) {
+        fxp_batch_remove(batch, fname);
+        sftp_batch_added(dupprintf("rm %s", fname),
+                         dupprintf("rm %s: OK", fname));
+        return true;
+    }
+
     req = fxp_remove_send(fname);
     pktin = sftp_wait_for_reply(req);
     result = fxp_remove_recv(pktin, req);
@@ -1523,8 +2021,10 @@ int sftp_cmd_rm(struct sftp_command *cmd)
     }
 
     ret = 1;
+    sftp_batch_begin();
     for (i = 1; i < cmd->nwords; i++)
         ret &= wildcard_iterate(cmd->words[i], sftp_action_rm, NULL);
+    ret &= sftp_batch_end();
 
     return ret;
 }
@@ -1569,14 +2069,32 @@ static bool sftp_action_mv(void *vctx, char *srcfname)
         p = srcfname + strlen(srcfname);
         while (p > srcfname && p[-1] != '/') p--;
         newname = dupcat(ctx->dstfname, "/", p);
-        newcanon = canonify(newname);
-        sfree(newname);
+        if (batch) {
+            /*
+             * The destination directory is canonical already, and
+             * we're only adding the final component of another
+             * canonical name, so save a round trip.
+             */
+            newcanon = newname;
+        } else {
+            newcanon = canonify(newname);
+            sfree(newname);
+        }
 
         finalfname = newcanon;
     } else {
         finalfname = ctx->dstfname;
     }
 
+    if (batch) {
+        fxp_batch_rename(batch, srcfname, finalfname);
+        with_stripctrl(san, finalfname)
+            sftp_batch_added(dupprintf("mv %s %s", srcfname, san),
+                             dupprintf("%s -> %s", srcfname, san));
+        sfree(newcanon);
+        return true;
+    }
+
     req = fxp_rename_send(srcfname, finalfname);
     pktin = sftp_wait_for_reply(req);
     result = fxp_rename_recv(pktin, req);
@@ -1631,8 +2149,161 @@ int sftp_cmd_mv(struct sftp_command *cmd)
      * Now iterate over the source arguments.
      */
     ret = 1;
+    sftp_batch_begin();
     for (i = 1; i < cmd->nwords-1; i++)
         ret &= wildcard_iterate(cmd->words[i], sftp_action_mv, ctx);
+    ret &= sftp_batch_end();
+
+    sfree(ctx->dstfname);
+    return ret;
+}
+
+/*
+ * Copy a file on the server, without bringing the data through the
+ * client at all, if the server supports copy-data.
+ */
+static bool sftp_action_cp(void *vctx, char *srcfname)
+{
+    struct sftp_context_mv *ctx = (struct sftp_context_mv *)vctx;
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    struct fxp_handle *srcfh, *dstfh;
+    struct fxp_attrs attrs, sizeattrs;
+    char *finalfname;
+    bool toret = false;
+
+    if (ctx->dest_is_dir) {
+        const char *p = srcfname + strlen(srcfname);
+        char *newname;
+        while (p > srcfname && p[-1] != '/') p--;
+        newname = dupcat(ctx->dstfname, "/", p);
+        finalfname = canonify(newname);
+        sfree(newname);
+    } else {
+        finalfname = dupstr(ctx->dstfname);
+    }
+
+    /*
+     * Both names are canonical, so this catches copying a file onto
+     * itself by any route short of a hard link. Opening the
+     * destination would otherwise destroy the source.
+     */
+    if (!strcmp(srcfname, finalfname)) {
+        with_stripctrl(san, finalfname)
+            printf("cp: %s and %s are the same file\n", srcfname, san);
+        sfree(finalfname);
+        return false;
+    }
+
+    req = fxp_open_send(srcfname, SSH_FXF_READ, NULL);
+    pktin = sftp_wait_for_reply(req);
+    srcfh = fxp_open_recv(pktin, req);
+    if (!srcfh) {
+        printf("%s: open for read: %s\n", srcfname, fxp_error());
+        sfree(finalfname);
+        return false;
+    }
+
+    req = fxp_fstat_send(srcfh);
+    pktin = sftp_wait_for_reply(req);
+    if (!fxp_fstat_recv(pktin, req, &attrs))
+        attrs.flags = 0;
+
+    if ((attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) &&
+        (attrs.permissions & 0040000)) {
+        printf("cp: %s: is a directory\n", srcfname);
+        req = fxp_close_send(srcfh);
+        pktin = sftp_wait_for_reply(req);
+        fxp_close_recv(pktin, req);
+        sfree(finalfname);
+        return false;
+    }
+
+    /*
+     * If we know how long the source is, don't truncate the
+     * destination until the copy has worked, so that if it's the
+     * source under another name and the server refuses, nothing is
+     * lost.
+     */
+    sizeattrs.flags = attrs.flags & SSH_FILEXFER_ATTR_SIZE;
+    sizeattrs.size = attrs.size;
+    attrs.flags &= SSH_FILEXFER_ATTR_PERMISSIONS;   /* perms _only_ */
+
+    req = fxp_open_send(finalfname, SSH_FXF_WRITE | SSH_FXF_CREAT |
+                        (sizeattrs.flags ? 0 : SSH_FXF_TRUNC), &attrs);
+    pktin = sftp_wait_for_reply(req);
+    dstfh = fxp_open_recv(pktin, req);
+
+    if (!dstfh) {
+        with_stripctrl(san, finalfname)
+            printf("%s: open for write: %s\n", san, fxp_error());
+    } else {
+        bool ok;
+
+        req = fxp_copy_data_send(srcfh, 0, 0, dstfh, 0);
+        pktin = sftp_wait_for_reply(req);
+        ok = fxp_copy_data_recv(pktin, req);
+        if (ok && sizeattrs.flags) {
+            req = fxp_fsetstat_send(dstfh, sizeattrs);
+            pktin = sftp_wait_for_reply(req);
+            ok = fxp_fsetstat_recv(pktin, req);
+        }
+        if (ok) {
+            with_stripctrl(san, finalfname)
+                printf("%s -> %s\n", srcfname, san);
+            toret = true;
+        } else {
+            with_stripctrl(san, finalfname)
+                printf("cp %s %s: %s\n", srcfname, san, fxp_error());
+        }
+
+        req = fxp_close_send(dstfh);
+        pktin = sftp_wait_for_reply(req);
+        fxp_close_recv(pktin, req);
+    }
+
+    req = fxp_close_send(srcfh);
+    pktin = sftp_wait_for_reply(req);
+    fxp_close_recv(pktin, req);
+
+    sfree(finalfname);
+    return toret;
+}
+
+int sftp_cmd_cp(struct sftp_command *cmd)
+{
+    struct sftp_context_mv ctx[1];
+    int i, ret;
+
+    if (!backend) {
+        not_connected();
+        return 0;
+    }
+
+    if (cmd->nwords < 3) {
+        printf("cp: expects two filenames\n");
+        return 0;
+    }
+
+    if (!fxp_has_extension("copy-data")) {
+        printf("cp: server does not support copying files\n");
+        return 0;
+    }
+
+    ctx->dstfname = canonify(cmd->words[cmd->nwords-1]);
+
+    /* As with mv, several sources need a directory to go into. */
+    ctx->dest_is_dir = check_is_dir(ctx->dstfname);
+    if ((cmd->nwords > 3 || is_wildcard(cmd->words[1])) && !ctx->dest_is_dir) {
+        printf("cp: multiple or wildcard arguments require the destination"
+               " to be a directory\n");
+        sfree(ctx->dstfname);
+        return 0;
+    }
+
+    ret = 1;
+    for (i = 1; i < cmd->nwords-1; i++)
+        ret &= wildcard_iterate(cmd->words[i], sftp_action_cp, ctx);
 
     sfree(ctx->dstfname);
     return ret;
@@ -1640,8 +2311,36 @@ int sftp_cmd_mv(struct sftp_command *cmd)
 
 struct sftp_context_chmod {
     unsigned attrs_clr, attrs_xor;
+
+    /* When batching, the files to change, to look them all up at once */
+    char **names;
+    size_t nnames, namesize;
+    struct fxp_attrs *attrs;
+    const char **errors;
 };
 
+/*
+ * Work out the new permissions for a file, given what FXP_STAT said
+ * about it. Returns false, having complained, if we can't.
+ */
+static bool chmod_new_perms(struct sftp_context_chmod *ctx, const char *fname,
+                            const char *error, struct fxp_attrs *attrs,
+                            unsigned *oldperms, unsigned *newperms)
+{
+    if (error || !(attrs->flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+        printf("get attrs for %s: %s\n", fname,
+               error ? error : "file permissions not provided");
+        return false;
+    }
+
+    attrs->flags = SSH_FILEXFER_ATTR_PERMISSIONS;   /* perms _only_ */
+    *oldperms = attrs->permissions & 07777;
+    attrs->permissions &= ~ctx->attrs_clr;
+    attrs->permissions ^= ctx->attrs_xor;
+    *newperms = attrs->permissions & 07777;
+    return true;
+}
+
 static bool sftp_action_chmod(void *vctx, char *fname)
 {
     struct fxp_attrs attrs;
@@ -1651,21 +2350,19 @@ static bool sftp_action_chmod(void *vctx, char *fname)
     unsigned oldperms, newperms;
     struct sftp_context_chmod *ctx = (struct sftp_context_chmod *)vctx;
 
+    if (batch) {
+        sgrowarray(ctx->names, ctx->namesize, ctx->nnames);
+        ctx->names[ctx->nnames++] = dupstr(fname);
+        return true;
+    }
+
     req = fxp_stat_send(fname);
     pktin = sftp_wait_for_reply(req);
     result = fxp_stat_recv(pktin, req, &attrs);
 
-    if (!result || !(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
-        printf("get attrs for %s: %s\n", fname,
-               result ? "file permissions not provided" : fxp_error());
+    if (!chmod_new_perms(ctx, fname, result ? NULL : fxp_error(),
+                         &attrs, &oldperms, &newperms))
         return false;
-    }
-
-    attrs.flags = SSH_FILEXFER_ATTR_PERMISSIONS;   /* perms _only_ */
-    oldperms = attrs.permissions & 07777;
-    attrs.permissions &= ~ctx->attrs_clr;
-    attrs.permissions ^= ctx->attrs_xor;
-    newperms = attrs.permissions & 07777;
 
     if (oldperms == newperms)
         return true;                   /* no need to do anything! */
@@ -1684,6 +2381,57 @@ static bool sftp_action_chmod(void *vctx, char *fname)
     return true;
 }
 
+static struct sftp_request *chmod_stat_send(void *vctx, size_t i)
+{
+    struct sftp_context_chmod *ctx = (struct sftp_context_chmod *)vctx;
+    return fxp_stat_send(ctx->names[i]);
+}
+
+static void chmod_stat_recv(void *vctx, size_t i, struct sftp_packet *pktin,
+                            struct sftp_request *req)
+{
+    struct sftp_context_chmod *ctx = (struct sftp_context_chmod *)vctx;
+    if (!fxp_stat_recv(pktin, req, &ctx->attrs[i]))
+        ctx->errors[i] = fxp_error();
+}
+
+/*
+ * The batched version of sftp_action_chmod, for all the files it
+ * has collected: look them all up at once, then change them all at
+ * once.
+ */
+static bool sftp_chmod_batch(struct sftp_context_chmod *ctx)
+{
+    bool toret = true;
+
+    ctx->attrs = snewn(ctx->nnames, struct fxp_attrs);
+    ctx->errors = snewn(ctx->nnames, const char *);
+    for (size_t i = 0; i < ctx->nnames; i++)
+        ctx->errors[i] = NULL;
+    sftp_pipeline(ctx->nnames, chmod_stat_send, chmod_stat_recv, ctx);
+
+    for (size_t i = 0; i < ctx->nnames; i++) {
+        const char *fname = ctx->names[i];
+        unsigned oldperms, newperms;
+
+        if (!chmod_new_perms(ctx, fname, ctx->errors[i], &ctx->attrs[i],
+                             &oldperms, &newperms)) {
+            toret = false;
+        } else if (oldperms != newperms) {
+            fxp_batch_setstat(batch, fname, ctx->attrs[i]);
+            sftp_batch_added(dupprintf("set attrs for %s", fname),
+                             dupprintf("%s: %04o -> %04o", fname,
+                                       oldperms, newperms));
+        }
+        sfree(ctx->names[i]);
+    }
+
+    sfree(ctx->names);
+    sfree(ctx->attrs);
+    sfree(ctx->errors);
+    return toret;
+}
+
 int sftp_cmd_chmod(struct sftp_command *cmd)
 {
     char *mode;
@@ -1806,8 +2554,14 @@ int sftp_cmd_chmod(struct sftp_command *cmd)
     }
 
     ret = 1;
+    ctx->names = NULL;
+    ctx->nnames = ctx->namesize = 0;
+    sftp_batch_begin();
     for (i = 2; i < cmd->nwords; i++)
         ret &= wildcard_iterate(cmd->words[i], sftp_action_chmod, ctx);
+    if (batch)
+        ret &= sftp_chmod_batch(ctx);
+    ret &= sftp_batch_end();
 
     return ret;
 }
@@ -1967,6 +2721,17 @@ static struct sftp_cmd_lookup {
             "  session, to the same server or to a different one.\n",
             sftp_cmd_close
     },
+    {
+        "cp", true, "copy file(s) on the remote server",
+            " <source> [ <source>... ] <destination>\n"
+            "  Copies <source>(s) on the server to <destination>, also on\n"
+            "  the server, without transferring the data over the network.\n"
+            "  This needs a server supporting the \"copy-data\" extension.\n"
+            "  If <destination> specifies an existing directory, then <source>\n"
+            "  may be a wildcard, and multiple <source>s may be given; all\n"
+            "  source files are copied into <destination>.\n",
+            sftp_cmd_cp
+    },
     {
         "del", true, "delete files on the remote server",
             " <filename-or-wildcard> [ <filename-or-wildcard>... ]\n"
@@ -2041,11 +2806,13 @@ static struct sftp_cmd_lookup {
     },
     {
         "mput", true, "upload multiple files at once",
-            " [ -r ] [ -- ] <filename-or-wildcard> [ <filename-or-wildcard>... ]\n"
+            " [ -r ] [ -d ] [ -- ] <filename-or-wildcard> [ <filename-or-wildcard>... ]\n"
             "  Uploads many files to the server, storing each one under the\n"
             "  same name it has on the client side. You can use wildcards\n"
             "  such as \"*.c\" to specify lots of files at once.\n"
-            "  If -r specified, recursively store files and directories.\n",
+            "  If -r specified, recursively store files and directories.\n"
+            "  If -d specified, send only the changes to files that\n"
+            "  already exist on the server, if the server supports it.\n",
             sftp_cmd_mput
     },
     {
@@ -2069,11 +2836,13 @@ static struct sftp_cmd_lookup {
     },
     {
         "put", true, "upload a file from your local machine to the server",
-            " [ -r ] [ -- ] <filename> [ <remote-filename> ]\n"
+            " [ -r ] [ -d ] [ -- ] <filename> [ <remote-filename> ]\n"
             "  Uploads a file to the server and stores it there under\n"
             "  the same name, or under a different one if you supply the\n"
             "  argument <remote-filename>.\n"
-            "  If -r specified, recursively store a directory.\n",
+            "  If -r specified, recursively store a directory.\n"
+            "  If -d specified, send only the changes to a file that\n"
+            "  already exists on the server, if the server supports it.\n",
             sftp_cmd_put
     },
     {
@@ -2123,6 +2892,14 @@ static struct sftp_cmd_lookup {
             "  The directory will not be removed unless it is empty.\n"
             "  Wildcards may be used to specify multiple directories.\n",
             sftp_cmd_rmdir
+    },
+    {
+        "stats", true, "show statistics for the SSH connection",
+            "\n"
+            "  Writes counts of packets and bytes transferred, output\n"
+            "  queue sizes and flow control events for the current SSH\n"
+            "  connection to the Event Log.\n",
+            sftp_cmd_stats
     }
 };
 
@@ -2361,9 +3138,23 @@ static int do_sftp_init(void)
     return 0;
 }
 
+/*
+ * Close the extra channels used for striped downloads. This must be
+ * done before sending EOF on the main channel, or the connection
+ * won't close when the server closes that.
+ */
+static void free_stripes(void)
+{
+    if (stripes) {
+        sftp_stripes_free(stripes);
+        stripes = NULL;
+    }
+}
+
 static void do_sftp_cleanup(void)
 {
     char ch;
+    free_stripes();
     if (backend) {
         backend_special(backend, SS_EOF, 0);
         sent_eof = true;
@@ -2538,6 +3329,11 @@ static void usage(void)
     printf("  -hostkey aa:bb:cc:...\n");
     printf("            manually specify a host key (may be repeated)\n");
     printf("  -batch    disable all interactive prompts\n");
+    printf("  -stripes n\n");
+    printf("            download large files over n SFTP channels at once\n");
+    printf("  -compress-files\n");
+    printf("            compress file data, if the server can\n");
+    printf("  -hash     print a SHA-256 hash of each file downloaded\n");
     printf("  -no-sanitise-stderr  don't strip control chars from"
            " standard error\n");
     printf("  -proxycmd command\n");
@@ -2821,6 +3617,15 @@ int psftp_main(int argc, char *argv[])
             version();
         } else if (strcmp(argv[i], "-batch") == 0) {
             console_batch_mode = true;
+        } else if (strcmp(argv[i], "-stripes") == 0 && i + 1 < argc) {
+            nstripes = atoi(argv[++i]);
+            if (nstripes < 1 || nstripes > SFTP_MAX_STRIPES)
+                cmdline_error("-stripes expects a number from 1 to %d",
+                              SFTP_MAX_STRIPES);
+        } else if (strcmp(argv[i], "-compress-files") == 0) {
+            compress_files = true;
+        } else if (strcmp(argv[i], "-hash") == 0) {
+            hash_files = true;
         } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
             mode = 1;
             batchfile = argv[++i];
@@ -2843,6 +3648,16 @@ int psftp_main(int argc, char *argv[])
     argv += i;
     backend = NULL;
 
+    /*
+     * The hash is worked out as the file is written in order, which
+     * a striped download doesn't do.
+     */
+    if (hash_files && nstripes > 1) {
+        fprintf(stderr, "psftp: -hash and -stripes cannot be used "
+                "together; ignoring -stripes\n");
+        nstripes = 1;
+    }
+
     stdio_sink_init(&stderr_ss, stderr);
     stderr_bs = BinarySink_UPCAST(&stderr_ss);
     if (sanitise_stderr) {
@@ -2880,6 +3695,7 @@ int psftp_main(int argc, char *argv[])
 
     ret = do_sftp(mode, modeflags, batchfile);
 
+    free_stripes();
     if (backend && backend_connected(backend)) {
         char ch;
         backend_special(backend, SS_EOF, 0);
@@ -102,6 +102,8 @@ void close_rfile(RFile *f);
 WFile *open_new_file(const char *name, long perms);
 /* Returns <0 on error, 0 on eof, or number of bytes written, as usual */
 int write_to_file(WFile *f, void *buffer, int length);
+/* The same, but at a given offset regardless of the file position */
+int write_to_file_at(WFile *f, uint64_t offset, void *buffer, int length);
 void set_file_times(WFile *f, unsigned long mtime, unsigned long atime);
 /* Closes and frees the WFile */
 void close_wfile(WFile *f);
@@ -198,6 +200,25 @@ char *dir_file_cat(const char *dir, const char *file);
  */
 char *stripslashes(const char *str, bool local);
 
+/*
+ * A background thread for CPU-heavy work that can overlap with the
+ * network, such as compressing upload data. Jobs are run in the
+ * order they're submitted and collected in the same order; the
+ * worker only passes each one to 'fn' and never looks inside it.
+ * bgworker_collect returns the oldest job once it's finished, or
+ * NULL if there are none (or, unless 'wait' is set, the oldest isn't
+ * finished yet). On a platform without threads, or if one can't be
+ * started, bgworker_submit just runs the job itself.
+ *
+ * All jobs must be collected before bgworker_free.
+ */
+typedef struct BgWorker BgWorker;
+typedef void (*bgworker_fn_t)(void *job);
+BgWorker *bgworker_new(bgworker_fn_t fn);
+void bgworker_submit(BgWorker *w, void *job);
+void *bgworker_collect(BgWorker *w, bool wait);
+void bgworker_free(BgWorker *w);
+
 /* ----------------------------------------------------------------------
  * In psftpcommon.c
  */
@@ -224,4 +245,126 @@ void list_directory_from_sftp_free(struct list_directory_from_sftp_ctx *ctx);
 void list_directory_from_sftp_warn_unsorted(void);
 void list_directory_from_sftp_print(struct fxp_name *name);
 
+/*
+ * Striped downloads: fetch a large file over several extra SFTP
+ * sessions on the same connection at once, each reading its own
+ * range of the file. The sessions are opened the first time they're
+ * needed and kept until sftp_stripes_free.
+ *
+ * sftp_striped_download writes the remote file from 'offset' up to
+ * its end (nominally 'size') into 'file', and calls 'progress' (if
+ * non-NULL) with the total number of bytes present so far. It
+ * returns STRIPED_UNAVAILABLE, having done nothing, if the file is
+ * too small to be worth striping or the server won't give us the
+ * sessions; then the caller should do an ordinary download. On
+ * STRIPED_FAILED, *error describes what went wrong.
+ */
+#define SFTP_MAX_STRIPES 16
+typedef struct SftpStripes SftpStripes;
+typedef enum {
+    STRIPED_UNAVAILABLE, STRIPED_DONE, STRIPED_FAILED
+} StripedResult;
+typedef void (*sftp_stripes_progress_fn_t)(void *ctx, uint64_t done);
+SftpStripes *sftp_stripes_new(Backend *backend, int nstripes);
+void sftp_stripes_free(SftpStripes *ss);
+StripedResult sftp_striped_download(
+    SftpStripes *ss, const char *fname, WFile *file,
+    uint64_t offset, uint64_t size,
+    sftp_stripes_progress_fn_t progress, void *progress_ctx,
+    const char **error);
+
+/*
+ * Verified resume: compare the first 'length' bytes of a local file
+ * with the same range of an open remote file, SFTP_CHECK_BLOCK bytes
+ * at a time, using the check-file-handle extension. On success,
+ * *runs is a dynamically allocated array of (start, end) offset
+ * pairs, *nruns of them, covering the blocks that differ. Returns
+ * false if the comparison couldn't be done (e.g. the server doesn't
+ * support it), in which case the caller should go on trusting the
+ * existing data as it did before.
+ */
+#define SFTP_CHECK_BLOCK 1048576
+struct fxp_handle; /* in sftp.h */
+bool sftp_check_blocks(RFile *local, struct fxp_handle *fh, uint64_t length,
+                       uint64_t **runs, size_t *nruns);
+
+/*
+ * Delta uploads: update an existing remote file by sending only the
+ * parts of the local one that the server doesn't already have, if
+ * it supports copy-data and our block-signatures extension. The new
+ * version is built in a temporary file and then renamed over the
+ * old one, so 'attrs' are the attributes to create it with.
+ *
+ * sftp_delta_upload returns DELTA_UNAVAILABLE, having changed
+ * nothing, if the server can't do it, the remote file doesn't exist
+ * or it's too small to bother with; DELTA_MISMATCH if the server's
+ * hash of the finished file didn't match ours (so it was thrown
+ * away); in either case the caller should fall back to an ordinary
+ * upload. On DELTA_DONE, *literal is the amount of file data we
+ * actually sent; on DELTA_FAILED, *error says what went wrong.
+ */
+typedef enum {
+    DELTA_UNAVAILABLE, DELTA_MISMATCH, DELTA_DONE, DELTA_FAILED
+} DeltaResult;
+struct fxp_attrs; /* in sftp.h */
+DeltaResult sftp_delta_upload(RFile *file, const char *outfname,
+                              const struct fxp_attrs *attrs,
+                              uint64_t *literal, const char **error);
+
+/*
+ * Compressed uploads, if the server supports our compressed-write
+ * extension. Data is passed to sftp_zq_submit in pieces of at most
+ * fxp_max_write_len(), which are compressed in the background (see
+ * bgworker_new) and then sent, in order, by sftp_zq_send. That
+ * returns false if nothing was ready to send; if 'wait' is set, it
+ * waits for the oldest piece instead, so only returns false if the
+ * queue is empty. sftp_zq_full says when to stop submitting.
+ */
+typedef struct SftpCompressQueue SftpCompressQueue;
+struct fxp_xfer; /* in sftp.h */
+SftpCompressQueue *sftp_zq_new(void);
+bool sftp_zq_full(SftpCompressQueue *zq);
+bool sftp_zq_empty(SftpCompressQueue *zq);
+void sftp_zq_submit(SftpCompressQueue *zq, const void *data, int len);
+bool sftp_zq_send(SftpCompressQueue *zq, struct fxp_xfer *xfer, bool wait);
+void sftp_zq_free(SftpCompressQueue *zq);
+
+/*
+ * Writing downloaded data to a local file in the background, so that
+ * a slow local disk doesn't stop us reading from the network. Each
+ * buffer passed to sftp_wq_write is taken over by the queue (which
+ * will sfree it) and written, in order, by a background worker (see
+ * bgworker_new). If more than a few megabytes are waiting to be
+ * written, sftp_wq_write waits for the disk to catch up.
+ *
+ * If 'hash' is set, a SHA-256 of the data is computed as it's
+ * written. When resuming a download, sftp_wq_hash_existing feeds the
+ * first 'len' bytes already in the local file into that hash; it
+ * must be called before any data is written.
+ *
+ * sftp_wq_failed says whether a write has failed yet (which may be a
+ * while after the data in question was passed in). sftp_wq_finish
+ * waits for all the writes, frees the queue, and returns false if any
+ * of them failed. If the hash was computed, and 'hexhash' is not
+ * NULL, *hexhash is set to a dynamically allocated hex string of it.
+ * The file itself is left open.
+ */
+typedef struct SftpWriteQueue SftpWriteQueue;
+SftpWriteQueue *sftp_wq_new(WFile *file, bool hash);
+void sftp_wq_hash_existing(SftpWriteQueue *wq, const char *fname,
+                           uint64_t len);
+void sftp_wq_write(SftpWriteQueue *wq, void *data, int len);
+bool sftp_wq_failed(SftpWriteQueue *wq);
+bool sftp_wq_finish(SftpWriteQueue *wq, char **hexhash);
+
+/*
+ * Walk the remote directory tree at 'root' (whose attributes the
+ * caller has already looked up) with fxp_walk, and wait for the
+ * whole manifest. Names in it are checked with vet_filename.
+ * Returns NULL, having printed nothing, if the connection failed.
+ */
+struct fxp_walk;
+struct fxp_walk *sftp_walk_tree(const char *root,
+                                const struct fxp_attrs *attrs);
+
 #endif /* PUTTY_PSFTP_H */
@@ -6,10 +6,12 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "putty.h"
 #include "sftp.h"
 #include "psftp.h"
+#include "ssh.h"
 
 #define MAX_NAMES_MEMORY ((size_t)8 << 20)
 
@@ -100,3 +102,1391 @@ void list_directory_from_sftp_finish(struct list_directory_from_sftp_ctx *ctx)
             list_directory_from_sftp_print(ctx->names[i]);
     }
 }
+
+/* ----------------------------------------------------------------------
+ * Striped downloads: fetch one large file over several extra SFTP
+ * sessions at once, each running on its own channel of the same SSH
+ * connection and reading its own contiguous byte range of the file,
+ * and put the pieces back together with positional writes.
+ *
+ * This helps when one channel's window, or the server's handling of
+ * a single session, is what limits the transfer rate.
+ */
+
+/* Files smaller than this aren't worth the extra round trips. */
+#define STRIPE_MIN_SIZE ((uint64_t)4 << 20)
+/* Stripe boundaries are rounded to a whole number of read requests. */
+#define STRIPE_ALIGN 32768
+
+struct sftp_stripe {
+    SubsysChannel *sub;
+    SftpStream stream;
+
+    struct fxp_handle *fh;
+    struct fxp_xfer *xfer;
+    uint64_t pos, end;
+};
+
+struct SftpStripes {
+    Backend *backend;
+    int nwanted;
+    bool started, unusable;
+
+    struct sftp_stripe *stripes;
+    int nstripes;
+};
+
+static bool stripe_senddata(SftpStream *stream, const char *data, size_t len)
+{
+    struct sftp_stripe *st = container_of(stream, struct sftp_stripe, stream);
+    if (subsyschan_failed(st->sub))
+        return false;
+    subsyschan_write(st->sub, data, len);
+    return true;
+}
+
+static size_t stripe_sendbuffer(SftpStream *stream)
+{
+    struct sftp_stripe *st = container_of(stream, struct sftp_stripe, stream);
+    return subsyschan_sendbuffer(st->sub);
+}
+
+static bool stripe_recvdata(SftpStream *stream, char *data, size_t len)
+{
+    struct sftp_stripe *st = container_of(stream, struct sftp_stripe, stream);
+    bufchain *input = subsyschan_input(st->sub);
+
+    while (bufchain_size(input) < len) {
+        if (subsyschan_failed(st->sub) || ssh_sftp_loop_iteration() < 0)
+            return false;
+    }
+    bufchain_fetch_consume(input, data, len);
+    return true;
+}
+
+static const struct SftpStreamVtable stripe_streamvt = {
+    stripe_senddata,
+    stripe_sendbuffer,
+    stripe_recvdata,
+};
+
+/*
+ * Whether a stripe has a whole SFTP packet waiting, so that
+ * sftp_recv on it won't block.
+ */
+static bool stripe_has_packet(struct sftp_stripe *st)
+{
+    bufchain *input = subsyschan_input(st->sub);
+    unsigned char len[4];
+
+    if (bufchain_size(input) < 4)
+        return false;
+    bufchain_fetch(input, len, 4);
+    return bufchain_size(input) - 4 >= GET_32BIT_MSB_FIRST(len);
+}
+
+/*
+ * Synchronously wait for the reply to a request on the currently
+ * selected stream. Unlike the front ends' sftp_wait_for_reply, a
+ * failure here isn't fatal: it just means we give up on whatever
+ * optimisation we were trying.
+ */
+static struct sftp_packet *wait_for_reply_nonfatal(struct sftp_request *req)
+{
+    struct sftp_packet *pktin;
+    struct sftp_request *rreq;
+
+    sftp_register(req);
+    pktin = sftp_recv();
+    if (!pktin) {
+        sftp_abandon_request(req);
+        return NULL;
+    }
+    rreq = sftp_find_request(pktin);
+    if (rreq != req) {
+        if (rreq)
+            sftp_abandon_request(rreq);
+        sftp_abandon_request(req);
+        sftp_pkt_free(pktin);
+        return NULL;
+    }
+    return pktin;
+}
+
+SftpStripes *sftp_stripes_new(Backend *backend, int nstripes)
+{
+    SftpStripes *ss = snew(SftpStripes);
+    memset(ss, 0, sizeof(*ss));
+    ss->backend = backend;
+    ss->nwanted = nstripes;
+    return ss;
+}
+
+static void sftp_stripes_drop(SftpStripes *ss, int i)
+{
+    subsyschan_close(ss->stripes[i].sub);
+    memmove(ss->stripes + i, ss->stripes + i + 1,
+            (ss->nstripes - i - 1) * sizeof(*ss->stripes));
+    ss->nstripes--;
+}
+
+void sftp_stripes_free(SftpStripes *ss)
+{
+    while (ss->nstripes > 0)
+        sftp_stripes_drop(ss, ss->nstripes - 1);
+    sfree(ss->stripes);
+    sfree(ss);
+}
+
+/*
+ * Make sure we have at least two working stripes. The channels are
+ * opened on first use and then kept for the rest of the session; if
+ * the server won't give us enough of them, stop trying.
+ */
+static bool sftp_stripes_start(SftpStripes *ss)
+{
+    if (ss->unusable)
+        return false;
+
+    if (!ss->started) {
+        ss->started = true;
+        ss->stripes = snewn(ss->nwanted, struct sftp_stripe);
+        for (int i = 0; i < ss->nwanted; i++) {
+            SubsysChannel *sub = ssh_subsystem_open(ss->backend, "sftp");
+            if (!sub)
+                break;
+            ss->stripes[ss->nstripes].sub = sub;
+            ss->stripes[ss->nstripes].stream.vt = &stripe_streamvt;
+            ss->nstripes++;
+        }
+
+        while (true) {
+            bool waiting = false;
+            for (int i = 0; i < ss->nstripes; i++)
+                if (!subsyschan_ready(ss->stripes[i].sub) &&
+                    !subsyschan_failed(ss->stripes[i].sub))
+                    waiting = true;
+            if (!waiting)
+                break;
+            if (ssh_sftp_loop_iteration() < 0) {
+                ss->unusable = true;
+                return false;
+            }
+        }
+
+        for (int i = ss->nstripes; i-- > 0 ;) {
+            struct sftp_stripe *st = &ss->stripes[i];
+            if (subsyschan_failed(st->sub)) {
+                sftp_stripes_drop(ss, i);
+                continue;
+            }
+            sftp_select_stream(&st->stream);
+            if (!fxp_init_stream())
+                sftp_stripes_drop(ss, i);
+        }
+        sftp_select_stream(NULL);
+    }
+
+    /* The server might have closed some since last time. */
+    for (int i = ss->nstripes; i-- > 0 ;)
+        if (subsyschan_failed(ss->stripes[i].sub))
+            sftp_stripes_drop(ss, i);
+
+    if (ss->nstripes < 2) {
+        ss->unusable = true;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Close the file handles of the first n stripes, sending all the
+ * requests before waiting for any of the replies.
+ */
+static void sftp_stripes_close_files(SftpStripes *ss, int n)
+{
+    struct sftp_request **reqs = snewn(n, struct sftp_request *);
+
+    for (int i = 0; i < n; i++) {
+        sftp_select_stream(&ss->stripes[i].stream);
+        reqs[i] = fxp_close_send(ss->stripes[i].fh);
+    }
+    for (int i = 0; i < n; i++) {
+        struct sftp_packet *pktin;
+        sftp_select_stream(&ss->stripes[i].stream);
+        pktin = wait_for_reply_nonfatal(reqs[i]);
+        if (pktin)
+            fxp_close_recv(pktin, reqs[i]);
+    }
+    sftp_select_stream(NULL);
+    sfree(reqs);
+}
+
+StripedResult sftp_striped_download(
+    SftpStripes *ss, const char *fname, WFile *file,
+    uint64_t offset, uint64_t size,
+    sftp_stripes_progress_fn_t progress, void *progress_ctx,
+    const char **error)
+{
+    struct sftp_request **reqs;
+    uint64_t stripelen, received;
+    int n, nopen;
+    bool ok = true, dead = false;
+
+    if (offset >= size || size - offset < STRIPE_MIN_SIZE ||
+        !sftp_stripes_start(ss))
+        return STRIPED_UNAVAILABLE;
+    n = ss->nstripes;
+
+    /*
+     * Open the file in every session.
+     */
+    reqs = snewn(n, struct sftp_request *);
+    for (int i = 0; i < n; i++) {
+        sftp_select_stream(&ss->stripes[i].stream);
+        reqs[i] = fxp_open_send(fname, SSH_FXF_READ, NULL);
+    }
+    nopen = n;
+    for (int i = 0; i < n; i++) {
+        struct sftp_packet *pktin;
+        struct fxp_handle *fh = NULL;
+
+        sftp_select_stream(&ss->stripes[i].stream);
+        pktin = wait_for_reply_nonfatal(reqs[i]);
+        if (pktin)
+            fh = fxp_open_recv(pktin, reqs[i]);
+        if (!fh && nopen == n)
+            nopen = i;
+        if (nopen < n && fh) {
+            /* Too late to use this one; we're falling back. */
+            struct sftp_request *req = fxp_close_send(fh);
+            pktin = wait_for_reply_nonfatal(req);
+            if (pktin)
+                fxp_close_recv(pktin, req);
+        }
+        ss->stripes[i].fh = fh;
+    }
+    sfree(reqs);
+    if (nopen < n) {
+        sftp_stripes_close_files(ss, nopen);
+        return STRIPED_UNAVAILABLE;
+    }
+
+    /*
+     * Divide up the file. The last stripe reads on to EOF, in case
+     * the file has grown since we found out its size.
+     */
+    stripelen = (size - offset + n - 1) / n;
+    stripelen = (stripelen + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+    for (int i = 0; i < n; i++) {
+        struct sftp_stripe *st = &ss->stripes[i];
+        st->pos = offset + i * stripelen;
+        if (st->pos > size)
+            st->pos = size;
+        st->end = (i == n-1 ? UINT64_MAX :
+                   size - st->pos < stripelen ? size : st->pos + stripelen);
+        sftp_select_stream(&st->stream);
+        st->xfer = xfer_download_init_range(st->fh, st->pos, st->end);
+    }
+
+    received = offset;
+    while (true) {
+        struct sftp_stripe *st = NULL;
+        struct sftp_packet *pktin;
+        bool done = true;
+        void *vbuf;
+        int retd, len;
+
+        for (int i = 0; i < n; i++) {
+            if (!xfer_done(ss->stripes[i].xfer)) {
+                done = false;
+                sftp_select_stream(&ss->stripes[i].stream);
+                xfer_download_queue(ss->stripes[i].xfer);
+            }
+        }
+        if (done)
+            break;
+
+        for (int i = 0; i < n; i++) {
+            if (!xfer_done(ss->stripes[i].xfer) &&
+                stripe_has_packet(&ss->stripes[i])) {
+                st = &ss->stripes[i];
+                break;
+            }
+        }
+
+        if (!st) {
+            for (int i = 0; i < n; i++)
+                if (!xfer_done(ss->stripes[i].xfer) &&
+                    subsyschan_failed(ss->stripes[i].sub))
+                    dead = true;
+            if (dead || ssh_sftp_loop_iteration() < 0) {
+                dead = true;
+                break;
+            }
+            continue;
+        }
+
+        sftp_select_stream(&st->stream);
+        pktin = sftp_recv();
+        if (!pktin) {
+            dead = true;
+            break;
+        }
+        retd = xfer_download_gotpkt(st->xfer, pktin);
+        if (retd <= 0) {
+            if (ok)
+                *error = fxp_error();
+            if (retd == INT_MIN)        /* pktin not even freed */
+                sftp_pkt_free(pktin);
+            ok = false;
+            for (int i = 0; i < n; i++)
+                xfer_set_error(ss->stripes[i].xfer);
+        }
+
+        while (xfer_download_data(st->xfer, &vbuf, &len)) {
+            if (ok && write_to_file_at(file, st->pos, vbuf, len) < len) {
+                *error = "error while writing local file";
+                ok = false;
+                for (int i = 0; i < n; i++)
+                    xfer_set_error(ss->stripes[i].xfer);
+            }
+            st->pos += len;
+            received += len;
+            sfree(vbuf);
+            if (ok && progress && len > 0)
+                progress(progress_ctx, received);
+        }
+    }
+
+    /*
+     * Every stripe but the last must have been filled, or else the
+     * file shrank under us and we've left a hole.
+     */
+    for (int i = 0; ok && !dead && i < n-1; i++) {
+        if (ss->stripes[i].pos != ss->stripes[i].end) {
+            *error = "file changed size during transfer";
+            ok = false;
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        xfer_cleanup(ss->stripes[i].xfer);
+    sftp_select_stream(NULL);
+
+    if (dead) {
+        /*
+         * We couldn't wait for all the outstanding requests, so any
+         * sessions still alive are out of step with us. Give up on
+         * all of them.
+         */
+        if (ok)
+            *error = "connection closed during striped transfer";
+        ok = false;
+        while (ss->nstripes > 0)
+            sftp_stripes_drop(ss, ss->nstripes - 1);
+        ss->unusable = true;
+    } else {
+        sftp_stripes_close_files(ss, n);
+    }
+
+    return ok ? STRIPED_DONE : STRIPED_FAILED;
+}
+
+/*
+ * Verified resume. We ask the server for hashes of the part of the
+ * file that both ends already have, all at once in a few big
+ * requests, and hash our own copy while it works on them.
+ */
+#define CHECK_BLOCKS_PER_REQUEST 64
+
+static bool read_block(RFile *file, unsigned char *buf, int len, int *got)
+{
+    *got = 0;
+    while (*got < len) {
+        int ret = read_from_file(file, buf + *got, len - *got);
+        if (ret < 0)
+            return false;
+        if (ret == 0)
+            break;
+        *got += ret;
+    }
+    return true;
+}
+
+bool sftp_check_blocks(RFile *local, struct fxp_handle *fh, uint64_t length,
+                       uint64_t **runs_out, size_t *nruns_out)
+{
+    size_t nblocks, nreqs, outstanding, nruns, runsize;
+    struct sftp_request **reqs;
+    unsigned char *ourhash, *buf;
+    bool *have_remote, *bad;
+    uint64_t *runs;
+    strbuf *sb;
+    bool ok = true;
+
+    *runs_out = NULL;
+    *nruns_out = 0;
+    if (length == 0)
+        return true;
+    if (!fxp_has_extension("check-file-handle"))
+        return false;
+
+    nblocks = (length + SFTP_CHECK_BLOCK - 1) / SFTP_CHECK_BLOCK;
+    nreqs = (nblocks + CHECK_BLOCKS_PER_REQUEST - 1) /
+        CHECK_BLOCKS_PER_REQUEST;
+
+    reqs = snewn(nreqs, struct sftp_request *);
+    for (size_t i = 0; i < nreqs; i++) {
+        uint64_t start = (uint64_t)i * CHECK_BLOCKS_PER_REQUEST *
+            SFTP_CHECK_BLOCK;
+        uint64_t len = (uint64_t)CHECK_BLOCKS_PER_REQUEST * SFTP_CHECK_BLOCK;
+        if (len > length - start)
+            len = length - start;
+        reqs[i] = fxp_check_file_send(fh, start, len, SFTP_CHECK_BLOCK);
+        sftp_register(reqs[i]);
+    }
+    outstanding = nreqs;
+
+    /*
+     * Hash our own copy while the server does the same.
+     */
+    bad = snewn(nblocks, bool);
+    ourhash = snewn(32 * nblocks, unsigned char);
+    have_remote = snewn(nblocks, bool);
+    memset(have_remote, 0, nblocks * sizeof(bool));
+    buf = snewn(SFTP_CHECK_BLOCK, unsigned char);
+    seek_file((WFile *)local, 0, FROM_START);
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t start = (uint64_t)i * SFTP_CHECK_BLOCK;
+        int want = (length - start < SFTP_CHECK_BLOCK ?
+                    (int)(length - start) : SFTP_CHECK_BLOCK);
+        int got;
+
+        if (!read_block(local, buf, want, &got)) {
+            ok = false;
+            break;
+        }
+        hash_simple(&ssh_sha256, make_ptrlen(buf, got), ourhash + 32 * i);
+        bad[i] = (got < want);
+    }
+    smemclr(buf, SFTP_CHECK_BLOCK);
+    sfree(buf);
+
+    /*
+     * Collect the replies, which may come back in any order, and
+     * compare them with our own hashes as they arrive.
+     */
+    sb = strbuf_new();
+    while (outstanding > 0) {
+        struct sftp_packet *pktin = sftp_recv();
+        struct sftp_request *req;
+        size_t r, first, count;
+        int got;
+
+        if (!pktin) {
+            ok = false;
+            break;
+        }
+        req = sftp_find_request(pktin);
+        for (r = 0; r < nreqs; r++)
+            if (reqs[r] && reqs[r] == req)
+                break;
+        if (r == nreqs) {
+            /* Not one of ours, which leaves us out of step. */
+            if (req)
+                sftp_abandon_request(req);
+            sftp_pkt_free(pktin);
+            ok = false;
+            break;
+        }
+        reqs[r] = NULL;
+        outstanding--;
+
+        strbuf_clear(sb);
+        got = fxp_check_file_recv(pktin, req, sb);
+        if (got < 0) {
+            /* The server didn't manage it after all; stop checking,
+             * but keep listening for the other replies. */
+            ok = false;
+            continue;
+        }
+        first = r * CHECK_BLOCKS_PER_REQUEST;
+        count = nblocks - first;
+        if (count > CHECK_BLOCKS_PER_REQUEST)
+            count = CHECK_BLOCKS_PER_REQUEST;
+        if ((size_t)got < count)
+            count = got;
+        for (size_t i = 0; i < count; i++) {
+            if (!smemeq(ourhash + 32 * (first + i), sb->u + 32 * i, 32))
+                bad[first + i] = true;
+            have_remote[first + i] = true;
+        }
+    }
+    strbuf_free(sb);
+    /* Any requests still outstanding stay in their slots in sftp.c's
+     * request table until sftp_cleanup_request. */
+    sfree(reqs);
+
+    /*
+     * Anything the server gave us no hash for is presumably beyond
+     * the end of its copy, so it needs sending again too. Then merge
+     * the bad blocks into runs, as (start, end) pairs.
+     */
+    runs = NULL;
+    nruns = runsize = 0;
+    for (size_t i = 0; ok && i < nblocks; i++) {
+        if (bad[i] || !have_remote[i]) {
+            uint64_t start = (uint64_t)i * SFTP_CHECK_BLOCK;
+            uint64_t end = start + SFTP_CHECK_BLOCK;
+            if (end > length)
+                end = length;
+            if (nruns > 0 && runs[2*nruns-1] == start) {
+                runs[2*nruns-1] = end;
+            } else {
+                sgrowarray(runs, runsize, 2*nruns+1);
+                runs[2*nruns] = start;
+                runs[2*nruns+1] = end;
+                nruns++;
+            }
+        }
+    }
+
+    sfree(bad);
+    sfree(ourhash);
+    sfree(have_remote);
+
+    if (!ok) {
+        sfree(runs);
+        return false;
+    }
+    *runs_out = runs;
+    *nruns_out = nruns;
+    return true;
+}
+
+/*
+ * Delta uploads. We fetch the block signatures of the existing
+ * remote file, slide a rolling checksum along our own copy looking
+ * for blocks the server already has, and build the new version in a
+ * temporary file next to the old one out of copy-data requests for
+ * those blocks and ordinary writes for everything else. Then the
+ * temporary file is renamed over the original.
+ */
+#define DELTA_MIN_SIZE 65536           /* not worth it for less */
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK 131072
+#define DELTA_SIGS_PER_REQUEST 8192
+#define DELTA_READ_SIZE (1024 * 1024)
+#define DELTA_MAX_OUTSTANDING 64
+
+struct delta_sig {
+    uint32_t weak;
+    unsigned char strong[SFTP_SIG_STRONG_LEN];
+};
+
+typedef struct DeltaState {
+    struct fxp_handle *basis, *out;
+    size_t outstanding;
+    bool failed, dead;
+    const char *error;
+
+    /* A copy we haven't sent yet, in case the next one extends it */
+    uint64_t copysrc, copydst, copylen;
+
+    uint64_t literal;
+} DeltaState;
+
+/* Marks our copy-data requests, to tell them apart from writes. */
+static char delta_copy_marker;
+
+/* An error message we had to format, kept until the next upload. */
+static char *delta_errbuf;
+
+/*
+ * Choose a block size of about the square root of the file size, as
+ * rsync does, so that the signatures and the data resent around each
+ * change grow together.
+ */
+static unsigned delta_block_size(uint64_t size)
+{
+    unsigned b = DELTA_MIN_BLOCK;
+    while (b < DELTA_MAX_BLOCK && (uint64_t)b * b < size)
+        b *= 2;
+    return b;
+}
+
+static void delta_fail(DeltaState *ds, const char *error)
+{
+    if (!ds->failed)
+        ds->error = error;
+    ds->failed = true;
+}
+
+/*
+ * Collect replies until no more than 'limit' requests are
+ * outstanding.
+ */
+static void delta_wait(DeltaState *ds, size_t limit)
+{
+    while (ds->outstanding > limit && !ds->dead) {
+        struct sftp_packet *pktin = sftp_recv();
+        struct sftp_request *req;
+        bool ok;
+
+        if (!pktin) {
+            delta_fail(ds, "connection lost during delta transfer");
+            ds->dead = true;
+            return;
+        }
+        req = sftp_find_request(pktin);
+        if (!req) {
+            sftp_pkt_free(pktin);
+            delta_fail(ds, fxp_error());
+            ds->dead = true;
+            return;
+        }
+        ds->outstanding--;
+        if (fxp_get_userdata(req) == &delta_copy_marker)
+            ok = fxp_copy_data_recv(pktin, req);
+        else
+            ok = fxp_write_recv(pktin, req);
+        if (!ok)
+            delta_fail(ds, fxp_error());
+    }
+}
+
+static void delta_send(DeltaState *ds, struct sftp_request *req, bool copy)
+{
+    sftp_register(req);
+    if (copy)
+        fxp_set_userdata(req, &delta_copy_marker);
+    ds->outstanding++;
+    delta_wait(ds, DELTA_MAX_OUTSTANDING);
+}
+
+static void delta_flush_copy(DeltaState *ds)
+{
+    if (ds->copylen && !ds->failed)
+        delta_send(ds, fxp_copy_data_send(ds->basis, ds->copysrc, ds->copylen,
+                                          ds->out, ds->copydst), true);
+    ds->copylen = 0;
+}
+
+static void delta_copy(DeltaState *ds, uint64_t src, uint64_t dst,
+                       uint64_t len)
+{
+    if (ds->copylen && ds->copysrc + ds->copylen == src &&
+        ds->copydst + ds->copylen == dst) {
+        ds->copylen += len;
+        return;
+    }
+    delta_flush_copy(ds);
+    ds->copysrc = src;
+    ds->copydst = dst;
+    ds->copylen = len;
+}
+
+static void delta_write(DeltaState *ds, const unsigned char *data,
+                        uint64_t dst, size_t len)
+{
+    size_t writelen = fxp_max_write_len();
+
+    while (len > 0 && !ds->failed) {
+        size_t thislen = (len < writelen ? len : writelen);
+        delta_send(ds, fxp_write_send(ds->out, (void *)data, dst, thislen),
+                   false);
+        ds->literal += thislen;
+        data += thislen;
+        dst += thislen;
+        len -= thislen;
+    }
+}
+
+/*
+ * Fetch the signatures of the whole basis file. Returns the number
+ * we got, which may be fewer than asked for if the file has shrunk,
+ * or -1 if the server wouldn't give them to us.
+ */
+static ptrdiff_t delta_get_sigs(DeltaState *ds, uint64_t size,
+                                unsigned blocksize, struct delta_sig *sigs)
+{
+    size_t nblocks = (size + blocksize - 1) / blocksize;
+    size_t nreqs = (nblocks + DELTA_SIGS_PER_REQUEST - 1) /
+        DELTA_SIGS_PER_REQUEST;
+    struct sftp_request **reqs = snewn(nreqs, struct sftp_request *);
+    size_t *got = snewn(nreqs, size_t);
+    size_t outstanding = nreqs, total;
+    strbuf *sb = strbuf_new();
+    bool ok = true;
+
+    for (size_t i = 0; i < nreqs; i++) {
+        uint64_t start = (uint64_t)i * DELTA_SIGS_PER_REQUEST * blocksize;
+        reqs[i] = fxp_block_sigs_send(
+            ds->basis, start, (uint64_t)DELTA_SIGS_PER_REQUEST * blocksize,
+            blocksize);
+        sftp_register(reqs[i]);
+        got[i] = 0;
+    }
+
+    while (outstanding > 0) {
+        struct sftp_packet *pktin = sftp_recv();
+        struct sftp_request *req;
+        BinarySource src[1];
+        size_t r;
+        int n;
+
+        if (!pktin) {
+            ds->dead = true;
+            ok = false;
+            break;
+        }
+        req = sftp_find_request(pktin);
+        for (r = 0; r < nreqs; r++)
+            if (reqs[r] && reqs[r] == req)
+                break;
+        if (r == nreqs) {
+            if (req)
+                sftp_abandon_request(req);
+            sftp_pkt_free(pktin);
+            ds->dead = true;
+            ok = false;
+            break;
+        }
+        reqs[r] = NULL;
+        outstanding--;
+
+        strbuf_clear(sb);
+        n = fxp_block_sigs_recv(pktin, req, sb);
+        if (n < 0) {
+            ok = false;
+            continue;
+        }
+        /* Ignore any beyond the size we were expecting. */
+        if (n > DELTA_SIGS_PER_REQUEST)
+            n = DELTA_SIGS_PER_REQUEST;
+        if (n > nblocks - r * DELTA_SIGS_PER_REQUEST)
+            n = nblocks - r * DELTA_SIGS_PER_REQUEST;
+        got[r] = n;
+
+        BinarySource_BARE_INIT_PL(src, ptrlen_from_strbuf(sb));
+        for (int i = 0; i < n; i++) {
+            struct delta_sig *sig = &sigs[r * DELTA_SIGS_PER_REQUEST + i];
+            sig->weak = get_uint32(src);
+            memcpy(sig->strong, get_data(src, SFTP_SIG_STRONG_LEN).ptr,
+                   SFTP_SIG_STRONG_LEN);
+        }
+    }
+    strbuf_free(sb);
+    /* Any requests still outstanding stay in their slots in sftp.c's
+     * request table until sftp_cleanup_request. */
+    sfree(reqs);
+
+    /*
+     * We can only use the signatures up to the first gap, since
+     * after that we don't know where in the file they belong.
+     */
+    total = 0;
+    for (size_t i = 0; ok && i < nreqs; i++) {
+        total += got[i];
+        if (got[i] < DELTA_SIGS_PER_REQUEST)
+            break;
+    }
+    sfree(got);
+    return ok ? (ptrdiff_t)total : -1;
+}
+
+/*
+ * Slide along the local file, sending copies and literal data as we
+ * go. 'tail', if not NULL, is the signature of a short final block of
+ * length 'taillen' following the nsigs full-sized ones. On return,
+ * 'h' has had the whole file fed to it.
+ */
+static void delta_scan(DeltaState *ds, RFile *file, unsigned blocksize,
+                       const struct delta_sig *sigs, size_t nsigs,
+                       const struct delta_sig *tail, size_t taillen,
+                       ssh_hash *h)
+{
+    size_t tablesize, mask, litmax = 4 * fxp_max_write_len();
+    int *head, *next;
+    unsigned char *buf;
+    size_t bufsize, buflen = 0, w = 0, lit = 0;
+    uint64_t bufpos = 0;               /* file offset of buf[0] */
+    uint32_t sum = 0;
+    bool have_sum = false, eof = false;
+    size_t expect = nsigs;             /* block after the last match */
+
+    /*
+     * Hash table from weak checksum to the blocks that have it.
+     */
+    tablesize = 16;
+    while (tablesize < 2 * nsigs)
+        tablesize *= 2;
+    mask = tablesize - 1;
+    head = snewn(tablesize, int);
+    next = snewn(nsigs ? nsigs : 1, int);
+    for (size_t i = 0; i < tablesize; i++)
+        head[i] = -1;
+    for (size_t i = nsigs; i-- > 0 ;) {
+        size_t b = (sigs[i].weak ^ (sigs[i].weak >> 15)) & mask;
+        next[i] = head[b];
+        head[b] = i;
+    }
+
+    bufsize = litmax + blocksize + DELTA_READ_SIZE;
+    buf = snewn(bufsize, unsigned char);
+
+    while (!ds->failed) {
+        unsigned char strong[SFTP_SIG_STRONG_LEN];
+        bool have_strong = false;
+        int match = -1;
+
+        /*
+         * Make sure we have at least one byte beyond the current
+         * window, so that we can roll it along, unless the file ends
+         * first.
+         */
+        if (buflen - w <= blocksize && !eof) {
+            memmove(buf, buf + lit, buflen - lit);
+            bufpos += lit;
+            buflen -= lit;
+            w -= lit;
+            lit = 0;
+            while (buflen < bufsize && !eof) {
+                int ret = read_from_file(file, buf + buflen,
+                                         bufsize - buflen);
+                if (ret < 0) {
+                    delta_fail(ds, "error while reading local file");
+                    break;
+                }
+                if (ret == 0)
+                    eof = true;
+                put_data(h, buf + buflen, ret);
+                buflen += ret;
+            }
+            if (ds->failed)
+                break;
+        }
+
+        if (buflen - w < blocksize)
+            break;
+
+        if (!have_sum) {
+            sum = sftp_rolling_checksum(make_ptrlen(buf + w, blocksize));
+            have_sum = true;
+        }
+
+        /*
+         * Look for a block with this checksum, trying the one after
+         * our last match first, since runs of unchanged blocks are
+         * the common case.
+         */
+        if (expect < nsigs && sigs[expect].weak == sum) {
+            sftp_strong_checksum(make_ptrlen(buf + w, blocksize), strong);
+            have_strong = true;
+            if (!memcmp(strong, sigs[expect].strong, SFTP_SIG_STRONG_LEN))
+                match = expect;
+        }
+        for (int i = head[(sum ^ (sum >> 15)) & mask];
+             match < 0 && i >= 0; i = next[i]) {
+            if (sigs[i].weak != sum)
+                continue;
+            if (!have_strong) {
+                sftp_strong_checksum(make_ptrlen(buf + w, blocksize),
+                                     strong);
+                have_strong = true;
+            }
+            if (!memcmp(strong, sigs[i].strong, SFTP_SIG_STRONG_LEN))
+                match = i;
+        }
+
+        if (match >= 0) {
+            delta_write(ds, buf + lit, bufpos + lit, w - lit);
+            delta_copy(ds, (uint64_t)match * blocksize, bufpos + w,
+                       blocksize);
+            w += blocksize;
+            lit = w;
+            have_sum = false;
+            expect = match + 1;
+            continue;
+        }
+
+        if (w - lit >= litmax) {
+            delta_write(ds, buf + lit, bufpos + lit, w - lit);
+            lit = w;
+        }
+        if (buflen - w > blocksize)
+            sum = sftp_rolling_checksum_roll(sum, blocksize, buf[w],
+                                             buf[w + blocksize]);
+        else
+            have_sum = false;
+        w++;
+    }
+
+    /*
+     * If we've just matched our way up to the last few bytes, see if
+     * they're the same as the end of the remote file too.
+     */
+    if (!ds->failed && tail && lit == w && buflen - w == taillen) {
+        unsigned char strong[SFTP_SIG_STRONG_LEN];
+        ptrlen data = make_ptrlen(buf + w, taillen);
+        sftp_strong_checksum(data, strong);
+        if (sftp_rolling_checksum(data) == tail->weak &&
+            !memcmp(strong, tail->strong, SFTP_SIG_STRONG_LEN)) {
+            delta_copy(ds, (uint64_t)nsigs * blocksize, bufpos + w,
+                       taillen);
+            lit = w = buflen;
+        }
+    }
+
+    /* Whatever is left over at the end goes as literal data. */
+    if (!ds->failed)
+        delta_write(ds, buf + lit, bufpos + lit, buflen - lit);
+    delta_flush_copy(ds);
+
+    sfree(buf);
+    sfree(head);
+    sfree(next);
+}
+
+/*
+ * Send a request and wait for its reply, for the housekeeping steps
+ * of a delta upload.
+ */
+static struct sftp_packet *delta_request(DeltaState *ds,
+                                         struct sftp_request *req)
+{
+    struct sftp_packet *pktin = wait_for_reply_nonfatal(req);
+    if (!pktin) {
+        delta_fail(ds, "connection lost during delta transfer");
+        ds->dead = true;
+    }
+    return pktin;
+}
+
+DeltaResult sftp_delta_upload(RFile *file, const char *outfname,
+                              const struct fxp_attrs *attrs,
+                              uint64_t *literal, const char **error)
+{
+    DeltaState ds[1];
+    struct sftp_request *req;
+    struct sftp_packet *pktin;
+    struct fxp_attrs rattrs;
+    struct delta_sig *sigs, *tail;
+    ptrdiff_t nsigs;
+    size_t taillen;
+    unsigned blocksize;
+    char *tmpname;
+    unsigned char ourhash[32];
+    ssh_hash *h;
+    strbuf *theirhash;
+    DeltaResult result;
+
+    if (!fxp_has_extension("block-signatures@putty.projects.tartarus.org") ||
+        !fxp_has_extension("copy-data"))
+        return DELTA_UNAVAILABLE;
+
+    memset(ds, 0, sizeof(ds));
+
+    /*
+     * Open the existing remote file and find out its size. If it's
+     * not there, there's nothing to save.
+     */
+    req = fxp_open_send(outfname, SSH_FXF_READ, NULL);
+    if (!(pktin = delta_request(ds, req)))
+        goto dead;
+    ds->basis = fxp_open_recv(pktin, req);
+    if (!ds->basis)
+        return DELTA_UNAVAILABLE;
+
+    req = fxp_fstat_send(ds->basis);
+    if (!(pktin = delta_request(ds, req)))
+        goto dead;
+    if (!fxp_fstat_recv(pktin, req, &rattrs) ||
+        !(rattrs.flags & SSH_FILEXFER_ATTR_SIZE) ||
+        rattrs.size < DELTA_MIN_SIZE) {
+        result = DELTA_UNAVAILABLE;
+        goto close_basis;
+    }
+
+    blocksize = delta_block_size(rattrs.size);
+    sigs = snewn((rattrs.size + blocksize - 1) / blocksize, struct delta_sig);
+    nsigs = delta_get_sigs(ds, rattrs.size, blocksize, sigs);
+    if (ds->dead) {
+        sfree(sigs);
+        goto dead;
+    }
+    if (nsigs < 0) {
+        sfree(sigs);
+        result = DELTA_UNAVAILABLE;
+        goto close_basis;
+    }
+    /* A short final block can't match a full-sized window, so it's
+     * dealt with separately. */
+    tail = NULL;
+    taillen = 0;
+    if (nsigs > 0 && (uint64_t)nsigs * blocksize > rattrs.size) {
+        nsigs--;
+        tail = &sigs[nsigs];
+        taillen = rattrs.size - (uint64_t)nsigs * blocksize;
+    }
+
+    /*
+     * Build the new file.
+     */
+    tmpname = dupcat(outfname, ".psftp-delta");
+    /* (Read access is so that we can check the result.) */
+    req = fxp_open_send(tmpname, SSH_FXF_READ | SSH_FXF_WRITE |
+                        SSH_FXF_CREAT | SSH_FXF_TRUNC, attrs);
+    if (!(pktin = delta_request(ds, req))) {
+        sfree(sigs);
+        sfree(tmpname);
+        goto dead;
+    }
+    ds->out = fxp_open_recv(pktin, req);
+    if (!ds->out) {
+        sfree(sigs);
+        sfree(tmpname);
+        result = DELTA_UNAVAILABLE;
+        goto close_basis;
+    }
+
+    h = ssh_hash_new(&ssh_sha256);
+    seek_file((WFile *)file, 0, FROM_START);
+    delta_scan(ds, file, blocksize, sigs, nsigs, tail, taillen, h);
+    ssh_hash_final(h, ourhash);
+    sfree(sigs);
+    delta_wait(ds, 0);
+    if (ds->dead) {
+        sfree(tmpname);
+        goto dead;
+    }
+
+    /*
+     * If the server can tell us the hash of what it's ended up
+     * with, check it, in case two different blocks had the same
+     * signature.
+     */
+    theirhash = strbuf_new();
+    if (!ds->failed && fxp_has_extension("check-file-handle")) {
+        req = fxp_check_file_send(ds->out, 0, 0, 0);
+        if ((pktin = delta_request(ds, req)) != NULL &&
+            fxp_check_file_recv(pktin, req, theirhash) == 1 &&
+            !smemeq(theirhash->u, ourhash, 32))
+            delta_fail(ds, NULL);      /* DELTA_MISMATCH, below */
+    }
+    strbuf_free(theirhash);
+    if (ds->dead) {
+        sfree(tmpname);
+        goto dead;
+    }
+
+    req = fxp_close_send(ds->out);
+    if (!(pktin = delta_request(ds, req))) {
+        sfree(tmpname);
+        goto dead;
+    }
+    if (!fxp_close_recv(pktin, req))
+        delta_fail(ds, fxp_error());
+    req = fxp_close_send(ds->basis);
+    if (!(pktin = delta_request(ds, req))) {
+        sfree(tmpname);
+        goto dead;
+    }
+    fxp_close_recv(pktin, req);
+
+    if (ds->failed) {
+        req = fxp_remove_send(tmpname);
+        if ((pktin = delta_request(ds, req)) != NULL)
+            fxp_remove_recv(pktin, req);
+        sfree(tmpname);
+        if (!ds->error)
+            return DELTA_MISMATCH;
+        *error = ds->error;
+        return DELTA_FAILED;
+    }
+
+    /*
+     * Put the new file in place of the old. Without the OpenSSH
+     * extension, a plain rename may refuse to replace the target.
+     */
+    if (fxp_has_extension("posix-rename@openssh.com"))
+        req = fxp_posix_rename_send(tmpname, outfname);
+    else
+        req = fxp_rename_send(tmpname, outfname);
+    if ((pktin = delta_request(ds, req)) != NULL &&
+        !fxp_rename_recv(pktin, req)) {
+        req = fxp_remove_send(outfname);
+        if ((pktin = delta_request(ds, req)) != NULL)
+            fxp_remove_recv(pktin, req);
+        req = fxp_rename_send(tmpname, outfname);
+        if ((pktin = delta_request(ds, req)) != NULL &&
+            !fxp_rename_recv(pktin, req)) {
+            /* The original is gone by now, so say where the new
+             * version is. */
+            sfree(delta_errbuf);
+            delta_errbuf = dupprintf("%s; new file left in %s",
+                                     fxp_error(), tmpname);
+            delta_fail(ds, delta_errbuf);
+        }
+    }
+    sfree(tmpname);
+    if (ds->failed) {
+        *error = ds->error;
+        return DELTA_FAILED;
+    }
+
+    *literal = ds->literal;
+    return DELTA_DONE;
+
+  close_basis:
+    req = fxp_close_send(ds->basis);
+    if ((pktin = delta_request(ds, req)) != NULL)
+        fxp_close_recv(pktin, req);
+    if (!ds->dead)
+        return result;
+
+  dead:
+    *error = "connection lost during delta transfer";
+    return DELTA_FAILED;
+}
+
+/*
+ * Compressed uploads: compress each FXP_WRITE's worth of data in a
+ * background worker, so that the compressor and the network can
+ * both be kept busy.
+ */
+#define ZQ_MAX_JOBS 8
+
+struct zq_job {
+    strbuf *data;        /* the raw data going in, the payload coming out */
+    unsigned method;
+    int rawlen;
+};
+
+struct SftpCompressQueue {
+    BgWorker *worker;
+    size_t njobs;
+};
+
+static void zq_compress(void *vjob)
+{
+    struct zq_job *job = (struct zq_job *)vjob;
+    strbuf *out = strbuf_new();
+
+    job->method = sftp_compress_block(ptrlen_from_strbuf(job->data), out);
+    strbuf_free(job->data);
+    job->data = out;
+}
+
+SftpCompressQueue *sftp_zq_new(void)
+{
+    SftpCompressQueue *zq = snew(SftpCompressQueue);
+    zq->worker = bgworker_new(zq_compress);
+    zq->njobs = 0;
+    return zq;
+}
+
+bool sftp_zq_full(SftpCompressQueue *zq)
+{
+    return zq->njobs >= ZQ_MAX_JOBS;
+}
+
+bool sftp_zq_empty(SftpCompressQueue *zq)
+{
+    return zq->njobs == 0;
+}
+
+void sftp_zq_submit(SftpCompressQueue *zq, const void *data, int len)
+{
+    struct zq_job *job = snew(struct zq_job);
+    job->data = strbuf_new();
+    put_data(job->data, data, len);
+    job->rawlen = len;
+    bgworker_submit(zq->worker, job);
+    zq->njobs++;
+}
+
+bool sftp_zq_send(SftpCompressQueue *zq, struct fxp_xfer *xfer, bool wait)
+{
+    struct zq_job *job = (struct zq_job *)bgworker_collect(zq->worker, wait);
+
+    if (!job)
+        return false;
+    zq->njobs--;
+    xfer_upload_compressed(xfer, job->method, ptrlen_from_strbuf(job->data),
+                           job->rawlen);
+    strbuf_free(job->data);
+    sfree(job);
+    return true;
+}
+
+void sftp_zq_free(SftpCompressQueue *zq)
+{
+    struct zq_job *job;
+
+    while ((job = (struct zq_job *)bgworker_collect(zq->worker, true)) != NULL) {
+        strbuf_free(job->data);
+        sfree(job);
+    }
+    bgworker_free(zq->worker);
+    sfree(zq);
+}
+
+/*
+ * Background writing of downloaded data. The worker thread is the
+ * only thing that touches the file, the hash and 'wfailed' while the
+ * queue is in use; the main thread only counts what's in flight.
+ */
+#define WQ_MAX_BYTES ((size_t)8 << 20)
+
+struct wq_job {
+    SftpWriteQueue *wq;
+    void *data;
+    int len;
+    bool failed;
+};
+
+struct SftpWriteQueue {
+    BgWorker *worker;
+    WFile *file;
+    ssh_hash *hash;
+    bool wfailed;                      /* seen by the worker */
+    bool failed;                       /* seen by the main thread */
+    size_t inflight;
+};
+
+static void wq_write(void *vjob)
+{
+    struct wq_job *job = (struct wq_job *)vjob;
+    SftpWriteQueue *wq = job->wq;
+
+    if (!wq->wfailed) {
+        if (write_to_file(wq->file, job->data, job->len) != job->len)
+            wq->wfailed = true;
+        else if (wq->hash)
+            put_data(wq->hash, job->data, job->len);
+    }
+    job->failed = wq->wfailed;
+}
+
+SftpWriteQueue *sftp_wq_new(WFile *file, bool hash)
+{
+    SftpWriteQueue *wq = snew(SftpWriteQueue);
+    wq->worker = bgworker_new(wq_write);
+    wq->file = file;
+    wq->hash = hash ? ssh_hash_new(&ssh_sha256) : NULL;
+    wq->wfailed = wq->failed = false;
+    wq->inflight = 0;
+    return wq;
+}
+
+void sftp_wq_hash_existing(SftpWriteQueue *wq, const char *fname,
+                           uint64_t len)
+{
+    RFile *file;
+    char buf[32768];
+
+    if (!wq->hash)
+        return;
+    assert(wq->inflight == 0);
+
+    file = open_existing_file(fname, NULL, NULL, NULL, NULL);
+    while (file && len > 0) {
+        int got = read_from_file(
+            file, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (got <= 0)
+            break;
+        put_data(wq->hash, buf, got);
+        len -= got;
+    }
+    if (file)
+        close_rfile(file);
+
+    if (len > 0) {
+        /* We couldn't see all of the existing data, so give up on
+         * hashing this file rather than report a wrong answer. */
+        ssh_hash_free(wq->hash);
+        wq->hash = NULL;
+    }
+}
+
+static bool wq_collect(SftpWriteQueue *wq, bool wait)
+{
+    struct wq_job *job = (struct wq_job *)bgworker_collect(wq->worker, wait);
+
+    if (!job)
+        return false;
+    wq->inflight -= job->len;
+    if (job->failed)
+        wq->failed = true;
+    sfree(job->data);
+    sfree(job);
+    return true;
+}
+
+void sftp_wq_write(SftpWriteQueue *wq, void *data, int len)
+{
+    struct wq_job *job = snew(struct wq_job);
+    job->wq = wq;
+    job->data = data;
+    job->len = len;
+    job->failed = false;
+    wq->inflight += len;
+    bgworker_submit(wq->worker, job);
+
+    while (wq_collect(wq, wq->inflight > WQ_MAX_BYTES));
+}
+
+bool sftp_wq_failed(SftpWriteQueue *wq)
+{
+    return wq->failed;
+}
+
+bool sftp_wq_finish(SftpWriteQueue *wq, char **hexhash)
+{
+    bool ok;
+
+    while (wq_collect(wq, true));
+    bgworker_free(wq->worker);
+    ok = !wq->failed;
+
+    if (hexhash)
+        *hexhash = NULL;
+    if (wq->hash) {
+        unsigned char digest[32];
+        ssh_hash_final(wq->hash, digest);
+        if (ok && hexhash) {
+            strbuf *sb = strbuf_new();
+            for (size_t i = 0; i < sizeof(digest); i++)
+                strbuf_catf(sb, "%02x", digest[i]);
+            *hexhash = strbuf_to_str(sb);
+        }
+    }
+
+    sfree(wq);
+    return ok;
+}
+
+struct fxp_walk *sftp_walk_tree(const char *root,
+                                const struct fxp_attrs *attrs)
+{
+    struct fxp_walk *walk = fxp_walk_init(root, attrs, vet_filename);
+
+    while (!fxp_walk_done(walk)) {
+        struct sftp_packet *pktin;
+
+        fxp_walk_queue(walk);
+        if (fxp_walk_done(walk))
+            break;
+
+        pktin = sftp_recv();
+        if (!pktin || fxp_walk_gotpkt(walk, pktin) == INT_MIN) {
+            if (pktin)
+                sftp_pkt_free(pktin);
+            fxp_walk_cleanup(walk);
+            return NULL;
+        }
+    }
+    return walk;
+}
@@ -16,12 +16,16 @@
  *
  *  - verbosity setting for log messages
  *
- *  - could import proxy.c and use name_lookup rather than
- *    sk_namelookup, to allow forwarding via some other proxy type
+ *  - could import proxy.c and use name_lookup_async rather than
+ *    sk_namelookup_async, to allow forwarding via some other proxy
+ *    type
  */
 
 #define BUFLIMIT 16384
 
+/* How long to remember the answer to a DNS lookup, in seconds */
+#define NAME_CACHE_TIME 60
+
 #define LOGBITS(X)                              \
     X(CONNSTATUS)                               \
     X(DIALOGUE)                                 \
@@ -59,6 +63,7 @@ struct psocks_connection {
     char *host, *realhost;
     int port;
     SockAddr *addr;
+    NameLookup *lookup;
     Socket *socket;
     bool connecting, eof_pfmgr_to_socket, eof_socket_to_pfmgr;
     uint64_t index;
@@ -127,6 +132,7 @@ static const struct SshChannelVtable psocks_scvt = {
     NULL /* send_signal */,
     NULL /* send_terminal_size_change */,
     NULL /* hint_channel_is_simple */,
+    NULL /* backlog */,
 };
 
 static void psocks_plug_log(Plug *p, PlugLogType type, SockAddr *addr,
@@ -298,6 +304,8 @@ static void psocks_conn_free(psocks_connection *conn)
 
     sfree(conn->host);
     sfree(conn->realhost);
+    if (conn->lookup)
+        sk_namelookup_cancel(conn->lookup);
     if (conn->socket)
         sk_close(conn->socket);
     if (conn->chan)
@@ -308,20 +316,38 @@ static void psocks_conn_free(psocks_connection *conn)
     sfree(conn);
 }
 
+static void psocks_connection_resolved(void *vctx, SockAddr *addr,
+                                       char *realhost);
+
 static void psocks_connection_establish(void *vctx)
 {
     psocks_connection *conn = (psocks_connection *)vctx;
 
     /*
-     * Look up destination host name.
+     * Look up destination host name, without holding up all the
+     * other connections while we wait for the answer.
      */
-    conn->addr = sk_namelookup(conn->host, &conn->realhost, ADDRTYPE_UNSPEC);
+    conn->lookup = sk_namelookup_async(conn->host, ADDRTYPE_UNSPEC,
+                                       NAME_CACHE_TIME,
+                                       psocks_connection_resolved, conn);
+}
+
+static void psocks_connection_resolved(void *vctx, SockAddr *addr,
+                                       char *realhost)
+{
+    psocks_connection *conn = (psocks_connection *)vctx;
+
+    conn->lookup = NULL;
+    conn->addr = addr;
+    conn->realhost = realhost;
 
     const char *err = sk_addr_error(conn->addr);
     if (err) {
         char *msg = dupprintf("name lookup failed: %s", err);
         chan_open_failed(conn->chan, msg);
         sfree(msg);
+        sk_addr_free(conn->addr);
+        conn->addr = NULL;
 
         psocks_conn_free(conn);
         return;
@@ -332,7 +358,7 @@ static void psocks_connection_establish(void *vctx)
      */
     conn->connecting = true;
     conn->socket = sk_new(conn->addr, conn->port, false, false, false, false,
-                          &conn->plug);
+                          0, &conn->plug);
 }
 
 static size_t psocks_sc_write(SshChannel *sc, bool is_stderr,
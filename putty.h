@@ -195,6 +195,7 @@ typedef enum {
      */
     SS_REKEY,  /* trigger an immediate repeat key exchange */
     SS_XCERT,  /* cross-certify another host key ('arg' indicates which) */
+    SS_STATS,  /* write connection statistics to the Event Log */
 
     /*
      * Send a POSIX-style signal. (Useful in SSH and also pterm.)
@@ -296,6 +297,8 @@ enum {
     KEX_WARN,
     KEX_DHGROUP1,
     KEX_DHGROUP14,
+    KEX_DHGROUP16,
+    KEX_DHGROUP18,
     KEX_DHGEX,
     KEX_RSA,
     KEX_ECDH,
@@ -917,6 +920,13 @@ struct SeatVtable {
      * Ask the seat whether it's an interactive program.
      */
     bool (*interactive)(Seat *seat);
+
+    /*
+     * Notify the seat that an SSH key exchange (the initial one or a
+     * rekey) has just completed and the new keys are in use. Seats
+     * that don't care about this can use nullseat_kex_finished.
+     */
+    void (*kex_finished)(Seat *seat);
 };
 
 static inline size_t seat_output(
@@ -966,6 +976,8 @@ static inline bool seat_verbose(Seat *seat)
 { return seat->vt->verbose(seat); }
 static inline bool seat_interactive(Seat *seat)
 { return seat->vt->interactive(seat); }
+static inline void seat_kex_finished(Seat *seat)
+{ seat->vt->kex_finished(seat); }
 
 /* Unlike the seat's actual method, the public entry point
  * seat_connection_fatal is a wrapper function with a printf-like API,
@@ -1022,6 +1034,7 @@ bool nullseat_verbose_no(Seat *seat);
 bool nullseat_verbose_yes(Seat *seat);
 bool nullseat_interactive_no(Seat *seat);
 bool nullseat_interactive_yes(Seat *seat);
+void nullseat_kex_finished(Seat *seat);
 
 /*
  * Seat functions provided by the platform's console-application
@@ -1209,6 +1222,8 @@ NORETURN void cleanup_exit(int);
     X(INT, NONE, ping_interval) /* in seconds */ \
     X(BOOL, NONE, tcp_nodelay) \
     X(BOOL, NONE, tcp_keepalives) \
+    X(INT, NONE, connect_delay) /* ms before racing the next address */ \
+    X(INT, NONE, name_cache_time) /* seconds to remember name lookups */ \
     X(STR, NONE, loghost) /* logical host being contacted, for host key check */ \
     /* Proxy options */ \
     X(STR, NONE, proxy_exclude_list) \
@@ -1226,7 +1241,9 @@ NORETURN void cleanup_exit(int);
     X(STR, NONE, remote_cmd2) /* fallback if remote_cmd fails; never loaded or saved */ \
     X(BOOL, NONE, nopty) \
     X(BOOL, NONE, compression) \
+    X(INT, NONE, ssh_stats_interval) /* in seconds; 0 = off */ \
     X(INT, INT, ssh_kexlist) \
+    X(BOOL, NONE, ssh_kex_guess) /* send a guessed kex packet after KEXINIT */ \
     X(INT, INT, ssh_hklist) \
     X(INT, NONE, ssh_rekey_time) /* in minutes */ \
     X(STR, NONE, ssh_rekey_data) /* string encoding e.g. "100K", "2M", "1G" */ \
@@ -2181,10 +2198,25 @@ unsigned long timing_last_clock(void);
  * This can be used as a means of speculatively terminating a poll
  * loop, as in PSFTP, for example - if a callback has run then perhaps
  * it might have done whatever the loop's caller was waiting for.
+ *
+ * run_toplevel_callbacks() runs just one callback. A front end whose
+ * event loop has to check every fd between calls to it can instead
+ * call run_toplevel_callbacks_batch(), which goes on running them
+ * until the queue is empty, or it has run CALLBACK_BATCH_MAX, or
+ * CALLBACK_BATCH_TICKS have elapsed. That way a burst of callbacks
+ * costs a few polls rather than one each, but a callback that keeps
+ * re-queueing itself still can't lock out network events.
+ *
+ * delete_callbacks_for_context(ctx) removes any queued callback
+ * whose context is ctx, or, for an idempotent callback, whose
+ * IdempotentCallback's context was ctx at the time it was queued.
  */
 typedef void (*toplevel_callback_fn_t)(void *ctx);
 void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx);
 bool run_toplevel_callbacks(void);
+#define CALLBACK_BATCH_MAX 256
+#define CALLBACK_BATCH_TICKS (TICKSPERSEC / 100)
+bool run_toplevel_callbacks_batch(void);
 bool toplevel_callback_pending(void);
 void delete_callbacks_for_context(void *ctx);
 
@@ -105,6 +105,86 @@ void *safegrowarray(void *array, size_t *size, size_t eltsize,
 #define sgrowarrayn_nm(a, s, n, m) sgrowarray_general(a, s, n, m, true )
 #define sgrowarray_nm( a, s, n   ) sgrowarray_general(a, s, n, 1, true )
 
+/*
+ * Slab allocation, for blocks that are allocated and freed at a high
+ * rate, such as SSH packets.
+ *
+ * slab_alloc rounds the size up to one of a set of size classes, and
+ * slab_free keeps a limited number of freed blocks of each class on a
+ * free list to satisfy the next slab_alloc of that class, so that a
+ * steady stream of packets doesn't go back to the system allocator
+ * every time. Blocks larger than the biggest class are passed
+ * straight through to safemalloc.
+ *
+ * slab_free always wipes the block (up to the size originally asked
+ * for) before doing anything else with it, so memory sitting on a
+ * free list never contains anything that was put in it, secret or
+ * otherwise. There's no need to smemclr a slab block before freeing
+ * it.
+ *
+ * A block from slab_alloc must be freed with slab_free, and vice
+ * versa. None of this is thread-safe: use it from the main thread
+ * only.
+ */
+void *slab_alloc(size_t size);
+void slab_free(void *ptr);
+
+/*
+ * slab_good_size returns the largest size that slab_alloc would put
+ * in the same size class as 'size', so that a caller with some
+ * flexibility about how much it allocates can use all of a block
+ * rather than leaving the end of it idle.
+ */
+size_t slab_good_size(size_t size);
+
+#define slab_new(type) ((type *)slab_alloc(sizeof(type)))
+#define slab_new_plus(type, extra) ((type *)slab_alloc(sizeof(type) + (extra)))
+
+/*
+ * Arenas, for groups of allocations that all become garbage at the
+ * same time, e.g. everything belonging to one key exchange or one
+ * SFTP request. arena_alloc (which takes its size as a product of two
+ * factors, like safemalloc) hands out space from large chunks, which
+ * themselves come from slab_alloc. There's no way to free an
+ * individual allocation: instead, arena_clear frees everything
+ * allocated from the arena so far (wiping it, by the slab_free rule),
+ * and arena_free does that and disposes of the arena itself.
+ *
+ * The name given to arena_new is used in the allocation statistics,
+ * and is not copied, so it should be a string literal.
+ */
+typedef struct MemArena MemArena;
+MemArena *arena_new(const char *name);
+void *arena_alloc(MemArena *arena, size_t factor1, size_t factor2);
+void arena_clear(MemArena *arena);
+void arena_free(MemArena *arena);
+
+#define arena_snew(arena, type) \
+    ((type *)arena_alloc(arena, 1, sizeof(type)))
+#define arena_snewn(arena, n, type) \
+    ((type *)arena_alloc(arena, (n), sizeof(type)))
+
+/*
+ * Allocation statistics. The counters in mem_stats are cumulative
+ * since the program started, so to measure something, take a copy
+ * with memstats_get before and subtract it from the values
+ * afterwards. (Read them that way rather than directly, since other
+ * threads may be updating the malloc counts.) memstats_dump
+ * writes a more detailed human-readable summary, including the state
+ * of every slab size class and every live arena, to a strbuf.
+ */
+typedef struct MemStats {
+    uint64_t mallocs;           /* blocks obtained from the system */
+    uint64_t reallocs;
+    uint64_t frees;             /* blocks returned to the system */
+    uint64_t slab_allocs;       /* calls to slab_alloc ... */
+    uint64_t slab_reuses;       /* ... satisfied from a free list */
+    uint64_t arena_allocs;
+} MemStats;
+extern MemStats mem_stats;
+void memstats_get(MemStats *out);
+void memstats_dump(strbuf *out);
+
 /*
  * This function is called by the innermost safemalloc/saferealloc
  * functions when allocation fails. Usually it's provided by misc.c
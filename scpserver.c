@@ -262,6 +262,15 @@ struct ScpReplyReceiver {
     struct fxp_attrs attrs;
     ptrlen name, handle, data;
 
+    /*
+     * If data_sc is set, file data returned from a read is written
+     * straight to that channel instead of being copied into 'data'
+     * (whose length is still filled in), and the channel's resulting
+     * backlog is stored in data_backlog.
+     */
+    SshChannel *data_sc;
+    size_t data_backlog;
+
     SftpReplyBuilder srb;
 };
 
@@ -322,7 +331,12 @@ static void scp_reply_data(SftpReplyBuilder *srb, ptrlen data)
     char *p;
     reply->err = false;
     sfree((void *)reply->data.ptr);
-    reply->data.ptr = p = mkstr(data);
+    if (reply->data_sc) {
+        reply->data_backlog = sshfwd_write(reply->data_sc, data.ptr, data.len);
+        reply->data.ptr = NULL;
+    } else {
+        reply->data.ptr = p = mkstr(data);
+    }
     reply->data.len = data.len;
 }
 
@@ -365,6 +379,12 @@ static void scp_reply_cleanup(ScpReplyReceiver *reply)
 
 #define SCP_MAX_BACKLOG 65536
 
+/*
+ * Most file data we'll send in one go before giving the rest of the
+ * event loop a turn, if the channel is still accepting it.
+ */
+#define SCP_MAX_BURST (4 * SCP_MAX_BACKLOG)
+
 typedef struct ScpSource ScpSource;
 typedef struct ScpSourceStackEntry ScpSourceStackEntry;
 
@@ -502,6 +522,7 @@ static ScpSource *scp_source_new(
 
     scp->scpserver.vt = &ScpSource_ScpServer_vt;
     scp_reply_setup(&scp->reply);
+    scp->reply.data_sc = sc;
     scp->sc = sc;
     scp->sf = sftpsrv_new(sftpserver_vt);
     scp->n_pending_commands = 0;
@@ -716,13 +737,18 @@ static void scp_source_process_stack(ScpSource *scp)
 
     if (scp->head && scp->head->type == SCP_READFILE) {
         /*
-         * Transfer file data if our backlog hasn't filled up.
+         * Transfer file data. Each read is sized to whatever room is
+         * left in our backlog allowance, and goes straight into the
+         * channel's output buffer. We keep reading until that
+         * allowance is used up or the channel throttles us, in which
+         * case scp_source_throttle or the ack of an SSH window
+         * adjustment will bring us back here.
          */
-        int backlog;
-        uint64_t limit = scp->file_size - scp->file_offset;
-        if (limit > 4096)
-            limit = 4096;
-        if (limit > 0) {
+        size_t backlog = 0, burst = 0;
+        while (scp->file_offset < scp->file_size) {
+            uint64_t limit = scp->file_size - scp->file_offset;
+            if (limit > SCP_MAX_BACKLOG - backlog)
+                limit = SCP_MAX_BACKLOG - backlog;
             sftpsrv_read(scp->sf, &scp->reply.srb, scp->head->handle,
                          scp->file_offset, limit);
             if (scp->reply.err) {
@@ -732,13 +758,16 @@ static void scp_source_process_stack(ScpSource *scp)
                 return;
             }
 
-            backlog = sshfwd_write(
-                scp->sc, scp->reply.data.ptr, scp->reply.data.len);
+            backlog = scp->reply.data_backlog;
             scp->file_offset += scp->reply.data.len;
+            burst += scp->reply.data.len;
 
-            if (backlog < SCP_MAX_BACKLOG)
+            if (backlog >= SCP_MAX_BACKLOG || scp->throttled)
+                return;
+            if (burst >= SCP_MAX_BURST) {
                 scp_requeue(scp);
-            return;
+                return;
+            }
         }
 
         /*
@@ -9,23 +9,65 @@
 #include <limits.h>
 
 #include "misc.h"
-#include "tree234.h"
 #include "sftp.h"
 
 static const char *fxp_error_message;
 static int fxp_errtype;
 
 static void fxp_internal_error(const char *msg);
+static void fxp_free_extensions(void);
+static bool fxp_get_limits(void);
+
+/*
+ * Extensions announced by the server in its FXP_VERSION packet, and
+ * the limits it gave us via limits@openssh.com, if it supports that.
+ */
+struct fxp_extension {
+    char *name;
+    strbuf *data;
+};
+static struct fxp_extension *fxp_extensions;
+static size_t n_fxp_extensions, fxp_extensions_size;
+static unsigned fxp_write_len = SFTP_DEFAULT_WRITE_LEN;
 
 /* ----------------------------------------------------------------------
  * Client-specific parts of the send- and receive-packet system.
  */
 
+/* The extra stream we're talking to, or NULL for the main one. */
+static SftpStream *sftp_stream;
+
+void sftp_select_stream(SftpStream *stream)
+{
+    sftp_stream = stream;
+}
+
+static bool sftp_stream_senddata(const char *data, size_t len)
+{
+    if (sftp_stream)
+        return sftp_stream->vt->senddata(sftp_stream, data, len);
+    return sftp_senddata(data, len);
+}
+
+static bool sftp_stream_recvdata(char *data, size_t len)
+{
+    if (sftp_stream)
+        return sftp_stream->vt->recvdata(sftp_stream, data, len);
+    return sftp_recvdata(data, len);
+}
+
+static size_t sftp_stream_sendbuffer(void)
+{
+    if (sftp_stream)
+        return sftp_stream->vt->sendbuffer(sftp_stream);
+    return sftp_sendbuffer();
+}
+
 bool sftp_send(struct sftp_packet *pkt)
 {
     bool ret;
     sftp_send_prepare(pkt);
-    ret = sftp_senddata(pkt->data, pkt->length);
+    ret = sftp_stream_senddata(pkt->data, pkt->length);
     sftp_pkt_free(pkt);
     return ret;
 }
@@ -35,12 +77,12 @@ struct sftp_packet *sftp_recv(void)
     struct sftp_packet *pkt;
     char x[4];
 
-    if (!sftp_recvdata(x, 4))
+    if (!sftp_stream_recvdata(x, 4))
         return NULL;
 
     pkt = sftp_recv_prepare(GET_32BIT_MSB_FIRST(x));
 
-    if (!sftp_recvdata(pkt->data, pkt->length)) {
+    if (!sftp_stream_recvdata(pkt->data, pkt->length)) {
         sftp_pkt_free(pkt);
         return NULL;
     }
@@ -55,94 +97,127 @@ struct sftp_packet *sftp_recv(void)
 
 /* ----------------------------------------------------------------------
  * Request ID allocation and temporary dispatch routines.
+ *
+ * Outstanding requests live in a flat array of slots, indexed by the
+ * low REQUEST_SLOT_BITS of the request ID. The remaining high bits
+ * hold a generation count, bumped each time a slot is reused, so
+ * that a late or duplicated reply quoting the ID of a request that
+ * has already completed won't be matched against whatever request
+ * now occupies its slot. Free slots are kept on a LIFO list so that
+ * the working set of slots stays as small as the number of requests
+ * actually in flight, and both allocation and lookup are O(1).
+ *
+ * The request structures themselves are recycled through a free
+ * list too, since a pipelined transfer allocates and frees one per
+ * chunk.
  */
 
-#define REQUEST_ID_OFFSET 256
+#define REQUEST_SLOT_BITS 20
+#define REQUEST_SLOT_MAX (1U << REQUEST_SLOT_BITS)
+#define REQUEST_SLOT_MASK (REQUEST_SLOT_MAX - 1)
+#define REQUEST_GEN_MASK (0xFFFFFFFFU >> REQUEST_SLOT_BITS)
+#define REQUEST_NO_SLOT ((unsigned)-1)
 
 struct sftp_request {
     unsigned id;
     bool registered;
     void *userdata;
+    struct sftp_request *next_free;
 };
 
-static int sftp_reqcmp(void *av, void *bv)
-{
-    struct sftp_request *a = (struct sftp_request *)av;
-    struct sftp_request *b = (struct sftp_request *)bv;
-    if (a->id < b->id)
-        return -1;
-    if (a->id > b->id)
-        return +1;
-    return 0;
-}
-static int sftp_reqfind(void *av, void *bv)
-{
-    unsigned *a = (unsigned *) av;
-    struct sftp_request *b = (struct sftp_request *)bv;
-    if (*a < b->id)
-        return -1;
-    if (*a > b->id)
-        return +1;
-    return 0;
-}
+struct sftp_reqslot {
+    struct sftp_request *req;          /* NULL if the slot is free */
+    unsigned gen;
+    unsigned next_free;
+};
 
-static tree234 *sftp_requests;
+static struct sftp_reqslot *sftp_reqslots;
+static size_t sftp_nreqslots, sftp_reqslotsize;
+static unsigned sftp_reqslot_free = REQUEST_NO_SLOT;
+static struct sftp_request *sftp_request_pool;
 
 static struct sftp_request *sftp_alloc_request(void)
 {
-    unsigned low, high, mid;
-    int tsize;
+    unsigned slot;
+    struct sftp_reqslot *s;
     struct sftp_request *r;
 
-    if (sftp_requests == NULL)
-        sftp_requests = newtree234(sftp_reqcmp);
-
-    /*
-     * First-fit allocation of request IDs: always pick the lowest
-     * unused one. To do this, binary-search using the counted
-     * B-tree to find the largest ID which is in a contiguous
-     * sequence from the beginning. (Precisely everything in that
-     * sequence must have ID equal to its tree index plus
-     * REQUEST_ID_OFFSET.)
-     */
-    tsize = count234(sftp_requests);
-
-    low = -1;
-    high = tsize;
-    while (high - low > 1) {
-        mid = (high + low) / 2;
-        r = index234(sftp_requests, mid);
-        if (r->id == mid + REQUEST_ID_OFFSET)
-            low = mid;                 /* this one is fine */
-        else
-            high = mid;                /* this one is past it */
-    }
-    /*
-     * Now low points to either -1, or the tree index of the
-     * largest ID in the initial sequence.
-     */
-    {
-        unsigned i = low + 1 + REQUEST_ID_OFFSET;
-        assert(NULL == find234(sftp_requests, &i, sftp_reqfind));
+    if (sftp_reqslot_free != REQUEST_NO_SLOT) {
+        slot = sftp_reqslot_free;
+        s = &sftp_reqslots[slot];
+        sftp_reqslot_free = s->next_free;
+    } else {
+        assert(sftp_nreqslots < REQUEST_SLOT_MAX);
+        sgrowarray(sftp_reqslots, sftp_reqslotsize, sftp_nreqslots);
+        slot = sftp_nreqslots++;
+        s = &sftp_reqslots[slot];
+        s->gen = 0;
     }
 
     /*
-     * So the request ID we need to create is
-     * low + 1 + REQUEST_ID_OFFSET.
+     * Skip generation 0 in slot 0, so that no request ever gets ID
+     * zero, which is at least a plausible thing for a confused
+     * server to send back.
      */
-    r = snew(struct sftp_request);
-    r->id = low + 1 + REQUEST_ID_OFFSET;
+    s->gen = (s->gen + 1) & REQUEST_GEN_MASK;
+    if (slot == 0 && s->gen == 0)
+        s->gen = 1;
+
+    if (sftp_request_pool) {
+        r = sftp_request_pool;
+        sftp_request_pool = r->next_free;
+    } else {
+        r = snew(struct sftp_request);
+    }
+    r->id = (s->gen << REQUEST_SLOT_BITS) | slot;
     r->registered = false;
     r->userdata = NULL;
-    add234(sftp_requests, r);
+    r->next_free = NULL;
+    s->req = r;
     return r;
 }
 
+static void sftp_free_request(struct sftp_request *req)
+{
+    req->next_free = sftp_request_pool;
+    sftp_request_pool = req;
+}
+
+static void sftp_release_slot(unsigned slot)
+{
+    sftp_reqslots[slot].req = NULL;
+    sftp_reqslots[slot].next_free = sftp_reqslot_free;
+    sftp_reqslot_free = slot;
+}
+
+/*
+ * Free a request we've given up waiting for the reply to. If the
+ * reply does turn up after all, its ID won't match anything.
+ */
+void sftp_abandon_request(struct sftp_request *req)
+{
+    unsigned slot = req->id & REQUEST_SLOT_MASK;
+    if (slot < sftp_nreqslots && sftp_reqslots[slot].req == req)
+        sftp_release_slot(slot);
+    sftp_free_request(req);
+}
+
 void sftp_cleanup_request(void)
 {
-    if (sftp_requests != NULL) {
-        freetree234(sftp_requests);
-        sftp_requests = NULL;
+    size_t i;
+
+    for (i = 0; i < sftp_nreqslots; i++)
+        if (sftp_reqslots[i].req)
+            sftp_free_request(sftp_reqslots[i].req);
+    sfree(sftp_reqslots);
+    sftp_reqslots = NULL;
+    sftp_nreqslots = sftp_reqslotsize = 0;
+    sftp_reqslot_free = REQUEST_NO_SLOT;
+
+    while (sftp_request_pool) {
+        struct sftp_request *r = sftp_request_pool;
+        sftp_request_pool = r->next_free;
+        sfree(r);
     }
 }
 
@@ -153,7 +228,7 @@ void sftp_register(struct sftp_request *req)
 
 struct sftp_request *sftp_find_request(struct sftp_packet *pktin)
 {
-    unsigned id;
+    unsigned id, slot;
     struct sftp_request *req;
 
     if (!pktin) {
@@ -167,13 +242,14 @@ struct sftp_request *sftp_find_request(struct sftp_packet *pktin)
         return NULL;
     }
 
-    req = find234(sftp_requests, &id, sftp_reqfind);
-    if (!req || !req->registered) {
+    slot = id & REQUEST_SLOT_MASK;
+    req = slot < sftp_nreqslots ? sftp_reqslots[slot].req : NULL;
+    if (!req || req->id != id || !req->registered) {
         fxp_internal_error("request ID mismatch\n");
         return NULL;
     }
 
-    del234(sftp_requests, req);
+    sftp_release_slot(slot);
 
     return req;
 }
@@ -183,11 +259,9 @@ struct sftp_request *sftp_find_request(struct sftp_packet *pktin)
  */
 
 /*
- * Deal with (and free) an FXP_STATUS packet. Return 1 if
- * SSH_FX_OK, 0 if SSH_FX_EOF, and -1 for anything else (error).
- * Also place the status into fxp_errtype.
+ * Set the error state from an SFTP status code.
  */
-static int fxp_got_status(struct sftp_packet *pktin)
+static void fxp_set_status(int code)
 {
     static const char *const messages[] = {
         /* SSH_FX_OK. The only time we will display a _message_ for this
@@ -204,19 +278,30 @@ static int fxp_got_status(struct sftp_packet *pktin)
         "operation unsupported",
     };
 
+    fxp_errtype = code;
+    if (fxp_errtype < 0 || fxp_errtype >= lenof(messages))
+        fxp_error_message = "unknown error code";
+    else
+        fxp_error_message = messages[fxp_errtype];
+}
+
+/*
+ * Deal with (and free) an FXP_STATUS packet. Return 1 if
+ * SSH_FX_OK, 0 if SSH_FX_EOF, and -1 for anything else (error).
+ * Also place the status into fxp_errtype.
+ */
+static int fxp_got_status(struct sftp_packet *pktin)
+{
     if (pktin->type != SSH_FXP_STATUS) {
         fxp_error_message = "expected FXP_STATUS packet";
         fxp_errtype = -1;
     } else {
-        fxp_errtype = get_uint32(pktin);
+        int code = get_uint32(pktin);
         if (get_err(pktin)) {
             fxp_error_message = "malformed FXP_STATUS packet";
             fxp_errtype = -1;
         } else {
-            if (fxp_errtype < 0 || fxp_errtype >= lenof(messages))
-                fxp_error_message = "unknown error code";
-            else
-                fxp_error_message = messages[fxp_errtype];
+            fxp_set_status(code);
         }
     }
 
@@ -246,8 +331,12 @@ int fxp_error_type(void)
 
 /*
  * Perform exchange of init/version packets. Return 0 on failure.
+ *
+ * If 'main' is false, this is an extra stream, whose server we
+ * assume to be the same one the main stream already talked to; so
+ * we don't replace what we learned from that.
  */
-bool fxp_init(void)
+static bool fxp_init_common(bool main)
 {
     struct sftp_packet *pktout, *pktin;
     unsigned long remotever;
@@ -278,17 +367,133 @@ bool fxp_init(void)
         sftp_pkt_free(pktin);
         return false;
     }
+
+    if (!main) {
+        sftp_pkt_free(pktin);
+        return true;
+    }
+
     /*
-     * In principle, this packet might also contain extension-
-     * string pairs. We should work through them and look for any
-     * we recognise. In practice we don't currently do so because
-     * we know we don't recognise _any_.
+     * The rest of the packet is extension-name / extension-data
+     * string pairs. Remember them all, so that callers can check
+     * for the ones they're interested in.
      */
+    fxp_free_extensions();
+    while (get_avail(pktin)) {
+        ptrlen name = get_string(pktin);
+        ptrlen data = get_string(pktin);
+        if (get_err(pktin))
+            break;                     /* ignore a truncated trailing pair */
+        sgrowarray(fxp_extensions, fxp_extensions_size, n_fxp_extensions);
+        struct fxp_extension *ext = &fxp_extensions[n_fxp_extensions++];
+        ext->name = mkstr(name);
+        ext->data = strbuf_new();
+        put_datapl(ext->data, data);
+    }
     sftp_pkt_free(pktin);
 
+    if (fxp_has_extension("limits@openssh.com") && !fxp_get_limits())
+        return false;
+
+    return true;
+}
+
+bool fxp_init(void)
+{
+    return fxp_init_common(true);
+}
+
+bool fxp_init_stream(void)
+{
+    return fxp_init_common(false);
+}
+
+static void fxp_free_extensions(void)
+{
+    for (size_t i = 0; i < n_fxp_extensions; i++) {
+        sfree(fxp_extensions[i].name);
+        strbuf_free(fxp_extensions[i].data);
+    }
+    n_fxp_extensions = 0;
+    fxp_write_len = SFTP_DEFAULT_WRITE_LEN;
+}
+
+bool fxp_has_extension(const char *name)
+{
+    for (size_t i = 0; i < n_fxp_extensions; i++)
+        if (!strcmp(fxp_extensions[i].name, name))
+            return true;
+    return false;
+}
+
+ptrlen fxp_extension_data(const char *name)
+{
+    for (size_t i = 0; i < n_fxp_extensions; i++)
+        if (!strcmp(fxp_extensions[i].name, name))
+            return ptrlen_from_strbuf(fxp_extensions[i].data);
+    return make_ptrlen(NULL, 0);
+}
+
+/*
+ * Ask the server for its limits@openssh.com limits, synchronously,
+ * as part of fxp_init when there are no other requests outstanding.
+ * Returns false only if the connection itself failed.
+ */
+static bool fxp_get_limits(void)
+{
+    struct sftp_request *req = sftp_alloc_request(), *rreq;
+    struct sftp_packet *pktout, *pktin;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "limits@openssh.com");
+    sftp_send(pktout);
+    sftp_register(req);
+
+    pktin = sftp_recv();
+    if (!pktin) {
+        fxp_internal_error("could not connect");
+        sftp_abandon_request(req);
+        return false;
+    }
+    rreq = sftp_find_request(pktin);
+    if (rreq != req) {
+        if (rreq)
+            sftp_free_request(rreq);
+        sftp_abandon_request(req);
+        sftp_pkt_free(pktin);
+        return false;
+    }
+    sftp_free_request(req);
+
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+        get_uint64(pktin);             /* max packet length */
+        get_uint64(pktin);             /* max read length */
+        uint64_t max_write = get_uint64(pktin);
+        get_uint64(pktin);             /* max open handles */
+
+        /* Zero means the server isn't imposing a limit. Either way,
+         * don't go below the size everyone must accept, or above
+         * our own cap. */
+        if (!get_err(pktin) && max_write) {
+            if (max_write > SFTP_MAX_WRITE_LEN)
+                max_write = SFTP_MAX_WRITE_LEN;
+            if (max_write < SFTP_DEFAULT_WRITE_LEN)
+                max_write = SFTP_DEFAULT_WRITE_LEN;
+            fxp_write_len = max_write;
+        } else if (!get_err(pktin)) {
+            fxp_write_len = SFTP_MAX_WRITE_LEN;
+        }
+    }
+    sftp_pkt_free(pktin);
     return true;
 }
 
+unsigned fxp_max_write_len(void)
+{
+    return fxp_write_len;
+}
+
 /*
  * Canonify a pathname.
  */
@@ -307,7 +512,7 @@ struct sftp_request *fxp_realpath_send(const char *path)
 
 char *fxp_realpath_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
-    sfree(req);
+    sftp_free_request(req);
 
     if (pktin->type == SSH_FXP_NAME) {
         unsigned long count;
@@ -376,7 +581,7 @@ static struct fxp_handle *fxp_got_handle(struct sftp_packet *pktin)
 struct fxp_handle *fxp_open_recv(struct sftp_packet *pktin,
                                  struct sftp_request *req)
 {
-    sfree(req);
+    sftp_free_request(req);
 
     if (pktin->type == SSH_FXP_HANDLE) {
         return fxp_got_handle(pktin);
@@ -406,7 +611,7 @@ struct sftp_request *fxp_opendir_send(const char *path)
 struct fxp_handle *fxp_opendir_recv(struct sftp_packet *pktin,
                                     struct sftp_request *req)
 {
-    sfree(req);
+    sftp_free_request(req);
     if (pktin->type == SSH_FXP_HANDLE) {
         return fxp_got_handle(pktin);
     } else {
@@ -437,7 +642,7 @@ struct sftp_request *fxp_close_send(struct fxp_handle *handle)
 
 bool fxp_close_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
-    sfree(req);
+    sftp_free_request(req);
     fxp_got_status(pktin);
     sftp_pkt_free(pktin);
     return fxp_errtype == SSH_FX_OK;
@@ -461,7 +666,7 @@ struct sftp_request *fxp_mkdir_send(const char *path,
 bool fxp_mkdir_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
     int id;
-    sfree(req);
+    sftp_free_request(req);
     id = fxp_got_status(pktin);
     sftp_pkt_free(pktin);
     return id == 1;
@@ -483,7 +688,7 @@ struct sftp_request *fxp_rmdir_send(const char *path)
 bool fxp_rmdir_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
     int id;
-    sfree(req);
+    sftp_free_request(req);
     id = fxp_got_status(pktin);
     sftp_pkt_free(pktin);
     return id == 1;
@@ -505,7 +710,7 @@ struct sftp_request *fxp_remove_send(const char *fname)
 bool fxp_remove_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
     int id;
-    sfree(req);
+    sftp_free_request(req);
     id = fxp_got_status(pktin);
     sftp_pkt_free(pktin);
     return id == 1;
@@ -529,7 +734,7 @@ struct sftp_request *fxp_rename_send(const char *srcfname,
 bool fxp_rename_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
     int id;
-    sfree(req);
+    sftp_free_request(req);
     id = fxp_got_status(pktin);
     sftp_pkt_free(pktin);
     return id == 1;
@@ -567,7 +772,7 @@ static bool fxp_got_attrs(struct sftp_packet *pktin, struct fxp_attrs *attrs)
 bool fxp_stat_recv(struct sftp_packet *pktin, struct sftp_request *req,
                   struct fxp_attrs *attrs)
 {
-    sfree(req);
+    sftp_free_request(req);
     if (pktin->type == SSH_FXP_ATTRS) {
         return fxp_got_attrs(pktin, attrs);
     } else {
@@ -593,7 +798,7 @@ struct sftp_request *fxp_fstat_send(struct fxp_handle *handle)
 bool fxp_fstat_recv(struct sftp_packet *pktin, struct sftp_request *req,
                     struct fxp_attrs *attrs)
 {
-    sfree(req);
+    sftp_free_request(req);
     if (pktin->type == SSH_FXP_ATTRS) {
         return fxp_got_attrs(pktin, attrs);
     } else {
@@ -624,7 +829,7 @@ struct sftp_request *fxp_setstat_send(const char *fname,
 bool fxp_setstat_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
     int id;
-    sfree(req);
+    sftp_free_request(req);
     id = fxp_got_status(pktin);
     sftp_pkt_free(pktin);
     return id == 1;
@@ -648,7 +853,7 @@ struct sftp_request *fxp_fsetstat_send(struct fxp_handle *handle,
 bool fxp_fsetstat_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
     int id;
-    sfree(req);
+    sftp_free_request(req);
     id = fxp_got_status(pktin);
     sftp_pkt_free(pktin);
     return id == 1;
@@ -679,7 +884,7 @@ struct sftp_request *fxp_read_send(struct fxp_handle *handle,
 int fxp_read_recv(struct sftp_packet *pktin, struct sftp_request *req,
                   char *buffer, int len)
 {
-    sfree(req);
+    sftp_free_request(req);
     if (pktin->type == SSH_FXP_DATA) {
         ptrlen data;
 
@@ -706,6 +911,90 @@ int fxp_read_recv(struct sftp_packet *pktin, struct sftp_request *req,
     }
 }
 
+/*
+ * Read and write with compression of the file data, using our own
+ * compressed-read and compressed-write extensions.
+ */
+struct sftp_request *fxp_read_compressed_send(struct fxp_handle *handle,
+                                              uint64_t offset, int len)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "compressed-read@putty.projects.tartarus.org");
+    put_string(pktout, handle->hstring, handle->hlen);
+    put_uint64(pktout, offset);
+    put_uint32(pktout, len);
+    sftp_send(pktout);
+
+    return req;
+}
+
+int fxp_read_compressed_recv(struct sftp_packet *pktin,
+                             struct sftp_request *req, char *buffer, int len)
+{
+    sftp_free_request(req);
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+        unsigned method;
+        size_t rawlen;
+        ptrlen payload;
+        strbuf *sb;
+
+        method = get_byte(pktin);
+        rawlen = get_uint32(pktin);
+        payload = get_string(pktin);
+        if (get_err(pktin)) {
+            fxp_internal_error("malformed compressed-read reply");
+            sftp_pkt_free(pktin);
+            return -1;
+        }
+
+        if (rawlen > len) {
+            fxp_internal_error("READ returned more bytes than requested");
+            sftp_pkt_free(pktin);
+            return -1;
+        }
+
+        sb = strbuf_new_nm();
+        if (!sftp_decompress_block(method, payload, rawlen, sb)) {
+            fxp_internal_error("unable to decompress READ data");
+            strbuf_free(sb);
+            sftp_pkt_free(pktin);
+            return -1;
+        }
+        memcpy(buffer, sb->u, rawlen);
+        strbuf_free(sb);
+        sftp_pkt_free(pktin);
+        return rawlen;
+    } else {
+        fxp_got_status(pktin);
+        sftp_pkt_free(pktin);
+        return -1;
+    }
+}
+
+struct sftp_request *fxp_write_compressed_send(
+    struct fxp_handle *handle, uint64_t offset, unsigned method,
+    int rawlen, ptrlen payload)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "compressed-write@putty.projects.tartarus.org");
+    put_string(pktout, handle->hstring, handle->hlen);
+    put_uint64(pktout, offset);
+    put_byte(pktout, method);
+    put_uint32(pktout, rawlen);
+    put_stringpl(pktout, payload);
+    sftp_send(pktout);
+
+    return req;
+}
+
 /*
  * Read from a directory.
  */
@@ -725,7 +1014,7 @@ struct sftp_request *fxp_readdir_send(struct fxp_handle *handle)
 struct fxp_names *fxp_readdir_recv(struct sftp_packet *pktin,
                                    struct sftp_request *req)
 {
-    sfree(req);
+    sftp_free_request(req);
     if (pktin->type == SSH_FXP_NAME) {
         struct fxp_names *ret;
         unsigned long i;
@@ -807,12 +1096,271 @@ struct sftp_request *fxp_write_send(struct fxp_handle *handle,
 
 bool fxp_write_recv(struct sftp_packet *pktin, struct sftp_request *req)
 {
-    sfree(req);
+    sftp_free_request(req);
     fxp_got_status(pktin);
     sftp_pkt_free(pktin);
     return fxp_errtype == SSH_FX_OK;
 }
 
+/*
+ * Ask for SHA-256 hashes of a range of an open file, using the
+ * check-file-handle extension.
+ */
+struct sftp_request *fxp_check_file_send(struct fxp_handle *handle,
+                                         uint64_t offset, uint64_t len,
+                                         unsigned blocksize)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "check-file-handle");
+    put_string(pktout, handle->hstring, handle->hlen);
+    put_stringz(pktout, "sha256");
+    put_uint64(pktout, offset);
+    put_uint64(pktout, len);
+    put_uint32(pktout, blocksize);
+    sftp_send(pktout);
+
+    return req;
+}
+
+int fxp_check_file_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                        strbuf *hashes)
+{
+    sftp_free_request(req);
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+        ptrlen alg = get_string(pktin);
+        ptrlen data = get_data(pktin, get_avail(pktin));
+        if (get_err(pktin) || !ptrlen_eq_string(alg, "sha256") ||
+            data.len % 32) {
+            fxp_internal_error("malformed check-file reply");
+            sftp_pkt_free(pktin);
+            return -1;
+        }
+        put_datapl(hashes, data);
+        sftp_pkt_free(pktin);
+        return data.len / 32;
+    } else {
+        fxp_got_status(pktin);
+        sftp_pkt_free(pktin);
+        return -1;
+    }
+}
+
+struct sftp_request *fxp_block_sigs_send(struct fxp_handle *handle,
+                                         uint64_t offset, uint64_t len,
+                                         unsigned blocksize)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "block-signatures@putty.projects.tartarus.org");
+    put_string(pktout, handle->hstring, handle->hlen);
+    put_uint64(pktout, offset);
+    put_uint64(pktout, len);
+    put_uint32(pktout, blocksize);
+    sftp_send(pktout);
+
+    return req;
+}
+
+int fxp_block_sigs_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                        strbuf *sigs)
+{
+    sftp_free_request(req);
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+        ptrlen data = get_data(pktin, get_avail(pktin));
+        if (data.len % SFTP_SIG_LEN) {
+            fxp_internal_error("malformed block-signatures reply");
+            sftp_pkt_free(pktin);
+            return -1;
+        }
+        put_datapl(sigs, data);
+        sftp_pkt_free(pktin);
+        return data.len / SFTP_SIG_LEN;
+    } else {
+        fxp_got_status(pktin);
+        sftp_pkt_free(pktin);
+        return -1;
+    }
+}
+
+struct sftp_request *fxp_copy_data_send(struct fxp_handle *src,
+                                        uint64_t srcoffset, uint64_t len,
+                                        struct fxp_handle *dst,
+                                        uint64_t dstoffset)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "copy-data");
+    put_string(pktout, src->hstring, src->hlen);
+    put_uint64(pktout, srcoffset);
+    put_uint64(pktout, len);
+    put_string(pktout, dst->hstring, dst->hlen);
+    put_uint64(pktout, dstoffset);
+    sftp_send(pktout);
+
+    return req;
+}
+
+bool fxp_copy_data_recv(struct sftp_packet *pktin, struct sftp_request *req)
+{
+    sftp_free_request(req);
+    fxp_got_status(pktin);
+    sftp_pkt_free(pktin);
+    return fxp_errtype == SSH_FX_OK;
+}
+
+struct sftp_request *fxp_posix_rename_send(const char *srcfname,
+                                           const char *dstfname)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "posix-rename@openssh.com");
+    put_stringz(pktout, srcfname);
+    put_stringz(pktout, dstfname);
+    sftp_send(pktout);
+
+    return req;
+}
+
+/*
+ * Batches of operations, with batch@putty.projects.tartarus.org.
+ */
+struct fxp_batch {
+    strbuf *ops;
+    size_t nops;
+    unsigned *status;
+};
+
+struct fxp_batch *fxp_batch_new(void)
+{
+    struct fxp_batch *batch = snew(struct fxp_batch);
+    batch->ops = strbuf_new();
+    batch->nops = 0;
+    batch->status = NULL;
+    return batch;
+}
+
+void fxp_batch_remove(struct fxp_batch *batch, const char *fname)
+{
+    put_byte(batch->ops, SSH_FXP_REMOVE);
+    put_stringz(batch->ops, fname);
+    batch->nops++;
+}
+
+void fxp_batch_rmdir(struct fxp_batch *batch, const char *path)
+{
+    put_byte(batch->ops, SSH_FXP_RMDIR);
+    put_stringz(batch->ops, path);
+    batch->nops++;
+}
+
+void fxp_batch_rename(struct fxp_batch *batch, const char *srcfname,
+                      const char *dstfname)
+{
+    put_byte(batch->ops, SSH_FXP_RENAME);
+    put_stringz(batch->ops, srcfname);
+    put_stringz(batch->ops, dstfname);
+    batch->nops++;
+}
+
+void fxp_batch_setstat(struct fxp_batch *batch, const char *fname,
+                       struct fxp_attrs attrs)
+{
+    put_byte(batch->ops, SSH_FXP_SETSTAT);
+    put_stringz(batch->ops, fname);
+    put_fxp_attrs(batch->ops, attrs);
+    batch->nops++;
+}
+
+size_t fxp_batch_count(struct fxp_batch *batch)
+{
+    return batch->nops;
+}
+
+size_t fxp_batch_size(struct fxp_batch *batch)
+{
+    return batch->ops->len;
+}
+
+struct sftp_request *fxp_batch_send(struct fxp_batch *batch)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "batch@putty.projects.tartarus.org");
+    put_uint32(pktout, batch->nops);
+    put_datapl(pktout, ptrlen_from_strbuf(batch->ops));
+    sftp_send(pktout);
+
+    return req;
+}
+
+bool fxp_batch_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                    struct fxp_batch *batch)
+{
+    sftp_free_request(req);
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+        size_t i;
+
+        sfree(batch->status);
+        batch->status = snewn(batch->nops, unsigned);
+        if (get_uint32(pktin) != batch->nops) {
+            fxp_internal_error("wrong number of results in batch reply");
+            sftp_pkt_free(pktin);
+            return false;
+        }
+        for (i = 0; i < batch->nops; i++)
+            batch->status[i] = get_uint32(pktin);
+        if (get_err(pktin)) {
+            fxp_internal_error("malformed batch reply");
+            sftp_pkt_free(pktin);
+            return false;
+        }
+        sftp_pkt_free(pktin);
+        return true;
+    } else {
+        fxp_got_status(pktin);
+        sftp_pkt_free(pktin);
+        return false;
+    }
+}
+
+bool fxp_batch_result(struct fxp_batch *batch, size_t i)
+{
+    assert(batch->status && i < batch->nops);
+    fxp_set_status(batch->status[i]);
+    return fxp_errtype == SSH_FX_OK;
+}
+
+void fxp_batch_clear(struct fxp_batch *batch)
+{
+    strbuf_clear(batch->ops);
+    batch->nops = 0;
+    sfree(batch->status);
+    batch->status = NULL;
+}
+
+void fxp_batch_free(struct fxp_batch *batch)
+{
+    strbuf_free(batch->ops);
+    sfree(batch->status);
+    sfree(batch);
+}
+
 /*
  * Free up an fxp_names structure.
  */
@@ -872,14 +1420,15 @@ void fxp_set_userdata(struct sftp_request *req, void *data)
 struct req {
     char *buffer;
     int len, retlen, complete;
+    bool compressed;
     uint64_t offset;
     struct req *next, *prev;
 };
 
 struct fxp_xfer {
-    uint64_t offset, furthestdata, filesize;
+    uint64_t offset, end, furthestdata, filesize;
     int req_totalsize, req_maxsize;
-    bool eof, err;
+    bool eof, err, compressed;
     struct fxp_handle *fh;
     struct req *head, *tail;
 };
@@ -890,10 +1439,12 @@ static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64_t offset)
 
     xfer->fh = fh;
     xfer->offset = offset;
+    xfer->end = UINT64_MAX;
     xfer->head = xfer->tail = NULL;
     xfer->req_totalsize = 0;
     xfer->req_maxsize = 1048576;
     xfer->err = false;
+    xfer->compressed = false;
     xfer->filesize = UINT64_MAX;
     xfer->furthestdata = 0;
 
@@ -903,16 +1454,18 @@ static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64_t offset)
 bool xfer_done(struct fxp_xfer *xfer)
 {
     /*
-     * We're finished if we've seen EOF _and_ there are no
-     * outstanding requests.
+     * We're finished if we've seen EOF (or asked for everything up
+     * to the end of our range) _and_ there are no outstanding
+     * requests.
      */
-    return (xfer->eof || xfer->err) && !xfer->head;
+    return (xfer->eof || xfer->err || xfer->offset >= xfer->end) &&
+        !xfer->head;
 }
 
 void xfer_download_queue(struct fxp_xfer *xfer)
 {
     while (xfer->req_totalsize < xfer->req_maxsize &&
-           !xfer->eof && !xfer->err) {
+           !xfer->eof && !xfer->err && xfer->offset < xfer->end) {
         /*
          * Queue a new read request.
          */
@@ -932,9 +1485,16 @@ void xfer_download_queue(struct fxp_xfer *xfer)
         xfer->tail = rr;
         rr->next = NULL;
 
-        rr->len = 32768;
+        rr->len = (xfer->compressed ? SFTP_COMPRESSED_READ_LEN : 32768);
+        if (rr->len > xfer->end - xfer->offset)
+            rr->len = xfer->end - xfer->offset;
         rr->buffer = snewn(rr->len, char);
-        sftp_register(req = fxp_read_send(xfer->fh, rr->offset, rr->len));
+        rr->compressed = xfer->compressed;
+        if (rr->compressed)
+            req = fxp_read_compressed_send(xfer->fh, rr->offset, rr->len);
+        else
+            req = fxp_read_send(xfer->fh, rr->offset, rr->len);
+        sftp_register(req);
         fxp_set_userdata(req, rr);
 
         xfer->offset += rr->len;
@@ -946,10 +1506,22 @@ void xfer_download_queue(struct fxp_xfer *xfer)
     }
 }
 
+void xfer_set_compressed(struct fxp_xfer *xfer)
+{
+    xfer->compressed = true;
+}
+
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64_t offset)
+{
+    return xfer_download_init_range(fh, offset, UINT64_MAX);
+}
+
+struct fxp_xfer *xfer_download_init_range(
+    struct fxp_handle *fh, uint64_t offset, uint64_t end)
 {
     struct fxp_xfer *xfer = xfer_init(fh, offset);
 
+    xfer->end = end;
     xfer->eof = false;
     xfer_download_queue(xfer);
 
@@ -973,7 +1545,11 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
         fxp_internal_error("request ID is not part of the current download");
         return INT_MIN;                /* this packet isn't ours */
     }
-    rr->retlen = fxp_read_recv(pktin, rreq, rr->buffer, rr->len);
+    if (rr->compressed)
+        rr->retlen = fxp_read_compressed_recv(pktin, rreq,
+                                              rr->buffer, rr->len);
+    else
+        rr->retlen = fxp_read_recv(pktin, rreq, rr->buffer, rr->len);
 #ifdef DEBUG_DOWNLOAD
     printf("read request %p has returned [%d]\n", rr, rr->retlen);
 #endif
@@ -1102,13 +1678,12 @@ struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64_t offset)
 
 bool xfer_upload_ready(struct fxp_xfer *xfer)
 {
-    return sftp_sendbuffer() == 0;
+    return sftp_stream_sendbuffer() == 0;
 }
 
-void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
+static struct req *xfer_upload_req(struct fxp_xfer *xfer, int len)
 {
     struct req *rr;
-    struct sftp_request *req;
 
     rr = snew(struct req);
     rr->offset = xfer->offset;
@@ -1125,8 +1700,7 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 
     rr->len = len;
     rr->buffer = NULL;
-    sftp_register(req = fxp_write_send(xfer->fh, buffer, rr->offset, len));
-    fxp_set_userdata(req, rr);
+    rr->compressed = false;
 
     xfer->offset += rr->len;
     xfer->req_totalsize += rr->len;
@@ -1135,6 +1709,27 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
     printf("queueing write request %p at %"PRIu64" [len %d]\n",
            rr, rr->offset, len);
 #endif
+    return rr;
+}
+
+void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
+{
+    struct req *rr = xfer_upload_req(xfer, len);
+    struct sftp_request *req;
+
+    sftp_register(req = fxp_write_send(xfer->fh, buffer, rr->offset, len));
+    fxp_set_userdata(req, rr);
+}
+
+void xfer_upload_compressed(struct fxp_xfer *xfer, unsigned method,
+                            ptrlen payload, int rawlen)
+{
+    struct req *rr = xfer_upload_req(xfer, rawlen);
+    struct sftp_request *req;
+
+    sftp_register(req = fxp_write_compressed_send(
+                      xfer->fh, rr->offset, method, rawlen, payload));
+    fxp_set_userdata(req, rr);
 }
 
 /*
@@ -1193,3 +1788,328 @@ void xfer_cleanup(struct fxp_xfer *xfer)
     }
     sfree(xfer);
 }
+
+/* ----------------------------------------------------------------------
+ * Walking a remote directory tree.
+ *
+ * Rather than listing one directory at a time, we keep up to
+ * WALK_MAX_REQUESTS requests in flight at once, spread over up to
+ * WALK_MAX_HANDLES open directories. READDIR already tells us the
+ * type of everything it returns, so the only entries we need to STAT
+ * are symlinks (to find out whether they lead to directories) and
+ * any for which the server didn't supply permissions.
+ */
+#define WALK_MAX_REQUESTS 64
+#define WALK_MAX_HANDLES 16
+
+enum { WALK_STAT, WALK_OPENDIR, WALK_READDIR, WALK_CLOSE };
+
+struct walk_node {
+    const char *path, *name;
+    struct fxp_attrs attrs;
+    bool is_dir, opened, rejected;
+    const char *error;
+
+    int op;                            /* next or outstanding request */
+    struct fxp_handle *dh;
+
+    /* Children are listed in arrival order, then sorted when done */
+    struct walk_node *children, *sibling, **sorted;
+    size_t nchildren;
+
+    struct walk_node *qnext;
+};
+
+struct walk_queue {
+    struct walk_node *head, *tail;
+};
+
+struct fxp_walk {
+    MemArena *arena;
+    bool (*vet)(const char *name);
+    struct walk_node *root;
+    struct walk_queue stats, opens, reads;
+    size_t nreqs, nhandles, nnodes;
+    struct fxp_walk_entry *entries;
+};
+
+static void walk_enqueue(struct walk_queue *q, struct walk_node *node)
+{
+    node->qnext = NULL;
+    if (q->tail)
+        q->tail->qnext = node;
+    else
+        q->head = node;
+    q->tail = node;
+}
+
+static struct walk_node *walk_dequeue(struct walk_queue *q)
+{
+    struct walk_node *node = q->head;
+    if (node) {
+        q->head = node->qnext;
+        if (!q->head)
+            q->tail = NULL;
+    }
+    return node;
+}
+
+static const char *walk_strdup(struct fxp_walk *walk, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *ret = arena_snewn(walk->arena, len, char);
+    memcpy(ret, s, len);
+    return ret;
+}
+
+static struct walk_node *walk_new_node(struct fxp_walk *walk,
+                                       const char *path,
+                                       const struct fxp_attrs *attrs)
+{
+    struct walk_node *node = arena_snew(walk->arena, struct walk_node);
+    const char *slash;
+
+    memset(node, 0, sizeof(*node));
+    node->path = walk_strdup(walk, path);
+    slash = strrchr(node->path, '/');
+    node->name = (slash && slash[1] ? slash + 1 : node->path);
+    node->attrs = *attrs;
+    walk->nnodes++;
+    return node;
+}
+
+/*
+ * Decide what to do with a name we've just found out about: look
+ * it up if READDIR didn't tell us enough, or list it if it's a
+ * directory.
+ */
+static void walk_classify(struct fxp_walk *walk, struct walk_node *node,
+                          bool stated)
+{
+    if (!stated && (!(node->attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) ||
+                    (node->attrs.permissions & 0170000) == 0120000)) {
+        node->op = WALK_STAT;
+        walk_enqueue(&walk->stats, node);
+    } else if ((node->attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) &&
+               (node->attrs.permissions & 0040000)) {
+        node->is_dir = true;
+        node->op = WALK_OPENDIR;
+        walk_enqueue(&walk->opens, node);
+    }
+}
+
+static int walk_node_cmp(const void *av, const void *bv)
+{
+    const struct walk_node *a = *(const struct walk_node *const *)av;
+    const struct walk_node *b = *(const struct walk_node *const *)bv;
+    return strcmp(a->name, b->name);
+}
+
+/*
+ * A directory has been completely read. Sort its contents into a
+ * predictable order (so that a reget of the same tree goes the same
+ * way), and start work on any subdirectories.
+ */
+static void walk_dir_done(struct fxp_walk *walk, struct walk_node *dir)
+{
+    struct walk_node *child;
+    size_t i;
+
+    if (dir->error) {
+        dir->nchildren = 0;            /* don't go any further down */
+        return;
+    }
+
+    dir->sorted = arena_snewn(walk->arena, dir->nchildren + 1,
+                              struct walk_node *);
+    for (i = 0, child = dir->children; child; child = child->sibling)
+        dir->sorted[i++] = child;
+    qsort(dir->sorted, dir->nchildren, sizeof(*dir->sorted), walk_node_cmp);
+
+    for (i = 0; i < dir->nchildren; i++)
+        if (!dir->sorted[i]->rejected)
+            walk_classify(walk, dir->sorted[i], false);
+}
+
+struct fxp_walk *fxp_walk_init(const char *root,
+                               const struct fxp_attrs *attrs,
+                               bool (*vet)(const char *name))
+{
+    struct fxp_walk *walk = snew(struct fxp_walk);
+
+    memset(walk, 0, sizeof(*walk));
+    walk->arena = arena_new("sftp-walk");
+    walk->vet = vet;
+    walk->root = walk_new_node(walk, root, attrs);
+    walk->root->is_dir = true;
+    walk->root->op = WALK_OPENDIR;
+    walk_enqueue(&walk->opens, walk->root);
+    return walk;
+}
+
+void fxp_walk_queue(struct fxp_walk *walk)
+{
+    while (walk->nreqs < WALK_MAX_REQUESTS) {
+        struct walk_node *node;
+        struct sftp_request *req;
+
+        /*
+         * Prefer reading directories we've already opened, so as to
+         * give their handles back as soon as possible.
+         */
+        if ((node = walk_dequeue(&walk->reads)) != NULL) {
+            if (node->op == WALK_READDIR) {
+                req = fxp_readdir_send(node->dh);
+            } else {
+                req = fxp_close_send(node->dh);
+                node->dh = NULL;
+            }
+        } else if ((node = walk_dequeue(&walk->stats)) != NULL) {
+            req = fxp_stat_send(node->path);
+        } else if (walk->nhandles < WALK_MAX_HANDLES &&
+                   (node = walk_dequeue(&walk->opens)) != NULL) {
+            req = fxp_opendir_send(node->path);
+            walk->nhandles++;
+        } else {
+            break;
+        }
+
+        sftp_register(req);
+        fxp_set_userdata(req, node);
+        walk->nreqs++;
+    }
+}
+
+/*
+ * Returns INT_MIN if the packet wasn't a reply to one of our
+ * requests, in which case pktin has not been freed. Errors on
+ * individual directories and files don't stop the walk: they're
+ * recorded in the manifest.
+ */
+int fxp_walk_gotpkt(struct fxp_walk *walk, struct sftp_packet *pktin)
+{
+    struct sftp_request *rreq;
+    struct walk_node *node;
+
+    rreq = sftp_find_request(pktin);
+    if (!rreq)
+        return INT_MIN;            /* this packet doesn't even make sense */
+    node = (struct walk_node *)fxp_get_userdata(rreq);
+    if (!node) {
+        fxp_internal_error("request ID is not part of the current walk");
+        return INT_MIN;                /* this packet isn't ours */
+    }
+    walk->nreqs--;
+
+    switch (node->op) {
+      case WALK_STAT: {
+        struct fxp_attrs attrs;
+        if (fxp_stat_recv(pktin, rreq, &attrs)) {
+            node->attrs = attrs;
+            walk_classify(walk, node, true);
+        } else {
+            node->error = walk_strdup(walk, fxp_error());
+        }
+        break;
+      }
+
+      case WALK_OPENDIR:
+        node->dh = fxp_opendir_recv(pktin, rreq);
+        if (node->dh) {
+            node->opened = true;
+            node->op = WALK_READDIR;
+            walk_enqueue(&walk->reads, node);
+        } else {
+            node->error = walk_strdup(walk, fxp_error());
+            walk->nhandles--;
+            walk_dir_done(walk, node);
+        }
+        break;
+
+      case WALK_READDIR: {
+        struct fxp_names *names = fxp_readdir_recv(pktin, rreq);
+
+        if (names && names->nnames > 0) {
+            for (size_t i = 0; i < names->nnames; i++) {
+                const char *fname = names->names[i].filename;
+                struct walk_node *child;
+                char *path;
+
+                if (!strcmp(fname, ".") || !strcmp(fname, ".."))
+                    continue;
+
+                path = dupcat(node->path, "/", fname);
+                child = walk_new_node(walk, path, &names->names[i].attrs);
+                child->name = walk_strdup(walk, fname);
+                child->rejected = (walk->vet && !walk->vet(fname));
+                sfree(path);
+
+                child->sibling = node->children;
+                node->children = child;
+                node->nchildren++;
+            }
+        } else {
+            if (!names && fxp_error_type() != SSH_FX_EOF)
+                node->error = walk_strdup(walk, fxp_error());
+            node->op = WALK_CLOSE;
+        }
+        if (names)
+            fxp_free_names(names);
+        walk_enqueue(&walk->reads, node);
+        break;
+      }
+
+      case WALK_CLOSE:
+        fxp_close_recv(pktin, rreq);
+        walk->nhandles--;
+        walk_dir_done(walk, node);
+        break;
+    }
+
+    return 1;
+}
+
+bool fxp_walk_done(struct fxp_walk *walk)
+{
+    return walk->nreqs == 0 && !walk->reads.head && !walk->stats.head &&
+        !walk->opens.head;
+}
+
+static size_t walk_flatten(struct fxp_walk *walk, struct walk_node *node,
+                           size_t i)
+{
+    struct fxp_walk_entry *e = &walk->entries[i];
+
+    e->path = node->path;
+    e->name = node->name;
+    e->attrs = node->attrs;
+    e->is_dir = node->is_dir;
+    e->opened = node->opened;
+    e->rejected = node->rejected;
+    e->error = node->error;
+
+    i++;
+    for (size_t k = 0; k < node->nchildren; k++)
+        i = walk_flatten(walk, node->sorted[k], i);
+    e->end = i;
+    return i;
+}
+
+const struct fxp_walk_entry *fxp_walk_entries(struct fxp_walk *walk,
+                                              size_t *nentries)
+{
+    assert(fxp_walk_done(walk));
+    if (!walk->entries) {
+        walk->entries = snewn(walk->nnodes, struct fxp_walk_entry);
+        walk_flatten(walk, walk->root, 0);
+    }
+    *nentries = walk->entries[0].end;
+    return walk->entries;
+}
+
+void fxp_walk_cleanup(struct fxp_walk *walk)
+{
+    arena_free(walk->arena);
+    sfree(walk->entries);
+    sfree(walk);
+}
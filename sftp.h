@@ -55,8 +55,58 @@
 
 #define SFTP_PROTO_VERSION 3
 
+/*
+ * Data length per FXP_WRITE. Every server should accept writes of
+ * 32K (it's what the drafts require and what OpenSSH sends); larger
+ * ones we only send to a server that has told us it can take them.
+ * SFTP_MAX_WRITE_LEN leaves 1K of a 256K SFTP packet for the rest
+ * of the request, as OpenSSH's server does.
+ */
+#define SFTP_DEFAULT_WRITE_LEN 32768
+#define SFTP_MAX_WRITE_LEN (255 * 1024)
+
 #define PERMS_DIRECTORY   040000
 
+/*
+ * Block signatures, for delta transfers using our
+ * block-signatures@putty.projects.tartarus.org extension. Each block
+ * of a file is described by a 32-bit rolling checksum in the style
+ * of rsync's, followed by the first SFTP_SIG_STRONG_LEN bytes of its
+ * SHA-256. The low and high halves of the rolling checksum are the
+ * plain and weighted sums of the bytes, each mod 2^16, so that
+ * sftp_rolling_checksum_roll can slide it along a byte at a time.
+ */
+#define SFTP_SIG_STRONG_LEN 16
+#define SFTP_SIG_LEN (4 + SFTP_SIG_STRONG_LEN)
+uint32_t sftp_rolling_checksum(ptrlen data);
+void sftp_strong_checksum(ptrlen data, unsigned char *out);
+static inline uint32_t sftp_rolling_checksum_roll(
+    uint32_t sum, size_t blocklen, unsigned char out, unsigned char in)
+{
+    uint32_t a = (sum - out + in) & 0xFFFF;
+    uint32_t b = ((sum >> 16) - (uint32_t)blocklen * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+/*
+ * Per-request compression of file data, for our compressed-read and
+ * compressed-write extensions (both @putty.projects.tartarus.org).
+ * Each block of data is compressed on its own, so that requests can
+ * be answered in any order, and is sent as it was if it doesn't look
+ * worth compressing or doesn't get any smaller.
+ *
+ * sftp_compress_block appends the data to send to 'out', and returns
+ * the method used. sftp_decompress_block appends the original data
+ * to 'out', returning false if it doesn't decode to exactly rawlen
+ * bytes.
+ */
+#define SFTP_COMPRESS_NONE 0
+#define SFTP_COMPRESS_ZLIB 1
+bool sftp_block_compressible(ptrlen data);
+unsigned sftp_compress_block(ptrlen data, strbuf *out);
+bool sftp_decompress_block(unsigned method, ptrlen payload, size_t rawlen,
+                           strbuf *out);
+
 /*
  * External references. The sftp client module sftp.c expects to be
  * able to get at these functions.
@@ -75,7 +125,27 @@ size_t sftp_sendbuffer(void);
 bool sftp_recvdata(char *data, size_t len);
 
 /*
- * Free sftp_requests
+ * Alternative transports for the client code. A front end running
+ * further SFTP sessions over extra channels (for striped transfers)
+ * provides an SftpStream for each, and selects it with
+ * sftp_select_stream while it sends requests and receives replies
+ * on that session. Selecting NULL goes back to the three functions
+ * above.
+ */
+typedef struct SftpStream SftpStream;
+struct SftpStreamVtable {
+    bool (*senddata)(SftpStream *stream, const char *data, size_t len);
+    size_t (*sendbuffer)(SftpStream *stream);
+    bool (*recvdata)(SftpStream *stream, char *data, size_t len);
+};
+struct SftpStream {
+    const struct SftpStreamVtable *vt;
+};
+void sftp_select_stream(SftpStream *stream);
+
+/*
+ * Free the requests still waiting in the request slot table, and the
+ * pool of spare request structures.
  */
 void sftp_cleanup_request(void);
 
@@ -167,6 +237,24 @@ int fxp_error_type(void);
  * Perform exchange of init/version packets. Return false on failure.
  */
 bool fxp_init(void);
+/* The same, for an extra stream, leaving the extensions and limits
+ * recorded from the main one alone. */
+bool fxp_init_stream(void);
+
+/*
+ * Find out whether the server announced a given extension in its
+ * FXP_VERSION packet, and if so, what extension data came with it.
+ */
+bool fxp_has_extension(const char *name);
+ptrlen fxp_extension_data(const char *name);
+
+/*
+ * The amount of data to send in each FXP_WRITE. This is
+ * SFTP_DEFAULT_WRITE_LEN unless the server told us something
+ * different via limits@openssh.com, in which case it's what the
+ * server said, capped at SFTP_MAX_WRITE_LEN.
+ */
+unsigned fxp_max_write_len(void);
 
 /*
  * Canonify a pathname. Concatenate the two given path elements
@@ -258,6 +346,91 @@ struct sftp_request *fxp_write_send(struct fxp_handle *handle,
                                     void *buffer, uint64_t offset, int len);
 bool fxp_write_recv(struct sftp_packet *pktin, struct sftp_request *req);
 
+/*
+ * Get SHA-256 hashes of consecutive blocks of an open file, via the
+ * check-file-handle extension (only worth trying if the server
+ * announced it). A zero blocksize asks for one hash of the whole
+ * range. fxp_check_file_recv appends the 32-byte hashes to 'hashes'
+ * and returns how many there were, which is fewer than requested if
+ * the file ended early, or -1 on error.
+ */
+struct sftp_request *fxp_check_file_send(struct fxp_handle *handle,
+                                         uint64_t offset, uint64_t len,
+                                         unsigned blocksize);
+int fxp_check_file_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                        strbuf *hashes);
+
+/*
+ * Get the block signatures of part of an open file (see
+ * SFTP_SIG_LEN above), if the server supports
+ * block-signatures@putty.projects.tartarus.org. As with check-file,
+ * the recv function appends the signatures to 'sigs' and returns
+ * how many there were, or -1 on error.
+ */
+struct sftp_request *fxp_block_sigs_send(struct fxp_handle *handle,
+                                         uint64_t offset, uint64_t len,
+                                         unsigned blocksize);
+int fxp_block_sigs_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                        strbuf *sigs);
+
+/*
+ * Copy part of one open file into another on the server, with the
+ * copy-data extension.
+ */
+struct sftp_request *fxp_copy_data_send(struct fxp_handle *src,
+                                        uint64_t srcoffset, uint64_t len,
+                                        struct fxp_handle *dst,
+                                        uint64_t dstoffset);
+bool fxp_copy_data_recv(struct sftp_packet *pktin, struct sftp_request *req);
+
+/*
+ * Rename a file over the top of any existing one, with the
+ * posix-rename@openssh.com extension. Use fxp_rename_recv for the
+ * reply.
+ */
+struct sftp_request *fxp_posix_rename_send(const char *srcfname,
+                                           const char *dstfname);
+
+/*
+ * Remove, rename and set the attributes of many files in one request,
+ * with our batch@putty.projects.tartarus.org extension. Queue up the
+ * operations in an fxp_batch, then send it. If fxp_batch_recv returns
+ * true, fxp_batch_result then says whether each operation worked,
+ * setting the error state to its outcome as the ordinary recv
+ * functions would. fxp_batch_clear empties the batch for reuse.
+ */
+struct fxp_batch;
+struct fxp_batch *fxp_batch_new(void);
+void fxp_batch_remove(struct fxp_batch *batch, const char *fname);
+void fxp_batch_rmdir(struct fxp_batch *batch, const char *path);
+void fxp_batch_rename(struct fxp_batch *batch, const char *srcfname,
+                      const char *dstfname);
+void fxp_batch_setstat(struct fxp_batch *batch, const char *fname,
+                       struct fxp_attrs attrs);
+size_t fxp_batch_count(struct fxp_batch *batch);
+size_t fxp_batch_size(struct fxp_batch *batch);  /* in bytes */
+struct sftp_request *fxp_batch_send(struct fxp_batch *batch);
+bool fxp_batch_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                    struct fxp_batch *batch);
+bool fxp_batch_result(struct fxp_batch *batch, size_t i);
+void fxp_batch_clear(struct fxp_batch *batch);
+void fxp_batch_free(struct fxp_batch *batch);
+
+/*
+ * Read and write like FXP_READ and FXP_WRITE, but with the file data
+ * compressed (see sftp_compress_block), if the server supports our
+ * compressed-read and compressed-write extensions. Reads are worth
+ * making larger than usual, since the replies will be smaller.
+ */
+#define SFTP_COMPRESSED_READ_LEN 131072
+struct sftp_request *fxp_read_compressed_send(struct fxp_handle *handle,
+                                              uint64_t offset, int len);
+int fxp_read_compressed_recv(struct sftp_packet *pktin,
+                             struct sftp_request *req, char *buffer, int len);
+struct sftp_request *fxp_write_compressed_send(
+    struct fxp_handle *handle, uint64_t offset, unsigned method,
+    int rawlen, ptrlen payload);
+
 /*
  * Read from a directory.
  */
@@ -291,6 +464,13 @@ void sftp_register(struct sftp_request *req);
 struct sftp_request *sftp_find_request(struct sftp_packet *pktin);
 struct sftp_packet *sftp_recv(void);
 
+/*
+ * Free a request without handling a reply to it: either one we've
+ * given up waiting for, or one sftp_find_request returned that
+ * wasn't the one we wanted.
+ */
+void sftp_abandon_request(struct sftp_request *req);
+
 /*
  * A wrapper to go round fxp_read_* and fxp_write_*, which manages
  * the queueing of multiple read/write requests.
@@ -299,19 +479,65 @@ struct sftp_packet *sftp_recv(void);
 struct fxp_xfer;
 
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64_t offset);
+/* Download only the range [offset,end) of the file. */
+struct fxp_xfer *xfer_download_init_range(
+    struct fxp_handle *fh, uint64_t offset, uint64_t end);
 void xfer_download_queue(struct fxp_xfer *xfer);
 int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 bool xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len);
+/* Make further reads use compressed-read (see above). */
+void xfer_set_compressed(struct fxp_xfer *xfer);
 
 struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64_t offset);
 bool xfer_upload_ready(struct fxp_xfer *xfer);
 void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len);
+/* Upload data that has already been through sftp_compress_block. */
+void xfer_upload_compressed(struct fxp_xfer *xfer, unsigned method,
+                            ptrlen payload, int rawlen);
 int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 
 bool xfer_done(struct fxp_xfer *xfer);
 void xfer_set_error(struct fxp_xfer *xfer);
 void xfer_cleanup(struct fxp_xfer *xfer);
 
+/*
+ * Walk a remote directory tree, with many directory reads in flight
+ * at once, and return its whole contents as a manifest. Driven in the
+ * same way as an fxp_xfer: queue, feed it packets until done.
+ *
+ * The manifest lists the tree in pre-order, starting with the root
+ * itself as entry 0, with each directory's contents sorted by name.
+ * The entries inside directory i are those from i+1 to entries[i].end,
+ * and the immediate children can be visited by starting at i+1 and
+ * stepping from each entry j to entries[j].end.
+ *
+ * Names which fail the 'vet' callback appear in the manifest with
+ * 'rejected' set, and are neither stat-ed nor descended into.
+ */
+struct fxp_walk;
+
+struct fxp_walk_entry {
+    const char *path;                  /* full remote path */
+    const char *name;                  /* final path component */
+    struct fxp_attrs attrs;
+    bool is_dir;                       /* contents follow this entry */
+    bool opened;                       /* for a dir, whether OPENDIR worked */
+    bool rejected;
+    const char *error;                 /* couldn't list dir or stat entry */
+    size_t end;
+};
+
+struct fxp_walk *fxp_walk_init(const char *root,
+                               const struct fxp_attrs *attrs,
+                               bool (*vet)(const char *name));
+void fxp_walk_queue(struct fxp_walk *walk);
+int fxp_walk_gotpkt(struct fxp_walk *walk, struct sftp_packet *pktin);
+bool fxp_walk_done(struct fxp_walk *walk);
+/* Only valid once fxp_walk_done; the manifest is freed by cleanup. */
+const struct fxp_walk_entry *fxp_walk_entries(struct fxp_walk *walk,
+                                              size_t *nentries);
+void fxp_walk_cleanup(struct fxp_walk *walk);
+
 /*
  * Vtable for the platform-specific filesystem implementation that
  * answers requests in an SFTP server.
@@ -387,6 +613,15 @@ struct SftpServerVtable {
      * then fxp_reply_full_name that many times */
     void (*readdir)(SftpServer *srv, SftpReplyBuilder *reply, ptrlen handle,
                     int max_entries, bool omit_longname);
+
+    /* Copy up to 'length' bytes from one open file to another,
+     * stopping early at end of file. The caller has checked that the
+     * ranges don't overlap if both handles are the same, but not
+     * whether two different handles refer to the same file. Should
+     * call fxp_reply_error or fxp_reply_ok */
+    void (*copy_data)(SftpServer *srv, SftpReplyBuilder *reply,
+                      ptrlen srchandle, uint64_t srcoffset, uint64_t length,
+                      ptrlen dsthandle, uint64_t dstoffset);
 };
 
 static inline SftpServer *sftpsrv_new(const SftpServerVtable *vt)
@@ -441,6 +676,11 @@ static inline void sftpsrv_readdir(
     SftpServer *srv, SftpReplyBuilder *reply, ptrlen handle,
     int max_entries, bool omit_longname)
 { srv->vt->readdir(srv, reply, handle, max_entries, omit_longname); }
+static inline void sftpsrv_copy_data(
+    SftpServer *srv, SftpReplyBuilder *reply, ptrlen srchandle,
+    uint64_t srcoffset, uint64_t length, ptrlen dsthandle, uint64_t dstoffset)
+{ srv->vt->copy_data(srv, reply, srchandle, srcoffset, length,
+                     dsthandle, dstoffset); }
 
 typedef struct SftpReplyBuilderVtable SftpReplyBuilderVtable;
 struct SftpReplyBuilder {
@@ -9,6 +9,7 @@
 #include <limits.h>
 
 #include "misc.h"
+#include "ssh.h"
 #include "sftp.h"
 
 static void sftp_pkt_BinarySink_write(
@@ -137,3 +138,139 @@ bool sftp_recv_finish(struct sftp_packet *pkt)
     pkt->type = get_byte(pkt);
     return !get_err(pkt);
 }
+
+uint32_t sftp_rolling_checksum(ptrlen data)
+{
+    const unsigned char *p = (const unsigned char *)data.ptr;
+    uint32_t a = 0, b = 0;
+
+    for (size_t i = 0; i < data.len; i++) {
+        a += p[i];
+        b += a;
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+void sftp_strong_checksum(ptrlen data, unsigned char *out)
+{
+    unsigned char hash[32];
+    hash_simple(&ssh_sha256, data, hash);
+    memcpy(out, hash, SFTP_SIG_STRONG_LEN);
+    smemclr(hash, sizeof(hash));
+}
+
+/*
+ * Guess whether a block of data will compress, by looking at how
+ * evenly its byte values are spread. Data that is already compressed
+ * or encrypted uses all 256 about equally, so the chance of two
+ * sampled bytes being the same is close to 1/256; text and most
+ * other uncompressed data are far more lopsided.
+ */
+#define PROBE_RUNS 64
+#define PROBE_RUNLEN 64
+
+bool sftp_block_compressible(ptrlen data)
+{
+    const unsigned char *p = (const unsigned char *)data.ptr;
+    unsigned counts[256];
+    uint64_t n = 0, sumsq = 0;
+
+    memset(counts, 0, sizeof(counts));
+    if (data.len <= PROBE_RUNS * PROBE_RUNLEN) {
+        for (size_t i = 0; i < data.len; i++)
+            counts[p[i]]++;
+        n = data.len;
+    } else {
+        size_t step = data.len / PROBE_RUNS;
+        for (size_t r = 0; r < PROBE_RUNS; r++)
+            for (size_t i = 0; i < PROBE_RUNLEN; i++)
+                counts[p[r * step + i]]++;
+        n = PROBE_RUNS * PROBE_RUNLEN;
+    }
+
+    for (unsigned i = 0; i < 256; i++)
+        sumsq += (uint64_t)counts[i] * counts[i];
+
+    /* Compressible if the chance of a repeat is more than 1/200. */
+    return sumsq * 200 > n * n;
+}
+
+unsigned sftp_compress_block(ptrlen data, strbuf *out)
+{
+    if (data.len > 0 && data.len <= INT_MAX &&
+        sftp_block_compressible(data)) {
+        ssh_compressor *comp = ssh_compressor_new(&ssh_zlib);
+        unsigned char *zdata;
+        int zlen;
+
+        ssh_compressor_compress(comp, data.ptr, data.len, &zdata, &zlen, 0);
+        ssh_compressor_free(comp);
+
+        /* Only worth it if it saved at least a sixteenth. */
+        if ((size_t)zlen < data.len - data.len / 16) {
+            put_data(out, zdata, zlen);
+            sfree(zdata);
+            return SFTP_COMPRESS_ZLIB;
+        }
+        sfree(zdata);
+    }
+
+    put_datapl(out, data);
+    return SFTP_COMPRESS_NONE;
+}
+
+bool sftp_decompress_block(unsigned method, ptrlen payload, size_t rawlen,
+                           strbuf *out)
+{
+    switch (method) {
+      case SFTP_COMPRESS_NONE:
+        if (payload.len != rawlen)
+            return false;
+        put_datapl(out, payload);
+        return true;
+
+      case SFTP_COMPRESS_ZLIB: {
+        ssh_decompressor *decomp;
+        size_t start = out->len, pos = 0;
+        bool ok = true;
+
+        /*
+         * Feed the decompressor a little at a time, so that we can
+         * give up as soon as the output is bigger than it should be.
+         * Deflate can expand each input byte about a thousandfold,
+         * and we don't want to find that out by inflating a whole
+         * packet's worth first.
+         */
+        decomp = ssh_decompressor_new(&ssh_zlib);
+        while (ok && pos < payload.len) {
+            size_t chunk = payload.len - pos;
+            unsigned char *data;
+            int len;
+
+            if (chunk > 256)
+                chunk = 256;
+            ok = ssh_decompressor_decompress(
+                decomp, (const unsigned char *)payload.ptr + pos, chunk,
+                &data, &len);
+            if (!ok)
+                break;
+            pos += chunk;
+            if ((size_t)len > rawlen - (out->len - start))
+                ok = false;
+            else
+                put_data(out, data, len);
+            sfree(data);
+        }
+        ssh_decompressor_free(decomp);
+
+        if (ok && out->len - start != rawlen)
+            ok = false;
+        if (!ok)
+            strbuf_shrink_to(out, start);
+        return ok;
+      }
+
+      default:
+        return false;
+    }
+}
@@ -10,6 +10,61 @@
 #include "ssh.h"
 #include "sftp.h"
 
+/*
+ * The largest SFTP packet we tell clients (via limits@openssh.com)
+ * that we'll accept.
+ */
+#define SFTP_SERVER_MAX_PACKET 262144
+
+/*
+ * Some extended requests (check-file-handle, our own block signatures
+ * and batches) are implemented here, on top of the SftpServer's
+ * ordinary methods, by calling those with a reply builder of our own
+ * that just catches the results. We read files in pieces of this
+ * size.
+ */
+#define INTERNAL_READ_SIZE 65536
+
+/* Most hashes we send back in one check-file-handle reply */
+#define CHECK_FILE_MAX_HASHES 4096
+
+/* Limits on a block-signatures request */
+#define SIGNATURE_MAX_BLOCKSIZE (1024 * 1024)
+#define SIGNATURE_MAX_BLOCKS 8192
+
+/* Most operations we accept in one batch request */
+#define BATCH_MAX_OPS 4096
+
+typedef struct InternalReceiver {
+    strbuf *data;
+    bool ok, eof, err;
+    unsigned code;
+    char *errmsg;
+
+    SftpReplyBuilder srb;
+} InternalReceiver;
+
+static void sftp_check_file(
+    SftpServer *srv, SftpReplyBuilder *rb, struct sftp_packet *reply,
+    ptrlen handle, ptrlen algorithms, uint64_t offset, uint64_t length,
+    unsigned blocksize);
+static void sftp_block_signatures(
+    SftpServer *srv, SftpReplyBuilder *rb, struct sftp_packet *reply,
+    ptrlen handle, uint64_t offset, uint64_t length, unsigned blocksize);
+static void sftp_copy_data(
+    SftpServer *srv, SftpReplyBuilder *rb, ptrlen srchandle,
+    uint64_t srcoffset, uint64_t length, ptrlen dsthandle,
+    uint64_t dstoffset);
+static void sftp_compressed_read(
+    SftpServer *srv, SftpReplyBuilder *rb, struct sftp_packet *reply,
+    ptrlen handle, uint64_t offset, unsigned length);
+static void sftp_compressed_write(
+    SftpServer *srv, SftpReplyBuilder *rb, ptrlen handle, uint64_t offset,
+    unsigned method, size_t rawlen, ptrlen payload);
+static void sftp_batch(
+    SftpServer *srv, SftpReplyBuilder *rb, struct sftp_packet *reply,
+    ptrlen ops);
+
 struct sftp_packet *sftp_handle_request(
     SftpServer *srv, struct sftp_packet *req)
 {
@@ -35,6 +90,24 @@ struct sftp_packet *sftp_handle_request(
          * input packet.
          */
         put_uint32(reply, SFTP_PROTO_VERSION);
+
+        /* Extensions we support, as name / data pairs */
+        put_stringz(reply, "limits@openssh.com");
+        put_stringz(reply, "1");
+        put_stringz(reply, "check-file-handle");
+        put_stringz(reply, "sha256");
+        put_stringz(reply, "copy-data");
+        put_stringz(reply, "1");
+        put_stringz(reply, "block-signatures@putty.projects.tartarus.org");
+        put_stringz(reply, "1");
+        put_stringz(reply, "compressed-read@putty.projects.tartarus.org");
+        put_stringz(reply, "zlib");
+        put_stringz(reply, "compressed-write@putty.projects.tartarus.org");
+        put_stringz(reply, "zlib");
+        put_stringz(reply, "batch@putty.projects.tartarus.org");
+        put_stringz(reply, "1");
+        put_stringz(reply, "posix-rename@openssh.com");
+        put_stringz(reply, "1");
         return reply;
     }
 
@@ -184,6 +257,94 @@ struct sftp_packet *sftp_handle_request(
         sftpsrv_write(srv, rb, handle, offset, data);
         break;
 
+      case SSH_FXP_EXTENDED:
+        path = get_string(req);        /* the extension name */
+        if (get_err(req))
+            goto decode_error;
+        if (ptrlen_eq_string(path, "limits@openssh.com")) {
+            reply->type = SSH_FXP_EXTENDED_REPLY;
+            put_uint64(reply, SFTP_SERVER_MAX_PACKET);
+            put_uint64(reply, SFTP_SERVER_MAX_PACKET - 1024); /* read */
+            put_uint64(reply, SFTP_SERVER_MAX_PACKET - 1024); /* write */
+            put_uint64(reply, 0);      /* no limit on open handles */
+        } else if (ptrlen_eq_string(path, "posix-rename@openssh.com")) {
+            /* Our rename method already replaces an existing target */
+            path = get_string(req);
+            dstpath = get_string(req);
+            if (get_err(req))
+                goto decode_error;
+            sftpsrv_rename(srv, rb, path, dstpath);
+        } else if (ptrlen_eq_string(path, "check-file-handle")) {
+            ptrlen algorithms;
+            uint64_t checklen;
+            unsigned blocksize;
+
+            handle = get_string(req);
+            algorithms = get_string(req);
+            offset = get_uint64(req);
+            checklen = get_uint64(req);
+            blocksize = get_uint32(req);
+            if (get_err(req))
+                goto decode_error;
+            sftp_check_file(srv, rb, reply, handle, algorithms,
+                            offset, checklen, blocksize);
+        } else if (ptrlen_eq_string(
+                       path, "block-signatures@putty.projects.tartarus.org")) {
+            uint64_t siglen;
+            unsigned blocksize;
+
+            handle = get_string(req);
+            offset = get_uint64(req);
+            siglen = get_uint64(req);
+            blocksize = get_uint32(req);
+            if (get_err(req))
+                goto decode_error;
+            sftp_block_signatures(srv, rb, reply, handle,
+                                  offset, siglen, blocksize);
+        } else if (ptrlen_eq_string(path, "copy-data")) {
+            ptrlen dsthandle;
+            uint64_t copylen, dstoffset;
+
+            handle = get_string(req);
+            offset = get_uint64(req);
+            copylen = get_uint64(req);
+            dsthandle = get_string(req);
+            dstoffset = get_uint64(req);
+            if (get_err(req))
+                goto decode_error;
+            sftp_copy_data(srv, rb, handle, offset, copylen,
+                           dsthandle, dstoffset);
+        } else if (ptrlen_eq_string(
+                       path, "compressed-read@putty.projects.tartarus.org")) {
+            handle = get_string(req);
+            offset = get_uint64(req);
+            length = get_uint32(req);
+            if (get_err(req))
+                goto decode_error;
+            sftp_compressed_read(srv, rb, reply, handle, offset, length);
+        } else if (ptrlen_eq_string(
+                       path, "compressed-write@putty.projects.tartarus.org")) {
+            unsigned method;
+            size_t rawlen;
+
+            handle = get_string(req);
+            offset = get_uint64(req);
+            method = get_byte(req);
+            rawlen = get_uint32(req);
+            data = get_string(req);
+            if (get_err(req))
+                goto decode_error;
+            sftp_compressed_write(srv, rb, handle, offset,
+                                  method, rawlen, data);
+        } else if (ptrlen_eq_string(
+                       path, "batch@putty.projects.tartarus.org")) {
+            sftp_batch(srv, rb, reply, get_data(req, get_avail(req)));
+        } else {
+            fxp_reply_error(rb, SSH_FX_OP_UNSUPPORTED,
+                            "Unrecognised extended request");
+        }
+        break;
+
       default:
         if (get_err(req))
             goto decode_error;
@@ -198,6 +359,454 @@ struct sftp_packet *sftp_handle_request(
     return reply;
 }
 
+static void internal_reply_ok(SftpReplyBuilder *srb)
+{
+    InternalReceiver *ir = container_of(srb, InternalReceiver, srb);
+    ir->ok = true;
+}
+
+static void internal_reply_error(
+    SftpReplyBuilder *srb, unsigned code, const char *msg)
+{
+    InternalReceiver *ir = container_of(srb, InternalReceiver, srb);
+    if (code == SSH_FX_EOF) {
+        ir->eof = true;
+    } else {
+        ir->err = true;
+        ir->code = code;
+        sfree(ir->errmsg);
+        ir->errmsg = dupstr(msg);
+    }
+}
+
+static void internal_reply_simple_name(SftpReplyBuilder *srb, ptrlen name)
+{
+    unreachable("read and write should not reply with a name");
+}
+
+static void internal_reply_name_count(SftpReplyBuilder *srb, unsigned count)
+{
+    unreachable("read and write should not reply with names");
+}
+
+static void internal_reply_full_name(
+    SftpReplyBuilder *srb, ptrlen name, ptrlen longname,
+    struct fxp_attrs attrs)
+{
+    unreachable("read and write should not reply with names");
+}
+
+static void internal_reply_handle(SftpReplyBuilder *srb, ptrlen handle)
+{
+    unreachable("read and write should not reply with a handle");
+}
+
+static void internal_reply_data(SftpReplyBuilder *srb, ptrlen data)
+{
+    InternalReceiver *ir = container_of(srb, InternalReceiver, srb);
+    put_datapl(ir->data, data);
+}
+
+static void internal_reply_attrs(
+    SftpReplyBuilder *srb, struct fxp_attrs attrs)
+{
+    unreachable("read and write should not reply with attributes");
+}
+
+static const struct SftpReplyBuilderVtable InternalReceiver_vt = {
+    internal_reply_ok,
+    internal_reply_error,
+    internal_reply_simple_name,
+    internal_reply_name_count,
+    internal_reply_full_name,
+    internal_reply_handle,
+    internal_reply_data,
+    internal_reply_attrs,
+};
+
+/*
+ * If the SftpServer reported an error, pass it on to the client and
+ * return true.
+ */
+static bool internal_failed(InternalReceiver *ir, SftpReplyBuilder *rb)
+{
+    if (!ir->err)
+        return false;
+    fxp_reply_error(rb, ir->code, ir->errmsg);
+    sfree(ir->errmsg);
+    ir->errmsg = NULL;
+    return true;
+}
+
+/*
+ * Read up to 'len' bytes at 'offset', appending them to 'out'. Stops
+ * short only at end of file. On error, replies to the client and
+ * returns false.
+ */
+static bool internal_read(SftpServer *srv, SftpReplyBuilder *rb,
+                          ptrlen handle, uint64_t offset, size_t len,
+                          strbuf *out)
+{
+    InternalReceiver ir;
+
+    memset(&ir, 0, sizeof(ir));
+    ir.srb.vt = &InternalReceiver_vt;
+    ir.data = out;
+
+    while (len > 0 && !ir.eof) {
+        size_t before = out->len, got;
+        unsigned want = (len < INTERNAL_READ_SIZE ? len : INTERNAL_READ_SIZE);
+
+        sftpsrv_read(srv, &ir.srb, handle, offset, want);
+        if (internal_failed(&ir, rb))
+            return false;
+        got = out->len - before;
+        if (got < want)
+            ir.eof = true;
+        offset += got;
+        len -= got;
+    }
+    return true;
+}
+
+static bool internal_write(SftpServer *srv, SftpReplyBuilder *rb,
+                           ptrlen handle, uint64_t offset, ptrlen data)
+{
+    InternalReceiver ir;
+
+    memset(&ir, 0, sizeof(ir));
+    ir.srb.vt = &InternalReceiver_vt;
+
+    sftpsrv_write(srv, &ir.srb, handle, offset, data);
+    if (internal_failed(&ir, rb))
+        return false;
+    if (!ir.ok) {
+        fxp_reply_error(rb, SSH_FX_FAILURE, "Write did not complete");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Implement check-file-handle, from the draft SFTP extensions: hash
+ * consecutive blocks of a file (or the whole range, if blocksize is
+ * zero) and send all the hashes back in one reply. A zero length
+ * means to carry on to the end of the file. We only do SHA-256.
+ */
+static void sftp_check_file(
+    SftpServer *srv, SftpReplyBuilder *rb, struct sftp_packet *reply,
+    ptrlen handle, ptrlen algorithms, uint64_t offset, uint64_t length,
+    unsigned blocksize)
+{
+    strbuf *hashes, *sb;
+    uint64_t end;
+    bool found = false, eof = false;
+
+    while (algorithms.len) {
+        ptrlen alg = ptrlen_get_word(&algorithms, ",");
+        if (ptrlen_eq_string(alg, "sha256"))
+            found = true;
+    }
+    if (!found) {
+        fxp_reply_error(rb, SSH_FX_OP_UNSUPPORTED,
+                        "No supported hash algorithm requested");
+        return;
+    }
+    if (blocksize != 0 && blocksize < 256) {
+        fxp_reply_error(rb, SSH_FX_FAILURE, "Block size too small");
+        return;
+    }
+
+    end = (length == 0 || length > UINT64_MAX - offset ?
+           UINT64_MAX : offset + length);
+
+    hashes = strbuf_new();
+    sb = strbuf_new();
+
+    while (offset < end && !eof &&
+           hashes->len < CHECK_FILE_MAX_HASHES * 32) {
+        uint64_t blockend = (blocksize == 0 || end - offset < blocksize ?
+                             end : offset + blocksize);
+        uint64_t blockstart = offset;
+        ssh_hash *h = ssh_hash_new(&ssh_sha256);
+        unsigned char digest[32];
+
+        while (offset < blockend && !eof) {
+            size_t want = INTERNAL_READ_SIZE;
+            if (want > blockend - offset)
+                want = blockend - offset;
+
+            strbuf_clear(sb);
+            if (!internal_read(srv, rb, handle, offset, want, sb)) {
+                ssh_hash_free(h);
+                strbuf_free(hashes);
+                strbuf_free(sb);
+                return;
+            }
+            put_datapl(h, ptrlen_from_strbuf(sb));
+            offset += sb->len;
+            if (sb->len < want)
+                eof = true;
+        }
+
+        if (offset == blockstart) {
+            /* Nothing at all in this block, so no hash for it. */
+            ssh_hash_free(h);
+            break;
+        }
+        ssh_hash_final(h, digest);
+        put_data(hashes, digest, 32);
+        smemclr(digest, sizeof(digest));
+    }
+
+    reply->type = SSH_FXP_EXTENDED_REPLY;
+    put_stringz(reply, "sha256");
+    put_datapl(reply, ptrlen_from_strbuf(hashes));
+    strbuf_free(hashes);
+    strbuf_free(sb);
+}
+
+/*
+ * Implement block-signatures@putty.projects.tartarus.org: the
+ * rolling and strong checksums of consecutive blocks of a file, for
+ * the client to work out a delta against. The reply is cut short at
+ * end of file, and at SIGNATURE_MAX_BLOCKS.
+ */
+static void sftp_block_signatures(
+    SftpServer *srv, SftpReplyBuilder *rb, struct sftp_packet *reply,
+    ptrlen handle, uint64_t offset, uint64_t length, unsigned blocksize)
+{
+    strbuf *sigs, *sb;
+    uint64_t end;
+    size_t nblocks = 0;
+
+    if (blocksize < 256 || blocksize > SIGNATURE_MAX_BLOCKSIZE) {
+        fxp_reply_error(rb, SSH_FX_FAILURE, "Unsupported block size");
+        return;
+    }
+
+    end = (length == 0 || length > UINT64_MAX - offset ?
+           UINT64_MAX : offset + length);
+
+    sigs = strbuf_new();
+    sb = strbuf_new();
+
+    while (offset < end && nblocks < SIGNATURE_MAX_BLOCKS) {
+        size_t want = (end - offset < blocksize ? end - offset : blocksize);
+        unsigned char strong[SFTP_SIG_STRONG_LEN];
+
+        strbuf_clear(sb);
+        if (!internal_read(srv, rb, handle, offset, want, sb)) {
+            strbuf_free(sigs);
+            strbuf_free(sb);
+            return;
+        }
+        if (sb->len == 0)
+            break;
+
+        put_uint32(sigs, sftp_rolling_checksum(ptrlen_from_strbuf(sb)));
+        sftp_strong_checksum(ptrlen_from_strbuf(sb), strong);
+        put_data(sigs, strong, SFTP_SIG_STRONG_LEN);
+        nblocks++;
+
+        offset += sb->len;
+        if (sb->len < want)
+            break;
+    }
+
+    reply->type = SSH_FXP_EXTENDED_REPLY;
+    put_datapl(reply, ptrlen_from_strbuf(sigs));
+    strbuf_free(sigs);
+    strbuf_free(sb);
+}
+
+/*
+ * Implement copy-data, from the draft SFTP extensions: copy a range
+ * of one open file into another (or elsewhere in the same one, as
+ * long as the two ranges don't overlap). A zero length means to copy
+ * to the end of the source file.
+ */
+static void sftp_copy_data(
+    SftpServer *srv, SftpReplyBuilder *rb, ptrlen srchandle,
+    uint64_t srcoffset, uint64_t length, ptrlen dsthandle,
+    uint64_t dstoffset)
+{
+    if (length == 0 || length > UINT64_MAX - srcoffset)
+        length = UINT64_MAX - srcoffset;
+    if (length > UINT64_MAX - dstoffset)
+        length = UINT64_MAX - dstoffset;
+
+    if (ptrlen_eq_ptrlen(srchandle, dsthandle) &&
+        srcoffset < dstoffset + length && dstoffset < srcoffset + length) {
+        fxp_reply_error(rb, SSH_FX_FAILURE,
+                        "Source and destination ranges overlap");
+        return;
+    }
+
+    sftpsrv_copy_data(srv, rb, srchandle, srcoffset, length,
+                      dsthandle, dstoffset);
+}
+
+/*
+ * Implement compressed-read@putty.projects.tartarus.org, which is
+ * FXP_READ except that the data in the reply may be compressed. The
+ * reply gives the compression method and the original length ahead
+ * of the data.
+ */
+static void sftp_compressed_read(
+    SftpServer *srv, SftpReplyBuilder *rb, struct sftp_packet *reply,
+    ptrlen handle, uint64_t offset, unsigned length)
+{
+    strbuf *sb, *payload;
+    unsigned method;
+
+    /* Leave room for the reply to hold the data uncompressed. */
+    if (length > SFTP_SERVER_MAX_PACKET - 1024)
+        length = SFTP_SERVER_MAX_PACKET - 1024;
+
+    sb = strbuf_new();
+    if (!internal_read(srv, rb, handle, offset, length, sb)) {
+        strbuf_free(sb);
+        return;
+    }
+    if (sb->len == 0) {
+        strbuf_free(sb);
+        fxp_reply_error(rb, SSH_FX_EOF, "End of file");
+        return;
+    }
+
+    payload = strbuf_new();
+    method = sftp_compress_block(ptrlen_from_strbuf(sb), payload);
+    reply->type = SSH_FXP_EXTENDED_REPLY;
+    put_byte(reply, method);
+    put_uint32(reply, sb->len);
+    put_stringsb(reply, payload);
+    strbuf_free(sb);
+}
+
+/*
+ * Implement compressed-write@putty.projects.tartarus.org, the
+ * corresponding version of FXP_WRITE.
+ */
+static void sftp_compressed_write(
+    SftpServer *srv, SftpReplyBuilder *rb, ptrlen handle, uint64_t offset,
+    unsigned method, size_t rawlen, ptrlen payload)
+{
+    strbuf *sb;
+
+    /* A client has no reason to send more than a packet's worth. */
+    if (rawlen > SFTP_SERVER_MAX_PACKET) {
+        fxp_reply_error(rb, SSH_FX_FAILURE, "Write too large");
+        return;
+    }
+
+    sb = strbuf_new();
+    if (!sftp_decompress_block(method, payload, rawlen, sb)) {
+        strbuf_free(sb);
+        fxp_reply_error(rb, SSH_FX_BAD_MESSAGE,
+                        "Unable to decompress data");
+        return;
+    }
+    if (internal_write(srv, rb, handle, offset, ptrlen_from_strbuf(sb)))
+        fxp_reply_ok(rb);
+    strbuf_free(sb);
+}
+
+/*
+ * Decode one operation from a batch request (see below), and carry
+ * it out if rb is non-NULL. Returns false if it didn't decode.
+ */
+static bool sftp_batch_op(SftpServer *srv, BinarySource *src,
+                          SftpReplyBuilder *rb)
+{
+    unsigned type = get_byte(src);
+    ptrlen path = get_string(src), dstpath;
+    struct fxp_attrs attrs;
+
+    switch (type) {
+      case SSH_FXP_REMOVE:
+        if (get_err(src))
+            return false;
+        if (rb)
+            sftpsrv_remove(srv, rb, path);
+        return true;
+
+      case SSH_FXP_RMDIR:
+        if (get_err(src))
+            return false;
+        if (rb)
+            sftpsrv_rmdir(srv, rb, path);
+        return true;
+
+      case SSH_FXP_RENAME:
+        dstpath = get_string(src);
+        if (get_err(src))
+            return false;
+        if (rb)
+            sftpsrv_rename(srv, rb, path, dstpath);
+        return true;
+
+      case SSH_FXP_SETSTAT:
+        get_fxp_attrs(src, &attrs);
+        if (get_err(src))
+            return false;
+        if (rb)
+            sftpsrv_setstat(srv, rb, path, attrs);
+        return true;
+
+      default:
+        return false;
+    }
+}
+
+/*
+ * Implement batch@putty.projects.tartarus.org: a count followed by
+ * that many REMOVE, RMDIR, RENAME and SETSTAT requests, each given as
+ * its packet type byte and then the fields that would follow the
+ * request id. They're carried out in order, going on past any that
+ * fail, and the reply gives the status code of each one.
+ *
+ * The whole batch is decoded before any of it is done, so that a
+ * malformed request has no effect at all.
+ */
+static void sftp_batch(
+    SftpServer *srv, SftpReplyBuilder *rb, struct sftp_packet *reply,
+    ptrlen ops)
+{
+    BinarySource src[1];
+    unsigned count, i;
+
+    BinarySource_BARE_INIT_PL(src, ops);
+    count = get_uint32(src);
+    for (i = 0; i < count && !get_err(src); i++)
+        if (!sftp_batch_op(srv, src, NULL))
+            break;
+    if (i < count || get_err(src) || get_avail(src)) {
+        fxp_reply_error(rb, SSH_FX_BAD_MESSAGE, "Unable to decode batch");
+        return;
+    }
+    if (count > BATCH_MAX_OPS) {
+        fxp_reply_error(rb, SSH_FX_FAILURE, "Too many operations in batch");
+        return;
+    }
+
+    reply->type = SSH_FXP_EXTENDED_REPLY;
+    put_uint32(reply, count);
+
+    BinarySource_BARE_INIT_PL(src, ops);
+    get_uint32(src);
+    for (i = 0; i < count; i++) {
+        InternalReceiver ir;
+
+        memset(&ir, 0, sizeof(ir));
+        ir.srb.vt = &InternalReceiver_vt;
+        sftp_batch_op(srv, src, &ir.srb);
+        put_uint32(reply, ir.err ? ir.code : ir.ok ? SSH_FX_OK :
+                   SSH_FX_FAILURE);
+        sfree(ir.errmsg);
+    }
+}
+
 static void default_reply_ok(SftpReplyBuilder *reply)
 {
     DefaultSftpReplyBuilder *d =
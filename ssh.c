@@ -98,6 +98,8 @@ struct Ssh {
 
     PacketLogSettings pls;
     struct DataTransferStats stats;
+    SshStats rtstats;
+    unsigned long stats_timer;
 
     BinaryPacketProtocol *bpp;
 
@@ -145,15 +147,49 @@ struct Ssh {
 static void ssh_shutdown(Ssh *ssh);
 static void ssh_throttle_all(Ssh *ssh, bool enable, size_t bufsize);
 static void ssh_bpp_output_raw_data_callback(void *vctx);
+static void ssh_schedule_stats(Ssh *ssh);
 
 LogContext *ssh_get_logctx(Ssh *ssh)
 {
     return ssh->logctx;
 }
 
+static void ssh_stats_dump(Ssh *ssh)
+{
+    ssh_stats_log(&ssh->rtstats, ssh->logctx,
+                  ssh->bpp ? ssh->bpp->out_pq.pqb.total_size : 0,
+                  bufchain_size(&ssh->out_raw));
+}
+
+static void ssh_stats_timer(void *ctx, unsigned long now)
+{
+    Ssh *ssh = (Ssh *)ctx;
+
+    if (now == ssh->stats_timer && ssh->s &&
+        conf_get_int(ssh->conf, CONF_ssh_stats_interval) > 0) {
+        ssh_stats_dump(ssh);
+        ssh_schedule_stats(ssh);
+    }
+}
+
+/*
+ * (Re)start the periodic statistics dump, if one is configured. A
+ * timer already pending is made stale by overwriting stats_timer, or
+ * ignored once the interval has been configured to zero.
+ */
+static void ssh_schedule_stats(Ssh *ssh)
+{
+    int interval = conf_get_int(ssh->conf, CONF_ssh_stats_interval);
+
+    if (interval > 0)
+        ssh->stats_timer = schedule_timer(
+            interval * TICKSPERSEC, ssh_stats_timer, ssh);
+}
+
 static void ssh_connect_bpp(Ssh *ssh)
 {
     ssh->bpp->ssh = ssh;
+    ssh->bpp->rtstats = &ssh->rtstats;
     ssh->bpp->in_raw = &ssh->in_raw;
     ssh->bpp->out_raw = &ssh->out_raw;
     bufchain_set_callback(ssh->bpp->out_raw, &ssh->ic_out_raw);
@@ -770,8 +806,17 @@ static const char *connect_to_host(
         }
         ssh->fullhostname = dupstr(*realhost);   /* save in case of GSSAPI */
 
+        /*
+         * SSH has no use for TCP urgent data, so we don't ask for it
+         * inline: that way the socket is eligible for the Unix
+         * io_uring path, which can't find the urgent mark. The only
+         * difference this makes is to a server that sends urgent
+         * data, which no SSH implementation does: such a byte would
+         * now be left unread out of band rather than passed on in
+         * the stream, and the connection would fail its MAC check.
+         */
         ssh->s = new_connection(addr, *realhost, port,
-                                false, true, nodelay, keepalive,
+                                false, false, nodelay, keepalive,
                                 &ssh->plug, ssh->conf);
         if ((err = sk_socket_error(ssh->s)) != NULL) {
             ssh->s = NULL;
@@ -831,6 +876,7 @@ void ssh_throttle_conn(Ssh *ssh, int adjust)
 
     if (ssh->conn_throttle_count && !old_count) {
         frozen = true;
+        ssh->rtstats.conn_throttles++;
     } else if (!ssh->conn_throttle_count && old_count) {
         frozen = false;
     } else {
@@ -889,9 +935,13 @@ static const char *ssh_init(const BackendVtable *vt, Seat *seat,
     ssh->pls.actx = SSH2_PKTCTX_NOAUTH;
     bufchain_init(&ssh->in_raw);
     bufchain_init(&ssh->out_raw);
+    bufchain_set_max_granule(&ssh->in_raw, 65536);
+    bufchain_set_max_granule(&ssh->out_raw, 65536);
     bufchain_init(&ssh->user_input);
     ssh->ic_out_raw.fn = ssh_bpp_output_raw_data_callback;
     ssh->ic_out_raw.ctx = ssh;
+    ssh_stats_init(&ssh->rtstats);
+    ssh_schedule_stats(ssh);
 
     ssh->term_width = conf_get_int(ssh->conf, CONF_width);
     ssh->term_height = conf_get_int(ssh->conf, CONF_height);
@@ -948,6 +998,7 @@ static void ssh_free(Backend *be)
 
     sfree(ssh->deferred_abort_message);
 
+    expire_timer_context(ssh);
     delete_callbacks_for_context(ssh); /* likely to catch ic_out_raw */
 
     need_random_unref = ssh->need_random_unref;
@@ -969,9 +1020,15 @@ static void ssh_reconfig(Backend *be, Conf *conf)
 
     ssh_ppl_reconfigure(ssh->base_layer, conf);
 
+    bool restart_stats = conf_get_int(ssh->conf, CONF_ssh_stats_interval) !=
+        conf_get_int(conf, CONF_ssh_stats_interval);
+
     conf_free(ssh->conf);
     ssh->conf = conf_copy(conf);
     ssh_cache_conf_values(ssh);
+
+    if (restart_stats)
+        ssh_schedule_stats(ssh);
 }
 
 /*
@@ -1066,8 +1123,12 @@ static const SessionSpecial *ssh_get_specials(Backend *be)
     ctx->specials = NULL;
     ctx->nspecials = ctx->specials_size = 0;
 
-    if (ssh->base_layer)
+    if (ssh->base_layer) {
         ssh_ppl_get_specials(ssh->base_layer, ssh_add_special, ctx);
+        if (ctx->specials)
+            ssh_add_special(ctx, NULL, SS_SEP, 0);
+        ssh_add_special(ctx, "Show statistics in Event Log", SS_STATS, 0);
+    }
 
     if (ctx->specials) {
         /* If the list is non-empty, terminate it with a SS_EXITMENU. */
@@ -1086,7 +1147,9 @@ static void ssh_special(Backend *be, SessionSpecialCode code, int arg)
 {
     Ssh *ssh = container_of(be, Ssh, backend);
 
-    if (ssh->base_layer)
+    if (code == SS_STATS)
+        ssh_stats_dump(ssh);
+    else if (ssh->base_layer)
         ssh_ppl_special_cmd(ssh->base_layer, code, arg);
 }
 
@@ -1175,6 +1238,14 @@ extern bool ssh_fallback_cmd(Backend *be)
     return ssh->fallback_cmd;
 }
 
+SubsysChannel *ssh_subsystem_open(Backend *be, const char *subsystem)
+{
+    Ssh *ssh = container_of(be, Ssh, backend);
+    if (ssh->version != 2 || !ssh->cl)
+        return NULL;
+    return subsyschan_new(ssh->cl, subsystem);
+}
+
 void ssh_got_fallback_cmd(Ssh *ssh)
 {
     ssh->fallback_cmd = true;
@@ -605,6 +605,8 @@ mp_int *ssh_rsakex_decrypt(
  */
 const char *ssh_ecdhkex_curve_textname(const ssh_kex *kex);
 ecdh_key *ssh_ecdhkex_newkey(const ssh_kex *kex);
+bool ssh_ecdhkex_pregenerate(const ssh_kex *kex);
+void ssh_ecdhkex_free_pools(void);
 void ssh_ecdhkex_freekey(ecdh_key *key);
 void ssh_ecdhkex_getpublic(ecdh_key *key, BinarySink *bs);
 mp_int *ssh_ecdhkex_getkey(ecdh_key *key, ptrlen remoteKey);
@@ -977,6 +979,8 @@ extern const ssh_hashalg ssh_sha384;
 extern const ssh_hashalg ssh_sha512;
 extern const ssh_kexes ssh_diffiehellman_group1;
 extern const ssh_kexes ssh_diffiehellman_group14;
+extern const ssh_kexes ssh_diffiehellman_group16;
+extern const ssh_kexes ssh_diffiehellman_group18;
 extern const ssh_kexes ssh_diffiehellman_gex;
 extern const ssh_kexes ssh_gssk5_sha1_kex;
 extern const ssh_kexes ssh_rsa_kex;
@@ -1022,6 +1026,27 @@ extern const char sshver[];
  */
 extern bool ssh_fallback_cmd(Backend *backend);
 
+/*
+ * Open an extra session channel on an SSH-2 connection, alongside
+ * the main one, and start the given subsystem in it. Returns NULL if
+ * the backend can't do that (SSH-1, or not connected yet).
+ *
+ * The channel is usable once subsyschan_ready returns true, and
+ * useless once subsyschan_failed does (the open or the subsystem
+ * request was refused, or the server closed it). Incoming data is
+ * appended to the bufchain returned by subsyschan_input, to be
+ * consumed by the caller; subsyschan_write and subsyschan_sendbuffer
+ * behave like the Backend send and sendbuffer methods.
+ * subsyschan_close closes the channel and frees the handle.
+ */
+SubsysChannel *ssh_subsystem_open(Backend *backend, const char *subsystem);
+bool subsyschan_ready(SubsysChannel *sub);
+bool subsyschan_failed(SubsysChannel *sub);
+size_t subsyschan_write(SubsysChannel *sub, const void *data, size_t len);
+size_t subsyschan_sendbuffer(SubsysChannel *sub);
+bufchain *subsyschan_input(SubsysChannel *sub);
+void subsyschan_close(SubsysChannel *sub);
+
 /*
  * The PRNG type, defined in sshprng.c. Visible data fields are
  * 'savesize', which suggests how many random bytes you should request
@@ -1163,9 +1188,12 @@ Channel *agentf_new(SshChannel *c);
 bool dh_is_gex(const ssh_kex *kex);
 dh_ctx *dh_setup_group(const ssh_kex *kex);
 dh_ctx *dh_setup_gex(mp_int *pval, mp_int *gval);
+const char *dh_validate_group(dh_ctx *);
 int dh_modulus_bit_size(const dh_ctx *ctx);
 void dh_cleanup(dh_ctx *);
 mp_int *dh_create_e(dh_ctx *, int nbits);
+bool dh_pregenerate(const ssh_kex *kex);
+void dh_free_pools(void);
 const char *dh_validate_f(dh_ctx *, mp_int *f);
 mp_int *dh_find_K(dh_ctx *, mp_int *f);
 
@@ -68,7 +68,7 @@ static void ssh1_bpp_free(BinaryPacketProtocol *bpp)
         ssh_decompressor_free(s->decompctx);
     if (s->crcda_ctx)
         crcda_free_context(s->crcda_ctx);
-    sfree(s->pktin);
+    slab_free(s->pktin);
     sfree(s);
 }
 
@@ -158,7 +158,7 @@ static void ssh1_bpp_handle_input(BinaryPacketProtocol *bpp)
         /*
          * Allocate the packet to return, now we know its length.
          */
-        s->pktin = snew_plus(PktIn, s->biglen);
+        s->pktin = slab_new_plus(PktIn, s->biglen);
         s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
         s->pktin->qnode.on_free_queue = false;
         s->pktin->type = 0;
@@ -204,12 +204,11 @@ static void ssh1_bpp_handle_input(BinaryPacketProtocol *bpp)
                 PktIn *old_pktin = s->pktin;
 
                 s->maxlen = s->pad + decomplen;
-                s->pktin = snew_plus(PktIn, s->maxlen);
+                s->pktin = slab_new_plus(PktIn, s->maxlen);
                 *s->pktin = *old_pktin; /* structure copy */
                 s->data = snew_plus_get_aux(s->pktin);
 
-                smemclr(old_pktin, s->biglen);
-                sfree(old_pktin);
+                slab_free(old_pktin);
             }
 
             memcpy(s->data + s->pad, decompblk, decomplen);
@@ -238,6 +237,8 @@ static void ssh1_bpp_handle_input(BinaryPacketProtocol *bpp)
 
         s->pktin->qnode.formal_size = get_avail(s->pktin);
         pq_push(&s->bpp.in_pq, s->pktin);
+        s->bpp.rtstats->pkts_in++;
+        s->bpp.rtstats->bytes_in += s->biglen + 4;
 
         {
             int type = s->pktin->type;
@@ -343,6 +344,8 @@ static void ssh1_bpp_format_packet(struct ssh1_bpp_state *s, PktOut *pkt)
 
     bufchain_add(s->bpp.out_raw, pkt->data + pktoffs,
                  biglen + 4); /* len(length+padding+type+data+CRC) */
+    s->bpp.rtstats->pkts_out++;
+    s->bpp.rtstats->bytes_out += biglen + 4;
 }
 
 static void ssh1_bpp_handle_output(BinaryPacketProtocol *bpp)
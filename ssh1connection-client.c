@@ -463,6 +463,7 @@ static const struct SshChannelVtable ssh1mainchan_vtable = {
     ssh1mainchan_send_signal,
     ssh1mainchan_send_terminal_size_change,
     ssh1mainchan_hint_channel_is_simple,
+    NULL /* backlog */,
 };
 
 static void ssh1_session_confirm_callback(void *vctx)
@@ -43,6 +43,7 @@ static const struct SshChannelVtable ssh1sesschan_vtable = {
     NULL /* send_signal */,
     NULL /* send_terminal_size_change */,
     NULL /* hint_channel_is_simple */,
+    NULL /* backlog */,
 };
 
 void ssh1connection_server_configure(
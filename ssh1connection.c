@@ -122,6 +122,7 @@ static const struct SshChannelVtable ssh1channel_vtable = {
     NULL /* send_signal */,
     NULL /* send_terminal_size_change */,
     NULL /* hint_channel_is_simple */,
+    NULL /* backlog */,
 };
 
 static void ssh1_channel_try_eof(struct ssh1_channel *c);
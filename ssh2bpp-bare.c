@@ -48,7 +48,7 @@ static void ssh2_bare_bpp_free(BinaryPacketProtocol *bpp)
 {
     struct ssh2_bare_bpp_state *s =
         container_of(bpp, struct ssh2_bare_bpp_state, bpp);
-    sfree(s->pktin);
+    slab_free(s->pktin);
     sfree(s);
 }
 
@@ -86,7 +86,7 @@ static void ssh2_bare_bpp_handle_input(BinaryPacketProtocol *bpp)
         /*
          * Allocate the packet to return, now we know its length.
          */
-        s->pktin = snew_plus(PktIn, s->packetlen);
+        s->pktin = slab_new_plus(PktIn, s->packetlen);
         s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
         s->pktin->qnode.on_free_queue = false;
         s->maxlen = 0;
@@ -124,7 +124,7 @@ static void ssh2_bare_bpp_handle_input(BinaryPacketProtocol *bpp)
         }
 
         if (ssh2_bpp_check_unimplemented(&s->bpp, s->pktin)) {
-            sfree(s->pktin);
+            slab_free(s->pktin);
             s->pktin = NULL;
             continue;
         }
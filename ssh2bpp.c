@@ -8,6 +8,7 @@
 #include "ssh.h"
 #include "sshbpp.h"
 #include "sshcr.h"
+#include "perfcount.h"
 
 struct ssh2_bpp_direction {
     unsigned long sequence;
@@ -27,6 +28,7 @@ struct ssh2_bpp_state {
     PktIn *pktin;
     struct DataTransferStats *stats;
     bool cbc_ignore_workaround;
+    uint64_t crypto_start;
 
     struct ssh2_bpp_direction in, out;
     /* comp and decomp logically belong in the per-direction
@@ -68,6 +70,28 @@ BinaryPacketProtocol *ssh2_bpp_new(
     return &s->bpp;
 }
 
+/*
+ * Bracket a cipher or MAC operation, for both the global per-layer
+ * accounting in perfcount.h and this connection's SshStats.
+ */
+static inline void ssh2_bpp_crypto_begin(
+    struct ssh2_bpp_state *s, PerfLayer layer, size_t len)
+{
+    perf_enter(layer, len);
+#ifdef PERF_HAVE_CYCLE_COUNTER
+    s->crypto_start = perf_timestamp();
+#endif
+}
+
+static inline void ssh2_bpp_crypto_end(
+    struct ssh2_bpp_state *s, PerfLayer layer)
+{
+#ifdef PERF_HAVE_CYCLE_COUNTER
+    s->bpp.rtstats->crypto_ticks += perf_timestamp() - s->crypto_start;
+#endif
+    perf_leave(layer);
+}
+
 static void ssh2_bpp_free_outgoing_crypto(struct ssh2_bpp_state *s)
 {
     /*
@@ -104,7 +128,7 @@ static void ssh2_bpp_free(BinaryPacketProtocol *bpp)
     sfree(s->buf);
     ssh2_bpp_free_outgoing_crypto(s);
     ssh2_bpp_free_incoming_crypto(s);
-    sfree(s->pktin);
+    slab_free(s->pktin);
     sfree(s);
 }
 
@@ -335,10 +359,13 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
                 BPP_READ(s->buf + (s->packetlen + s->maclen), s->cipherblk);
                 /* Decrypt one more block (a little further back in
                  * the stream). */
+                ssh2_bpp_crypto_begin(s, PERF_CIPHER, s->cipherblk);
                 ssh_cipher_decrypt(s->in.cipher,
                                    s->buf + s->packetlen, s->cipherblk);
+                ssh2_bpp_crypto_end(s, PERF_CIPHER);
 
                 /* Feed that block to the MAC. */
+                ssh2_bpp_crypto_begin(s, PERF_MAC, s->cipherblk);
                 put_data(s->in.mac,
                          s->buf + s->packetlen, s->cipherblk);
                 s->packetlen += s->cipherblk;
@@ -346,8 +373,11 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
                 /* See if that gives us a valid packet. */
                 if (ssh2_mac_verresult(s->in.mac, s->buf + s->packetlen) &&
                     ((s->len = toint(GET_32BIT_MSB_FIRST(s->buf))) ==
-                     s->packetlen-4))
+                     s->packetlen-4)) {
+                    ssh2_bpp_crypto_end(s, PERF_MAC);
                     break;
+                }
+                ssh2_bpp_crypto_end(s, PERF_MAC);
                 if (s->packetlen >= (long)OUR_V2_PACKETLIMIT) {
                     ssh_sw_abort(s->bpp.ssh,
                                  "No valid incoming packet found");
@@ -359,7 +389,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             /*
              * Now transfer the data into an output packet.
              */
-            s->pktin = snew_plus(PktIn, s->maxlen);
+            s->pktin = slab_new_plus(PktIn, s->maxlen);
             s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
             s->pktin->type = 0;
             s->pktin->qnode.on_free_queue = false;
@@ -409,7 +439,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             /*
              * Allocate the packet to return, now we know its length.
              */
-            s->pktin = snew_plus(PktIn, OUR_V2_PACKETLIMIT + s->maclen);
+            s->pktin = slab_new_plus(PktIn, OUR_V2_PACKETLIMIT + s->maclen);
             s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
             s->pktin->type = 0;
             s->pktin->qnode.on_free_queue = false;
@@ -424,16 +454,22 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             /*
              * Check the MAC.
              */
+            ssh2_bpp_crypto_begin(s, PERF_MAC, s->len + 4);
             if (s->in.mac && !ssh2_mac_verify(
                     s->in.mac, s->data, s->len + 4, s->in.sequence)) {
+                ssh2_bpp_crypto_end(s, PERF_MAC);
                 ssh_sw_abort(s->bpp.ssh, "Incorrect MAC received on packet");
                 crStopV;
             }
+            ssh2_bpp_crypto_end(s, PERF_MAC);
 
             /* Decrypt everything between the length field and the MAC. */
-            if (s->in.cipher)
+            if (s->in.cipher) {
+                ssh2_bpp_crypto_begin(s, PERF_CIPHER, s->packetlen - 4);
                 ssh_cipher_decrypt(
                     s->in.cipher, s->data + 4, s->packetlen - 4);
+                ssh2_bpp_crypto_end(s, PERF_CIPHER);
+            }
         } else {
             if (s->bufsize < s->cipherblk) {
                 s->bufsize = s->cipherblk;
@@ -446,8 +482,11 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
              */
             BPP_READ(s->buf, s->cipherblk);
 
-            if (s->in.cipher)
+            if (s->in.cipher) {
+                ssh2_bpp_crypto_begin(s, PERF_CIPHER, s->cipherblk);
                 ssh_cipher_decrypt(s->in.cipher, s->buf, s->cipherblk);
+                ssh2_bpp_crypto_end(s, PERF_CIPHER);
+            }
 
             /*
              * Now get the length figure.
@@ -474,7 +513,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
              * Allocate the packet to return, now we know its length.
              */
             s->maxlen = s->packetlen + s->maclen;
-            s->pktin = snew_plus(PktIn, s->maxlen);
+            s->pktin = slab_new_plus(PktIn, s->maxlen);
             s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
             s->pktin->type = 0;
             s->pktin->qnode.on_free_queue = false;
@@ -488,19 +527,25 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
                      s->packetlen + s->maclen - s->cipherblk);
 
             /* Decrypt everything _except_ the MAC. */
-            if (s->in.cipher)
+            if (s->in.cipher) {
+                ssh2_bpp_crypto_begin(s, PERF_CIPHER, s->packetlen - s->cipherblk);
                 ssh_cipher_decrypt(
                     s->in.cipher,
                     s->data + s->cipherblk, s->packetlen - s->cipherblk);
+                ssh2_bpp_crypto_end(s, PERF_CIPHER);
+            }
 
             /*
              * Check the MAC.
              */
+            ssh2_bpp_crypto_begin(s, PERF_MAC, s->len + 4);
             if (s->in.mac && !ssh2_mac_verify(
                     s->in.mac, s->data, s->len + 4, s->in.sequence)) {
+                ssh2_bpp_crypto_end(s, PERF_MAC);
                 ssh_sw_abort(s->bpp.ssh, "Incorrect MAC received on packet");
                 crStopV;
             }
+            ssh2_bpp_crypto_end(s, PERF_MAC);
         }
         /* Get and sanity-check the amount of random padding. */
         s->pad = s->data[4];
@@ -517,6 +562,8 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
         s->length = s->payload + 5;
 
         dts_consume(&s->stats->in, s->packetlen);
+        s->bpp.rtstats->pkts_in++;
+        s->bpp.rtstats->bytes_in += s->packetlen + s->maclen;
 
         s->pktin->sequence = s->in.sequence++;
 
@@ -529,19 +576,24 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
         {
             unsigned char *newpayload;
             int newlen;
-            if (s->in_decomp && ssh_decompressor_decompress(
+            bool decompressed = false;
+            if (s->in_decomp) {
+                perf_enter(PERF_COMPRESS, s->length - 5);
+                decompressed = ssh_decompressor_decompress(
                     s->in_decomp, s->data + 5, s->length - 5,
-                    &newpayload, &newlen)) {
+                    &newpayload, &newlen);
+                perf_leave(PERF_COMPRESS);
+            }
+            if (decompressed) {
                 if (s->maxlen < newlen + 5) {
                     PktIn *old_pktin = s->pktin;
 
                     s->maxlen = newlen + 5;
-                    s->pktin = snew_plus(PktIn, s->maxlen);
+                    s->pktin = slab_new_plus(PktIn, s->maxlen);
                     *s->pktin = *old_pktin; /* structure copy */
                     s->data = snew_plus_get_aux(s->pktin);
 
-                    smemclr(old_pktin, s->packetlen + s->maclen);
-                    sfree(old_pktin);
+                    slab_free(old_pktin);
                 }
                 s->length = 5 + newlen;
                 memcpy(s->data + 5, newpayload, newlen);
@@ -584,7 +636,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
         }
 
         if (ssh2_bpp_check_unimplemented(&s->bpp, s->pktin)) {
-            sfree(s->pktin);
+            slab_free(s->pktin);
             s->pktin = NULL;
             continue;
         }
@@ -714,8 +766,10 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
             minlen -= 8;              /* length field + min padding */
         }
 
+        perf_enter(PERF_COMPRESS, pkt->length - 5);
         ssh_compressor_compress(s->out_comp, pkt->data + 5, pkt->length - 5,
                                 &newpayload, &newlen, minlen);
+        perf_leave(PERF_COMPRESS);
         pkt->length = 5;
         put_data(pkt, newpayload, newlen);
         sfree(newpayload);
@@ -744,8 +798,10 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
     /* Encrypt length if the scheme requires it */
     if (s->out.cipher &&
         (ssh_cipher_alg(s->out.cipher)->flags & SSH_CIPHER_SEPARATE_LENGTH)) {
+        ssh2_bpp_crypto_begin(s, PERF_CIPHER, 4);
         ssh_cipher_encrypt_length(s->out.cipher, pkt->data, 4,
                                   s->out.sequence);
+        ssh2_bpp_crypto_end(s, PERF_CIPHER);
     }
 
     put_padding(pkt, maclen, 0);
@@ -754,25 +810,38 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
         /*
          * OpenSSH-defined encrypt-then-MAC protocol.
          */
-        if (s->out.cipher)
+        if (s->out.cipher) {
+            ssh2_bpp_crypto_begin(s, PERF_CIPHER, origlen + padding - 4);
             ssh_cipher_encrypt(s->out.cipher,
                                pkt->data + 4, origlen + padding - 4);
+            ssh2_bpp_crypto_end(s, PERF_CIPHER);
+        }
+        ssh2_bpp_crypto_begin(s, PERF_MAC, origlen + padding);
         ssh2_mac_generate(s->out.mac, pkt->data, origlen + padding,
                           s->out.sequence);
+        ssh2_bpp_crypto_end(s, PERF_MAC);
     } else {
         /*
          * SSH-2 standard protocol.
          */
-        if (s->out.mac)
+        if (s->out.mac) {
+            ssh2_bpp_crypto_begin(s, PERF_MAC, origlen + padding);
             ssh2_mac_generate(s->out.mac, pkt->data, origlen + padding,
                               s->out.sequence);
-        if (s->out.cipher)
+            ssh2_bpp_crypto_end(s, PERF_MAC);
+        }
+        if (s->out.cipher) {
+            ssh2_bpp_crypto_begin(s, PERF_CIPHER, origlen + padding);
             ssh_cipher_encrypt(s->out.cipher, pkt->data, origlen + padding);
+            ssh2_bpp_crypto_end(s, PERF_CIPHER);
+        }
     }
 
     s->out.sequence++;       /* whether or not we MACed */
 
     dts_consume(&s->stats->out, origlen + padding);
+    s->bpp.rtstats->pkts_out++;
+    s->bpp.rtstats->bytes_out += origlen + padding + maclen;
 }
 
 static void ssh2_bpp_format_packet(struct ssh2_bpp_state *s, PktOut *pkt)
@@ -842,6 +911,8 @@ static void ssh2_bpp_format_packet(struct ssh2_bpp_state *s, PktOut *pkt)
 
     ssh2_bpp_format_packet_inner(s, pkt);
     bufchain_add(s->bpp.out_raw, pkt->data, pkt->length);
+    ssh_stats_watermark(&s->bpp.rtstats->out_raw_max,
+                        bufchain_size(s->bpp.out_raw));
 }
 
 static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
@@ -850,6 +921,9 @@ static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
     PktOut *pkt;
     int n_userauth;
 
+    ssh_stats_watermark(&s->bpp.rtstats->out_pq_max,
+                        s->bpp.out_pq.pqb.total_size);
+
     /*
      * Count the userauth packets in the queue.
      */
@@ -11,6 +11,7 @@
 #include "sshchan.h"
 #include "sshcr.h"
 #include "ssh2connection.h"
+#include "perfcount.h"
 
 static void ssh2_connection_free(PacketProtocolLayer *);
 static void ssh2_connection_process_queue(PacketProtocolLayer *);
@@ -131,6 +132,7 @@ static void ssh2channel_x11_sharing_handover(
     const char *peer_addr, int peer_port, int endian,
     int protomajor, int protominor, const void *initial_data, int initial_len);
 static void ssh2channel_hint_channel_is_simple(SshChannel *c);
+static size_t ssh2channel_backlog(SshChannel *c);
 
 static const struct SshChannelVtable ssh2channel_vtable = {
     ssh2channel_write,
@@ -154,6 +156,7 @@ static const struct SshChannelVtable ssh2channel_vtable = {
     ssh2channel_send_signal,
     ssh2channel_send_terminal_size_change,
     ssh2channel_hint_channel_is_simple,
+    ssh2channel_backlog,
 };
 
 static void ssh2_channel_check_close(struct ssh2_channel *c);
@@ -583,6 +586,7 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                          (s->ssh_is_simple && bufsize>0)) &&
                         !c->throttling_conn) {
                         c->throttling_conn = true;
+                        s->ppl.bpp->rtstats->chan_throttles++;
                         ssh_throttle_conn(s->ppl.ssh, +1);
                     }
                 }
@@ -591,6 +595,7 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
               case SSH2_MSG_CHANNEL_WINDOW_ADJUST:
                 if (!(c->closes & CLOSES_SENT_EOF)) {
                     c->remwindow += get_uint32(pktin);
+                    c->window_stalled = false;
                     ssh2_try_send_and_unthrottle(c);
                 }
                 break;
@@ -965,8 +970,12 @@ static void ssh2_connection_process_queue(PacketProtocolLayer *ppl)
     struct ssh2_connection_state *s =
         container_of(ppl, struct ssh2_connection_state, ppl);
     PktIn *pktin;
+    bool terminated;
 
-    if (ssh2_connection_filter_queue(s)) /* no matter why we were called */
+    perf_enter(PERF_CONNECTION, s->ppl.in_pq->pqb.total_size);
+    terminated = ssh2_connection_filter_queue(s);
+    perf_leave(PERF_CONNECTION);
+    if (terminated) /* no matter why we were called */
         return;
 
     crBegin(s->crState);
@@ -1117,6 +1126,8 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
     PktOut *pktout;
     size_t bufsize;
 
+    perf_enter(PERF_CONNECTION, 0);
+
     if (!c->halfopen) {
         while (c->remwindow > 0 &&
                (bufchain_size(&c->outbuffer) > 0 ||
@@ -1139,6 +1150,7 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
                 put_uint32(pktout, c->remoteid);
             }
             put_stringpl(pktout, data);
+            perf_count_bytes(PERF_CONNECTION, data.len);
             pq_push(s->ppl.out_pq, pktout);
             bufchain_consume(buf, data.len);
             c->remwindow -= data.len;
@@ -1151,6 +1163,11 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
      */
     bufsize = bufchain_size(&c->outbuffer) + bufchain_size(&c->errbuffer);
 
+    if (bufsize && !c->halfopen && c->remwindow == 0 && !c->window_stalled) {
+        c->window_stalled = true;
+        s->ppl.bpp->rtstats->window_stalls++;
+    }
+
     /*
      * And if there's no data pending but we need to send an EOF, send
      * it.
@@ -1158,6 +1175,7 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
     if (!bufsize && c->pending_eof)
         ssh2_channel_try_eof(c);
 
+    perf_leave(PERF_CONNECTION);
     return bufsize;
 }
 
@@ -1278,6 +1296,7 @@ void ssh2_channel_init(struct ssh2_channel *c)
     c->pending_eof = false;
     c->throttling_conn = false;
     c->throttled_by_backlog = false;
+    c->window_stalled = false;
     c->sharectx = NULL;
     c->locwindow = c->locmaxwin = c->remlocwin =
         s->ssh_is_simple ? OUR_V2_BIGWIN : OUR_V2_WINSIZE;
@@ -1451,6 +1470,12 @@ static void ssh2channel_hint_channel_is_simple(SshChannel *sc)
     pq_push(s->ppl.out_pq, pktout);
 }
 
+static size_t ssh2channel_backlog(SshChannel *sc)
+{
+    struct ssh2_channel *c = container_of(sc, struct ssh2_channel, sc);
+    return bufchain_size(&c->outbuffer) + bufchain_size(&c->errbuffer);
+}
+
 static SshChannel *ssh2_lportfwd_open(
     ConnectionLayer *cl, const char *hostname, int port,
     const char *description, const SocketPeerInfo *pi, Channel *chan)
@@ -98,6 +98,13 @@ struct ssh2_channel {
      */
     bool throttled_by_backlog;
 
+    /*
+     * True if we've run out of remote window with data still to
+     * send, and haven't had a WINDOW_ADJUST since. Only used to count
+     * stalls in the connection statistics.
+     */
+    bool window_stalled;
+
     bufchain outbuffer, errbuffer;
     unsigned remwindow, remmaxpkt;
     /* locwindow is signed so we can cope with excess data. */
@@ -94,6 +94,16 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                 return;
             }
             s->dh_ctx = dh_setup_gex(s->p, s->g);
+            {
+                const char *err = dh_validate_group(s->dh_ctx);
+                if (err) {
+                    ssh_proto_error(s->ppl.ssh, "Diffie-Hellman group "
+                                    "received from server is unusable: %s",
+                                    err);
+                    *aborted = true;
+                    return;
+                }
+            }
             s->kex_init_value = SSH2_MSG_KEX_DH_GEX_INIT;
             s->kex_reply_value = SSH2_MSG_KEX_DH_GEX_REPLY;
 
@@ -189,22 +199,16 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                      ssh_hash_alg(s->exhash)->text_name);
         s->ppl.bpp->pls->kctx = SSH2_PKTCTX_ECDHKEX;
 
-        s->ecdh_key = ssh_ecdhkex_newkey(s->kex_alg);
-        if (!s->ecdh_key) {
-            ssh_sw_abort(s->ppl.ssh, "Unable to generate key for ECDH");
+        /*
+         * If our guessed KEX_ECDH_INIT was accepted, it's already
+         * gone, and s->ecdh_key is the key we sent in it.
+         */
+        if (!s->guessok &&
+            !ssh2transport_send_ecdh_init(s, s->kex_alg)) {
             *aborted = true;
             return;
         }
 
-        pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
-        {
-            strbuf *pubpoint = strbuf_new();
-            ssh_ecdhkex_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
-            put_stringsb(pktout, pubpoint);
-        }
-
-        pq_push(s->ppl.out_pq, pktout);
-
         crMaybeWaitUntilV((pktin = ssh2_transport_pop(s)) != NULL);
         if (pktin->type != SSH2_MSG_KEX_ECDH_REPLY) {
             ssh_proto_error(s->ppl.ssh, "Received unexpected packet when "
@@ -313,6 +317,16 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                 return;
             }
             s->dh_ctx = dh_setup_gex(s->p, s->g);
+            {
+                const char *err = dh_validate_group(s->dh_ctx);
+                if (err) {
+                    ssh_proto_error(s->ppl.ssh, "Diffie-Hellman group "
+                                    "received from server is unusable: %s",
+                                    err);
+                    *aborted = true;
+                    return;
+                }
+            }
         } else {
             s->dh_ctx = dh_setup_group(s->kex_alg);
             ppl_logevent("Using GSSAPI (with Kerberos V5) Diffie-Hellman with"
@@ -39,6 +39,36 @@ static void no_progress(void *param, int action, int phase, int iprogress)
 {
 }
 
+/*
+ * Inventing a prime is by far the slowest part of a group exchange,
+ * and clients ask for the same few sizes over and over, so we keep
+ * the last few we made and hand them out again. (That also lets the
+ * DH code reuse its setup for the group on both sides.)
+ */
+#define GEX_PRIME_CACHE_SIZE 4
+static struct {
+    int bits;
+    mp_int *p;
+} gex_primes[GEX_PRIME_CACHE_SIZE];
+static size_t gex_primes_next;
+
+static mp_int *gex_prime(int bits)
+{
+    for (size_t i = 0; i < GEX_PRIME_CACHE_SIZE; i++)
+        if (gex_primes[i].p && gex_primes[i].bits == bits)
+            return mp_copy(gex_primes[i].p);
+
+    mp_int *p = primegen(bits, 2, 2, NULL, 1, no_progress, NULL, 1);
+
+    size_t i = gex_primes_next;
+    gex_primes_next = (gex_primes_next + 1) % GEX_PRIME_CACHE_SIZE;
+    if (gex_primes[i].p)
+        mp_free(gex_primes[i].p);
+    gex_primes[i].bits = bits;
+    gex_primes[i].p = mp_copy(p);
+    return p;
+}
+
 void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
 {
     PacketProtocolLayer *ppl = &s->ppl; /* for ppl_logevent */
@@ -100,7 +130,7 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
              * group! It's good enough for testing a client against,
              * but not for serious use.
              */
-            s->p = primegen(s->pbits, 2, 2, NULL, 1, no_progress, NULL, 1);
+            s->p = gex_prime(s->pbits);
             s->g = mp_from_integer(2);
             s->dh_ctx = dh_setup_gex(s->p, s->g);
             s->kex_init_value = SSH2_MSG_KEX_DH_GEX_INIT;
@@ -126,6 +156,7 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
          * Generate e for Diffie-Hellman.
          */
         s->e = dh_create_e(s->dh_ctx, s->nbits * 2);
+        ssh2transport_refill_kex_pool(s->kex_alg);
 
         /*
          * Wait to receive f.
@@ -197,6 +228,7 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
             *aborted = true;
             return;
         }
+        ssh2transport_refill_kex_pool(s->kex_alg);
 
         crMaybeWaitUntilV((pktin = ssh2_transport_pop(s)) != NULL);
         if (pktin->type != SSH2_MSG_KEX_ECDH_INIT) {
@@ -76,6 +76,8 @@ static size_t ssh2_transport_queued_data_size(PacketProtocolLayer *ppl);
 static void ssh2_transport_set_max_data_size(struct ssh2_transport_state *s);
 static unsigned long sanitise_rekey_time(int rekey_time, unsigned long def);
 static void ssh2_transport_higher_layer_packet_callback(void *context);
+static void kexpool_add_user(void);
+static void kexpool_remove_user(void);
 
 static const struct PacketProtocolLayerVtable ssh2_transport_vtable = {
     ssh2_transport_free,
@@ -173,6 +175,8 @@ PacketProtocolLayer *ssh2_transport_new(
 
     ssh2_transport_set_max_data_size(s);
 
+    kexpool_add_user();
+
     return &s->ppl;
 }
 
@@ -236,6 +240,8 @@ static void ssh2_transport_free(PacketProtocolLayer *ppl)
 
     freetree234(s->weak_algorithms_consented_to);
 
+    kexpool_remove_user();
+
     expire_timer_context(s);
     sfree(s);
 }
@@ -430,7 +436,8 @@ static void ssh2_write_kexinit_lists(
     const char *hk_host, int hk_port, const ssh_keyalg *hk_prev,
     ssh_transient_hostkey_cache *thc,
     ssh_key *const *our_hostkeys, int our_nhostkeys,
-    bool first_time, bool can_gssapi_keyex, bool transient_hostkey_mode)
+    bool first_time, bool can_gssapi_keyex, bool transient_hostkey_mode,
+    const ssh_kex *kex_first)
 {
     int i, j, k;
     bool warn;
@@ -459,6 +466,14 @@ static void ssh2_write_kexinit_lists(
             preferred_kex[n_preferred_kex++] =
                 &ssh_diffiehellman_gex;
             break;
+          case KEX_DHGROUP18:
+            preferred_kex[n_preferred_kex++] =
+                &ssh_diffiehellman_group18;
+            break;
+          case KEX_DHGROUP16:
+            preferred_kex[n_preferred_kex++] =
+                &ssh_diffiehellman_group16;
+            break;
           case KEX_DHGROUP14:
             preferred_kex[n_preferred_kex++] =
                 &ssh_diffiehellman_group14;
@@ -547,6 +562,12 @@ static void ssh2_write_kexinit_lists(
             kexlists[i][j].name = NULL;
     /* List key exchange algorithms. */
     warn = false;
+    if (kex_first) {
+        /* Promoted for a guessed kex; see ssh2_choose_kex_guess.
+         * Its warn flag is filled in when we reach it below. */
+        alg = ssh2_kexinit_addalg(kexlists[KEXLIST_KEX], kex_first->name);
+        alg->u.kex.kex = kex_first;
+    }
     for (i = 0; i < n_preferred_kex; i++) {
         const ssh_kexes *k = preferred_kex[i];
         if (!k) warn = true;
@@ -861,7 +882,7 @@ static bool ssh2_scan_kexinits(
          * both sides' lists, that means the guessed key exchange
          * packet (if any) is officially wrong.
          */
-        if ((i == KEXLIST_KEX || i == KEXLIST_HOSTKEY) && !(cfirst || sfirst))
+        if ((i == KEXLIST_KEX || i == KEXLIST_HOSTKEY) && !(cfirst && sfirst))
             guess_correct = false;
     }
 
@@ -992,6 +1013,191 @@ static bool ssh2_scan_kexinits(
     return true;
 }
 
+/*
+ * Decide whether to follow our KEXINIT with a guessed first kex
+ * packet, and if so, for which method. RFC 4253 only lets the guess
+ * stand if both sides put the same kex and host key algorithms
+ * first, and all the other lists have something in common; if not,
+ * the server throws our packet away and we've lost nothing but a
+ * little CPU.
+ *
+ * At the start of the connection we know nothing about the server,
+ * so we can only guess our own first choice. On a rekey, we have the
+ * server's previous KEXINIT to go on: if the method we'd agree with
+ * it is also the one it lists first, we guess that, and the caller
+ * moves it to the front of our own list. That can't change which
+ * method is agreed, because nothing we prefer to it was on offer.
+ *
+ * Only ECDH is worth guessing: the packet is cheap to make, and
+ * doesn't depend on anything else in the negotiation.
+ */
+static bool kexinit_list_contains(ptrlen list, const char *name)
+{
+    ptrlen word;
+    while (get_commasep_word(&list, &word))
+        if (ptrlen_eq_string(word, name))
+            return true;
+    return false;
+}
+
+static const ssh_kex *ssh2_choose_kex_guess(struct ssh2_transport_state *s)
+{
+    struct kexinit_algorithm *ours = s->kexlists[KEXLIST_KEX];
+    struct kexinit_algorithm *guess = NULL;
+
+    if (!s->got_session_id) {
+        guess = &ours[0];
+    } else {
+        BinarySource src[1];
+        ptrlen kexlist, hklist, first;
+        int i;
+
+        BinarySource_BARE_INIT_PL(src, ptrlen_from_strbuf(s->server_kexinit));
+        get_data(src, 1 + 16);
+        kexlist = get_string(src);
+        hklist = get_string(src);
+        if (get_err(src))
+            return NULL;
+
+        /* We only offer one host key algorithm in a rekey */
+        if (!get_commasep_word(&hklist, &first) ||
+            !ptrlen_eq_string(first, s->kexlists[KEXLIST_HOSTKEY][0].name))
+            return NULL;
+
+        for (i = 0; i < MAXKEXLIST && ours[i].name; i++) {
+            if (kexinit_list_contains(kexlist, ours[i].name)) {
+                guess = &ours[i];
+                break;
+            }
+        }
+        if (!guess || !get_commasep_word(&kexlist, &first) ||
+            !ptrlen_eq_string(first, guess->name))
+            return NULL;
+    }
+
+    if (!guess->name || guess->u.kex.warn ||
+        guess->u.kex.kex->main_type != KEXTYPE_ECDH)
+        return NULL;
+    return guess->u.kex.kex;
+}
+
+/*
+ * Ephemeral keys for ECDH and the standard DH groups are kept in
+ * small pools (see ssh_ecdhkex_pregenerate and dh_pregenerate), so
+ * that a key exchange can take one ready-made. Whenever a server's
+ * key exchange takes a key, we arrange to replace it a little later,
+ * by which time we've sent our half of the exchange and are waiting
+ * for the other side's. We make one key per timer firing, so that a
+ * burst of connections or rekeys doesn't hold up the event loop for
+ * long at a time.
+ *
+ * Clients don't refill the pools: a client typically does one key
+ * exchange per process, and a spare key would only be thrown away.
+ *
+ * The pools are shared by every connection in the process. When the
+ * last transport layer is freed, so are any keys left in them.
+ */
+#define KEXPOOL_MAX_ALGS 8
+#define KEXPOOL_DELAY (TICKSPERSEC / 20)
+static const ssh_kex *kexpool_algs[KEXPOOL_MAX_ALGS];
+static size_t kexpool_nalgs;
+static bool kexpool_timer_pending;
+static unsigned long kexpool_timer_time;
+static unsigned kexpool_users;
+
+static void kexpool_add_user(void)
+{
+    kexpool_users++;
+}
+
+static void kexpool_remove_user(void)
+{
+    assert(kexpool_users > 0);
+    if (--kexpool_users > 0)
+        return;
+
+    expire_timer_context(kexpool_algs);
+    kexpool_timer_pending = false;
+    kexpool_nalgs = 0;
+
+    ssh_ecdhkex_free_pools();
+    dh_free_pools();
+}
+
+static bool kexpool_pregenerate(const ssh_kex *kex)
+{
+    switch (kex->main_type) {
+      case KEXTYPE_ECDH:
+        return ssh_ecdhkex_pregenerate(kex);
+      case KEXTYPE_DH:
+        return dh_pregenerate(kex);
+      default:
+        return false;
+    }
+}
+
+static void kexpool_timer(void *ctx, unsigned long now)
+{
+    if (!kexpool_timer_pending || now != kexpool_timer_time)
+        return;
+    kexpool_timer_pending = false;
+
+    /* Make one key for the first method whose pool isn't full, and
+     * forget about any we find that are. */
+    while (kexpool_nalgs > 0) {
+        if (kexpool_pregenerate(kexpool_algs[0]))
+            break;
+        memmove(kexpool_algs, kexpool_algs + 1,
+                --kexpool_nalgs * sizeof(*kexpool_algs));
+    }
+
+    if (kexpool_nalgs > 0) {
+        kexpool_timer_time = schedule_timer(
+            KEXPOOL_DELAY, kexpool_timer, kexpool_algs);
+        kexpool_timer_pending = true;
+    }
+}
+
+void ssh2transport_refill_kex_pool(const ssh_kex *kex)
+{
+    size_t i;
+
+    for (i = 0; i < kexpool_nalgs; i++)
+        if (kexpool_algs[i] == kex)
+            break;
+    if (i == kexpool_nalgs) {
+        if (kexpool_nalgs == KEXPOOL_MAX_ALGS)
+            return;
+        kexpool_algs[kexpool_nalgs++] = kex;
+    }
+
+    if (!kexpool_timer_pending) {
+        kexpool_timer_time = schedule_timer(
+            KEXPOOL_DELAY, kexpool_timer, kexpool_algs);
+        kexpool_timer_pending = true;
+    }
+}
+
+bool ssh2transport_send_ecdh_init(struct ssh2_transport_state *s,
+                                  const ssh_kex *kex)
+{
+    PktOut *pktout;
+    strbuf *pubpoint;
+
+    s->ecdh_key = ssh_ecdhkex_newkey(kex);
+    if (!s->ecdh_key) {
+        ssh_sw_abort(s->ppl.ssh, "Unable to generate key for ECDH");
+        return false;
+    }
+
+    pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
+    pubpoint = strbuf_new();
+    ssh_ecdhkex_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
+    put_stringsb(pktout, pubpoint);
+    pq_push(s->ppl.out_pq, pktout);
+    return true;
+}
+
 void ssh2transport_finalise_exhash(struct ssh2_transport_state *s)
 {
     put_mp_ssh2(s->exhash, s->K);
@@ -1085,7 +1291,7 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      * Construct our KEXINIT packet, in a strbuf so we can refer to it
      * later.
      */
-    strbuf_clear(s->client_kexinit);
+    strbuf_clear(s->outgoing_kexinit);
     put_byte(s->outgoing_kexinit, SSH2_MSG_KEXINIT);
     random_read(strbuf_append(s->outgoing_kexinit, 16), 16);
     ssh2_write_kexinit_lists(
@@ -1094,9 +1300,29 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
         s->savedhost, s->savedport, s->hostkey_alg, s->thc,
         s->hostkeys, s->nhostkeys,
         !s->got_session_id, s->can_gssapi_keyex,
-        s->gss_kex_used && !s->need_gss_transient_hostkey);
-    /* First KEX packet does _not_ follow, because we're not that brave. */
-    put_bool(s->outgoing_kexinit, false);
+        s->gss_kex_used && !s->need_gss_transient_hostkey, NULL);
+
+    /*
+     * Unless configured to, we don't guess the kex method, because
+     * we're not that brave.
+     */
+    s->kex_guess = NULL;
+    s->guessok = false;
+    if (!s->ssc && !s->can_gssapi_keyex &&
+        conf_get_bool(s->conf, CONF_ssh_kex_guess) &&
+        (s->kex_guess = ssh2_choose_kex_guess(s)) != NULL &&
+        s->kex_guess != s->kexlists[KEXLIST_KEX][0].u.kex.kex) {
+        strbuf_shrink_to(s->outgoing_kexinit, 1 + 16);
+        ssh2_write_kexinit_lists(
+            BinarySink_UPCAST(s->outgoing_kexinit), s->kexlists,
+            s->conf, s->ssc, s->ppl.remote_bugs,
+            s->savedhost, s->savedport, s->hostkey_alg, s->thc,
+            s->hostkeys, s->nhostkeys,
+            !s->got_session_id, s->can_gssapi_keyex,
+            s->gss_kex_used && !s->need_gss_transient_hostkey,
+            s->kex_guess);
+    }
+    put_bool(s->outgoing_kexinit, s->kex_guess != NULL);
     put_uint32(s->outgoing_kexinit, 0);             /* reserved */
 
     /*
@@ -1107,6 +1333,16 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
              s->outgoing_kexinit->len - 1); /* omit initial packet type byte */
     pq_push(s->ppl.out_pq, pktout);
 
+    /*
+     * And, if we're guessing, the first packet of the guessed kex.
+     */
+    if (s->kex_guess) {
+        ppl_logevent("Guessing key exchange method %s", s->kex_guess->name);
+        s->ppl.bpp->pls->kctx = SSH2_PKTCTX_ECDHKEX;
+        if (!ssh2transport_send_ecdh_init(s, s->kex_guess))
+            return;
+    }
+
     /*
      * Flag that KEX is in progress.
      */
@@ -1133,15 +1369,31 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      */
     {
         int nhk, hks[MAXKEXLIST], i, j;
+        bool our_guess_wrong;
 
+        /* s->ignorepkt is about the _other_ side's guess */
         if (!ssh2_scan_kexinits(
                 ptrlen_from_strbuf(s->client_kexinit),
                 ptrlen_from_strbuf(s->server_kexinit),
                 s->kexlists, &s->kex_alg, &s->hostkey_alg, s->cstrans,
                 s->sctrans, &s->warn_kex, &s->warn_hk, &s->warn_cscipher,
-                &s->warn_sccipher, s->ppl.ssh, NULL, &s->ignorepkt, &nhk, hks))
+                &s->warn_sccipher, s->ppl.ssh,
+                s->ssc ? &s->ignorepkt : &our_guess_wrong,
+                s->ssc ? &our_guess_wrong : &s->ignorepkt, &nhk, hks))
             return; /* false means a fatal error function was called */
 
+        if (s->kex_guess) {
+            if (our_guess_wrong) {
+                ppl_logevent("Server did not accept guessed key exchange");
+                ssh_ecdhkex_freekey(s->ecdh_key);
+                s->ecdh_key = NULL;
+            } else {
+                /* A correct guess means we both listed it first */
+                assert(s->kex_alg == s->kex_guess);
+                s->guessok = true;
+            }
+        }
+
         /*
          * In addition to deciding which host key we're actually going
          * to use, we should make a list of the host keys offered by
@@ -1404,6 +1656,8 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      */
     seat_update_specials_menu(s->ppl.seat);
 
+    seat_kex_finished(s->ppl.seat);
+
     /*
      * Key exchange is over. Loop straight back round if we have a
      * deferred rekey reason.
@@ -1474,6 +1728,14 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
         queue_idempotent_callback(&s->higher_layer->ic_process_queue);
     }
 
+    /*
+     * The higher layer may have queued more packets while we were
+     * waiting for the other side's NEWKEYS. If it has now finished
+     * sending altogether, nothing else will come along to wake us up
+     * and pass them through, so do it now.
+     */
+    pq_concatenate(s->ppl.out_pq, s->ppl.out_pq, &s->pq_out_higher);
+
     s->rekey_class = RK_NONE;
     do {
         crReturnV;
@@ -181,7 +181,8 @@ struct ssh2_transport_state {
     bool warned_about_no_gss_transient_hostkey;
     bool got_session_id;
     int dlgret;
-    bool guessok;
+    const ssh_kex *kex_guess;      /* if we sent a guessed kex packet */
+    bool guessok;                  /* ... and the server accepted it */
     bool ignorepkt;
     struct kexinit_algorithm kexlists[NKEXLIST][MAXKEXLIST];
 #ifndef NO_GSSAPI
@@ -229,6 +230,9 @@ void ssh2_transport_dialog_callback(void *, int);
 
 /* Provided by transport for use in kex */
 void ssh2transport_finalise_exhash(struct ssh2_transport_state *s);
+bool ssh2transport_send_ecdh_init(struct ssh2_transport_state *s,
+                                  const ssh_kex *kex);
+void ssh2transport_refill_kex_pool(const ssh_kex *kex);
 
 /* Provided by kex for use in transport. Must set the 'aborted' flag
  * if it throws a connection-terminating error, so that the caller
@@ -24,6 +24,7 @@ struct BinaryPacketProtocol {
     PacketLogSettings *pls;
     LogContext *logctx;
     Ssh *ssh;
+    SshStats *rtstats;
 
     /* ic_in_raw is filled in by the BPP (probably by calling
      * ssh_bpp_common_setup). The BPP's owner triggers it when data is
@@ -127,6 +128,36 @@ static inline void dts_reset(struct DataTransferStatsDirection *s,
     s->running = (starting_size != 0);
 }
 
+/*
+ * Runtime statistics for one SSH connection, kept so that throughput
+ * problems can be diagnosed from the Event Log rather than guessed
+ * at. Unlike DataTransferStats, nothing here affects the protocol.
+ * Each counter is bumped by whichever layer sees the event, and
+ * ssh_stats_log() writes a summary.
+ */
+struct SshStats {
+    unsigned long start_time;          /* GETTICKCOUNT() at creation */
+    uint64_t pkts_in, pkts_out;
+    uint64_t bytes_in, bytes_out;      /* binary packets, as on the wire */
+    size_t out_pq_max, out_raw_max;    /* high-water marks of BPP output */
+    unsigned long window_stalls;       /* channel sends blocked on window */
+    unsigned long conn_throttles;      /* times we stopped reading input */
+    unsigned long chan_throttles;      /* channels throttling the above */
+    uint64_t crypto_ticks;             /* in cipher and MAC: perfcount.h */
+
+    /* Snapshot taken by the previous ssh_stats_log, to compute rates */
+    unsigned long last_time;
+    uint64_t last_pkts_in, last_pkts_out, last_bytes_in, last_bytes_out;
+};
+void ssh_stats_init(SshStats *st);
+void ssh_stats_log(SshStats *st, LogContext *logctx,
+                   size_t out_pq_size, size_t out_raw_size);
+static inline void ssh_stats_watermark(size_t *max, size_t size)
+{
+    if (*max < size)
+        *max = size;
+}
+
 BinaryPacketProtocol *ssh2_bpp_new(
     LogContext *logctx, struct DataTransferStats *stats, bool is_server);
 void ssh2_bpp_new_outgoing_crypto(
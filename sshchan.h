@@ -224,6 +224,10 @@ struct SshChannelVtable {
     void (*send_terminal_size_change)(
         SshChannel *c, int w, int h);
     void (*hint_channel_is_simple)(SshChannel *c);
+
+    /* Return the amount of outgoing data still buffered, as the
+     * write method would. */
+    size_t (*backlog)(SshChannel *c);
 };
 
 struct SshChannel {
@@ -293,6 +297,8 @@ static inline void sshfwd_send_terminal_size_change(
 { c->vt->send_terminal_size_change(c, w, h); }
 static inline void sshfwd_hint_channel_is_simple(SshChannel *c)
 { c->vt->hint_channel_is_simple(c); }
+static inline size_t sshfwd_backlog(SshChannel *c)
+{ return c->vt->backlog(c); }
 
 /* ----------------------------------------------------------------------
  * The 'main' or primary channel of the SSH connection is special,
@@ -309,4 +315,7 @@ void mainchan_get_specials(
 void mainchan_special_cmd(mainchan *mc, SessionSpecialCode code, int arg);
 void mainchan_terminal_size(mainchan *mc, int width, int height);
 
+/* Extra subsystem channels; see ssh_subsystem_open in ssh.h. */
+SubsysChannel *subsyschan_new(ConnectionLayer *cl, const char *subsystem);
+
 #endif /* PUTTY_SSHCHAN_H */
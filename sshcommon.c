@@ -12,6 +12,7 @@
 #include "sshbpp.h"
 #include "sshppl.h"
 #include "sshchan.h"
+#include "perfcount.h"
 
 /* ----------------------------------------------------------------------
  * Implementation of PacketQueue.
@@ -64,7 +65,7 @@ static void pktin_free_queue_callback(void *vctx)
         PacketQueueNode *node = pktin_freeq_head.next;
         PktIn *pktin = container_of(node, PktIn, qnode);
         pktin_freeq_head.next = node->next;
-        sfree(pktin);
+        slab_free(pktin);
     }
 
     pktin_freeq_head.prev = &pktin_freeq_head;
@@ -242,7 +243,7 @@ static void ssh_pkt_BinarySink_write(BinarySink *bs,
                                      const void *data, size_t len);
 PktOut *ssh_new_packet(void)
 {
-    PktOut *pkt = snew(PktOut);
+    PktOut *pkt = slab_new(PktOut);
 
     BinarySink_INIT(pkt, ssh_pkt_BinarySink_write);
     pkt->data = NULL;
@@ -258,7 +259,23 @@ PktOut *ssh_new_packet(void)
 
 static void ssh_pkt_adddata(PktOut *pkt, const void *data, int len)
 {
-    sgrowarrayn_nm(pkt->data, pkt->maxlen, pkt->length, len);
+    /* (pkt->length can exceed pkt->maxlen before the first write,
+     * if a BPP has reserved space for its own prefix.) */
+    if (pkt->length + len > pkt->maxlen) {
+        /* Grow by copying to a new slab block, which also means the
+         * old one is wiped, as sgrowarray_nm would do. */
+        size_t newmax = pkt->maxlen + pkt->maxlen / 2;
+        if (newmax < pkt->length + len)
+            newmax = pkt->length + len;
+        if (newmax < 256)
+            newmax = 256;
+        unsigned char *newdata = slab_alloc(newmax);
+        if (pkt->data)
+            memcpy(newdata, pkt->data, pkt->length);
+        slab_free(pkt->data);
+        pkt->data = newdata;
+        pkt->maxlen = newmax;
+    }
     memcpy(pkt->data + pkt->length, data, len);
     pkt->length += len;
     pkt->qnode.formal_size = pkt->length;
@@ -273,8 +290,8 @@ static void ssh_pkt_BinarySink_write(BinarySink *bs,
 
 void ssh_free_pktout(PktOut *pkt)
 {
-    sfree(pkt->data);
-    sfree(pkt);
+    slab_free(pkt->data);
+    slab_free(pkt);
 }
 
 /* ----------------------------------------------------------------------
@@ -746,7 +763,9 @@ static void ssh_bpp_input_raw_data_callback(void *context)
 {
     BinaryPacketProtocol *bpp = (BinaryPacketProtocol *)context;
     Ssh *ssh = bpp->ssh;               /* in case bpp is about to get freed */
+    perf_enter(PERF_BPP, bufchain_size(bpp->in_raw));
     ssh_bpp_handle_input(bpp);
+    perf_leave(PERF_BPP);
     /* If we've now cleared enough backlog on the input connection, we
      * may need to unfreeze it. */
     ssh_conn_processed_data(ssh);
@@ -755,7 +774,9 @@ static void ssh_bpp_input_raw_data_callback(void *context)
 static void ssh_bpp_output_packet_callback(void *context)
 {
     BinaryPacketProtocol *bpp = (BinaryPacketProtocol *)context;
+    perf_enter(PERF_BPP, bpp->out_pq.pqb.total_size);
     ssh_bpp_handle_output(bpp);
+    perf_leave(PERF_BPP);
 }
 
 void ssh_bpp_common_setup(BinaryPacketProtocol *bpp)
@@ -944,3 +965,51 @@ void ssh1_compute_session_id(
     put_data(hash, cookie, 8);
     ssh_hash_final(hash, session_id);
 }
+
+/* ----------------------------------------------------------------------
+ * Runtime statistics.
+ */
+
+void ssh_stats_init(SshStats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->start_time = st->last_time = GETTICKCOUNT();
+}
+
+void ssh_stats_log(SshStats *st, LogContext *logctx,
+                   size_t out_pq_size, size_t out_raw_size)
+{
+    unsigned long now = GETTICKCOUNT();
+    double elapsed = (double)(now - st->start_time) / TICKSPERSEC;
+    double interval = (double)(now - st->last_time) / TICKSPERSEC;
+    if (interval <= 0)
+        interval = 1.0 / TICKSPERSEC;
+
+    logeventf(logctx, "Statistics after %.1f seconds:", elapsed);
+    logeventf(logctx, "  received %"PRIu64" packets (%.1f/s), "
+              "%"PRIu64" bytes (%.1f kB/s)", st->pkts_in,
+              (st->pkts_in - st->last_pkts_in) / interval, st->bytes_in,
+              (st->bytes_in - st->last_bytes_in) / interval / 1000);
+    logeventf(logctx, "  sent %"PRIu64" packets (%.1f/s), "
+              "%"PRIu64" bytes (%.1f kB/s)", st->pkts_out,
+              (st->pkts_out - st->last_pkts_out) / interval, st->bytes_out,
+              (st->bytes_out - st->last_bytes_out) / interval / 1000);
+    logeventf(logctx, "  output queued: %"SIZEu" bytes of packets "
+              "(max %"SIZEu"), %"SIZEu" bytes of raw data (max %"SIZEu")",
+              out_pq_size, st->out_pq_max, out_raw_size, st->out_raw_max);
+    logeventf(logctx, "  flow control: %lu window stalls, "
+              "%lu connection throttles, %lu channel throttles",
+              st->window_stalls, st->conn_throttles, st->chan_throttles);
+    if (st->crypto_ticks) {
+        uint64_t bytes = st->bytes_in + st->bytes_out;
+        logeventf(logctx, "  cipher and MAC: %.1f M%s (%.1f per byte)",
+                  st->crypto_ticks / 1e6, perf_tick_unit,
+                  bytes ? (double)st->crypto_ticks / bytes : 0.0);
+    }
+
+    st->last_time = now;
+    st->last_pkts_in = st->pkts_in;
+    st->last_pkts_out = st->pkts_out;
+    st->last_bytes_in = st->bytes_in;
+    st->last_bytes_out = st->bytes_out;
+}
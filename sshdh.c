@@ -3,34 +3,96 @@
  */
 
 #include <assert.h>
+#include <limits.h>
+#include <string.h>
 
 #include "ssh.h"
 #include "misc.h"
 #include "mpint.h"
 
+/*
+ * Everything we know about a DH group that doesn't depend on a
+ * particular key exchange. The standard groups each have one of these
+ * that lives as long as the process does; groups received in group
+ * exchange are kept in a small cache (see below), so that a repeat
+ * connection to the same server needn't validate the group again.
+ *
+ * Once a group has been used more than once, we also build a table
+ * of powers of g, which turns each subsequent g^x into one modular
+ * multiplication per 4 bits of x instead of two per bit. Building it
+ * costs about as much as two ordinary exponentiations, which is why
+ * we don't bother for a group that is only ever used once.
+ */
+#define DH_POOL_SIZE 2
+
+typedef struct dh_group dh_group;
+struct dh_group {
+    mp_int *p, *q, *g;
+    MontyContext *mc;             /* NULL if p failed the basic checks */
+    const char *invalid;          /* why the group is unusable, or NULL */
+
+    /*
+     * Fixed-base table: table[15*i + d-1] is g^(d * 16^i), in
+     * Montgomery form, for 0 <= i < table_windows and 1 <= d <= 15.
+     */
+    mp_int **table;
+    size_t table_windows;
+    unsigned uses;
+
+    /*
+     * Keys made in advance by dh_pregenerate, all for the exponent
+     * size that the most recent key exchange in this group asked for
+     * (or none, if pool_nbits is still negative). Each is removed
+     * when it's handed out, so it can only be used once.
+     */
+    struct dh_pregen {
+        mp_int *x, *e;
+    } pool[DH_POOL_SIZE];
+    size_t npool;
+    int pool_nbits;
+
+    unsigned refcount;
+};
+
 struct dh_ctx {
-    mp_int *x, *e, *p, *q, *g;
+    dh_group *group;
+    mp_int *x, *e;
 };
 
 struct dh_extra {
     bool gex;
-    void (*construct)(dh_ctx *ctx);
+    void (*construct)(dh_group *group);
+    dh_group **cached;
 };
 
-static void dh_group1_construct(dh_ctx *ctx)
+static void dh_group1_construct(dh_group *group)
+{
+    group->p = MP_LITERAL(0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7EDEE386BFB5A899FA5AE9F24117C4B1FE649286651ECE65381FFFFFFFFFFFFFFFF);
+    group->g = mp_from_integer(2);
+}
+
+static void dh_group14_construct(dh_group *group)
 {
-    ctx->p = MP_LITERAL(0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7EDEE386BFB5A899FA5AE9F24117C4B1FE649286651ECE65381FFFFFFFFFFFFFFFF);
-    ctx->g = mp_from_integer(2);
+    group->p = MP_LITERAL(0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7EDEE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF0598DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3BE39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF6955817183995497CEA956AE515D2261898FA051015728E5A8AACAA68FFFFFFFFFFFFFFFF);
+    group->g = mp_from_integer(2);
 }
 
-static void dh_group14_construct(dh_ctx *ctx)
+/* Groups 16 and 18 are the 4096- and 8192-bit MODP groups of RFC 3526. */
+static void dh_group16_construct(dh_group *group)
 {
-    ctx->p = MP_LITERAL(0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7EDEE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF0598DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3BE39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF6955817183995497CEA956AE515D2261898FA051015728E5A8AACAA68FFFFFFFFFFFFFFFF);
-    ctx->g = mp_from_integer(2);
+    group->p = MP_LITERAL(0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7EDEE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF0598DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3BE39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF6955817183995497CEA956AE515D2261898FA051015728E5A8AAAC42DAD33170D04507A33A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864D87602733EC86A64521F2B18177B200CBBE117577A615D6C770988C0BAD946E208E24FA074E5AB3143DB5BFCE0FD108E4B82D120A92108011A723C12A787E6D788719A10BDBA5B2699C327186AF4E23C1A946834B6150BDA2583E9CA2AD44CE8DBBBC2DB04DE8EF92E8EFC141FBECAA6287C59474E6BC05D99B2964FA090C3A2233BA186515BE7ED1F612970CEE2D7AFB81BDD762170481CD0069127D5B05AA993B4EA988D8FDDC186FFB7DC90A6C08F4DF435C934063199FFFFFFFFFFFFFFFF);
+    group->g = mp_from_integer(2);
 }
 
+static void dh_group18_construct(dh_group *group)
+{
+    group->p = MP_LITERAL(0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7EDEE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF0598DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3BE39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF6955817183995497CEA956AE515D2261898FA051015728E5A8AAAC42DAD33170D04507A33A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864D87602733EC86A64521F2B18177B200CBBE117577A615D6C770988C0BAD946E208E24FA074E5AB3143DB5BFCE0FD108E4B82D120A92108011A723C12A787E6D788719A10BDBA5B2699C327186AF4E23C1A946834B6150BDA2583E9CA2AD44CE8DBBBC2DB04DE8EF92E8EFC141FBECAA6287C59474E6BC05D99B2964FA090C3A2233BA186515BE7ED1F612970CEE2D7AFB81BDD762170481CD0069127D5B05AA993B4EA988D8FDDC186FFB7DC90A6C08F4DF435C93402849236C3FAB4D27C7026C1D4DCB2602646DEC9751E763DBA37BDF8FF9406AD9E530EE5DB382F413001AEB06A53ED9027D831179727B0865A8918DA3EDBEBCF9B14ED44CE6CBACED4BB1BDB7F1447E6CC254B332051512BD7AF426FB8F401378CD2BF5983CA01C64B92ECF032EA15D1721D03F482D7CE6E74FEF6D55E702F46980C82B5A84031900B1C9E59E7C97FBEC7E8F323A97A7E36CC88BE0F1D45B7FF585AC54BD407B22B4154AACC8F6D7EBF48E1D814CC5ED20F8037E0A79715EEF29BE32806A1D58BB7C5DA76F550AA3D8A1FBFF0EB19CCB1A313D55CDA56C9EC2EF29632387FE8D76E3C0468043E8F663F4860EE12BF2D5B0B7474D6E694F91E6DBE115974A3926F12FEE5E438777CB6A932DF8CD8BEC4D073B931BA3BC832B68D9DD300741FA7BF8AFC47ED2576F6936BA424663AAB639C5AE4F5683423B4742BF1C978238F16CBE39D652DE3FDB8BEFC848AD922222E04A4037C0713EB57A81A23F0C73473FC646CEA306B4BCBC8862F8385DDFA9D4B7FA2C087E879683303ED5BDD3A062B3CF5B3A278A66D2A13F83F44F82DDF310EE074AB6A364597E899A0255DC164F31CC50846851DF9AB48195DED7EA1B1D510BD7EE74D73FAF36BC31ECFA268359046F4EB879F924009438B481C6CD7889A002ED5EE382BC9190DA6FC026E479558E4475677E9AA9E3050E2765694DFC81F56E880B96E7160C980DD98EDD3DFFFFFFFFFFFFFFFFF);
+    group->g = mp_from_integer(2);
+}
+
+static dh_group *group1_cached;
 static const struct dh_extra extra_group1 = {
-    false, dh_group1_construct,
+    false, dh_group1_construct, &group1_cached,
 };
 
 static const ssh_kex ssh_diffiehellman_group1_sha1 = {
@@ -44,8 +106,9 @@ static const ssh_kex *const group1_list[] = {
 
 const ssh_kexes ssh_diffiehellman_group1 = { lenof(group1_list), group1_list };
 
+static dh_group *group14_cached;
 static const struct dh_extra extra_group14 = {
-    false, dh_group14_construct,
+    false, dh_group14_construct, &group14_cached,
 };
 
 static const ssh_kex ssh_diffiehellman_group14_sha256 = {
@@ -67,6 +130,42 @@ const ssh_kexes ssh_diffiehellman_group14 = {
     lenof(group14_list), group14_list
 };
 
+static dh_group *group16_cached;
+static const struct dh_extra extra_group16 = {
+    false, dh_group16_construct, &group16_cached,
+};
+
+static const ssh_kex ssh_diffiehellman_group16_sha512 = {
+    "diffie-hellman-group16-sha512", "group16",
+    KEXTYPE_DH, &ssh_sha512, &extra_group16,
+};
+
+static const ssh_kex *const group16_list[] = {
+    &ssh_diffiehellman_group16_sha512
+};
+
+const ssh_kexes ssh_diffiehellman_group16 = {
+    lenof(group16_list), group16_list
+};
+
+static dh_group *group18_cached;
+static const struct dh_extra extra_group18 = {
+    false, dh_group18_construct, &group18_cached,
+};
+
+static const ssh_kex ssh_diffiehellman_group18_sha512 = {
+    "diffie-hellman-group18-sha512", "group18",
+    KEXTYPE_DH, &ssh_sha512, &extra_group18,
+};
+
+static const ssh_kex *const group18_list[] = {
+    &ssh_diffiehellman_group18_sha512
+};
+
+const ssh_kexes ssh_diffiehellman_group18 = {
+    lenof(group18_list), group18_list
+};
+
 static const struct dh_extra extra_gex = { true };
 
 static const ssh_kex ssh_diffiehellman_gex_sha256 = {
@@ -126,12 +225,215 @@ const ssh_kexes ssh_gssk5_sha1_kex = {
 };
 
 /*
- * Common DH initialisation.
+ * Fill in the derived fields of a group whose p and g are set, and
+ * run the checks we can do cheaply on a group we didn't choose
+ * ourselves.
  */
-static void dh_init(dh_ctx *ctx)
+static void dh_group_init(dh_group *group)
 {
-    ctx->q = mp_rshift_fixed(ctx->p, 1);
-    ctx->x = ctx->e = NULL;
+    group->q = mp_rshift_fixed(group->p, 1);
+    group->mc = NULL;
+    group->invalid = NULL;
+    group->table = NULL;
+    group->table_windows = 0;
+    group->uses = 0;
+    group->npool = 0;
+    group->pool_nbits = -1;
+    group->refcount = 1;
+
+    if (!mp_get_bit(group->p, 0)) {
+        group->invalid = "modulus is even";
+        return;
+    }
+
+    group->mc = monty_new(group->p);
+
+    mp_int *pm1 = mp_copy(group->p);
+    mp_sub_integer_into(pm1, pm1, 1);
+    unsigned g_ok = mp_hs_integer(group->g, 2) & (mp_cmp_hs(group->g, pm1) ^ 1);
+    mp_free(pm1);
+    if (!g_ok)
+        group->invalid = "generator is out of range";
+}
+
+/*
+ * A single round of Miller-Rabin on p, with a random witness. This is
+ * only a sanity check on a group the server handed us (who could
+ * equally well have chosen a weak prime), so one round is enough to
+ * catch anything that isn't prime by mistake, and it costs about one
+ * full-width exponentiation. See sshprime.c for the details of the
+ * test.
+ */
+static bool dh_group_probably_prime(dh_group *group)
+{
+    MontyContext *mc = group->mc;
+    mp_int *p = group->p;
+
+    size_t k;
+    for (k = 0; mp_get_bit(p, k) == !k; k++)
+        continue;
+    mp_int *r = mp_rshift_safe(p, k);
+
+    mp_int *two = mp_from_integer(2);
+    mp_int *pm1 = mp_copy(p);
+    mp_sub_integer_into(pm1, pm1, 1);
+    mp_int *m_pm1 = monty_import(mc, pm1);
+
+    mp_int *w = mp_random_in_range(two, pm1);
+    monty_import_into(mc, w, w);
+    mp_int *z = monty_pow(mc, w, r);
+
+    bool passed = mp_cmp_eq(z, monty_identity(mc)) || mp_cmp_eq(z, m_pm1);
+    for (size_t i = 1; i < k && !passed; i++) {
+        monty_mul_into(mc, z, z, z);
+        passed = mp_cmp_eq(z, m_pm1);
+    }
+
+    mp_free(z);
+    mp_free(w);
+    mp_free(m_pm1);
+    mp_free(pm1);
+    mp_free(two);
+    mp_free(r);
+    return passed;
+}
+
+static void dh_group_flush_pool(dh_group *group)
+{
+    while (group->npool > 0) {
+        struct dh_pregen *key = &group->pool[--group->npool];
+        mp_free(key->x);
+        mp_free(key->e);
+        key->x = key->e = NULL;
+    }
+}
+
+static void dh_group_free(dh_group *group)
+{
+    dh_group_flush_pool(group);
+    for (size_t i = 0; i < 15 * group->table_windows; i++)
+        mp_free(group->table[i]);
+    sfree(group->table);
+    if (group->mc)
+        monty_free(group->mc);
+    mp_free(group->p);
+    mp_free(group->q);
+    mp_free(group->g);
+    sfree(group);
+}
+
+static void dh_group_unref(dh_group *group)
+{
+    if (--group->refcount == 0)
+        dh_group_free(group);
+}
+
+/*
+ * Extend the fixed-base table of a group so that it covers exponents
+ * of up to 4*windows bits.
+ */
+static void dh_group_extend_table(dh_group *group, size_t windows)
+{
+    MontyContext *mc = group->mc;
+    size_t i = group->table_windows;
+
+    if (windows <= i)
+        return;
+
+    group->table = sresize(group->table, 15 * windows, mp_int *);
+
+    /* base = g^(16^i), i.e. the d=1 entry of the first new window */
+    mp_int *base;
+    if (i == 0) {
+        base = monty_import(mc, group->g);
+    } else {
+        base = mp_copy(group->table[15 * i - 1]);
+        monty_mul_into(mc, base, base, group->table[15 * i - 15]);
+    }
+
+    for (; i < windows; i++) {
+        mp_int **row = group->table + 15 * i;
+        row[0] = base;
+        for (size_t d = 1; d < 15; d++)
+            row[d] = monty_mul(mc, row[d-1], base);
+        if (i + 1 < windows) {
+            base = mp_copy(row[14]);
+            monty_mul_into(mc, base, base, row[0]);
+        }
+    }
+
+    group->table_windows = windows;
+}
+
+static inline unsigned dh_window_eq(unsigned a, unsigned b)
+{
+    unsigned diff = a ^ b;
+    return 1 & ((diff - 1) >> (sizeof(diff) * CHAR_BIT - 1));
+}
+
+/*
+ * Compute g^x, in Montgomery form, using the fixed-base table. x must
+ * fit in the windows the table covers. Every table entry is touched
+ * for every window, so the memory access pattern doesn't depend on x.
+ */
+static mp_int *dh_group_fixed_pow(dh_group *group, mp_int *x)
+{
+    MontyContext *mc = group->mc;
+    mp_int *out = mp_copy(monty_identity(mc));
+    mp_int *entry = mp_new(mp_max_bits(group->p));
+
+    for (size_t i = 0; i < group->table_windows; i++) {
+        unsigned digit = (mp_get_bit(x, 4*i) |
+                          mp_get_bit(x, 4*i+1) << 1 |
+                          mp_get_bit(x, 4*i+2) << 2 |
+                          mp_get_bit(x, 4*i+3) << 3);
+        mp_int **row = group->table + 15 * i;
+        mp_copy_into(entry, monty_identity(mc));
+        for (unsigned d = 1; d < 16; d++)
+            mp_select_into(entry, entry, row[d-1], dh_window_eq(digit, d));
+        monty_mul_into(mc, out, out, entry);
+    }
+
+    mp_free(entry);
+    return out;
+}
+
+/*
+ * Cache of groups received in group exchange, most recently used
+ * first. The cache holds one reference to each group; a group evicted
+ * while some dh_ctx is still using it lives until that's cleaned up.
+ */
+#define DH_GEX_CACHE_SIZE 4
+static dh_group *gex_cache[DH_GEX_CACHE_SIZE];
+static size_t gex_cache_len;
+
+static dh_group *dh_gex_group(mp_int *pval, mp_int *gval)
+{
+    dh_group *group;
+    size_t i;
+
+    for (i = 0; i < gex_cache_len; i++) {
+        group = gex_cache[i];
+        if (mp_cmp_eq(group->p, pval) && mp_cmp_eq(group->g, gval))
+            goto found;
+    }
+
+    group = snew(dh_group);
+    group->p = mp_copy(pval);
+    group->g = mp_copy(gval);
+    dh_group_init(group);
+    if (!group->invalid && !dh_group_probably_prime(group))
+        group->invalid = "modulus is not prime";
+
+    if (gex_cache_len == DH_GEX_CACHE_SIZE)
+        dh_group_unref(gex_cache[--gex_cache_len]);
+    i = gex_cache_len++;
+
+  found:
+    memmove(gex_cache + 1, gex_cache, i * sizeof(*gex_cache));
+    gex_cache[0] = group;
+    group->refcount++;
+    return group;
 }
 
 bool dh_is_gex(const ssh_kex *kex)
@@ -147,30 +449,51 @@ dh_ctx *dh_setup_group(const ssh_kex *kex)
 {
     const struct dh_extra *extra = (const struct dh_extra *)kex->extra;
     assert(!extra->gex);
+
+    dh_group *group = *extra->cached;
+    if (!group) {
+        group = snew(dh_group);
+        extra->construct(group);
+        dh_group_init(group);
+        assert(!group->invalid);
+        *extra->cached = group;
+    }
+
     dh_ctx *ctx = snew(dh_ctx);
-    extra->construct(ctx);
-    dh_init(ctx);
+    ctx->group = group;
+    group->refcount++;
+    ctx->x = ctx->e = NULL;
     return ctx;
 }
 
 /*
- * Initialise DH for a server-supplied group.
+ * Initialise DH for a server-supplied group. The group must be
+ * checked with dh_validate_group before going any further.
  */
 dh_ctx *dh_setup_gex(mp_int *pval, mp_int *gval)
 {
     dh_ctx *ctx = snew(dh_ctx);
-    ctx->p = mp_copy(pval);
-    ctx->g = mp_copy(gval);
-    dh_init(ctx);
+    ctx->group = dh_gex_group(pval, gval);
+    ctx->x = ctx->e = NULL;
     return ctx;
 }
 
+/*
+ * Check that a group is one we're prepared to do DH in. Returns NULL
+ * if so, or an error message if not. The answer is remembered along
+ * with the group, so this is cheap for a group we've seen before.
+ */
+const char *dh_validate_group(dh_ctx *ctx)
+{
+    return ctx->group->invalid;
+}
+
 /*
  * Return size of DH modulus p.
  */
 int dh_modulus_bit_size(const dh_ctx *ctx)
 {
-    return mp_get_nbits(ctx->p);
+    return mp_get_nbits(ctx->group->p);
 }
 
 /*
@@ -182,18 +505,12 @@ void dh_cleanup(dh_ctx *ctx)
         mp_free(ctx->x);
     if (ctx->e)
         mp_free(ctx->e);
-    if (ctx->p)
-        mp_free(ctx->p);
-    if (ctx->g)
-        mp_free(ctx->g);
-    if (ctx->q)
-        mp_free(ctx->q);
+    dh_group_unref(ctx->group);
     sfree(ctx);
 }
 
 /*
- * DH stage 1: invent a number x between 1 and q, and compute e =
- * g^x mod p. Return e.
+ * Invent a number x between 1 and q, and compute e = g^x mod p.
  *
  * If `nbits' is greater than zero, it is used as an upper limit
  * for the number of bits in x. This is safe provided that (a) you
@@ -206,7 +523,8 @@ void dh_cleanup(dh_ctx *ctx)
  * Advances in Cryptology: Proceedings of Eurocrypt '96
  * Springer-Verlag, May 1996.
  */
-mp_int *dh_create_e(dh_ctx *ctx, int nbits)
+static void dh_group_make_key(dh_group *group, int nbits,
+                              mp_int **x_out, mp_int **e_out)
 {
     /*
      * Lower limit is just 2.
@@ -216,7 +534,7 @@ mp_int *dh_create_e(dh_ctx *ctx, int nbits)
     /*
      * Upper limit.
      */
-    mp_int *hi = mp_copy(ctx->q);
+    mp_int *hi = mp_copy(group->q);
     mp_sub_integer_into(hi, hi, 1);
     if (nbits) {
         mp_int *pow2 = mp_power_2(nbits+1);
@@ -228,18 +546,99 @@ mp_int *dh_create_e(dh_ctx *ctx, int nbits)
     /*
      * Make a random number in that range.
      */
-    ctx->x = mp_random_in_range(lo, hi);
+    mp_int *x = mp_random_in_range(lo, hi);
+    size_t windows = (mp_get_nbits(hi) + 3) / 4;
     mp_free(lo);
     mp_free(hi);
 
     /*
-     * Now compute e = g^x mod p.
+     * Now compute e = g^x mod p, from the table if the group has been
+     * used enough to have earned one.
      */
-    ctx->e = mp_modpow(ctx->g, ctx->x, ctx->p);
+    mp_int *m_e;
+    if (group->uses++ > 0) {
+        dh_group_extend_table(group, windows);
+        m_e = dh_group_fixed_pow(group, x);
+    } else {
+        mp_int *m_g = monty_import(group->mc, group->g);
+        m_e = monty_pow(group->mc, m_g, x);
+        mp_free(m_g);
+    }
+    *e_out = monty_export(group->mc, m_e);
+    mp_free(m_e);
+
+    *x_out = x;
+}
+
+/*
+ * DH stage 1: choose x and compute e = g^x mod p, as described
+ * above. Return e. We take x and e from the pool if there's a
+ * suitable pair waiting there.
+ */
+mp_int *dh_create_e(dh_ctx *ctx, int nbits)
+{
+    dh_group *group = ctx->group;
+    assert(!group->invalid);
+
+    if (nbits != group->pool_nbits) {
+        dh_group_flush_pool(group);
+        group->pool_nbits = nbits;
+    }
+
+    if (group->npool > 0) {
+        struct dh_pregen *key = &group->pool[--group->npool];
+        ctx->x = key->x;
+        ctx->e = key->e;
+        key->x = key->e = NULL;
+    } else {
+        dh_group_make_key(group, nbits, &ctx->x, &ctx->e);
+    }
 
     return ctx->e;
 }
 
+/*
+ * Add a key to the pool for a standard group, of the size last asked
+ * for in that group. Returns false if there's nothing to do, because
+ * the pool is full or the group hasn't been used yet. (We don't pool
+ * keys for group exchange, since a server rarely hands out the same
+ * group twice in a row.)
+ */
+bool dh_pregenerate(const ssh_kex *kex)
+{
+    const struct dh_extra *extra = (const struct dh_extra *)kex->extra;
+    if (extra->gex)
+        return false;
+
+    dh_group *group = *extra->cached;
+    if (!group || group->pool_nbits < 0 || group->npool >= DH_POOL_SIZE)
+        return false;
+
+    struct dh_pregen *key = &group->pool[group->npool++];
+    dh_group_make_key(group, group->pool_nbits, &key->x, &key->e);
+    return true;
+}
+
+/*
+ * Free the pooled keys for all the standard groups, wiping the
+ * private exponents. The groups themselves stay cached, but won't be
+ * pooled for again until another key exchange has said what size of
+ * key to make.
+ */
+void dh_free_pools(void)
+{
+    dh_group *const groups[] = {
+        group1_cached, group14_cached, group16_cached, group18_cached,
+    };
+
+    for (size_t i = 0; i < lenof(groups); i++) {
+        if (groups[i]) {
+            dh_group_flush_pool(groups[i]);
+            groups[i]->pool_nbits = -1;
+        }
+    }
+}
+
 /*
  * DH stage 2-epsilon: given a number f, validate it to ensure it's in
  * range. (RFC 4253 section 8: "Values of 'e' or 'f' that are not in
@@ -253,7 +652,7 @@ const char *dh_validate_f(dh_ctx *ctx, mp_int *f)
     if (!mp_hs_integer(f, 2)) {
         return "f value received is too small";
     } else {
-        mp_int *pm1 = mp_copy(ctx->p);
+        mp_int *pm1 = mp_copy(ctx->group->p);
         mp_sub_integer_into(pm1, pm1, 1);
         unsigned cmp = mp_cmp_hs(f, pm1);
         mp_free(pm1);
@@ -268,5 +667,11 @@ const char *dh_validate_f(dh_ctx *ctx, mp_int *f)
  */
 mp_int *dh_find_K(dh_ctx *ctx, mp_int *f)
 {
-    return mp_modpow(f, ctx->x, ctx->p);
+    MontyContext *mc = ctx->group->mc;
+    mp_int *m_f = monty_import(mc, f);
+    mp_int *m_K = monty_pow(mc, m_f, ctx->x);
+    mp_int *K = monty_export(mc, m_K);
+    mp_free(m_f);
+    mp_free(m_K);
+    return K;
 }
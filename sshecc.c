@@ -1290,12 +1290,26 @@ const ssh_keyalg ssh_ecdsa_nistp521 = {
  * Exposed ECDH interface
  */
 
+/*
+ * Each curve keeps a few keys generated in advance by
+ * ssh_ecdhkex_pregenerate, so that when a key exchange wants one, the
+ * scalar multiplication has already been done. (ssh2transport.c
+ * decides when there's time to do that.) A key is removed from the
+ * pool when it's handed out, so none is ever used twice.
+ */
+#define ECDH_POOL_SIZE 4
+struct ecdh_pool {
+    ecdh_key *keys[ECDH_POOL_SIZE];
+    size_t nkeys;
+};
+
 struct eckex_extra {
     struct ec_curve *(*curve)(void);
     void (*setup)(ecdh_key *dh);
     void (*cleanup)(ecdh_key *dh);
     void (*getpublic)(ecdh_key *dh, BinarySink *bs);
     mp_int *(*getkey)(ecdh_key *dh, ptrlen remoteKey);
+    struct ecdh_pool *pool;
 };
 
 struct ecdh_key {
@@ -1346,18 +1360,45 @@ static void ssh_ecdhkex_m_setup(ecdh_key *dh)
     dh->m_public = ecc_montgomery_multiply(dh->curve->m.G, dh->private);
 }
 
-ecdh_key *ssh_ecdhkex_newkey(const ssh_kex *kex)
+static ecdh_key *ssh_ecdhkex_generate(const struct eckex_extra *extra)
 {
-    const struct eckex_extra *extra = (const struct eckex_extra *)kex->extra;
-    const struct ec_curve *curve = extra->curve();
-
     ecdh_key *dh = snew(ecdh_key);
     dh->extra = extra;
-    dh->curve = curve;
+    dh->curve = extra->curve();
     dh->extra->setup(dh);
     return dh;
 }
 
+ecdh_key *ssh_ecdhkex_newkey(const ssh_kex *kex)
+{
+    const struct eckex_extra *extra = (const struct eckex_extra *)kex->extra;
+    struct ecdh_pool *pool = extra->pool;
+
+    if (pool->nkeys) {
+        ecdh_key *dh = pool->keys[--pool->nkeys];
+        pool->keys[pool->nkeys] = NULL;
+        return dh;
+    }
+
+    return ssh_ecdhkex_generate(extra);
+}
+
+/*
+ * Add a key to the pool for this kex method. Returns false if the
+ * pool was already full.
+ */
+bool ssh_ecdhkex_pregenerate(const ssh_kex *kex)
+{
+    const struct eckex_extra *extra = (const struct eckex_extra *)kex->extra;
+    struct ecdh_pool *pool = extra->pool;
+
+    if (pool->nkeys >= ECDH_POOL_SIZE)
+        return false;
+
+    pool->keys[pool->nkeys++] = ssh_ecdhkex_generate(extra);
+    return true;
+}
+
 static void ssh_ecdhkex_w_getpublic(ecdh_key *dh, BinarySink *bs)
 {
     put_wpoint(bs, dh->w_public, dh->curve, true);
@@ -1475,48 +1516,56 @@ void ssh_ecdhkex_freekey(ecdh_key *dh)
     sfree(dh);
 }
 
+static struct ecdh_pool pool_curve25519;
 static const struct eckex_extra kex_extra_curve25519 = {
     ec_curve25519,
     ssh_ecdhkex_m_setup,
     ssh_ecdhkex_m_cleanup,
     ssh_ecdhkex_m_getpublic,
     ssh_ecdhkex_m_getkey,
+    &pool_curve25519,
 };
 const ssh_kex ssh_ec_kex_curve25519 = {
     "curve25519-sha256@libssh.org", NULL, KEXTYPE_ECDH,
     &ssh_sha256, &kex_extra_curve25519,
 };
 
+static struct ecdh_pool pool_nistp256;
 static const struct eckex_extra kex_extra_nistp256 = {
     ec_p256,
     ssh_ecdhkex_w_setup,
     ssh_ecdhkex_w_cleanup,
     ssh_ecdhkex_w_getpublic,
     ssh_ecdhkex_w_getkey,
+    &pool_nistp256,
 };
 const ssh_kex ssh_ec_kex_nistp256 = {
     "ecdh-sha2-nistp256", NULL, KEXTYPE_ECDH,
     &ssh_sha256, &kex_extra_nistp256,
 };
 
+static struct ecdh_pool pool_nistp384;
 static const struct eckex_extra kex_extra_nistp384 = {
     ec_p384,
     ssh_ecdhkex_w_setup,
     ssh_ecdhkex_w_cleanup,
     ssh_ecdhkex_w_getpublic,
     ssh_ecdhkex_w_getkey,
+    &pool_nistp384,
 };
 const ssh_kex ssh_ec_kex_nistp384 = {
     "ecdh-sha2-nistp384", NULL, KEXTYPE_ECDH,
     &ssh_sha384, &kex_extra_nistp384,
 };
 
+static struct ecdh_pool pool_nistp521;
 static const struct eckex_extra kex_extra_nistp521 = {
     ec_p521,
     ssh_ecdhkex_w_setup,
     ssh_ecdhkex_w_cleanup,
     ssh_ecdhkex_w_getpublic,
     ssh_ecdhkex_w_getkey,
+    &pool_nistp521,
 };
 const ssh_kex ssh_ec_kex_nistp521 = {
     "ecdh-sha2-nistp521", NULL, KEXTYPE_ECDH,
@@ -1530,6 +1579,23 @@ static const ssh_kex *const ec_kex_list[] = {
     &ssh_ec_kex_nistp521,
 };
 
+/*
+ * Free every key still waiting in the pools, wiping the private
+ * values.
+ */
+void ssh_ecdhkex_free_pools(void)
+{
+    for (size_t i = 0; i < lenof(ec_kex_list); i++) {
+        const struct eckex_extra *extra =
+            (const struct eckex_extra *)ec_kex_list[i]->extra;
+        struct ecdh_pool *pool = extra->pool;
+        while (pool->nkeys) {
+            ssh_ecdhkex_freekey(pool->keys[--pool->nkeys]);
+            pool->keys[pool->nkeys] = NULL;
+        }
+    }
+}
+
 const ssh_kexes ssh_ecdh_kex = { lenof(ec_kex_list), ec_kex_list };
 
 /* ----------------------------------------------------------------------
@@ -28,13 +28,18 @@ struct server {
     PacketLogSettings pls;
     LogContext *logctx;
     struct DataTransferStats stats;
+    SshStats rtstats;
+
+    SshServerStats *srvstats;
+    unsigned long start_time;
+    bool first_kex_done;
 
     int remote_bugs;
 
     Socket *socket;
     Plug plug;
     int conn_throttle_count;
-    bool frozen;
+    bool frozen, throttled_all;
 
     Conf *conf;
     const SshServerConfig *ssc;
@@ -63,6 +68,7 @@ static void server_got_ssh_version(struct ssh_version_receiver *rcv,
                                    int major_version);
 static void server_connect_bpp(server *srv);
 static void server_bpp_output_raw_data_callback(void *vctx);
+static void srv_throttle_all(server *srv, bool enable);
 
 void share_activate(ssh_sharing_state *sharestate,
                     const char *server_verstring) {}
@@ -101,6 +107,22 @@ static int server_confirm_weak_cached_hostkey(
     Seat *seat, const char *algname, const char *betteralgs,
     void (*callback)(void *ctx, int result), void *ctx) { return 1; }
 
+static void server_kex_finished(Seat *seat)
+{
+    server *srv = container_of(seat, server, seat);
+
+    if (!srv->srvstats)
+        return;
+
+    srv->srvstats->nkex++;
+    if (!srv->first_kex_done) {
+        srv->first_kex_done = true;
+        srv->srvstats->kex_msec += (uint64_t)(GETTICKCOUNT() -
+                                              srv->start_time) *
+            1000 / TICKSPERSEC;
+    }
+}
+
 static const SeatVtable server_seat_vt = {
     nullseat_output,
     nullseat_eof,
@@ -122,6 +144,7 @@ static const SeatVtable server_seat_vt = {
     nullseat_set_trust_status,
     nullseat_verbose_no,
     nullseat_interactive_no,
+    server_kex_finished,
 };
 
 static void server_socket_log(Plug *plug, PlugLogType type, SockAddr *addr,
@@ -153,6 +176,9 @@ static void server_receive(
         log_packet(srv->logctx, PKT_INCOMING, -1, NULL, data, len,
                    0, NULL, NULL, 0, NULL);
 
+    if (srv->srvstats)
+        srv->srvstats->bytes_in += len;
+
     bufchain_add(&srv->in_raw, data, len);
     if (!srv->frozen && srv->bpp)
         queue_idempotent_callback(&srv->bpp->ic_in_raw);
@@ -160,20 +186,18 @@ static void server_receive(
 
 static void server_sent(Plug *plug, size_t bufsize)
 {
-#ifdef FIXME
     server *srv = container_of(plug, server, plug);
 
     /*
-     * If the send backlog on the SSH socket itself clears, we should
-     * unthrottle the whole world if it was throttled. Also trigger an
+     * If the send backlog on the SSH socket itself clears, trigger an
      * extra call to the consumer of the BPP's output, to try to send
-     * some more data off its bufchain.
+     * some more data off its bufchain: it gives up when the backlog
+     * gets too big, and nothing else will restart it if the BPP has
+     * no more packets to add. That will also unthrottle the whole
+     * world, once it has emptied the bufchain.
      */
-    if (bufsize < SSH_MAX_BACKLOG) {
-        srv_throttle_all(srv, 0, bufsize);
+    if (bufsize < SSH_MAX_BACKLOG)
         queue_idempotent_callback(&srv->ic_out_raw);
-    }
-#endif
 }
 
 LogContext *ssh_get_logctx(Ssh *ssh)
@@ -182,6 +206,20 @@ LogContext *ssh_get_logctx(Ssh *ssh)
     return srv->logctx;
 }
 
+/*
+ * Throttle or unthrottle _all_ local data streams (for when sends
+ * on the SSH connection itself back up).
+ */
+static void srv_throttle_all(server *srv, bool enable)
+{
+    if (enable == srv->throttled_all)
+        return;
+    srv->throttled_all = enable;
+
+    if (srv->cl)
+        ssh_throttle_all_channels(srv->cl, enable);
+}
+
 void ssh_throttle_conn(Ssh *ssh, int adjust)
 {
     server *srv = container_of(ssh, server, ssh);
@@ -193,6 +231,7 @@ void ssh_throttle_conn(Ssh *ssh, int adjust)
 
     if (srv->conn_throttle_count && !old_count) {
         frozen = true;
+        srv->rtstats.conn_throttles++;
     } else if (!srv->conn_throttle_count && old_count) {
         frozen = false;
     } else {
@@ -249,6 +288,7 @@ Plug *ssh_server_plug(
     server *srv = snew(server);
 
     memset(srv, 0, sizeof(server));
+    ssh_stats_init(&srv->rtstats);
 
     srv->plug.vt = &ssh_server_plugvt;
     srv->conf = conf_copy(conf);
@@ -266,6 +306,8 @@ Plug *ssh_server_plug(
 
     bufchain_init(&srv->in_raw);
     bufchain_init(&srv->out_raw);
+    bufchain_set_max_granule(&srv->in_raw, 65536);
+    bufchain_set_max_granule(&srv->out_raw, 65536);
     bufchain_init(&srv->dummy_user_input);
 
 #ifndef NO_GSSAPI
@@ -277,6 +319,12 @@ Plug *ssh_server_plug(
     return &srv->plug;
 }
 
+void ssh_server_set_stats(Plug *plug, SshServerStats *stats)
+{
+    server *srv = container_of(plug, server, plug);
+    srv->srvstats = stats;
+}
+
 void ssh_server_start(Plug *plug, Socket *socket)
 {
     server *srv = container_of(plug, server, plug);
@@ -294,6 +342,7 @@ void ssh_server_start(Plug *plug, Socket *socket)
     }
 
     srv->socket = socket;
+    srv->start_time = GETTICKCOUNT();
 
     srv->ic_out_raw.fn = server_bpp_output_raw_data_callback;
     srv->ic_out_raw.ctx = srv;
@@ -342,6 +391,7 @@ static void ssh_server_free_callback(void *vsrv)
 static void server_connect_bpp(server *srv)
 {
     srv->bpp->ssh = &srv->ssh;
+    srv->bpp->rtstats = &srv->rtstats;
     srv->bpp->in_raw = &srv->in_raw;
     srv->bpp->out_raw = &srv->out_raw;
     bufchain_set_callback(srv->bpp->out_raw, &srv->ic_out_raw);
@@ -379,17 +429,19 @@ static void server_bpp_output_raw_data_callback(void *vctx)
             log_packet(srv->logctx, PKT_OUTGOING, -1, NULL, data.ptr, data.len,
                        0, NULL, NULL, 0, NULL);
         backlog = sk_write(srv->socket, data.ptr, data.len);
+        if (srv->srvstats)
+            srv->srvstats->bytes_out += data.len;
 
         bufchain_consume(&srv->out_raw, data.len);
 
         if (backlog > SSH_MAX_BACKLOG) {
-#ifdef FIXME
-            ssh_throttle_all(ssh, 1, backlog);
-#endif
+            srv_throttle_all(srv, true);
             return;
         }
     }
 
+    srv_throttle_all(srv, false);
+
     if (srv->pending_close) {
         sk_close(srv->socket);
         srv->socket = NULL;
@@ -26,6 +26,19 @@ Plug *ssh_server_plug(
     const SftpServerVtable *sftpserver_vt);
 void ssh_server_start(Plug *plug, Socket *socket);
 
+/*
+ * Running totals that a server instance can be asked to add its own
+ * activity into. The same SshServerStats can be shared between many
+ * instances, so that a front end can keep aggregate figures for
+ * everything it has served.
+ */
+struct SshServerStats {
+    uint64_t bytes_in, bytes_out;      /* raw data on the network socket */
+    unsigned long nkex;                /* completed key exchanges */
+    uint64_t kex_msec;  /* total time from connection start to first NEWKEYS */
+};
+void ssh_server_set_stats(Plug *plug, SshServerStats *stats);
+
 void server_instance_terminated(LogPolicy *logpolicy);
 void platform_logevent(const char *msg);
 
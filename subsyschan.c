@@ -0,0 +1,214 @@
+/*
+ * Extra session channels running a subsystem, opened by a client
+ * alongside its main channel. PSFTP and PSCP use these to run
+ * further SFTP sessions over the same SSH connection.
+ *
+ * Unlike the main channel, these aren't connected to the Seat at
+ * all. Incoming data is simply buffered, and the front end polls
+ * for it while it runs its own event loop.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "putty.h"
+#include "ssh.h"
+#include "sshppl.h"
+#include "sshchan.h"
+
+static void subsyschan_free(Channel *chan);
+static void subsyschan_open_confirmation(Channel *chan);
+static void subsyschan_open_failure(Channel *chan, const char *errtext);
+static size_t subsyschan_send(
+    Channel *chan, bool is_stderr, const void *, size_t);
+static void subsyschan_send_eof(Channel *chan);
+static void subsyschan_set_input_wanted(Channel *chan, bool wanted);
+static char *subsyschan_log_close_msg(Channel *chan);
+static void subsyschan_request_response(Channel *chan, bool success);
+
+static const struct ChannelVtable subsyschan_channelvt = {
+    subsyschan_free,
+    subsyschan_open_confirmation,
+    subsyschan_open_failure,
+    subsyschan_send,
+    subsyschan_send_eof,
+    subsyschan_set_input_wanted,
+    subsyschan_log_close_msg,
+    chan_default_want_close,
+    chan_no_exit_status,
+    chan_no_exit_signal,
+    chan_no_exit_signal_numeric,
+    chan_no_run_shell,
+    chan_no_run_command,
+    chan_no_run_subsystem,
+    chan_no_enable_x11_forwarding,
+    chan_no_enable_agent_forwarding,
+    chan_no_allocate_pty,
+    chan_no_set_env,
+    chan_no_send_break,
+    chan_no_send_signal,
+    chan_no_change_window_size,
+    subsyschan_request_response,
+};
+
+struct SubsysChannel {
+    SshChannel *sc;                    /* NULL once the channel is gone */
+    char *subsystem;
+    bufchain input;
+
+    bool ready, failed;
+
+    /*
+     * The structure is shared between the connection layer (which
+     * owns the Channel, and calls chan_free when the channel goes
+     * away) and the front end (which owns the SubsysChannel handle,
+     * and calls subsyschan_close when it's finished). Whichever
+     * lets go second frees it.
+     */
+    bool chan_freed, handle_freed;
+
+    Channel chan;
+};
+
+SubsysChannel *subsyschan_new(ConnectionLayer *cl, const char *subsystem)
+{
+    SubsysChannel *sub = snew(SubsysChannel);
+    memset(sub, 0, sizeof(SubsysChannel));
+    sub->subsystem = dupstr(subsystem);
+    bufchain_init(&sub->input);
+
+    sub->chan.vt = &subsyschan_channelvt;
+    sub->chan.initial_fixed_window_size = 0;
+    sub->sc = ssh_session_open(cl, &sub->chan);
+
+    return sub;
+}
+
+static void subsyschan_free_if_done(SubsysChannel *sub)
+{
+    if (sub->chan_freed && sub->handle_freed) {
+        bufchain_clear(&sub->input);
+        sfree(sub->subsystem);
+        sfree(sub);
+    }
+}
+
+static void subsyschan_free(Channel *chan)
+{
+    assert(chan->vt == &subsyschan_channelvt);
+    SubsysChannel *sub = container_of(chan, SubsysChannel, chan);
+
+    sub->sc = NULL;
+    sub->failed = true;        /* nothing more can arrive or be sent */
+    sub->chan_freed = true;
+    subsyschan_free_if_done(sub);
+}
+
+static void subsyschan_open_confirmation(Channel *chan)
+{
+    assert(chan->vt == &subsyschan_channelvt);
+    SubsysChannel *sub = container_of(chan, SubsysChannel, chan);
+
+    /* All our incoming data is buffered without limit, so the
+     * connection layer may as well use the large windows it keeps
+     * for that case. */
+    sshfwd_hint_channel_is_simple(sub->sc);
+
+    if (!sshfwd_start_subsystem(sub->sc, true, sub->subsystem))
+        sub->failed = true;
+}
+
+static void subsyschan_open_failure(Channel *chan, const char *errtext)
+{
+    assert(chan->vt == &subsyschan_channelvt);
+    SubsysChannel *sub = container_of(chan, SubsysChannel, chan);
+
+    sub->failed = true;
+}
+
+static void subsyschan_request_response(Channel *chan, bool success)
+{
+    assert(chan->vt == &subsyschan_channelvt);
+    SubsysChannel *sub = container_of(chan, SubsysChannel, chan);
+
+    /* The only request we ever make is the one to start the
+     * subsystem. */
+    if (success)
+        sub->ready = true;
+    else
+        sub->failed = true;
+}
+
+static size_t subsyschan_send(Channel *chan, bool is_stderr,
+                              const void *data, size_t length)
+{
+    assert(chan->vt == &subsyschan_channelvt);
+    SubsysChannel *sub = container_of(chan, SubsysChannel, chan);
+
+    if (!is_stderr)
+        bufchain_add(&sub->input, data, length);
+    return 0;
+}
+
+static void subsyschan_send_eof(Channel *chan)
+{
+    assert(chan->vt == &subsyschan_channelvt);
+    SubsysChannel *sub = container_of(chan, SubsysChannel, chan);
+
+    /* A subsystem that stops talking to us is no further use. */
+    sub->failed = true;
+}
+
+static void subsyschan_set_input_wanted(Channel *chan, bool wanted)
+{
+    /* We have no local input source to throttle. */
+}
+
+static char *subsyschan_log_close_msg(Channel *chan)
+{
+    assert(chan->vt == &subsyschan_channelvt);
+    SubsysChannel *sub = container_of(chan, SubsysChannel, chan);
+
+    return dupprintf("Extra %s channel closed", sub->subsystem);
+}
+
+bool subsyschan_ready(SubsysChannel *sub)
+{
+    return sub->ready && !sub->failed;
+}
+
+bool subsyschan_failed(SubsysChannel *sub)
+{
+    return sub->failed;
+}
+
+size_t subsyschan_write(SubsysChannel *sub, const void *data, size_t len)
+{
+    assert(sub->sc && !sub->failed);
+    return sshfwd_write(sub->sc, data, len);
+}
+
+size_t subsyschan_sendbuffer(SubsysChannel *sub)
+{
+    if (!sub->sc || sub->failed)
+        return 0;
+    return sshfwd_backlog(sub->sc);
+}
+
+bufchain *subsyschan_input(SubsysChannel *sub)
+{
+    return &sub->input;
+}
+
+void subsyschan_close(SubsysChannel *sub)
+{
+    sub->handle_freed = true;
+    if (sub->sc) {
+        /* The connection layer calls subsyschan_free later, once the
+         * close has gone through, and that frees the structure. */
+        sshfwd_initiate_close(sub->sc, NULL);
+    } else {
+        subsyschan_free_if_done(sub);
+    }
+}
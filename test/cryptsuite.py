@@ -1360,6 +1360,113 @@ class crypt(MyTestBase):
             '7964541892e7511798e61dd78429358f4d6a887a50d2c5ebccf0e04f48fc665c'
         ))
 
+    def testDHKex(self):
+        # Round-trip Diffie-Hellman in each of the standard groups.
+        # Each group is used several times, so that later rounds go
+        # through the fixed-base table rather than a plain modpow; if
+        # the table were wrong, e would come out wrong and the two
+        # sides would disagree about K. The last round asks for a full
+        # size exponent, which makes the table grow.
+        for group, bits in [('group1', 1024), ('group14', 2048),
+                            ('group16', 4096), ('group18', 8192)]:
+            for nbits in [256, 256, 256, 0]:
+                if nbits == 0 and bits > 2048:
+                    continue # too slow to be worth it
+                with self.subTest(group=group, nbits=nbits):
+                    alice = dh_setup_group(group)
+                    bob = dh_setup_group(group)
+                    self.assertEqual(int(dh_modulus_bit_size(alice)), bits)
+                    self.assertTrue(dh_validate_group(alice))
+                    with random_prng("dh kex test {} {}".format(group, nbits)):
+                        ea = dh_create_e(alice, nbits)
+                        eb = dh_create_e(bob, nbits)
+                    self.assertTrue(dh_validate_f(alice, eb))
+                    self.assertTrue(dh_validate_f(bob, ea))
+                    self.assertEqual(int(dh_find_K(alice, eb)),
+                                     int(dh_find_K(bob, ea)))
+
+    def testDHGexValidation(self):
+        p14 = int(mp_from_hex(
+            'FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74'
+            '020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437'
+            '4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED'
+            'EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05'
+            '98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB'
+            '9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B'
+            'E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF695581718'
+            '3995497CEA956AE515D2261898FA051015728E5A8AACAA68FFFFFFFFFFFFFFFF'))
+
+        def valid(p, g):
+            with random_prng("dh gex validation {:x} {:x}".format(p, g)):
+                return dh_validate_group(dh_setup_gex(p, g))
+
+        self.assertTrue(valid(p14, 2))
+        self.assertTrue(valid(p14, 2)) # now from the cache
+        self.assertFalse(valid(p14 + 1, 2)) # even
+        self.assertFalse(valid(p14 * 3, 2)) # composite
+        self.assertFalse(valid(p14, 1))
+        self.assertFalse(valid(p14, p14 - 1))
+
+        # A group from the cache still does key exchange correctly.
+        for i in range(3):
+            with random_prng("dh gex kex test {}".format(i)):
+                alice = dh_setup_gex(p14, 2)
+                bob = dh_setup_gex(p14, 2)
+                ea = dh_create_e(alice, 256)
+                eb = dh_create_e(bob, 256)
+            self.assertEqual(int(dh_find_K(alice, eb)),
+                             int(dh_find_K(bob, ea)))
+
+    def testKexKeyPool(self):
+        # Keys handed out from the pregenerated pools must each be
+        # different, and must still work.
+        with random_prng("ecdh key pool test"):
+            for i in range(4):
+                self.assertTrue(ssh_ecdhkex_pregenerate('curve25519'))
+            self.assertFalse(ssh_ecdhkex_pregenerate('curve25519'))
+            # four from the pool, then one made on the spot
+            keys = [ssh_ecdhkex_newkey('curve25519') for i in range(5)]
+        pubs = [ssh_ecdhkex_getpublic(k) for k in keys]
+        self.assertEqual(len(set(pubs)), len(pubs))
+        self.assertEqual(int(ssh_ecdhkex_getkey(keys[0], pubs[1])),
+                         int(ssh_ecdhkex_getkey(keys[1], pubs[0])))
+
+        with random_prng("dh key pool test"):
+            # Nothing to pool until we know what size of key to make.
+            dh_create_e(dh_setup_group('group1'), 256)
+            self.assertTrue(dh_pregenerate('group1'))
+            self.assertTrue(dh_pregenerate('group1'))
+            self.assertFalse(dh_pregenerate('group1'))
+            ctxs = [dh_setup_group('group1') for i in range(3)]
+            es = [dh_create_e(ctx, 256) for ctx in ctxs]
+            self.assertEqual(len(set(map(int, es))), len(es))
+            self.assertEqual(int(dh_find_K(ctxs[0], es[1])),
+                             int(dh_find_K(ctxs[1], es[0])))
+
+            # Asking for a different size discards the pool, and
+            # refills it at the new size.
+            self.assertTrue(dh_pregenerate('group1'))
+            self.assertTrue(dh_pregenerate('group1'))
+            dh_create_e(dh_setup_group('group1'), 512)
+            self.assertTrue(dh_pregenerate('group1'))
+            self.assertTrue(dh_pregenerate('group1'))
+            self.assertFalse(dh_pregenerate('group1'))
+
+            # Freeing the pools empties them, and a DH group isn't
+            # pooled for again until it's next used.
+            dh_free_pools()
+            self.assertFalse(dh_pregenerate('group1'))
+            dh_create_e(dh_setup_group('group1'), 256)
+            self.assertTrue(dh_pregenerate('group1'))
+
+            self.assertTrue(ssh_ecdhkex_pregenerate('curve25519'))
+            ssh_ecdhkex_free_pools()
+            for i in range(4):
+                self.assertTrue(ssh_ecdhkex_pregenerate('curve25519'))
+            self.assertFalse(ssh_ecdhkex_pregenerate('curve25519'))
+            ssh_ecdhkex_free_pools()
+            dh_free_pools()
+
     def testMontgomeryKexLowOrderPoints(self):
         # List of all the bad input values for Curve25519 which can
         # end up generating a zero output key. You can find the first
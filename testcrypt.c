@@ -315,6 +315,8 @@ static const ssh_kex *get_dh_group(BinarySource *in)
     } algs[] = {
         {"group1", &ssh_diffiehellman_group1},
         {"group14", &ssh_diffiehellman_group14},
+        {"group16", &ssh_diffiehellman_group16},
+        {"group18", &ssh_diffiehellman_group18},
     };
 
     ptrlen name = get_word(in);
@@ -812,12 +814,25 @@ strbuf *ssh2_mac_genresult_wrapper(ssh2_mac *m)
 #undef ssh2_mac_genresult
 #define ssh2_mac_genresult ssh2_mac_genresult_wrapper
 
+mp_int *dh_create_e_wrapper(dh_ctx *dh, int nbits)
+{
+    /* the returned value belongs to the dh_ctx, so give Python a copy */
+    return mp_copy(dh_create_e(dh, nbits));
+}
+#define dh_create_e dh_create_e_wrapper
+
 bool dh_validate_f_wrapper(dh_ctx *dh, mp_int *f)
 {
     return dh_validate_f(dh, f) == NULL;
 }
 #define dh_validate_f dh_validate_f_wrapper
 
+bool dh_validate_group_wrapper(dh_ctx *dh)
+{
+    return dh_validate_group(dh) == NULL;
+}
+#define dh_validate_group dh_validate_group_wrapper
+
 void ssh_hash_update(ssh_hash *h, ptrlen pl)
 {
     put_datapl(h, pl);
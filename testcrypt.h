@@ -192,8 +192,11 @@ FUNC3(val_string, ssh_cipher_decrypt_length, val_cipher, val_string_ptrlen, uint
  */
 FUNC1(val_dh, dh_setup_group, dh_group)
 FUNC2(val_dh, dh_setup_gex, val_mpint, val_mpint)
+FUNC1(boolean, dh_validate_group, val_dh)
 FUNC1(uint, dh_modulus_bit_size, val_dh)
 FUNC2(val_mpint, dh_create_e, val_dh, uint)
+FUNC1(boolean, dh_pregenerate, dh_group)
+FUNC0(void, dh_free_pools)
 FUNC2(boolean, dh_validate_f, val_dh, val_mpint)
 FUNC2(val_mpint, dh_find_K, val_dh, val_mpint)
 
@@ -201,6 +204,8 @@ FUNC2(val_mpint, dh_find_K, val_dh, val_mpint)
  * Elliptic-curve Diffie-Hellman.
  */
 FUNC1(val_ecdh, ssh_ecdhkex_newkey, ecdh_alg)
+FUNC1(boolean, ssh_ecdhkex_pregenerate, ecdh_alg)
+FUNC0(void, ssh_ecdhkex_free_pools)
 FUNC2(void, ssh_ecdhkex_getpublic, val_ecdh, out_val_string_binarysink)
 FUNC2(opt_val_mpint, ssh_ecdhkex_getkey, val_ecdh, val_string_ptrlen)
 
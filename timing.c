@@ -25,91 +25,299 @@
  * fired OR before the time it was set. In the latter case the clock must
  * have jumped, the former is (probably) just the normal passage of time.
  *
+ *
+ * A server or a port-forwarding session can have a great many timers
+ * live at once (a keepalive and a rekey timer per connection, and so
+ * on), so they're kept in a hierarchical timing wheel rather than a
+ * sorted tree. Level 0 of the wheel has a slot for each of the next
+ * 256 ticks; each level above it has 64 slots, each covering as many
+ * ticks as the whole of the level below. A timer is filed in the
+ * lowest level whose range reaches its due time, and whenever the
+ * wheel's notion of the current time crosses into a new slot of a
+ * higher level, the timers in that slot are 'cascaded' down to
+ * wherever they now belong. Five levels cover the whole range of a
+ * 32-bit tick count, so scheduling a timer is constant time.
+ *
+ * Every timer is also on a chain in a hash table indexed by its
+ * context pointer, so that expire_timer_context() can find and free
+ * all of a context's timers without searching.
  */
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "putty.h"
-#include "tree234.h"
 
 struct timer {
+    struct timer *next, **prevp;       /* wheel slot, or list being run */
+    struct timer *hnext, **hprevp;     /* context hash chain */
+
     timer_fn_t fn;
     void *ctx;
     unsigned long now;
     unsigned long when_set;
+    int level;                         /* -1 if on a list being run */
 };
 
-static tree234 *timers = NULL;
-static tree234 *timer_contexts = NULL;
+#define WHEEL_BITS0 8
+#define WHEEL_BITS 6
+#define WHEEL_LEVELS 5
+#define WHEEL_SIZE0 (1 << WHEEL_BITS0)
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+
+static struct timer *wheel0[WHEEL_SIZE0];
+static struct timer *wheel[WHEEL_LEVELS - 1][WHEEL_SIZE];
+static size_t level_count[WHEEL_LEVELS];
+
+/*
+ * 'wheel_time' is the next tick the wheel has yet to process: every
+ * timer due before it has already been taken out and run.
+ */
+static unsigned long wheel_time;
+
+static struct timer **ctxhash;
+static size_t ctxhash_size, ntimers;
+
+/*
+ * Cache of the time the earliest timer is due, because the front end
+ * asks for it on every pass of its event loop, and it only changes
+ * when a timer is added, or the earliest one is run or expired.
+ */
+static bool next_valid;
+static unsigned long next_time;
+
+/* Spare nodes, as in callback.c */
+#define TIMER_POOL_MAX 1024
+static struct timer *timer_free_list;
+static size_t timer_free_count;
+
+static bool timers_initialised = false;
 static unsigned long now = 0L;
 
-static int compare_timers(void *av, void *bv)
+static void init_timers(void)
+{
+    if (!timers_initialised) {
+        now = GETTICKCOUNT();
+        wheel_time = now;
+        timers_initialised = true;
+    }
+}
+
+static inline int wheel_shift(int level)
 {
-    struct timer *a = (struct timer *)av;
-    struct timer *b = (struct timer *)bv;
-    long at = a->now - now;
-    long bt = b->now - now;
+    return level ? WHEEL_BITS0 + (level - 1) * WHEEL_BITS : 0;
+}
 
-    if (at < bt)
-        return -1;
-    else if (at > bt)
-        return +1;
+static inline unsigned wheel_index(int level, unsigned long when)
+{
+    return (when >> wheel_shift(level)) &
+        (level ? WHEEL_SIZE - 1 : WHEEL_SIZE0 - 1);
+}
 
-    /*
-     * Failing that, compare on the other two fields, just so that
-     * we don't get unwanted equality.
-     */
-#if defined(__LCC__) || defined(__clang__)
-    /* lcc won't let us compare function pointers. Legal, but annoying. */
-    {
-        int c = memcmp(&a->fn, &b->fn, sizeof(a->fn));
-        if (c)
-            return c;
+static inline struct timer **wheel_slot(int level, unsigned index)
+{
+    return level ? &wheel[level - 1][index] : &wheel0[index];
+}
+
+static void list_insert(struct timer **head, struct timer *t)
+{
+    t->next = *head;
+    if (t->next)
+        t->next->prevp = &t->next;
+    t->prevp = head;
+    *head = t;
+}
+
+static void list_remove(struct timer *t)
+{
+    *t->prevp = t->next;
+    if (t->next)
+        t->next->prevp = t->prevp;
+}
+
+static void wheel_insert(struct timer *t)
+{
+    unsigned long delta = t->now - wheel_time;
+    struct timer **slot;
+    int level;
+
+    if ((long)delta < 0) {
+        /* Already overdue; have it run the next time the wheel turns */
+        level = 0;
+        slot = &wheel0[wheel_index(0, wheel_time)];
+    } else {
+        for (level = 0; level < WHEEL_LEVELS - 1; level++)
+            if (delta < 1UL << wheel_shift(level + 1))
+                break;
+        slot = wheel_slot(level, wheel_index(level, t->now));
     }
-#else
-    if (a->fn < b->fn)
-        return -1;
-    else if (a->fn > b->fn)
-        return +1;
-#endif
-
-    if (a->ctx < b->ctx)
-        return -1;
-    else if (a->ctx > b->ctx)
-        return +1;
 
-    /*
-     * Failing _that_, the two entries genuinely are equal, and we
-     * never have a need to store them separately in the tree.
-     */
-    return 0;
+    list_insert(slot, t);
+    t->level = level;
+    level_count[level]++;
 }
 
-static int compare_timer_contexts(void *av, void *bv)
+static void wheel_remove(struct timer *t)
 {
-    char *a = (char *)av;
-    char *b = (char *)bv;
-    if (a < b)
-        return -1;
-    else if (a > b)
-        return +1;
-    return 0;
+    list_remove(t);
+    if (t->level >= 0)
+        level_count[t->level]--;
+    if (next_valid && (long)(t->now - next_time) <= 0)
+        next_valid = false;
 }
 
-static void init_timers(void)
+/*
+ * Move the timers in one slot of a higher level down to wherever
+ * they belong now. Returns the index of the slot, so the caller can
+ * tell whether this level has wrapped round and the one above it
+ * needs cascading too.
+ */
+static unsigned wheel_cascade(int level)
 {
-    if (!timers) {
-        timers = newtree234(compare_timers);
-        timer_contexts = newtree234(compare_timer_contexts);
-        now = GETTICKCOUNT();
+    unsigned index = wheel_index(level, wheel_time);
+    struct timer **slot = wheel_slot(level, index);
+    struct timer *t, *next;
+
+    for (t = *slot, *slot = NULL; t; t = next) {
+        next = t->next;
+        level_count[level]--;
+        wheel_insert(t);
+    }
+    return index;
+}
+
+static size_t wheel_count(void)
+{
+    size_t total = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+        total += level_count[level];
+    return total;
+}
+
+/*
+ * Find when the front end next needs to call run_timers. Level 0
+ * maps straight on to ticks, so the first occupied slot there gives
+ * an exact answer. In a higher level, we only report the time the
+ * first occupied slot will be cascaded, which is no later than any
+ * timer in it is due; that costs at most an early wakeup or two,
+ * where finding the exact time would mean searching a slot that
+ * might hold thousands of timers.
+ */
+static bool wheel_next(unsigned long *next)
+{
+    bool found = false;
+    unsigned long best = 0;
+
+    if (level_count[0]) {
+        for (unsigned i = 0; i < WHEEL_SIZE0; i++) {
+            if (wheel0[wheel_index(0, wheel_time + i)]) {
+                best = wheel_time + i;
+                found = true;
+                break;
+            }
+        }
+    }
+
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (!level_count[level])
+            continue;
+        int shift = wheel_shift(level);
+        /*
+         * If the wheel has stopped exactly on a boundary of this
+         * level, the current slot hasn't been cascaded yet, so it
+         * comes first.
+         */
+        unsigned i0 = (wheel_time & ((1UL << shift) - 1)) ? 1 : 0;
+        for (unsigned i = i0; i <= WHEEL_SIZE; i++) {
+            unsigned long start = ((wheel_time >> shift) + i) << shift;
+            if (wheel[level - 1][wheel_index(level, start)]) {
+                if (!found || (long)(start - best) < 0) {
+                    best = start;
+                    found = true;
+                }
+                break;
+            }
+        }
+    }
+
+    *next = best;
+    return found;
+}
+
+static inline size_t ctxhash_index(void *ctx)
+{
+    size_t h = (uintptr_t)ctx;
+    h ^= h >> 7;
+    h ^= h >> 15;
+    return h & (ctxhash_size - 1);
+}
+
+static void ctxhash_add(struct timer *t)
+{
+    struct timer **bucket = &ctxhash[ctxhash_index(t->ctx)];
+    t->hnext = *bucket;
+    if (t->hnext)
+        t->hnext->hprevp = &t->hnext;
+    t->hprevp = bucket;
+    *bucket = t;
+}
+
+static void ctxhash_remove(struct timer *t)
+{
+    *t->hprevp = t->hnext;
+    if (t->hnext)
+        t->hnext->hprevp = t->hprevp;
+    ntimers--;
+}
+
+static void ctxhash_grow(void)
+{
+    struct timer **oldhash = ctxhash;
+    size_t oldsize = ctxhash_size;
+
+    ctxhash_size = oldsize ? oldsize * 2 : 64;
+    ctxhash = snewn(ctxhash_size, struct timer *);
+    memset(ctxhash, 0, ctxhash_size * sizeof(*ctxhash));
+
+    for (size_t i = 0; i < oldsize; i++) {
+        struct timer *t, *next;
+        for (t = oldhash[i]; t; t = next) {
+            next = t->hnext;
+            ctxhash_add(t);
+        }
+    }
+    sfree(oldhash);
+}
+
+static struct timer *timer_new(void)
+{
+    struct timer *t = timer_free_list;
+    if (t) {
+        timer_free_list = t->next;
+        timer_free_count--;
+    } else {
+        t = snew(struct timer);
+    }
+    return t;
+}
+
+static void timer_free(struct timer *t)
+{
+    if (timer_free_count < TIMER_POOL_MAX) {
+        t->next = timer_free_list;
+        timer_free_list = t;
+        timer_free_count++;
+    } else {
+        sfree(t);
     }
 }
 
 unsigned long schedule_timer(int ticks, timer_fn_t fn, void *ctx)
 {
-    unsigned long when;
-    struct timer *t, *first;
+    unsigned long when, old_next;
+    bool old_valid;
+    struct timer *t;
 
     init_timers();
 
@@ -124,25 +332,49 @@ unsigned long schedule_timer(int ticks, timer_fn_t fn, void *ctx)
     if (when - now <= 0)
         when = now + 1;
 
-    t = snew(struct timer);
+    /*
+     * If there's nothing in the wheel, we can bring its idea of the
+     * time up to date for free, which saves it stepping through any
+     * time that's elapsed since it last turned.
+     */
+    if (!wheel_count())
+        wheel_time = now;
+
+    if (ctxhash_size) {
+        /* Don't store an identical timer twice */
+        for (t = ctxhash[ctxhash_index(ctx)]; t; t = t->hnext)
+            if (t->ctx == ctx && t->fn == fn && t->now == when)
+                return when;
+    }
+
+    if (ntimers >= 2 * ctxhash_size)
+        ctxhash_grow();
+
+    old_valid = next_valid;
+    old_next = next_time;
+
+    t = timer_new();
     t->fn = fn;
     t->ctx = ctx;
     t->now = when;
     t->when_set = now;
+    wheel_insert(t);
+    ctxhash_add(t);
+    ntimers++;
 
-    if (t != add234(timers, t)) {
-        sfree(t);                      /* identical timer already exists */
-    } else {
-        add234(timer_contexts, t->ctx);/* don't care if this fails */
-    }
+    if (!next_valid)
+        next_valid = wheel_next(&next_time);
+    else if ((long)(when - next_time) < 0)
+        next_time = when;
 
-    first = (struct timer *)index234(timers, 0);
-    if (first == t) {
+    if (!old_valid || next_time != old_next) {
         /*
-         * This timer is the very first on the list, so we must
-         * notify the front end.
+         * The earliest time we need to be called back has changed,
+         * so we must notify the front end. That isn't necessarily
+         * this timer's own due time: if it went into a higher level
+         * of the wheel, it's the time that slot is cascaded.
          */
-        timer_change_notify(first->now);
+        timer_change_notify(next_time);
     }
 
     return when;
@@ -159,6 +391,89 @@ unsigned long timing_last_clock(void)
     return now;
 }
 
+static void run_list_append(struct timer ***tail, struct timer *t)
+{
+    t->next = NULL;
+    t->prevp = *tail;
+    **tail = t;
+    *tail = &t->next;
+    t->level = -1;
+}
+
+/*
+ * The clock has gone backwards. Anything set after the time we've
+ * jumped back to is treated as due, as the old tree-based code did;
+ * everything else is refiled relative to the new time.
+ */
+static void wheel_clock_jumped(struct timer ***tail)
+{
+    struct timer *all = NULL, *t, *next;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        unsigned size = level ? WHEEL_SIZE : WHEEL_SIZE0;
+        for (unsigned i = 0; i < size; i++) {
+            struct timer **slot = wheel_slot(level, i);
+            while ((t = *slot) != NULL) {
+                list_remove(t);
+                list_insert(&all, t);
+            }
+        }
+        level_count[level] = 0;
+    }
+
+    wheel_time = now;
+    next_valid = false;
+
+    for (t = all; t; t = next) {
+        next = t->next;
+        if (now - (t->when_set - 10) > t->now - (t->when_set - 10))
+            run_list_append(tail, t);
+        else
+            wheel_insert(t);
+    }
+}
+
+/*
+ * Turn the wheel up to the present, moving every timer that's now
+ * due on to the end of a list to be run.
+ */
+static void wheel_advance(struct timer ***tail)
+{
+    while ((long)(now - wheel_time) >= 0) {
+        unsigned index = wheel_index(0, wheel_time);
+
+        if (!wheel_count()) {
+            wheel_time = now + 1;
+            break;
+        }
+
+        if (index == 0) {
+            for (int level = 1; level < WHEEL_LEVELS; level++)
+                if (wheel_cascade(level) != 0)
+                    break;
+        }
+
+        struct timer *t;
+        while ((t = wheel0[index]) != NULL) {
+            wheel_remove(t);
+            run_list_append(tail, t);
+        }
+        wheel_time++;
+
+        if (!level_count[0] && wheel_index(0, wheel_time) != 0) {
+            /*
+             * Nothing more to do until the next cascade, so skip
+             * straight to it (or to the present, if that's sooner).
+             */
+            unsigned long boundary = (wheel_time | (WHEEL_SIZE0 - 1)) + 1;
+            if ((long)(now - boundary) >= 0)
+                wheel_time = boundary;
+            else
+                wheel_time = now + 1;
+        }
+    }
+}
+
 /*
  * Call to run any timers whose time has reached the present.
  * Returns the time (in ticks) expected until the next timer after
@@ -166,43 +481,38 @@ unsigned long timing_last_clock(void)
  */
 bool run_timers(unsigned long anow, unsigned long *next)
 {
-    struct timer *first;
+    struct timer *torun = NULL, **tail = &torun, *t;
 
     init_timers();
 
     now = GETTICKCOUNT();
 
-    while (1) {
-        first = (struct timer *)index234(timers, 0);
+    if ((long)(now - wheel_time) < -10)
+        wheel_clock_jumped(&tail);
+    wheel_advance(&tail);
 
-        if (!first)
-            return false;              /* no timers remaining */
+    /* We may have got here because a cascade was due */
+    if (next_valid && (long)(now - next_time) >= 0)
+        next_valid = false;
 
-        if (find234(timer_contexts, first->ctx, NULL) == NULL) {
-            /*
-             * This timer belongs to a context that has been
-             * expired. Delete it without running.
-             */
-            delpos234(timers, 0);
-            sfree(first);
-        } else if (now - (first->when_set - 10) >
-                   first->now - (first->when_set - 10)) {
-            /*
-             * This timer is active and has reached its running
-             * time. Run it.
-             */
-            delpos234(timers, 0);
-            first->fn(first->ctx, first->now);
-            sfree(first);
-        } else {
-            /*
-             * This is the first still-active timer that is in the
-             * future. Return how long it has yet to go.
-             */
-            *next = first->now;
-            return true;
-        }
+    /*
+     * Each timer is unlinked from everything before it's run, so
+     * that the function can freely schedule new timers, or expire
+     * contexts (including ones with timers still on this list).
+     */
+    while ((t = torun) != NULL) {
+        list_remove(t);
+        ctxhash_remove(t);
+        t->fn(t->ctx, t->now);
+        timer_free(t);
     }
+
+    if (!next_valid)
+        next_valid = wheel_next(&next_time);
+    if (!next_valid)
+        return false;                  /* no timers remaining */
+    *next = next_time;
+    return true;
 }
 
 /*
@@ -210,13 +520,19 @@ bool run_timers(unsigned long anow, unsigned long *next)
  */
 void expire_timer_context(void *ctx)
 {
+    struct timer *t, *next;
+
     init_timers();
 
-    /*
-     * We don't bother to check the return value; if the context
-     * already wasn't in the tree (presumably because no timers
-     * ever actually got scheduled for it) then that's fine and we
-     * simply don't need to do anything.
-     */
-    del234(timer_contexts, ctx);
+    if (!ntimers)
+        return;
+
+    for (t = ctxhash[ctxhash_index(ctx)]; t; t = next) {
+        next = t->hnext;
+        if (t->ctx == ctx) {
+            wheel_remove(t);
+            ctxhash_remove(t);
+            timer_free(t);
+        }
+    }
 }
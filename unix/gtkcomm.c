@@ -205,7 +205,7 @@ static void notify_toplevel_callback(void *);
 
 static gint idle_toplevel_callback_func(gpointer data)
 {
-    run_toplevel_callbacks();
+    run_toplevel_callbacks_batch();
 
     /*
      * If we've emptied our toplevel callback queue, unschedule
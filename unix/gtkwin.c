@@ -399,6 +399,7 @@ static const SeatVtable gtk_seat_vt = {
     gtk_seat_set_trust_status,
     nullseat_verbose_yes,
     nullseat_interactive_yes,
+    nullseat_kex_finished,
 };
 
 static void gtk_eventlog(LogPolicy *lp, const char *string)
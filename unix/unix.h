@@ -380,6 +380,37 @@ extern const struct BackendVtable serial_backend;
  */
 bool so_peercred(int fd, int *pid, int *uid, int *gid);
 
+/*
+ * uxuring.c, which lets uxnet.c hand the bulk reading and writing of
+ * a connected stream socket to io_uring, where the kernel supports
+ * it. uring_socket_new returns NULL if it doesn't, in which case the
+ * caller carries on using ordinary recv() and send().
+ *
+ * Received data is passed to 'receive' straight out of a buffer
+ * owned by the kernel ring, which is recycled as soon as the
+ * callback returns. 'closing' reports EOF (err == 0) or an error on
+ * the receive side. 'sent' reports that the whole of the last buffer
+ * passed to uring_socket_send has gone (err == 0), or failed.
+ *
+ * uring_socket_free may be called from inside any of the callbacks.
+ * The fd can be closed straight after it: the ring holds its own
+ * reference to the file until any outstanding operations have been
+ * cancelled.
+ */
+typedef struct UringSocket UringSocket;
+typedef struct UringSocketCallbacks {
+    void (*receive)(void *ctx, const void *data, size_t len);
+    void (*closing)(void *ctx, int err);
+    void (*sent)(void *ctx, int err);
+} UringSocketCallbacks;
+UringSocket *uring_socket_new(int fd, const UringSocketCallbacks *cb,
+                              void *ctx);
+void uring_socket_free(UringSocket *us);
+void uring_socket_set_receiving(UringSocket *us, bool receiving);
+/* Returns NULL if a send is already in progress */
+void *uring_socket_send_buffer(UringSocket *us, size_t *size);
+void uring_socket_send(UringSocket *us, size_t len, int flags);
+
 /*
  * uxfdsock.c.
  */
@@ -135,7 +135,8 @@ Socket *agent_connect(Plug *plug)
     const char *path = agent_socket_path();
     if (!path)
         return new_error_socket_fmt(plug, "SSH_AUTH_SOCK not set");
-    return sk_new(unix_sock_addr(path), 0, false, false, false, false, plug);
+    return sk_new(unix_sock_addr(path), 0, false, false, false, false, 0,
+                  plug);
 }
 
 agent_pending_query *agent_query(
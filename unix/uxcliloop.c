@@ -1,6 +1,7 @@
 #include <errno.h>
 
 #include "putty.h"
+#include "perfcount.h"
 
 void cli_main_loop(cliloop_pw_setup_t pw_setup,
                    cliloop_pw_check_t pw_check,
@@ -19,6 +20,12 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
         int fdstate;
         unsigned long next;
 
+        /*
+         * Run any pending timers before deciding what to poll, since
+         * a timer can start (or stop) something wanting an fd.
+         */
+        bool timers = run_timers(now, &next);
+
         pollwrap_clear(pw);
 
         if (!pw_setup(ctx, pw))
@@ -44,9 +51,11 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
             pollwrap_add_fd_rwx(pw, fd, rwx);
         }
 
+        perf_enter(PERF_IDLE, 0);
         if (toplevel_callback_pending()) {
             ret = pollwrap_poll_instant(pw);
-        } else if (run_timers(now, &next)) {
+            now = GETTICKCOUNT();
+        } else if (timers) {
             do {
                 unsigned long then;
                 long ticks;
@@ -73,6 +82,7 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
         } else {
             ret = pollwrap_poll_endless(pw);
         }
+        perf_leave(PERF_IDLE);
 
         if (ret < 0 && errno == EINTR)
             continue;
@@ -102,7 +112,7 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
 
         pw_check(ctx, pw);
 
-        bool ran_callback = run_toplevel_callbacks();
+        bool ran_callback = run_toplevel_callbacks_batch();
 
         if (!cont(ctx, found_fd, ran_callback))
             break;
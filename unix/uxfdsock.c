@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "tree234.h"
 #include "putty.h"
@@ -164,8 +165,15 @@ static int fdsocket_try_send(FdSocket *fds)
     while (bufchain_size(&fds->pending_output_data) > 0) {
         ssize_t ret;
 
-        ptrlen data = bufchain_prefix(&fds->pending_output_data);
-        ret = write(fds->outfd, data.ptr, data.len);
+        ptrlen spans[BUFCHAIN_MAX_IOV];
+        struct iovec iov[BUFCHAIN_MAX_IOV];
+        size_t i, n = bufchain_prefix_iov(&fds->pending_output_data, spans,
+                                          BUFCHAIN_MAX_IOV);
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = (void *)spans[i].ptr;
+            iov[i].iov_len = spans[i].len;
+        }
+        ret = writev(fds->outfd, iov, n);
         noise_ultralight(NOISE_SOURCE_IOID, ret);
         if (ret < 0 && errno != EWOULDBLOCK) {
             if (!fds->pending_error) {
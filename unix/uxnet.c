@@ -2,6 +2,10 @@
  * Unix networking abstraction.
  */
 
+#ifdef HAVE_CONFIG_H
+# include "uxconfig.h" /* leading space prevents mkfiles.pl trying to follow */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -19,9 +23,14 @@
 #include <pwd.h>
 #include <grp.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include "putty.h"
 #include "network.h"
 #include "tree234.h"
+#include "perfcount.h"
 
 /* Solaris needs <sys/sockio.h> for SIOCATMARK. */
 #ifndef SIOCATMARK
@@ -59,6 +68,15 @@ struct SockAddrStep_tag {
 };
 
 typedef struct NetSocket NetSocket;
+typedef struct ConnectAttempt ConnectAttempt;
+
+struct ConnectAttempt {
+    int fd;
+    SockAddrStep step;
+    NetSocket *sock;
+    ConnectAttempt *next;
+};
+
 struct NetSocket {
     const char *error;
     int s;
@@ -81,6 +99,23 @@ struct NetSocket {
     int port;                          /* and again */
     SockAddr *addr;
     SockAddrStep step;
+
+    /*
+     * When connecting to a host with several addresses, we don't
+     * wait for each attempt to fail before starting the next: if one
+     * hasn't finished after connect_delay milliseconds, we start
+     * another alongside it, and keep whichever connects first (RFC
+     * 8305, 'Happy Eyeballs'). 'order' lists the addresses in the
+     * order we'll try them, and 'racing' the attempts in progress
+     * besides the one in s->s.
+     */
+    int connect_delay;
+    SockAddrStep *order;
+    int norder, nextorder;
+    ConnectAttempt *racing;
+    bool race_pending;                 /* is a timer set to start another? */
+    unsigned long race_time;
+
     /*
      * We sometimes need pairs of Socket structures to be linked:
      * if we are listening on the same IPv6 and v4 port, for
@@ -89,6 +124,13 @@ struct NetSocket {
      */
     NetSocket *parent, *child;
 
+    /*
+     * If this is non-NULL, the socket's data is being moved by
+     * io_uring (see uxuring.c) rather than by recv() and send() in
+     * response to poll events.
+     */
+    UringSocket *uring;
+
     Socket sock;
 };
 
@@ -139,6 +181,9 @@ struct SockAddr {
 
 static tree234 *sktree;
 
+/* Connection attempts racing the main one in their NetSocket */
+static tree234 *racetree;
+
 static void uxsel_tell(NetSocket *s);
 
 static int cmpfortree(void *av, void *bv)
@@ -167,9 +212,31 @@ static int cmpforsearch(void *av, void *bv)
     return 0;
 }
 
+static int cmpforrace(void *av, void *bv)
+{
+    ConnectAttempt *a = (ConnectAttempt *) av, *b = (ConnectAttempt *) bv;
+    if (a->fd < b->fd)
+        return -1;
+    if (a->fd > b->fd)
+        return +1;
+    return 0;
+}
+
+static int cmpforracesearch(void *av, void *bv)
+{
+    ConnectAttempt *b = (ConnectAttempt *) bv;
+    int as = *(int *)av, bs = b->fd;
+    if (as < bs)
+        return -1;
+    if (as > bs)
+        return +1;
+    return 0;
+}
+
 void sk_init(void)
 {
     sktree = newtree234(cmpfortree);
+    racetree = newtree234(cmpforrace);
 }
 
 void sk_cleanup(void)
@@ -182,8 +249,49 @@ void sk_cleanup(void)
             close(s->s);
         }
     }
+    if (racetree) {
+        ConnectAttempt *a;
+        for (i = 0; (a = index234(racetree, i)) != NULL; i++)
+            close(a->fd);
+    }
 }
 
+#ifndef NO_IPV6
+static void namelookup_hints(struct addrinfo *hints, int address_family)
+{
+    hints->ai_flags = AI_CANONNAME;
+    hints->ai_family = (address_family == ADDRTYPE_IPV4 ? AF_INET :
+                        address_family == ADDRTYPE_IPV6 ? AF_INET6 :
+                        AF_UNSPEC);
+    hints->ai_socktype = SOCK_STREAM;
+    hints->ai_protocol = 0;
+    hints->ai_addrlen = 0;
+    hints->ai_addr = NULL;
+    hints->ai_canonname = NULL;
+    hints->ai_next = NULL;
+}
+
+/*
+ * Fill in a SockAddr from the results of getaddrinfo(), which has
+ * left its addresses in ret->ais (or failed with 'err').
+ */
+static SockAddr *sk_addr_from_ais(SockAddr *ret, const char *host, int err,
+                                  char **canonicalname)
+{
+    if (err != 0) {
+        ret->error = gai_strerror(err);
+        return ret;
+    }
+    ret->superfamily = IP;
+
+    if (ret->ais->ai_canonname != NULL)
+        *canonicalname = dupstr(ret->ais->ai_canonname);
+    else
+        *canonicalname = dupstr(host);
+    return ret;
+}
+#endif
+
 SockAddr *sk_namelookup(const char *host, char **canonicalname, int address_family)
 {
     if (host[0] == '/') {
@@ -199,8 +307,8 @@ SockAddr *sk_namelookup(const char *host, char **canonicalname, int address_fami
     unsigned long a;
     struct hostent *h = NULL;
     int n;
-#endif
     strbuf *realhost = strbuf_new();
+#endif
 
     /* Clear the structure and default to IPv4. */
     memset(ret, 0, sizeof(SockAddr));
@@ -209,32 +317,13 @@ SockAddr *sk_namelookup(const char *host, char **canonicalname, int address_fami
     ret->refcount = 1;
 
 #ifndef NO_IPV6
-    hints.ai_flags = AI_CANONNAME;
-    hints.ai_family = (address_family == ADDRTYPE_IPV4 ? AF_INET :
-                       address_family == ADDRTYPE_IPV6 ? AF_INET6 :
-                       AF_UNSPEC);
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = 0;
-    hints.ai_addrlen = 0;
-    hints.ai_addr = NULL;
-    hints.ai_canonname = NULL;
-    hints.ai_next = NULL;
+    namelookup_hints(&hints, address_family);
     {
         char *trimmed_host = host_strduptrim(host); /* strip [] on literals */
         err = getaddrinfo(trimmed_host, NULL, &hints, &ret->ais);
         sfree(trimmed_host);
     }
-    if (err != 0) {
-        ret->error = gai_strerror(err);
-        strbuf_free(realhost);
-        return ret;
-    }
-    ret->superfamily = IP;
-
-    if (ret->ais->ai_canonname != NULL)
-        strbuf_catf(realhost, "%s", ret->ais->ai_canonname);
-    else
-        strbuf_catf(realhost, "%s", host);
+    return sk_addr_from_ais(ret, host, err, canonicalname);
 #else
     if ((a = inet_addr(host)) == (unsigned long)(in_addr_t)(-1)) {
         /*
@@ -278,9 +367,9 @@ SockAddr *sk_namelookup(const char *host, char **canonicalname, int address_fami
         ret->naddresses = 1;
         ret->addresses[0] = ntohl(a);
     }
-#endif
     *canonicalname = strbuf_to_str(realhost);
     return ret;
+#endif
 }
 
 SockAddr *sk_nonamelookup(const char *host)
@@ -299,6 +388,381 @@ SockAddr *sk_nonamelookup(const char *host)
     return ret;
 }
 
+/*
+ * Asynchronous name lookup.
+ *
+ * getaddrinfo() blocks until the DNS answers. That's fine when we're
+ * looking up the host for a session's main connection, since there's
+ * nothing else to do yet. But when we're making connections on
+ * behalf of port forwardings or SOCKS clients, a slow lookup would
+ * freeze the event loop, and every other channel along with it. So
+ * those lookups go to a small pool of threads. Each thread makes the
+ * blocking call and posts the result back through a pipe, and the
+ * main loop picks it up from there.
+ *
+ * Successful lookups are also kept in a cache, because SOCKS clients
+ * tend to ask for the same few names again and again. getaddrinfo()
+ * doesn't tell us the records' TTL, so the caller decides how long
+ * an entry stays valid.
+ */
+
+#if defined HAVE_PTHREAD && !defined NO_IPV6
+#define NAMELOOKUP_THREADS
+#endif
+
+struct NameLookup {
+    char *host;
+    int address_family;
+    int cache_time;                    /* in seconds */
+    namelookup_callback_fn_t callback;
+    void *ctx;
+
+    /* The result, once we have one */
+    SockAddr *addr;
+    char *canonicalname;
+
+#ifdef NAMELOOKUP_THREADS
+    bool in_pool;                      /* owned by the resolver threads */
+
+    /* These are protected by resolver_mutex while in_pool is set */
+    bool cancelled;
+    char *trimmed_host;
+    struct addrinfo *ais;
+    int err;
+    NameLookup *next;
+#endif
+};
+
+typedef struct NameCacheEntry {
+    char *host;
+    int address_family;
+    SockAddr *addr;
+    char *canonicalname;
+    unsigned long when;
+} NameCacheEntry;
+
+#define NAMECACHE_MAX 256
+
+static tree234 *namecache;
+
+static int namecache_cmp(void *av, void *bv)
+{
+    NameCacheEntry *a = (NameCacheEntry *)av, *b = (NameCacheEntry *)bv;
+    int c = strcmp(a->host, b->host);
+    if (c)
+        return c;
+    if (a->address_family < b->address_family)
+        return -1;
+    if (a->address_family > b->address_family)
+        return +1;
+    return 0;
+}
+
+static void namecache_free_entry(NameCacheEntry *e)
+{
+    sfree(e->host);
+    sk_addr_free(e->addr);
+    sfree(e->canonicalname);
+    sfree(e);
+}
+
+static NameCacheEntry *namecache_find(const char *host, int address_family,
+                                      int cache_time)
+{
+    NameCacheEntry key, *e;
+
+    if (!namecache || cache_time <= 0)
+        return NULL;
+
+    key.host = (char *)host;
+    key.address_family = address_family;
+    e = find234(namecache, &key, NULL);
+    if (!e)
+        return NULL;
+    if (GETTICKCOUNT() - e->when >=
+        (unsigned long)cache_time * TICKSPERSEC) {
+        del234(namecache, e);
+        namecache_free_entry(e);
+        return NULL;
+    }
+    return e;
+}
+
+static void namecache_add(NameLookup *nl)
+{
+    NameCacheEntry *e, *old;
+
+    if (nl->cache_time <= 0 || sk_addr_error(nl->addr) || nl->host[0] == '/')
+        return;
+
+    if (!namecache)
+        namecache = newtree234(namecache_cmp);
+
+    if (count234(namecache) >= NAMECACHE_MAX) {
+        /* Make room by throwing out whichever entry is oldest. */
+        NameCacheEntry *oldest = NULL;
+        for (int i = 0; (e = index234(namecache, i)) != NULL; i++)
+            if (!oldest || e->when - oldest->when > ULONG_MAX / 2)
+                oldest = e;
+        del234(namecache, oldest);
+        namecache_free_entry(oldest);
+    }
+
+    e = snew(NameCacheEntry);
+    e->host = dupstr(nl->host);
+    e->address_family = nl->address_family;
+    e->addr = sk_addr_dup(nl->addr);
+    e->canonicalname = dupstr(nl->canonicalname);
+    e->when = GETTICKCOUNT();
+    if ((old = add234(namecache, e)) != e) {
+        del234(namecache, old);
+        namecache_free_entry(old);
+        add234(namecache, e);
+    }
+}
+
+static void namelookup_free(NameLookup *nl)
+{
+    delete_callbacks_for_context(nl);
+    if (nl->addr)
+        sk_addr_free(nl->addr);
+    sfree(nl->canonicalname);
+    sfree(nl->host);
+#ifdef NAMELOOKUP_THREADS
+    sfree(nl->trimmed_host);
+#endif
+    sfree(nl);
+}
+
+static void namelookup_deliver(void *vctx)
+{
+    NameLookup *nl = (NameLookup *)vctx;
+
+    if (!nl->addr) {
+        /* Nobody has done the lookup yet, so we must do it here. */
+        nl->addr = sk_namelookup(nl->host, &nl->canonicalname,
+                                 nl->address_family);
+        namecache_add(nl);
+    }
+
+    nl->callback(nl->ctx, nl->addr, nl->canonicalname);
+    nl->addr = NULL;
+    nl->canonicalname = NULL;
+    namelookup_free(nl);
+}
+
+#ifdef NAMELOOKUP_THREADS
+
+#define RESOLVER_MAX_THREADS 4
+
+static pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static NameLookup *resolver_queue_head, *resolver_queue_tail;
+static NameLookup *resolver_done;
+static int resolver_nthreads, resolver_nidle;
+static int resolver_pipe[2] = { -1, -1 };
+static size_t resolver_outstanding;    /* only touched by main thread */
+
+static void *resolver_thread(void *vctx)
+{
+    pthread_mutex_lock(&resolver_mutex);
+    while (true) {
+        NameLookup *nl;
+
+        while (!resolver_queue_head) {
+            resolver_nidle++;
+            pthread_cond_wait(&resolver_cond, &resolver_mutex);
+            resolver_nidle--;
+        }
+
+        nl = resolver_queue_head;
+        resolver_queue_head = nl->next;
+        if (!resolver_queue_head)
+            resolver_queue_tail = NULL;
+
+        if (!nl->cancelled) {
+            struct addrinfo hints, *ais = NULL;
+            int err;
+
+            namelookup_hints(&hints, nl->address_family);
+            pthread_mutex_unlock(&resolver_mutex);
+            err = getaddrinfo(nl->trimmed_host, NULL, &hints, &ais);
+            pthread_mutex_lock(&resolver_mutex);
+            nl->ais = ais;
+            nl->err = err;
+        }
+
+        nl->next = resolver_done;
+        resolver_done = nl;
+        if (write(resolver_pipe[1], "", 1) < 0) {
+            /* The pipe is full, so the main loop will wake up anyway */
+        }
+    }
+    return NULL;
+}
+
+static void resolver_select_result(int fd, int event)
+{
+    char buf[64];
+    NameLookup *done, *nl;
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&resolver_mutex);
+    done = resolver_done;
+    resolver_done = NULL;
+    pthread_mutex_unlock(&resolver_mutex);
+
+    while ((nl = done) != NULL) {
+        done = nl->next;
+        nl->in_pool = false;
+        if (--resolver_outstanding == 0)
+            uxsel_del(resolver_pipe[0]);
+
+        if (nl->cancelled) {
+            if (nl->ais)
+                freeaddrinfo(nl->ais);
+            namelookup_free(nl);
+            continue;
+        }
+
+        SockAddr *ret = snew(SockAddr);
+        memset(ret, 0, sizeof(SockAddr));
+        ret->superfamily = UNRESOLVED;
+        ret->error = NULL;
+        ret->refcount = 1;
+        ret->ais = nl->ais;
+        nl->addr = sk_addr_from_ais(ret, nl->host, nl->err,
+                                    &nl->canonicalname);
+        namecache_add(nl);
+        queue_toplevel_callback(namelookup_deliver, nl);
+    }
+}
+
+/*
+ * Hand a lookup to the thread pool, starting the pool (or another
+ * thread in it) if necessary. Returns false if we couldn't, in which
+ * case the caller will have to do the lookup itself.
+ */
+static bool resolver_submit(NameLookup *nl)
+{
+    if (resolver_pipe[0] < 0) {
+        if (pipe(resolver_pipe) < 0) {
+            resolver_pipe[0] = resolver_pipe[1] = -1;
+            return false;
+        }
+        cloexec(resolver_pipe[0]);
+        cloexec(resolver_pipe[1]);
+        nonblock(resolver_pipe[0]);
+        nonblock(resolver_pipe[1]);
+    }
+
+    pthread_mutex_lock(&resolver_mutex);
+    if (resolver_nidle == 0 && resolver_nthreads < RESOLVER_MAX_THREADS) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        bool ok;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ok = (pthread_create(&thread, &attr, resolver_thread, NULL) == 0);
+        pthread_attr_destroy(&attr);
+        if (ok) {
+            resolver_nthreads++;
+        } else if (resolver_nthreads == 0) {
+            pthread_mutex_unlock(&resolver_mutex);
+            return false;
+        }
+    }
+
+    nl->in_pool = true;
+    nl->trimmed_host = host_strduptrim(nl->host);
+    nl->next = NULL;
+    if (resolver_queue_tail)
+        resolver_queue_tail->next = nl;
+    else
+        resolver_queue_head = nl;
+    resolver_queue_tail = nl;
+    pthread_cond_signal(&resolver_cond);
+    pthread_mutex_unlock(&resolver_mutex);
+
+    if (resolver_outstanding++ == 0)
+        uxsel_set(resolver_pipe[0], SELECT_R, resolver_select_result);
+    return true;
+}
+
+/*
+ * Is this host name a numeric address, which getaddrinfo() can deal
+ * with without asking anybody?
+ */
+static bool host_is_numeric(const char *host)
+{
+    struct addrinfo hints, *ais;
+    char *trimmed_host = host_strduptrim(host);
+    int err;
+
+    namelookup_hints(&hints, ADDRTYPE_UNSPEC);
+    hints.ai_flags |= AI_NUMERICHOST;
+    err = getaddrinfo(trimmed_host, NULL, &hints, &ais);
+    sfree(trimmed_host);
+    if (err)
+        return false;
+    freeaddrinfo(ais);
+    return true;
+}
+
+#endif /* NAMELOOKUP_THREADS */
+
+NameLookup *sk_namelookup_async(const char *host, int address_family,
+                                int cache_time,
+                                namelookup_callback_fn_t callback, void *ctx)
+{
+    NameLookup *nl = snew(NameLookup);
+    NameCacheEntry *e;
+
+    memset(nl, 0, sizeof(NameLookup));
+    nl->host = dupstr(host);
+    nl->address_family = address_family;
+    nl->cache_time = cache_time;
+    nl->callback = callback;
+    nl->ctx = ctx;
+
+    if (address_family == ADDRTYPE_NAME) {
+        nl->addr = sk_nonamelookup(host);
+        nl->canonicalname = dupstr(host);
+    } else if ((e = namecache_find(host, address_family,
+                                   cache_time)) != NULL) {
+        nl->addr = sk_addr_dup(e->addr);
+        nl->canonicalname = dupstr(e->canonicalname);
+    }
+#ifdef NAMELOOKUP_THREADS
+    else if (host[0] != '/' && !host_is_numeric(host) &&
+             resolver_submit(nl)) {
+        return nl;
+    }
+#endif
+
+    queue_toplevel_callback(namelookup_deliver, nl);
+    return nl;
+}
+
+void sk_namelookup_cancel(NameLookup *nl)
+{
+#ifdef NAMELOOKUP_THREADS
+    if (nl->in_pool) {
+        /*
+         * A resolver thread may be using this right now, so leave it
+         * to be freed when it comes back.
+         */
+        pthread_mutex_lock(&resolver_mutex);
+        nl->cancelled = true;
+        pthread_mutex_unlock(&resolver_mutex);
+        return;
+    }
+#endif
+    namelookup_free(nl);
+}
+
 static bool sk_nextaddr(SockAddr *addr, SockAddrStep *step)
 {
 #ifndef NO_IPV6
@@ -516,6 +980,32 @@ static struct SocketVtable NetSocket_sockvt = {
     sk_net_peer_info,
 };
 
+static void net_uring_receive(void *ctx, const void *data, size_t len);
+static void net_uring_closing(void *ctx, int err);
+static void net_uring_sent(void *ctx, int err);
+static void try_send_uring(NetSocket *s);
+
+static const UringSocketCallbacks NetSocket_uringcb = {
+    net_uring_receive,
+    net_uring_closing,
+    net_uring_sent,
+};
+
+/*
+ * Called when a stream socket becomes connected, to hand its data
+ * transfer over to io_uring if the kernel supports it. Sockets in
+ * SO_OOBINLINE mode stay with the poll-driven code, which knows how
+ * to find the urgent mark with SIOCATMARK between reads.
+ */
+static void sk_net_try_uring(NetSocket *s)
+{
+    if (s->oobinline || s->uring)
+        return;
+    s->uring = uring_socket_new(s->s, &NetSocket_uringcb, s);
+    if (s->uring)
+        try_send_uring(s);  /* in case anything was written before now */
+}
+
 static Socket *sk_net_accept(accept_ctx_t ctx, Plug *plug)
 {
     int sockfd = ctx.i;
@@ -541,6 +1031,12 @@ static Socket *sk_net_accept(accept_ctx_t ctx, Plug *plug)
     ret->parent = ret->child = NULL;
     ret->addr = NULL;
     ret->connected = true;
+    ret->uring = NULL;
+    ret->order = NULL;
+    ret->norder = ret->nextorder = 0;
+    ret->racing = NULL;
+    ret->race_pending = false;
+    ret->connect_delay = 0;
 
     ret->s = sockfd;
 
@@ -551,13 +1047,23 @@ static Socket *sk_net_accept(accept_ctx_t ctx, Plug *plug)
 
     ret->oobinline = false;
 
+    sk_net_try_uring(ret);
     uxsel_tell(ret);
     add234(sktree, ret);
 
     return &ret->sock;
 }
 
-static int try_connect(NetSocket *sock)
+/*
+ * Start a non-blocking connection to one of sock's candidate
+ * addresses. The new fd is returned in *fdp (and is the caller's to
+ * close, even if the attempt failed), or -1 if we didn't get as far
+ * as making one. Returns 0 if the connection is in progress or (in
+ * which case *connected is set) already complete, or an errno value
+ * if it failed straight away.
+ */
+static int start_connect(NetSocket *sock, SockAddrStep *step, int *fdp,
+                         bool *connected)
 {
     int s;
     union sockaddr_union u;
@@ -566,20 +1072,11 @@ static int try_connect(NetSocket *sock)
     short localport;
     int salen, family;
 
-    /*
-     * Remove the socket from the tree before we overwrite its
-     * internal socket id, because that forms part of the tree's
-     * sorting criterion. We'll add it back before exiting this
-     * function, whether we changed anything or not.
-     */
-    del234(sktree, sock);
-
-    if (sock->s >= 0)
-        close(sock->s);
+    *fdp = -1;
+    *connected = false;
 
     {
-        SockAddr thisaddr = sk_extractaddr_tmp(
-            sock->addr, &sock->step);
+        SockAddr thisaddr = sk_extractaddr_tmp(sock->addr, step);
         plug_log(sock->plug, PLUGLOG_CONNECT_TRYING,
                  &thisaddr, sock->port, NULL, 0);
     }
@@ -587,10 +1084,10 @@ static int try_connect(NetSocket *sock)
     /*
      * Open socket.
      */
-    family = SOCKADDR_FAMILY(sock->addr, sock->step);
+    family = SOCKADDR_FAMILY(sock->addr, *step);
     assert(family != AF_UNSPEC);
     s = socket(family, SOCK_STREAM, 0);
-    sock->s = s;
+    *fdp = s;
 
     if (s < 0) {
         err = errno;
@@ -604,7 +1101,6 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, SOL_SOCKET, SO_OOBINLINE,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
@@ -614,7 +1110,6 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
@@ -624,7 +1119,6 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
@@ -690,21 +1184,21 @@ static int try_connect(NetSocket *sock)
 #ifndef NO_IPV6
       case AF_INET:
         /* XXX would be better to have got getaddrinfo() to fill in the port. */
-        ((struct sockaddr_in *)sock->step.ai->ai_addr)->sin_port =
+        ((struct sockaddr_in *)step->ai->ai_addr)->sin_port =
             htons(sock->port);
-        sa = (const union sockaddr_union *)sock->step.ai->ai_addr;
-        salen = sock->step.ai->ai_addrlen;
+        sa = (const union sockaddr_union *)step->ai->ai_addr;
+        salen = step->ai->ai_addrlen;
         break;
       case AF_INET6:
-        ((struct sockaddr_in *)sock->step.ai->ai_addr)->sin_port =
+        ((struct sockaddr_in *)step->ai->ai_addr)->sin_port =
             htons(sock->port);
-        sa = (const union sockaddr_union *)sock->step.ai->ai_addr;
-        salen = sock->step.ai->ai_addrlen;
+        sa = (const union sockaddr_union *)step->ai->ai_addr;
+        salen = step->ai->ai_addrlen;
         break;
 #else
       case AF_INET:
         u.sin.sin_family = AF_INET;
-        u.sin.sin_addr.s_addr = htonl(sock->addr->addresses[sock->step.curraddr]);
+        u.sin.sin_addr.s_addr = htonl(sock->addr->addresses[step->curraddr]);
         u.sin.sin_port = htons((short) sock->port);
         sa = &u;
         salen = sizeof u.sin;
@@ -732,37 +1226,346 @@ static int try_connect(NetSocket *sock)
         }
     } else {
         /*
-         * If we _don't_ get EWOULDBLOCK, the connect has completed
-         * and we should set the socket as connected and writable.
+         * If we _don't_ get EWOULDBLOCK, the connect has completed.
          */
-        sock->connected = true;
-        sock->writable = true;
+        *connected = true;
 
-        SockAddr thisaddr = sk_extractaddr_tmp(sock->addr, &sock->step);
+        SockAddr thisaddr = sk_extractaddr_tmp(sock->addr, step);
         plug_log(sock->plug, PLUGLOG_CONNECT_SUCCESS,
                  &thisaddr, sock->port, NULL, 0);
     }
 
-    uxsel_tell(sock);
-
     ret:
+    if (err) {
+        SockAddr thisaddr = sk_extractaddr_tmp(sock->addr, step);
+        plug_log(sock->plug, PLUGLOG_CONNECT_FAILED,
+                 &thisaddr, sock->port, strerror(err), err);
+    }
+    return err;
+}
+
+/*
+ * Start the main connection attempt for a socket, to the address in
+ * sock->step, replacing any previous one.
+ */
+static int try_connect(NetSocket *sock)
+{
+    bool connected;
+    int err;
+
+    /*
+     * Remove the socket from the tree before we overwrite its
+     * internal socket id, because that forms part of the tree's
+     * sorting criterion. We'll add it back before exiting this
+     * function, whether we changed anything or not.
+     */
+    del234(sktree, sock);
+
+    if (sock->s >= 0) {
+        uxsel_del(sock->s);
+        close(sock->s);
+    }
+
+    err = start_connect(sock, &sock->step, &sock->s, &connected);
+    if (sock->s >= 0 && err) {
+        close(sock->s);
+        sock->s = -1;
+    }
+
+    if (!err) {
+        if (connected) {
+            /*
+             * The connect has completed, so we should set the
+             * socket as connected and writable.
+             */
+            sock->connected = true;
+            sock->writable = true;
+            sk_net_try_uring(sock);
+        }
+        uxsel_tell(sock);
+    }
 
     /*
      * No matter what happened, put the socket back in the tree.
      */
     add234(sktree, sock);
 
-    if (err) {
-        SockAddr thisaddr = sk_extractaddr_tmp(
-            sock->addr, &sock->step);
-        plug_log(sock->plug, PLUGLOG_CONNECT_FAILED,
-                 &thisaddr, sock->port, strerror(err), err);
+    return err;
+}
+
+/*
+ * Work out the order to try a socket's candidate addresses in. If
+ * we're going to be racing them, then as RFC 8305 recommends, we
+ * alternate between address families (starting with whichever the
+ * resolver put first), so that a broken IPv6 route doesn't hold up
+ * every attempt until the IPv4 addresses are reached.
+ */
+static void sk_net_order_addresses(NetSocket *s)
+{
+    SockAddrStep step, *first, *second;
+    int nfirst = 0, nsecond = 0, i, j, k;
+
+    s->norder = 0;
+    START_STEP(s->addr, step);
+    do {
+        s->norder++;
+    } while (sk_nextaddr(s->addr, &step));
+
+    s->order = snewn(s->norder, SockAddrStep);
+    first = snewn(s->norder, SockAddrStep);
+    second = snewn(s->norder, SockAddrStep);
+
+    START_STEP(s->addr, step);
+    int family = SOCKADDR_FAMILY(s->addr, step);
+    do {
+        if (s->connect_delay <= 0 || SOCKADDR_FAMILY(s->addr, step) == family)
+            first[nfirst++] = step;
+        else
+            second[nsecond++] = step;
+    } while (sk_nextaddr(s->addr, &step));
+
+    for (i = j = k = 0; i < s->norder; ) {
+        if (j < nfirst)
+            s->order[i++] = first[j++];
+        if (k < nsecond)
+            s->order[i++] = second[k++];
     }
+
+    sfree(first);
+    sfree(second);
+    s->nextorder = 0;
+}
+
+static void sk_net_race_select_result(int fd, int event);
+
+#define ABANDONED "abandoned after connecting to another address"
+
+static void sk_net_abandon(NetSocket *s, ConnectAttempt *a, const char *why)
+{
+    SockAddr thisaddr = sk_extractaddr_tmp(s->addr, &a->step);
+    plug_log(s->plug, PLUGLOG_CONNECT_FAILED, &thisaddr, s->port, why, 0);
+    del234(racetree, a);
+    uxsel_del(a->fd);
+    close(a->fd);
+    sfree(a);
+}
+
+/*
+ * Stop all the connection attempts besides the one in s->s, because
+ * it's won, or because the socket is being closed.
+ */
+static void sk_net_stop_racing(NetSocket *s, const char *why)
+{
+    ConnectAttempt *a;
+
+    while ((a = s->racing) != NULL) {
+        s->racing = a->next;
+        if (why) {
+            sk_net_abandon(s, a, why);
+        } else {
+            del234(racetree, a);
+            uxsel_del(a->fd);
+            close(a->fd);
+            sfree(a);
+        }
+    }
+    s->race_pending = false;
+    sfree(s->order);
+    s->order = NULL;
+    s->norder = s->nextorder = 0;
+}
+
+/*
+ * Called when the attempt in s->s has just connected, whether it
+ * started there or won a race.
+ */
+static void sk_net_connected(NetSocket *s)
+{
+    sk_net_stop_racing(s, ABANDONED);
+    if (s->addr) {
+        sk_addr_free(s->addr);
+        s->addr = NULL;
+    }
+    s->connected = true;
+    s->writable = true;
+    sk_net_try_uring(s);
+    uxsel_tell(s);
+}
+
+/*
+ * Close the main connection attempt, logging why if it hasn't
+ * already failed.
+ */
+static void sk_net_drop_main(NetSocket *s, const char *why)
+{
+    if (s->s < 0)
+        return;
+    if (why) {
+        SockAddr thisaddr = sk_extractaddr_tmp(s->addr, &s->step);
+        plug_log(s->plug, PLUGLOG_CONNECT_FAILED, &thisaddr, s->port,
+                 why, 0);
+    }
+    del234(sktree, s);
+    uxsel_del(s->s);
+    close(s->s);
+    s->s = -1;
+    add234(sktree, s);
+}
+
+/*
+ * Make a racing connection attempt into the main one, once the
+ * previous main one is out of the way.
+ */
+static void sk_net_promote(NetSocket *s, ConnectAttempt *a)
+{
+    ConnectAttempt **pp;
+
+    assert(s->s < 0);
+    for (pp = &s->racing; *pp != a; pp = &(*pp)->next);
+    *pp = a->next;
+    del234(racetree, a);
+    uxsel_del(a->fd);
+
+    del234(sktree, s);
+    s->s = a->fd;
+    s->step = a->step;
+    add234(sktree, s);
+    uxsel_tell(s);
+    sfree(a);
+}
+
+static void sk_net_race_timer(void *ctx, unsigned long now);
+
+/*
+ * If we're still trying to connect and have addresses left to try,
+ * arrange to start on the next one if nothing's happened by the time
+ * connect_delay is up.
+ */
+static void sk_net_schedule_race(NetSocket *s)
+{
+    if (!s->connected && s->connect_delay > 0 &&
+        s->nextorder < s->norder) {
+        s->race_time = schedule_timer(
+            s->connect_delay * TICKSPERSEC / 1000, sk_net_race_timer, s);
+        s->race_pending = true;
+    }
+}
+
+/*
+ * Start a connection attempt to the next address on the list, in
+ * parallel with the one(s) already in progress, and set a timer to
+ * start the one after that.
+ */
+static void sk_net_race(NetSocket *s)
+{
+    s->race_pending = false;
+
+    while (s->nextorder < s->norder) {
+        ConnectAttempt *a = snew(ConnectAttempt);
+        bool connected;
+        int err;
+
+        a->sock = s;
+        a->step = s->order[s->nextorder++];
+        err = start_connect(s, &a->step, &a->fd, &connected);
+        if (err) {
+            if (a->fd >= 0)
+                close(a->fd);
+            sfree(a);
+            continue;
+        }
+
+        a->next = s->racing;
+        s->racing = a;
+        add234(racetree, a);
+        if (connected) {
+            sk_net_drop_main(s, ABANDONED);
+            sk_net_promote(s, a);
+            sk_net_connected(s);
+            return;
+        }
+        uxsel_set(a->fd, SELECT_W, sk_net_race_select_result);
+        break;
+    }
+
+    sk_net_schedule_race(s);
+}
+
+static void sk_net_race_timer(void *ctx, unsigned long now)
+{
+    NetSocket *s = (NetSocket *)ctx;
+
+    if (s->race_pending && now == s->race_time)
+        sk_net_race(s);
+}
+
+/*
+ * Called when the attempt in s->s has failed. Returns 0 if another
+ * attempt has taken over, or an errno value if we've run out of
+ * addresses.
+ */
+static int sk_net_connect_failed(NetSocket *s, int err)
+{
+    if (s->racing) {
+        /*
+         * Another attempt was already under way, so that one becomes
+         * the main one; and, rather than waiting out the rest of the
+         * delay, we start the next one straight away.
+         */
+        sk_net_drop_main(s, NULL);
+        sk_net_promote(s, s->racing);
+        if (!s->connected && s->nextorder < s->norder)
+            sk_net_race(s);
+        return 0;
+    }
+
+    while (err && s->nextorder < s->norder) {
+        s->step = s->order[s->nextorder++];
+        err = try_connect(s);
+    }
+    if (!err)
+        sk_net_schedule_race(s);
     return err;
 }
 
+static void sk_net_race_select_result(int fd, int event)
+{
+    ConnectAttempt *a;
+    NetSocket *s;
+    int err;
+    socklen_t errlen = sizeof(err);
+
+    a = find234(racetree, &fd, cmpforracesearch);
+    if (!a || event != SELECT_W)
+        return;
+    s = a->sock;
+
+    noise_ultralight(NOISE_SOURCE_IOID, fd);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+        err = errno;
+
+    if (err) {
+        ConnectAttempt **pp;
+        for (pp = &s->racing; *pp != a; pp = &(*pp)->next);
+        *pp = a->next;
+        sk_net_abandon(s, a, strerror(err));
+
+        /* As above, a failure means we needn't wait to try another */
+        if (s->nextorder < s->norder)
+            sk_net_race(s);
+        return;
+    }
+
+    SockAddr thisaddr = sk_extractaddr_tmp(s->addr, &a->step);
+    plug_log(s->plug, PLUGLOG_CONNECT_SUCCESS, &thisaddr, s->port, NULL, 0);
+    sk_net_drop_main(s, ABANDONED);
+    sk_net_promote(s, a);
+    sk_net_connected(s);
+}
+
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
-               bool nodelay, bool keepalive, Plug *plug)
+               bool nodelay, bool keepalive, int connect_delay, Plug *plug)
 {
     NetSocket *ret;
     int err;
@@ -787,17 +1590,26 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
     ret->incomingeof = false;
     ret->listener = false;
     ret->addr = addr;
-    START_STEP(ret->addr, ret->step);
     ret->s = -1;
+    ret->uring = NULL;
+    ret->order = NULL;
+    ret->norder = ret->nextorder = 0;
+    ret->racing = NULL;
+    ret->race_pending = false;
     ret->oobinline = oobinline;
     ret->nodelay = nodelay;
     ret->keepalive = keepalive;
     ret->privport = privport;
     ret->port = port;
+    ret->connect_delay = connect_delay;
 
-    do {
-        err = try_connect(ret);
-    } while (err && sk_nextaddr(ret->addr, &ret->step));
+    sk_net_order_addresses(ret);
+    ret->step = ret->order[ret->nextorder++];
+    err = try_connect(ret);
+    if (err)
+        err = sk_net_connect_failed(ret, err);
+    else
+        sk_net_schedule_race(ret);
 
     if (err)
         ret->error = strerror(err);
@@ -841,6 +1653,12 @@ Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
     ret->listener = true;
     ret->addr = NULL;
     ret->s = -1;
+    ret->uring = NULL;
+    ret->order = NULL;
+    ret->norder = ret->nextorder = 0;
+    ret->racing = NULL;
+    ret->race_pending = false;
+    ret->connect_delay = 0;
 
     /*
      * Translate address_family from platform-independent constants
@@ -1020,6 +1838,10 @@ static void sk_net_close(Socket *sock)
     bufchain_clear(&s->output_data);
 
     del234(sktree, s);
+    sk_net_stop_racing(s, NULL);
+    expire_timer_context(s);
+    if (s->uring)
+        uring_socket_free(s->uring);
     if (s->s >= 0) {
         uxsel_del(s->s);
         close(s->s);
@@ -1110,25 +1932,44 @@ static void socket_error_callback(void *vs)
  */
 void try_send(NetSocket *s)
 {
+    if (s->uring) {
+        try_send_uring(s);
+        return;
+    }
+
     while (s->sending_oob || bufchain_size(&s->output_data) > 0) {
         int nsent;
         int err;
-        const void *data;
         size_t len;
-        int urgentflag;
 
         if (s->sending_oob) {
-            urgentflag = MSG_OOB;
             len = s->sending_oob;
-            data = &s->oobdata;
+            perf_enter(PERF_SOCKET, len);
+            nsent = send(s->s, &s->oobdata, len, MSG_OOB);
         } else {
-            urgentflag = 0;
-            ptrlen bufdata = bufchain_prefix(&s->output_data);
-            data = bufdata.ptr;
-            len = bufdata.len;
+            /*
+             * Hand the kernel several granules of the output chain
+             * at once, to save a system call per granule.
+             */
+            ptrlen spans[BUFCHAIN_MAX_IOV];
+            struct iovec iov[BUFCHAIN_MAX_IOV];
+            struct msghdr msg;
+            size_t i, n = bufchain_prefix_iov(&s->output_data, spans,
+                                              BUFCHAIN_MAX_IOV);
+            len = 0;
+            for (i = 0; i < n; i++) {
+                iov[i].iov_base = (void *)spans[i].ptr;
+                iov[i].iov_len = spans[i].len;
+                len += spans[i].len;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            perf_enter(PERF_SOCKET, len);
+            nsent = sendmsg(s->s, &msg, 0);
         }
-        nsent = send(s->s, data, len, urgentflag);
         noise_ultralight(NOISE_SOURCE_IOLEN, nsent);
+        perf_leave(PERF_SOCKET);
         if (nsent <= 0) {
             err = (nsent < 0 ? errno : 0);
             if (err == EWOULDBLOCK) {
@@ -1191,6 +2032,86 @@ void try_send(NetSocket *s)
     uxsel_tell(s);
 }
 
+/*
+ * The io_uring version of try_send. Only one send is in flight at a
+ * time, from a buffer belonging to the UringSocket; so we fill that
+ * up from the output bufchain, and come back here for more when
+ * net_uring_sent tells us it's gone.
+ */
+static void try_send_uring(NetSocket *s)
+{
+    void *buf;
+    size_t size, len;
+
+    if (s->pending_error ||
+        !(buf = uring_socket_send_buffer(s->uring, &size)))
+        return;
+
+    if (s->sending_oob) {
+        memcpy(buf, s->oobdata, s->sending_oob);
+        uring_socket_send(s->uring, s->sending_oob, MSG_OOB);
+        s->sending_oob = 0;
+    } else if ((len = bufchain_size(&s->output_data)) > 0) {
+        if (len > size)
+            len = size;
+        bufchain_fetch_consume(&s->output_data, buf, len);
+        uring_socket_send(s->uring, len, 0);
+    } else if (s->outgoingeof == EOF_PENDING) {
+        shutdown(s->s, SHUT_WR);
+        s->outgoingeof = EOF_SENT;
+    }
+}
+
+static void net_uring_sent(void *ctx, int err)
+{
+    NetSocket *s = (NetSocket *)ctx;
+    size_t bufsize_before, bufsize_after;
+
+    noise_ultralight(NOISE_SOURCE_IOID, s->s);
+
+    if (err) {
+        /* Same deferred handling as a send() error in try_send */
+        s->pending_error = err;
+        uxsel_tell(s);
+        queue_toplevel_callback(socket_error_callback, s);
+        return;
+    }
+
+    bufsize_before = s->sending_oob + bufchain_size(&s->output_data);
+    try_send_uring(s);
+    bufsize_after = s->sending_oob + bufchain_size(&s->output_data);
+    if (bufsize_after < bufsize_before)
+        plug_sent(s->plug, bufsize_after);
+}
+
+static void net_uring_receive(void *ctx, const void *data, size_t len)
+{
+    NetSocket *s = (NetSocket *)ctx;
+
+    noise_ultralight(NOISE_SOURCE_IOID, s->s);
+    noise_ultralight(NOISE_SOURCE_IOLEN, len);
+
+    /* As in net_select_result, we can stop trying other addresses */
+    if (s->addr) {
+        sk_addr_free(s->addr);
+        s->addr = NULL;
+    }
+    plug_receive(s->plug, 0, data, len);
+}
+
+static void net_uring_closing(void *ctx, int err)
+{
+    NetSocket *s = (NetSocket *)ctx;
+
+    if (err) {
+        plug_closing(s->plug, strerror(err), err, 0);
+    } else {
+        s->incomingeof = true;
+        uxsel_tell(s);
+        plug_closing(s->plug, NULL, 0, 0);
+    }
+}
+
 static size_t sk_net_write(Socket *sock, const void *buf, size_t len)
 {
     NetSocket *s = container_of(sock, NetSocket, sock);
@@ -1200,7 +2121,9 @@ static size_t sk_net_write(Socket *sock, const void *buf, size_t len)
     /*
      * Add the data to the buffer list on the socket.
      */
+    perf_enter(PERF_SOCKET, 0);
     bufchain_add(&s->output_data, buf, len);
+    perf_leave(PERF_SOCKET);
 
     /*
      * Now try sending from the start of the buffer list.
@@ -1376,8 +2299,12 @@ static void net_select_result(int fd, int event)
         } else
             atmark = true;
 
+        perf_enter(PERF_SOCKET, 0);
         ret = recv(s->s, buf, s->oobpending ? 1 : sizeof(buf), 0);
         noise_ultralight(NOISE_SOURCE_IOLEN, ret);
+        perf_leave(PERF_SOCKET);
+        if (ret > 0)
+            perf_count_bytes(PERF_SOCKET, ret);
         if (ret < 0) {
             if (errno == EWOULDBLOCK) {
                 break;
@@ -1434,9 +2361,7 @@ static void net_select_result(int fd, int event)
                     plug_log(s->plug, PLUGLOG_CONNECT_FAILED,
                              &thisaddr, s->port, errmsg, err);
 
-                    while (err && s->addr && sk_nextaddr(s->addr, &s->step)) {
-                        err = try_connect(s);
-                    }
+                    err = sk_net_connect_failed(s, err);
                     if (err) {
                         plug_closing(s->plug, strerror(err), err, 0);
                         return;      /* socket is now presumably defunct */
@@ -1456,13 +2381,7 @@ static void net_select_result(int fd, int event)
             /*
              * If we get here, we've managed to make a connection.
              */
-            if (s->addr) {
-                sk_addr_free(s->addr);
-                s->addr = NULL;
-            }
-            s->connected = true;
-            s->writable = true;
-            uxsel_tell(s);
+            sk_net_connected(s);
         } else {
             size_t bufsize_before, bufsize_after;
             s->writable = true;
@@ -1576,7 +2495,17 @@ int sk_net_get_fd(Socket *sock)
 static void uxsel_tell(NetSocket *s)
 {
     int rwx = 0;
-    if (!s->pending_error) {
+    if (s->uring) {
+        /*
+         * io_uring does all the reading and writing. We still poll
+         * for exceptional conditions, to pick up urgent data.
+         */
+        bool receiving = !s->pending_error && !s->frozen &&
+            !s->incomingeof;
+        uring_socket_set_receiving(s->uring, receiving);
+        if (receiving)
+            rwx |= SELECT_X;
+    } else if (!s->pending_error) {
         if (s->listener) {
             rwx |= SELECT_R;           /* read == accept */
         } else {
@@ -1704,6 +2633,12 @@ Socket *new_unix_listener(SockAddr *listenaddr, Plug *plug)
     ret->listener = true;
     ret->addr = listenaddr;
     ret->s = -1;
+    ret->uring = NULL;
+    ret->order = NULL;
+    ret->norder = ret->nextorder = 0;
+    ret->racing = NULL;
+    ret->race_pending = false;
+    ret->connect_delay = 0;
 
     assert(listenaddr->superfamily == UNIX);
 
@@ -14,6 +14,7 @@
 #include <pwd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "putty.h"
 #include "ssh.h"
@@ -330,13 +331,20 @@ size_t try_output(bool is_stderr)
 
     if (bufchain_size(chain) > 0) {
         bool prev_nonblock = nonblock(fd);
-        ptrlen senddata;
+        ptrlen spans[BUFCHAIN_MAX_IOV];
+        struct iovec iov[BUFCHAIN_MAX_IOV];
+        size_t i, n, len;
         do {
-            senddata = bufchain_prefix(chain);
-            ret = write(fd, senddata.ptr, senddata.len);
+            n = bufchain_prefix_iov(chain, spans, BUFCHAIN_MAX_IOV);
+            for (i = len = 0; i < n; i++) {
+                iov[i].iov_base = (void *)spans[i].ptr;
+                iov[i].iov_len = spans[i].len;
+                len += spans[i].len;
+            }
+            ret = writev(fd, iov, n);
             if (ret > 0)
                 bufchain_consume(chain, ret);
-        } while (ret == senddata.len && bufchain_size(chain) != 0);
+        } while (ret == len && bufchain_size(chain) != 0);
         if (!prev_nonblock)
             no_nonblock(fd);
         if (ret < 0 && errno != EAGAIN) {
@@ -407,6 +415,7 @@ static const SeatVtable plink_seat_vt = {
     console_set_trust_status,
     cmdline_seat_verbose,
     plink_seat_interactive,
+    nullseat_kex_finished,
 };
 static Seat plink_seat[1] = {{ &plink_seat_vt }};
 
@@ -484,6 +493,12 @@ void sigwinch(int signum)
         /* not much we can do about it */;
 }
 
+static void sigusr1(int signum)
+{
+    if (write(signalpipe[1], "s", 1) <= 0)
+        /* not much we can do about it */;
+}
+
 /*
  * Short description of parameters.
  */
@@ -601,10 +616,13 @@ static void plink_pw_check(void *vctx, pollwrapper *pw)
         char c[1];
         struct winsize size;
         if (read(signalpipe[0], c, 1) <= 0)
-            /* ignore error */;
-        /* ignore its value; it'll be `x' */
-        if (ioctl(STDIN_FILENO, TIOCGWINSZ, (void *)&size) >= 0)
+            c[0] = 'x';                /* ignore error */
+        if (c[0] == 's') {
+            /* SIGUSR1: dump connection statistics to the Event Log */
+            backend_special(backend, SS_STATS, 0);
+        } else if (ioctl(STDIN_FILENO, TIOCGWINSZ, (void *)&size) >= 0) {
             backend_size(backend, size.ws_col, size.ws_row);
+        }
     }
 
     if (pollwrap_check_fd_rwx(pw, STDIN_FILENO, SELECT_R)) {
@@ -838,6 +856,7 @@ int main(int argc, char **argv)
     cloexec(signalpipe[0]);
     cloexec(signalpipe[1]);
     putty_signal(SIGWINCH, sigwinch);
+    putty_signal(SIGUSR1, sigusr1);
 
     /*
      * Now that we've got the SIGWINCH handler installed, try to find
@@ -37,6 +37,8 @@
 #include <pwd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "putty.h"
 #include "mpint.h"
@@ -309,6 +311,12 @@ static void show_help(FILE *fp)
           "options: --listen [PORT|PATH] listen to a port on localhost, or Unix socket\n"
           "         --listen-once        (with --listen) stop after one "
           "connection\n"
+          "         --workers N          (with --listen) serve connections "
+          "from N\n"
+          "                                pre-forked worker processes\n"
+          "         --stats-file FILE    (with --workers) write per-worker "
+          "statistics\n"
+          "                                to FILE once a second\n"
           "         --hostkey KEY        SSH host key (need at least one)\n"
           "         --rsakexkey KEY      key for SSH-2 RSA key exchange "
           "(in SSH-1 format)\n"
@@ -360,11 +368,29 @@ const bool buildinfo_gtk_relevant = false;
 
 static bool listening = false, listen_once = false;
 static bool finished = false;
+
+/*
+ * Statistics kept by each pre-forked worker process, in a shared
+ * memory mapping set up by the parent before forking. Each worker
+ * only ever writes to its own slot; the parent only reads them.
+ */
+struct worker_stats {
+    pid_t pid;
+    unsigned long restarts;
+    unsigned long connections, active;
+    SshServerStats ss;
+};
+
+static struct worker_stats *worker_stats; /* this process's slot, if any */
+
 void server_instance_terminated(LogPolicy *lp)
 {
     struct server_instance *inst = container_of(
         lp, struct server_instance, logpolicy);
 
+    if (worker_stats)
+        worker_stats->active--;
+
     if (listening && !listen_once) {
         log_to_stderr(inst->id, "connection terminated");
     } else {
@@ -442,9 +468,12 @@ static Plug *server_conn_plug(
     if (inst_out)
         *inst_out = inst;
 
-    return ssh_server_plug(
+    Plug *plug = ssh_server_plug(
         cfg->conf, cfg->ssc, cfg->hostkeys, cfg->nhostkeys, cfg->hostkey1,
         &inst->ap, &inst->logpolicy, &unix_live_sftpserver_vt);
+    if (worker_stats)
+        ssh_server_set_stats(plug, &worker_stats->ss);
+    return plug;
 }
 
 static void server_log(Plug *plug, PlugLogType type, SockAddr *addr, int port,
@@ -498,6 +527,11 @@ static int server_accepting(Plug *p, accept_fn_t constructor, accept_ctx_t ctx)
     sfree(msg);
     sk_free_peer_info(pi);
 
+    if (worker_stats) {
+        worker_stats->connections++;
+        worker_stats->active++;
+    }
+
     sk_set_frozen(s, false);
     ssh_server_start(plug, s);
     return 0;
@@ -511,10 +545,167 @@ static const PlugVtable server_plugvt = {
     server_accepting
 };
 
+/*
+ * Pre-forked worker mode. All the expensive setup (loading host keys,
+ * opening the listening socket) has been done once in the parent
+ * before we get here. Each worker inherits the listening socket and
+ * runs its own event loop on it; the kernel's accept queue hands
+ * each incoming connection to whichever worker gets to it first, so
+ * that a worker stuck in a slow key exchange simply stops taking new
+ * connections until it's finished.
+ *
+ * The parent process never returns from this function: it sits
+ * watching its children, restarting any that die, and periodically
+ * writing out their statistics. Each child returns, with
+ * worker_stats pointing at its own slot, and goes on to run the
+ * normal main loop.
+ */
+static struct worker_stats *all_worker_stats;
+static int nworkers;
+static volatile sig_atomic_t parent_terminating;
+
+static void parent_sigterm(int sig)
+{
+    parent_terminating = 1;
+}
+
+static bool spawn_worker(int index)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "%s: fork: %s\n", appname, strerror(errno));
+        return false;
+    }
+
+    if (pid == 0) {
+        /*
+         * In the child. Make sure the random number generator state
+         * diverges from the parent's and from every other worker's;
+         * otherwise they would all generate the same ephemeral keys.
+         */
+        struct timeval tv;
+        strbuf *seed = strbuf_new_nm();
+        gettimeofday(&tv, NULL);
+        put_uint32(seed, index);
+        put_uint32(seed, getpid());
+        put_uint64(seed, tv.tv_sec);
+        put_uint32(seed, tv.tv_usec);
+        random_reseed(ptrlen_from_strbuf(seed));
+        strbuf_free(seed);
+
+        putty_signal(SIGTERM, SIG_DFL);
+        putty_signal(SIGINT, SIG_DFL);
+
+        worker_stats = &all_worker_stats[index];
+        worker_stats->pid = getpid();
+        worker_stats->active = 0;
+        return true;
+    }
+
+    all_worker_stats[index].pid = pid;
+    return false;
+}
+
+static void write_worker_stats(const char *statsfile)
+{
+    char *tmpname = dupprintf("%s.tmp", statsfile);
+    FILE *fp = fopen(tmpname, "w");
+    if (!fp) {
+        fprintf(stderr, "%s: %s: open: %s\n", appname, tmpname,
+                strerror(errno));
+        sfree(tmpname);
+        return;
+    }
+
+    fprintf(fp, "# worker pid restarts connections active "
+            "kex kex_msec bytes_in bytes_out\n");
+    for (int i = 0; i < nworkers; i++) {
+        struct worker_stats *ws = &all_worker_stats[i];
+        fprintf(fp, "%d %d %lu %lu %lu %lu %"PRIu64" %"PRIu64" %"PRIu64"\n",
+                i, (int)ws->pid, ws->restarts, ws->connections, ws->active,
+                ws->ss.nkex, ws->ss.kex_msec,
+                ws->ss.bytes_in, ws->ss.bytes_out);
+    }
+
+    /* Write a new file and rename it over the old one, so that a
+     * reader never sees a partly written set of statistics. */
+    if (fclose(fp) != 0 || rename(tmpname, statsfile) < 0)
+        fprintf(stderr, "%s: %s: write: %s\n", appname, statsfile,
+                strerror(errno));
+    sfree(tmpname);
+}
+
+static void run_worker_pool(struct server_config *cfg, const char *statsfile)
+{
+    all_worker_stats = mmap(NULL, nworkers * sizeof(struct worker_stats),
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (all_worker_stats == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap: %s\n", appname, strerror(errno));
+        exit(1);
+    }
+    memset(all_worker_stats, 0, nworkers * sizeof(struct worker_stats));
+
+    /*
+     * Several processes will be polling the same listening socket,
+     * so the ones that lose the race to accept a connection must not
+     * block in accept().
+     */
+    nonblock(sk_net_get_fd(cfg->listening_socket));
+
+    for (int i = 0; i < nworkers; i++)
+        if (spawn_worker(i))
+            return;
+
+    putty_signal(SIGTERM, parent_sigterm);
+    putty_signal(SIGINT, parent_sigterm);
+
+    char *msg = dupprintf("%s: started %d worker processes",
+                          appname, nworkers);
+    log_to_stderr(-1, msg);
+    sfree(msg);
+
+    while (!parent_terminating) {
+        pid_t pid;
+        int status;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < nworkers; i++) {
+                if (all_worker_stats[i].pid != pid)
+                    continue;
+
+                msg = dupprintf("%s: worker %d (pid %d) exited with "
+                                "status %d; restarting", appname, i,
+                                (int)pid, status);
+                log_to_stderr(-1, msg);
+                sfree(msg);
+
+                all_worker_stats[i].restarts++;
+                if (spawn_worker(i))
+                    return;
+            }
+        }
+
+        if (statsfile)
+            write_worker_stats(statsfile);
+
+        sleep(1);
+    }
+
+    for (int i = 0; i < nworkers; i++)
+        kill(all_worker_stats[i].pid, SIGTERM);
+    while (wait(NULL) > 0)
+        ;
+    if (statsfile)
+        write_worker_stats(statsfile);
+    exit(0);
+}
+
 int main(int argc, char **argv)
 {
     int listen_port = -1;
     const char *listen_socket = NULL;
+    const char *statsfile = NULL;
 
     ssh_key **hostkeys = NULL;
     size_t nhostkeys = 0, hostkeysize = 0;
@@ -566,6 +757,15 @@ int main(int argc, char **argv)
             }
         } else if (!strcmp(arg, "--listen-once")) {
             listen_once = true;
+        } else if (longoptarg(arg, "--workers", &val, &argc, &argv)) {
+            nworkers = atoi(val);
+            if (nworkers <= 0) {
+                fprintf(stderr, "%s: --workers expects a positive number\n",
+                        appname);
+                exit(1);
+            }
+        } else if (longoptarg(arg, "--stats-file", &val, &argc, &argv)) {
+            statsfile = val;
         } else if (longoptarg(arg, "--hostkey", &val, &argc, &argv)) {
             Filename *keyfile;
             int keytype;
@@ -788,6 +988,21 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    if (nworkers) {
+        if (listen_port < 0 && !listen_socket) {
+            fprintf(stderr, "%s: --workers requires --listen\n", appname);
+            exit(1);
+        }
+        if (listen_once) {
+            fprintf(stderr, "%s: --workers is incompatible with "
+                    "--listen-once\n", appname);
+            exit(1);
+        }
+    } else if (statsfile) {
+        fprintf(stderr, "%s: --stats-file requires --workers\n", appname);
+        exit(1);
+    }
+
     random_ref();
 
     /*
@@ -828,6 +1043,9 @@ int main(int argc, char **argv)
 
         log_to_stderr(-1, msg);
         sfree(msg);
+
+        if (nworkers)
+            run_worker_pool(&scfg, statsfile);
     } else {
         struct server_instance *inst;
         Plug *plug = server_conn_plug(&scfg, &inst);
@@ -21,6 +21,10 @@
 #include <glob.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 char *x_get_default(const char *key)
 {
     return NULL;                       /* this is a stub */
@@ -128,6 +132,12 @@ RFile *open_existing_file(const char *name, uint64_t *size,
     ret = snew(RFile);
     ret->fd = fd;
 
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* We're about to read the whole thing in large blocks, so
+     * encourage the kernel to read ahead aggressively */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
     if (size || mtime || atime || perms) {
         struct stat statbuf;
         if (fstat(fd, &statbuf) < 0) {
@@ -190,7 +200,11 @@ WFile *open_existing_wfile(const char *name, uint64_t *size)
     int fd;
     WFile *ret;
 
-    fd = open(name, O_APPEND | O_WRONLY);
+    /*
+     * Not O_APPEND: callers seek to wherever they want to write, and
+     * on Linux O_APPEND would make write_to_file_at ignore its offset.
+     */
+    fd = open(name, O_WRONLY);
     if (fd < 0)
         return NULL;
 
@@ -234,6 +248,28 @@ int write_to_file(WFile *f, void *buffer, int length)
     return so_far;
 }
 
+int write_to_file_at(WFile *f, uint64_t offset, void *buffer, int length)
+{
+    char *p = (char *)buffer;
+    int so_far = 0;
+
+    while (length > 0) {
+        int ret = pwrite(f->fd, p, length, offset + so_far);
+
+        if (ret < 0)
+            return ret;
+
+        if (ret == 0)
+            break;
+
+        p += ret;
+        length -= ret;
+        so_far += ret;
+    }
+
+    return so_far;
+}
+
 void set_file_times(WFile *f, unsigned long mtime, unsigned long atime)
 {
     struct utimbuf ut;
@@ -576,3 +612,138 @@ int main(int argc, char *argv[])
     uxsel_init();
     return psftp_main(argc, argv);
 }
+
+struct bgjob {
+    void *job;
+    bool done;
+    struct bgjob *next;
+};
+
+struct BgWorker {
+    bgworker_fn_t fn;
+    struct bgjob *head, *tail, *torun;
+#ifdef HAVE_PTHREAD
+    bool threaded, quit;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;           /* signalled for new jobs and done ones */
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+static void *bgworker_thread(void *vctx)
+{
+    BgWorker *w = (BgWorker *)vctx;
+
+    pthread_mutex_lock(&w->mutex);
+    while (true) {
+        struct bgjob *j;
+
+        while (!w->torun && !w->quit)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        if (w->quit)
+            break;
+
+        j = w->torun;
+        w->torun = j->next;
+        pthread_mutex_unlock(&w->mutex);
+        w->fn(j->job);
+        pthread_mutex_lock(&w->mutex);
+        j->done = true;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+#endif
+
+BgWorker *bgworker_new(bgworker_fn_t fn)
+{
+    BgWorker *w = snew(BgWorker);
+    memset(w, 0, sizeof(*w));
+    w->fn = fn;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->threaded = (pthread_create(&w->thread, NULL, bgworker_thread, w) == 0);
+#endif
+    return w;
+}
+
+void bgworker_submit(BgWorker *w, void *job)
+{
+    struct bgjob *j = snew(struct bgjob);
+    j->job = job;
+    j->done = false;
+    j->next = NULL;
+
+#ifdef HAVE_PTHREAD
+    if (w->threaded) {
+        pthread_mutex_lock(&w->mutex);
+        if (w->tail)
+            w->tail->next = j;
+        else
+            w->head = j;
+        w->tail = j;
+        if (!w->torun)
+            w->torun = j;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+        return;
+    }
+#endif
+
+    w->fn(job);
+    j->done = true;
+    if (w->tail)
+        w->tail->next = j;
+    else
+        w->head = j;
+    w->tail = j;
+}
+
+void *bgworker_collect(BgWorker *w, bool wait)
+{
+    struct bgjob *j;
+    void *job = NULL;
+
+#ifdef HAVE_PTHREAD
+    if (w->threaded) {
+        pthread_mutex_lock(&w->mutex);
+        while (wait && w->head && !w->head->done)
+            pthread_cond_wait(&w->cond, &w->mutex);
+    }
+#endif
+
+    j = w->head;
+    if (j && j->done) {
+        w->head = j->next;
+        if (!w->head)
+            w->tail = NULL;
+        job = j->job;
+        sfree(j);
+    }
+
+#ifdef HAVE_PTHREAD
+    if (w->threaded)
+        pthread_mutex_unlock(&w->mutex);
+#endif
+    return job;
+}
+
+void bgworker_free(BgWorker *w)
+{
+    assert(!w->head);
+#ifdef HAVE_PTHREAD
+    if (w->threaded) {
+        pthread_mutex_lock(&w->mutex);
+        w->quit = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+        pthread_join(w->thread, NULL);
+    }
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+#endif
+    sfree(w);
+}
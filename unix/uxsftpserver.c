@@ -3,6 +3,14 @@
  * really operating on the Unix filesystem).
  */
 
+#ifdef HAVE_CONFIG_H
+# include "uxconfig.h" /* leading space prevents mkfiles.pl trying to follow */
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+#define _GNU_SOURCE                    /* for copy_file_range */
+#endif
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -247,6 +255,16 @@ static void uss_open(SftpServer *srv, SftpReplyBuilder *reply,
     if (fd < 0) {
         uss_error(uss, reply);
     } else {
+#ifdef HAVE_POSIX_FADVISE
+        /*
+         * Files opened only for reading are nearly always read from
+         * start to end, by SCP or by a pipelined SFTP download, so ask
+         * the kernel for more aggressive readahead. It's only a hint,
+         * so don't care if it fails.
+         */
+        if (openflags == O_RDONLY)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
         uss_return_new_handle(uss, reply, fd);
     }
 }
@@ -578,106 +596,236 @@ static void uss_write(SftpServer *srv, SftpReplyBuilder *reply,
     }
 }
 
+/*
+ * Most we ask for in one system call in uss_copy_data. The whole
+ * range is still copied before we send the reply, so a big copy
+ * holds up the rest of this server until it's done. Chunking only
+ * bounds how much we hand the kernel in each call.
+ */
+#define USS_COPY_CHUNK (16 * 1024 * 1024)
+
+static void uss_copy_data(SftpServer *srv, SftpReplyBuilder *reply,
+                          ptrlen srchandle, uint64_t srcoffset,
+                          uint64_t length, ptrlen dsthandle,
+                          uint64_t dstoffset)
+{
+    UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
+    int srcfd, dstfd;
+#ifdef HAVE_COPY_FILE_RANGE
+    /*
+     * Let the kernel do the copy if it can, which saves bringing the
+     * data through user space at all, and on some filesystems just
+     * shares the blocks between the two files.
+     */
+    bool use_cfr = true;
+#endif
+
+    if ((srcfd = uss_lookup_fd(uss, reply, srchandle)) < 0 ||
+        (dstfd = uss_lookup_fd(uss, reply, dsthandle)) < 0)
+        return;
+
+    /*
+     * The caller only checked for overlap within one handle. Two
+     * handles on the same file (opened by different names, or
+     * through a hard link) need the same check here.
+     */
+    if (srcfd != dstfd) {
+        struct stat srcst, dstst;
+
+        if (fstat(srcfd, &srcst) < 0 || fstat(dstfd, &dstst) < 0) {
+            uss_error(uss, reply);
+            return;
+        }
+        if (srcst.st_dev == dstst.st_dev && srcst.st_ino == dstst.st_ino &&
+            srcoffset < dstoffset + length && dstoffset < srcoffset + length) {
+            fxp_reply_error(reply, SSH_FX_FAILURE,
+                            "Source and destination ranges overlap");
+            return;
+        }
+    }
+
+    while (length > 0) {
+        size_t want = (length < USS_COPY_CHUNK ? length : USS_COPY_CHUNK);
+        ssize_t got;
+
+#ifdef HAVE_COPY_FILE_RANGE
+        if (use_cfr) {
+            off_t in = srcoffset, out = dstoffset;
+            got = copy_file_range(srcfd, &in, dstfd, &out, want, 0);
+            if (got < 0 && (errno == EXDEV || errno == EINVAL ||
+                            errno == ENOSYS || errno == EOPNOTSUPP)) {
+                /* Not possible between these files; copy by hand */
+                use_cfr = false;
+                continue;
+            }
+        } else
+#endif
+        {
+            char buf[65536];
+            ssize_t done, put;
+
+            if (want > sizeof(buf))
+                want = sizeof(buf);
+            got = pread(srcfd, buf, want, srcoffset);
+            for (done = 0; done < got; done += put) {
+                put = pwrite(dstfd, buf + done, got - done, dstoffset + done);
+                if (put < 0) {
+                    got = -1;
+                    break;
+                }
+            }
+        }
+
+        if (got < 0) {
+            uss_error(uss, reply);
+            return;
+        }
+        if (got == 0)
+            break;                     /* end of the source file */
+
+        srcoffset += got;
+        dstoffset += got;
+        length -= got;
+    }
+
+    fxp_reply_ok(reply);
+}
+
+/*
+ * Most names we return from one FXP_READDIR, as OpenSSH's server does.
+ */
+#define USS_READDIR_MAX 100
+
+/*
+ * Find out the attributes of a directory entry, and make up an 'ls
+ * -l' style long name for it unless we've been told not to bother.
+ * *longname is left NULL if we haven't got one.
+ */
+static void uss_dirent_info(struct uss_dirhandle *udh, struct dirent *de,
+                            bool omit_longname, struct fxp_attrs *attrs,
+                            char **longname)
+{
+    *attrs = no_attrs;
+    *longname = NULL;
+
+#if defined HAVE_FSTATAT && defined HAVE_DIRFD
+    struct stat st;
+    if (!fstatat(dirfd(udh->dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+        char perms[11], *uidbuf = NULL, *gidbuf = NULL;
+        struct passwd *pwd;
+        struct group *grp;
+        const char *user, *group;
+        struct tm tm;
+
+        *attrs = uss_translate_struct_stat(&st);
+
+        if (!omit_longname) {
+
+            strcpy(perms, "----------");
+            switch (st.st_mode & S_IFMT) {
+              case S_IFBLK: perms[0] = 'b'; break;
+              case S_IFCHR: perms[0] = 'c'; break;
+              case S_IFDIR: perms[0] = 'd'; break;
+              case S_IFIFO: perms[0] = 'p'; break;
+              case S_IFLNK: perms[0] = 'l'; break;
+              case S_IFSOCK: perms[0] = 's'; break;
+            }
+            if (st.st_mode & S_IRUSR)
+                perms[1] = 'r';
+            if (st.st_mode & S_IWUSR)
+                perms[2] = 'w';
+            if (st.st_mode & S_IXUSR)
+                perms[3] = (st.st_mode & S_ISUID ? 's' : 'x');
+            else
+                perms[3] = (st.st_mode & S_ISUID ? 'S' : '-');
+            if (st.st_mode & S_IRGRP)
+                perms[4] = 'r';
+            if (st.st_mode & S_IWGRP)
+                perms[5] = 'w';
+            if (st.st_mode & S_IXGRP)
+                perms[6] = (st.st_mode & S_ISGID ? 's' : 'x');
+            else
+                perms[6] = (st.st_mode & S_ISGID ? 'S' : '-');
+            if (st.st_mode & S_IROTH)
+                perms[7] = 'r';
+            if (st.st_mode & S_IWOTH)
+                perms[8] = 'w';
+            if (st.st_mode & S_IXOTH)
+                perms[9] = 'x';
+
+            if ((pwd = getpwuid(st.st_uid)) != NULL)
+                user = pwd->pw_name;
+            else
+                user = uidbuf = dupprintf("%u", (unsigned)st.st_uid);
+            if ((grp = getgrgid(st.st_gid)) != NULL)
+                group = grp->gr_name;
+            else
+                group = gidbuf = dupprintf("%u", (unsigned)st.st_gid);
+
+            tm = *localtime(&st.st_mtime);
+
+            *longname = dupprintf(
+                "%s %3u %-8s %-8s %8"PRIuMAX" %.3s %2d %02d:%02d %s",
+                perms, (unsigned)st.st_nlink, user, group,
+                (uintmax_t)st.st_size,
+                (&"JanFebMarAprMayJunJulAugSepOctNovDec"[3*tm.tm_mon]),
+                tm.tm_mday, tm.tm_hour, tm.tm_min, de->d_name);
+
+            sfree(uidbuf);
+            sfree(gidbuf);
+        }
+    }
+#endif
+}
+
 static void uss_readdir(SftpServer *srv, SftpReplyBuilder *reply,
                         ptrlen handle, int max_entries, bool omit_longname)
 {
     UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
     struct dirent *de;
     struct uss_dirhandle *udh;
+    struct {
+        char *name, *longname;
+        struct fxp_attrs attrs;
+    } names[USS_READDIR_MAX];
+    int nnames = 0;
 
     if ((udh = uss_lookup_dirhandle(uss, reply, handle)) == NULL)
         return;
 
-    errno = 0;
-    de = readdir(udh->dp);
-    if (!de) {
-        if (errno == 0) {
-            fxp_reply_error(reply, SSH_FX_EOF, "End of directory");
-        } else {
-            uss_error(uss, reply);
-        }
-    } else {
-        ptrlen longname = PTRLEN_LITERAL("");
-        char *longnamebuf = NULL;
-        struct fxp_attrs attrs = no_attrs;
+    if (max_entries > USS_READDIR_MAX)
+        max_entries = USS_READDIR_MAX;
 
-#if defined HAVE_FSTATAT && defined HAVE_DIRFD
-        struct stat st;
-        if (!fstatat(dirfd(udh->dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
-            char perms[11], *uidbuf = NULL, *gidbuf = NULL;
-            struct passwd *pwd;
-            struct group *grp;
-            const char *user, *group;
-            struct tm tm;
-
-            attrs = uss_translate_struct_stat(&st);
-
-            if (!omit_longname) {
-
-                strcpy(perms, "----------");
-                switch (st.st_mode & S_IFMT) {
-                  case S_IFBLK: perms[0] = 'b'; break;
-                  case S_IFCHR: perms[0] = 'c'; break;
-                  case S_IFDIR: perms[0] = 'd'; break;
-                  case S_IFIFO: perms[0] = 'p'; break;
-                  case S_IFLNK: perms[0] = 'l'; break;
-                  case S_IFSOCK: perms[0] = 's'; break;
-                }
-                if (st.st_mode & S_IRUSR)
-                    perms[1] = 'r';
-                if (st.st_mode & S_IWUSR)
-                    perms[2] = 'w';
-                if (st.st_mode & S_IXUSR)
-                    perms[3] = (st.st_mode & S_ISUID ? 's' : 'x');
-                else
-                    perms[3] = (st.st_mode & S_ISUID ? 'S' : '-');
-                if (st.st_mode & S_IRGRP)
-                    perms[4] = 'r';
-                if (st.st_mode & S_IWGRP)
-                    perms[5] = 'w';
-                if (st.st_mode & S_IXGRP)
-                    perms[6] = (st.st_mode & S_ISGID ? 's' : 'x');
-                else
-                    perms[6] = (st.st_mode & S_ISGID ? 'S' : '-');
-                if (st.st_mode & S_IROTH)
-                    perms[7] = 'r';
-                if (st.st_mode & S_IWOTH)
-                    perms[8] = 'w';
-                if (st.st_mode & S_IXOTH)
-                    perms[9] = 'x';
-
-                if ((pwd = getpwuid(st.st_uid)) != NULL)
-                    user = pwd->pw_name;
-                else
-                    user = uidbuf = dupprintf("%u", (unsigned)st.st_uid);
-                if ((grp = getgrgid(st.st_gid)) != NULL)
-                    group = grp->gr_name;
-                else
-                    group = gidbuf = dupprintf("%u", (unsigned)st.st_gid);
-
-                tm = *localtime(&st.st_mtime);
-
-                longnamebuf = dupprintf(
-                    "%s %3u %-8s %-8s %8"PRIuMAX" %.3s %2d %02d:%02d %s",
-                    perms, (unsigned)st.st_nlink, user, group,
-                    (uintmax_t)st.st_size,
-                    (&"JanFebMarAprMayJunJulAugSepOctNovDec"[3*tm.tm_mon]),
-                    tm.tm_mday, tm.tm_hour, tm.tm_min, de->d_name);
-                longname = ptrlen_from_asciz(longnamebuf);
-
-                sfree(uidbuf);
-                sfree(gidbuf);
+    while (nnames < max_entries) {
+        errno = 0;
+        de = readdir(udh->dp);
+        if (!de) {
+            /* Return what we've got; any error will happen again
+             * on the next call */
+            if (nnames > 0)
+                break;
+            if (errno == 0) {
+                fxp_reply_error(reply, SSH_FX_EOF, "End of directory");
+            } else {
+                uss_error(uss, reply);
             }
+            return;
         }
-#endif
 
-        /* FIXME: be able to return more than one, in which case we
-         * must also check max_entries */
-        fxp_reply_name_count(reply, 1);
-        fxp_reply_full_name(reply, ptrlen_from_asciz(de->d_name),
-                            longname, attrs);
+        names[nnames].name = dupstr(de->d_name);
+        uss_dirent_info(udh, de, omit_longname, &names[nnames].attrs,
+                        &names[nnames].longname);
+        nnames++;
+    }
 
-        sfree(longnamebuf);
+    fxp_reply_name_count(reply, nnames);
+    for (int i = 0; i < nnames; i++) {
+        fxp_reply_full_name(
+            reply, ptrlen_from_asciz(names[i].name),
+            (names[i].longname ? ptrlen_from_asciz(names[i].longname) :
+             PTRLEN_LITERAL("")), names[i].attrs);
+        sfree(names[i].name);
+        sfree(names[i].longname);
     }
 }
 
@@ -699,4 +847,5 @@ const struct SftpServerVtable unix_live_sftpserver_vt = {
     uss_read,
     uss_write,
     uss_readdir,
+    uss_copy_data,
 };
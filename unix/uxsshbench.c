@@ -0,0 +1,1238 @@
+/*
+ * sshbench: benchmark harness for PuTTY's SSH client and server
+ * stacks.
+ *
+ * In connection-storm mode (the default), it starts an instance of
+ * Uppity listening on a private Unix-domain socket, and then drives
+ * a configurable number of concurrent instances of the real SSH
+ * client backend (ssh.c) against it, all in this process's event
+ * loop. Each session goes through version exchange, key exchange,
+ * host key verification, password authentication and opening of a
+ * session channel, and is then torn down. The time spent in each of
+ * those phases is recorded from the client's point of view, and
+ * summarised as percentiles at the end of each run.
+ *
+ * A run is done for every combination of requested key exchange
+ * method and host key type. The server is restarted for each one,
+ * with its KEXINIT lists overridden to offer only the algorithms
+ * under test, so that the client (whose own preferences are left at
+ * their defaults) is forced to negotiate them.
+ *
+ * In throughput mode (--throughput), a single session is opened per
+ * run, and a fixed volume of data is pushed through its session
+ * channel, either from client to server (into 'cat > /dev/null') or
+ * from server to client (out of 'head -c'). That exercises the whole
+ * bulk data path: connection layer, binary packet protocol, cipher,
+ * MAC, compression and socket. One run is done for every combination
+ * of cipher, MAC and compression method, and the client's time is
+ * broken down by layer using the counters in perfcount.h.
+ *
+ * In timer mode (--timers N), no connections are made at all. N
+ * contexts each keep a timer live in timing.c, at intervals typical
+ * of keepalives and rekeys, and the costs of scheduling, cancelling
+ * and firing timers, and of run_timers() calls that find nothing
+ * due, are measured with all of them in place.
+ *
+ * (The client and server halves of PuTTY can't currently be linked
+ * into the same binary, because they each supply their own versions
+ * of the same glue functions. So the server runs as a separate
+ * process, and the two talk over an AF_UNIX stream socket, which
+ * keeps the network stack out of the measurements as much as is
+ * practical.)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "putty.h"
+#include "ssh.h"
+#include "storage.h"
+#include "network.h"
+#include "perfcount.h"
+
+const char *const appname = "sshbench";
+
+const bool share_can_be_downstream = false;
+const bool share_can_be_upstream = false;
+
+const bool buildinfo_gtk_relevant = false;
+
+char *x_get_default(const char *key) { return NULL; }
+void platform_get_x11_auth(struct X11Display *display, Conf *conf) {}
+const bool platform_uses_x11_unix_by_default = true;
+void ldisc_echoedit_update(Ldisc *ldisc) {}
+char *platform_default_s(const char *name) { return NULL; }
+bool platform_default_b(const char *name, bool def) { return def; }
+int platform_default_i(const char *name, int def) { return def; }
+FontSpec *platform_default_fontspec(const char *name)
+{ return fontspec_new(""); }
+Filename *platform_default_filename(const char *name)
+{ return filename_from_str(""); }
+
+static bool verbose = false;
+
+/*
+ * Wall-clock timestamps, in microseconds, from the monotonic clock.
+ */
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * The points in a connection's lifetime at which we take a
+ * timestamp. The phases we report are the intervals between them.
+ */
+#define BENCH_MARKS(X)                                                  \
+    X(START, "connect")                                                 \
+    X(VERSION, "version exchange complete")                             \
+    X(HOSTKEY_PRESENTED, "host key presented")                          \
+    X(HOSTKEY_VERIFIED, "host key verified")                            \
+    X(KEX, "key exchange complete")                                     \
+    X(USERAUTH, "user authentication complete")                         \
+    X(CHANNEL, "session channel open")                                  \
+    /* end of list */
+#define ENUM_DECL(name, desc) MARK_##name,
+enum { BENCH_MARKS(ENUM_DECL) NMARKS };
+#undef ENUM_DECL
+
+#define BENCH_PHASES(X)                                                 \
+    X(VERSION, "version")                                               \
+    X(KEX, "kex")                                                       \
+    X(HOSTKEY, "hostkey")                                               \
+    X(USERAUTH, "userauth")                                             \
+    X(CHANNEL, "channel")                                               \
+    X(TOTAL, "total")                                                   \
+    /* end of list */
+#define ENUM_DECL(name, desc) PHASE_##name,
+enum { BENCH_PHASES(ENUM_DECL) NPHASES };
+#undef ENUM_DECL
+#define NAME_DECL(name, desc) desc,
+static const char *const phase_names[] = { BENCH_PHASES(NAME_DECL) };
+#undef NAME_DECL
+
+typedef struct BenchRun BenchRun;
+typedef struct BenchSession BenchSession;
+typedef struct XferRun XferRun;
+
+struct BenchSession {
+    BenchRun *run;
+    unsigned id;
+
+    Backend *backend;
+    LogContext *logctx;
+    Conf *conf;
+
+    uint64_t marks[NMARKS];
+    bool finished;
+
+    Seat seat;
+    LogPolicy logpolicy;
+};
+
+struct BenchRun {
+    const char *kex, *hostkey;
+    Conf *conf;
+    XferRun *xfer;                     /* NULL in connection-storm mode */
+
+    int total, concurrency;
+    int started, active, succeeded, failed;
+
+    /* Per-phase latencies of each successful session, in microseconds */
+    uint64_t *phases[NPHASES];
+
+    uint64_t start_time, end_time;
+};
+
+/*
+ * State of a throughput run. Only one session is active at a time.
+ */
+struct XferRun {
+    const char *cipher, *mac, *comp;
+    bool upload;
+    uint64_t volume;
+
+    BenchSession *sess;                /* once its channel is open */
+    uint64_t sent, received;
+    bool eof_sent;
+
+    uint64_t start_time, end_time;
+    PerfLayerStats layers[PERF_NLAYERS];
+    MemStats mem_start, mem;           /* allocator activity during xfer */
+};
+
+static Conf *base_conf;
+static const char *server_socket_path;
+
+static void bench_session_start(BenchRun *run);
+
+static void bench_session_free_callback(void *vctx)
+{
+    BenchSession *sess = (BenchSession *)vctx;
+    BenchRun *run = sess->run;
+
+    if (sess->backend)
+        backend_free(sess->backend);
+    log_free(sess->logctx);
+    conf_free(sess->conf);
+    sfree(sess);
+
+    run->active--;
+    if (run->started < run->total)
+        bench_session_start(run);
+}
+
+static void bench_session_finish(BenchSession *sess, const char *error)
+{
+    BenchRun *run = sess->run;
+
+    if (sess->finished)
+        return;
+    sess->finished = true;
+
+    if (run->xfer) {
+        XferRun *xfer = run->xfer;
+        perf_stop();
+        xfer->end_time = now_usec();
+        memcpy(xfer->layers, perf_stats, sizeof(xfer->layers));
+        MemStats ms;
+        memstats_get(&ms);
+        xfer->mem.mallocs = ms.mallocs - xfer->mem_start.mallocs;
+        xfer->mem.reallocs = ms.reallocs - xfer->mem_start.reallocs;
+        xfer->mem.frees = ms.frees - xfer->mem_start.frees;
+        xfer->mem.slab_allocs = ms.slab_allocs - xfer->mem_start.slab_allocs;
+        xfer->mem.slab_reuses = ms.slab_reuses - xfer->mem_start.slab_reuses;
+        xfer->sess = NULL;
+    }
+
+    if (error) {
+        run->failed++;
+        fprintf(stderr, "%s: session %u failed: %s\n",
+                appname, sess->id, error);
+    } else if (run->xfer) {
+        run->succeeded++;
+    } else {
+        int i = run->succeeded++;
+        uint64_t *m = sess->marks;
+        run->phases[PHASE_VERSION][i] = m[MARK_VERSION] - m[MARK_START];
+        run->phases[PHASE_KEX][i] =
+            (m[MARK_HOSTKEY_PRESENTED] - m[MARK_VERSION]) +
+            (m[MARK_KEX] - m[MARK_HOSTKEY_VERIFIED]);
+        run->phases[PHASE_HOSTKEY][i] =
+            m[MARK_HOSTKEY_VERIFIED] - m[MARK_HOSTKEY_PRESENTED];
+        run->phases[PHASE_USERAUTH][i] = m[MARK_USERAUTH] - m[MARK_KEX];
+        run->phases[PHASE_CHANNEL][i] = m[MARK_CHANNEL] - m[MARK_USERAUTH];
+        run->phases[PHASE_TOTAL][i] = m[MARK_CHANNEL] - m[MARK_START];
+    }
+
+    /* We can't free the backend from inside one of its own callbacks */
+    queue_toplevel_callback(bench_session_free_callback, sess);
+}
+
+static void bench_mark(BenchSession *sess, int mark)
+{
+    if (!sess->marks[mark])
+        sess->marks[mark] = now_usec();
+}
+
+/* ----------------------------------------------------------------------
+ * Seat and LogPolicy for each client session. Most phase transitions
+ * are visible to us as Seat method calls; the rest we have to pick
+ * out of the Event Log.
+ */
+
+static size_t bench_output(
+    Seat *seat, bool is_stderr, const void *data, size_t len)
+{
+    BenchSession *sess = container_of(seat, BenchSession, seat);
+    if (sess->run->xfer && !is_stderr)
+        sess->run->xfer->received += len;
+    return 0;
+}
+
+static bool bench_eof(Seat *seat)
+{
+    BenchSession *sess = container_of(seat, BenchSession, seat);
+    /* In throughput mode, wait for the exit status that follows */
+    if (!sess->run->xfer)
+        bench_session_finish(sess, "unexpected EOF from server");
+    return false;
+}
+
+static int bench_get_userpass_input(Seat *seat, prompts_t *p, bufchain *input)
+{
+    /* Uppity's built-in good password */
+    for (size_t i = 0; i < p->n_prompts; i++)
+        prompt_set_result(p->prompts[i], "weasel");
+    return 1;
+}
+
+static void bench_notify_remote_exit(Seat *seat)
+{
+    BenchSession *sess = container_of(seat, BenchSession, seat);
+    XferRun *xfer = sess->run->xfer;
+
+    if (!xfer || !xfer->sess) {
+        bench_session_finish(sess, "remote side exited");
+    } else if (backend_exitcode(sess->backend) != 0) {
+        bench_session_finish(sess, "remote command failed");
+    } else if (xfer->upload ? xfer->sent != xfer->volume :
+               xfer->received != xfer->volume) {
+        bench_session_finish(sess, "transfer incomplete");
+    } else {
+        bench_session_finish(sess, NULL);
+    }
+}
+
+static void bench_connection_fatal(Seat *seat, const char *message)
+{
+    BenchSession *sess = container_of(seat, BenchSession, seat);
+    bench_session_finish(sess, message);
+}
+
+static void bench_kex_finished(Seat *seat)
+{
+    BenchSession *sess = container_of(seat, BenchSession, seat);
+    bench_mark(sess, MARK_KEX);
+}
+
+static int bench_verify_ssh_host_key(
+    Seat *seat, const char *host, int port,
+    const char *keytype, char *keystr, char *key_fingerprint,
+    void (*callback)(void *ctx, int result), void *ctx)
+{
+    BenchSession *sess = container_of(seat, BenchSession, seat);
+
+    /*
+     * Do the same host key database lookup as a real client would,
+     * so that its cost is included. But accept the key whatever the
+     * answer is.
+     */
+    bench_mark(sess, MARK_HOSTKEY_PRESENTED);
+    verify_host_key(host, port, keytype, keystr);
+    bench_mark(sess, MARK_HOSTKEY_VERIFIED);
+    return 1;
+}
+
+static int bench_confirm_weak_crypto_primitive(
+    Seat *seat, const char *algtype, const char *algname,
+    void (*callback)(void *ctx, int result), void *ctx)
+{
+    return 1;
+}
+
+static int bench_confirm_weak_cached_hostkey(
+    Seat *seat, const char *algname, const char *betteralgs,
+    void (*callback)(void *ctx, int result), void *ctx)
+{
+    return 1;
+}
+
+static const SeatVtable bench_seat_vt = {
+    bench_output,
+    bench_eof,
+    bench_get_userpass_input,
+    bench_notify_remote_exit,
+    bench_connection_fatal,
+    nullseat_update_specials_menu,
+    nullseat_get_ttymode,
+    nullseat_set_busy_status,
+    bench_verify_ssh_host_key,
+    bench_confirm_weak_crypto_primitive,
+    bench_confirm_weak_cached_hostkey,
+    nullseat_is_never_utf8,
+    nullseat_echoedit_update,
+    nullseat_get_x_display,
+    nullseat_get_windowid,
+    nullseat_get_window_pixel_size,
+    nullseat_stripctrl_new,
+    nullseat_set_trust_status_vacuously,
+    nullseat_verbose_no,
+    nullseat_interactive_no,
+    bench_kex_finished,
+};
+
+static void bench_eventlog(LogPolicy *lp, const char *event)
+{
+    BenchSession *sess = container_of(lp, BenchSession, logpolicy);
+
+    if (verbose)
+        fprintf(stderr, "#%u +%.3fms: %s\n", sess->id,
+                (now_usec() - sess->marks[MARK_START]) / 1000.0, event);
+
+    if (strstartswith(event, "Using SSH protocol version")) {
+        bench_mark(sess, MARK_VERSION);
+    } else if (!strcmp(event, "Access granted")) {
+        bench_mark(sess, MARK_USERAUTH);
+    } else if (!strcmp(event, "Opened main channel")) {
+        bench_mark(sess, MARK_CHANNEL);
+        if (sess->run->xfer) {
+            XferRun *xfer = sess->run->xfer;
+            xfer->sess = sess;
+            xfer->start_time = now_usec();
+            memstats_get(&xfer->mem_start);
+            perf_start();
+        } else {
+            bench_session_finish(sess, NULL);
+        }
+    }
+}
+
+static int bench_askappend(LogPolicy *lp, Filename *filename,
+                           void (*callback)(void *ctx, int result), void *ctx)
+{
+    return 2;
+}
+
+static void bench_logging_error(LogPolicy *lp, const char *event)
+{
+    fprintf(stderr, "%s: logging error: %s\n", appname, event);
+}
+
+static const LogPolicyVtable bench_logpolicy_vt = {
+    bench_eventlog,
+    bench_askappend,
+    bench_logging_error,
+    null_lp_verbose_no,
+};
+
+/*
+ * ssh.c thinks it's making an ordinary network connection to a
+ * proxy. We intercept that, and connect it to our server's socket
+ * instead.
+ */
+Socket *platform_new_connection(SockAddr *addr, const char *hostname,
+                                int port, bool privport,
+                                bool oobinline, bool nodelay, bool keepalive,
+                                Plug *plug, Conf *conf)
+{
+    sk_addr_free(addr);
+    return sk_new(unix_sock_addr(server_socket_path), 0,
+                  false, false, false, false, 0, plug);
+}
+
+static void bench_session_start(BenchRun *run)
+{
+    BenchSession *sess = snew(BenchSession);
+    memset(sess, 0, sizeof(*sess));
+
+    sess->run = run;
+    sess->id = run->started++;
+    sess->seat.vt = &bench_seat_vt;
+    sess->logpolicy.vt = &bench_logpolicy_vt;
+    sess->conf = conf_copy(run->conf);
+    sess->logctx = log_init(&sess->logpolicy, sess->conf);
+    run->active++;
+
+    char *realhost;
+    sess->marks[MARK_START] = now_usec();
+    const char *error = backend_init(
+        &ssh_backend, &sess->seat, &sess->backend, sess->logctx, sess->conf,
+        conf_get_str(sess->conf, CONF_host), conf_get_int(sess->conf,
+                                                          CONF_port),
+        &realhost, true, false);
+    if (error) {
+        sess->backend = NULL;
+        bench_session_finish(sess, error);
+        return;
+    }
+    sfree(realhost);
+}
+
+/* ----------------------------------------------------------------------
+ * Running the server.
+ */
+
+static const char *server_program = "./uppity";
+static const char **server_hostkeys;
+static size_t n_server_hostkeys, server_hostkeys_size;
+static int server_workers = 4;
+
+static pid_t start_server(const char *kex, const char *hostkey,
+                          char *const *extra_args, size_t n_extra_args)
+{
+    char *kexarg = dupprintf("--kexinit-kex=%s", kex);
+    char *hkarg = dupprintf("--kexinit-hostkey=%s", hostkey);
+    char *listenarg = dupprintf("--listen=%s", server_socket_path);
+    char *workersarg = dupprintf("--workers=%d", server_workers);
+
+    const char **args = snewn(8 + 2 * n_server_hostkeys + n_extra_args,
+                              const char *);
+    size_t nargs = 0;
+    args[nargs++] = server_program;
+    args[nargs++] = listenarg;
+    args[nargs++] = workersarg;
+    args[nargs++] = kexarg;
+    args[nargs++] = hkarg;
+    for (size_t i = 0; i < n_server_hostkeys; i++) {
+        args[nargs++] = "--hostkey";
+        args[nargs++] = server_hostkeys[i];
+    }
+    for (size_t i = 0; i < n_extra_args; i++)
+        args[nargs++] = extra_args[i];
+    args[nargs++] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "%s: fork: %s\n", appname, strerror(errno));
+        exit(1);
+    } else if (pid == 0) {
+        if (!verbose) {
+            int fd = open("/dev/null", O_WRONLY);
+            if (fd >= 0) {
+                dup2(fd, 2);
+                close(fd);
+            }
+        }
+        execv(server_program, (char **)args);
+        fprintf(stderr, "%s: %s: exec: %s\n", appname, server_program,
+                strerror(errno));
+        _exit(1);
+    }
+
+    sfree(args);
+    sfree(listenarg);
+    sfree(workersarg);
+    sfree(kexarg);
+    sfree(hkarg);
+
+    /* Wait for the listening socket to appear */
+    for (int i = 0; i < 1000; i++) {
+        struct stat st;
+        int status;
+        if (stat(server_socket_path, &st) == 0)
+            return pid;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "%s: server exited with status %d\n",
+                    appname, status);
+            exit(1);
+        }
+        usleep(10000);
+    }
+
+    fprintf(stderr, "%s: server did not start listening\n", appname);
+    kill(pid, SIGTERM);
+    exit(1);
+}
+
+static void stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(server_socket_path);
+}
+
+/* ----------------------------------------------------------------------
+ * Reporting.
+ */
+
+static int cmp_uint64(const void *av, const void *bv)
+{
+    uint64_t a = *(const uint64_t *)av, b = *(const uint64_t *)bv;
+    return a < b ? -1 : a > b ? +1 : 0;
+}
+
+static double percentile(const uint64_t *sorted, int n, double q)
+{
+    int i = (int)(q * n);
+    if (i >= n)
+        i = n - 1;
+    return sorted[i] / 1000.0;
+}
+
+static void report_run(BenchRun *run)
+{
+    double elapsed = (run->end_time - run->start_time) / 1000000.0;
+    int n = run->succeeded;
+
+    printf("kex %s, host key %s: %d ok, %d failed, %.1f connections/s\n",
+           run->kex, run->hostkey, run->succeeded, run->failed,
+           elapsed > 0 ? run->succeeded / elapsed : 0.0);
+    if (!n)
+        return;
+
+    printf("  %-10s %9s %9s %9s %9s %9s %9s  (ms)\n",
+           "phase", "mean", "min", "p50", "p90", "p99", "max");
+    for (int p = 0; p < NPHASES; p++) {
+        uint64_t *v = run->phases[p];
+        uint64_t sum = 0;
+        qsort(v, n, sizeof(*v), cmp_uint64);
+        for (int i = 0; i < n; i++)
+            sum += v[i];
+        printf("  %-10s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+               phase_names[p], (double)sum / n / 1000.0, v[0] / 1000.0,
+               percentile(v, n, 0.50), percentile(v, n, 0.90),
+               percentile(v, n, 0.99), v[n-1] / 1000.0);
+    }
+    fflush(stdout);
+}
+
+static bool bench_continue(void *ctx, bool found_any_fd,
+                           bool ran_any_callback)
+{
+    BenchRun *run = (BenchRun *)ctx;
+    return run->active > 0 || run->started < run->total;
+}
+
+static bool do_run(const char *kex, const char *hostkey,
+                   int total, int concurrency)
+{
+    BenchRun run[1];
+    memset(run, 0, sizeof(run));
+    run->kex = kex;
+    run->hostkey = hostkey;
+    run->conf = base_conf;
+    run->total = total;
+    run->concurrency = concurrency;
+    for (int p = 0; p < NPHASES; p++)
+        run->phases[p] = snewn(total, uint64_t);
+
+    pid_t pid = start_server(kex, hostkey, NULL, 0);
+
+    run->start_time = now_usec();
+    for (int i = 0; i < concurrency && run->started < total; i++)
+        bench_session_start(run);
+    cli_main_loop(cliloop_no_pw_setup, cliloop_no_pw_check,
+                  bench_continue, run);
+    run->end_time = now_usec();
+
+    stop_server(pid);
+    report_run(run);
+
+    for (int p = 0; p < NPHASES; p++)
+        sfree(run->phases[p]);
+    return run->failed == 0;
+}
+
+/* ----------------------------------------------------------------------
+ * Throughput mode.
+ */
+
+enum { DATA_ZERO, DATA_TEXT, DATA_RANDOM };
+static const char *const data_names[] = { "zero", "text", "random" };
+static const char text_line[] =
+    "The quick brown fox jumps over the lazy dog. 0123456789\n";
+
+#define XFER_CHUNK 32768
+#define XFER_MAX_BACKLOG 262144
+static char xfer_data[XFER_CHUNK];
+
+static void fill_xfer_data(int data_type)
+{
+    switch (data_type) {
+      case DATA_ZERO:
+        memset(xfer_data, 0, XFER_CHUNK);
+        break;
+      case DATA_TEXT:
+        for (size_t i = 0; i < XFER_CHUNK; i++)
+            xfer_data[i] = text_line[i % (sizeof(text_line) - 1)];
+        break;
+      case DATA_RANDOM:
+        random_read(xfer_data, XFER_CHUNK);
+        break;
+    }
+}
+
+/*
+ * Keep the client's outgoing buffers topped up during an upload,
+ * and send EOF once the whole volume has been handed over.
+ */
+static void xfer_pump(XferRun *xfer)
+{
+    BenchSession *sess = xfer->sess;
+
+    if (!sess || sess->finished || !xfer->upload || xfer->eof_sent ||
+        !backend_sendok(sess->backend))
+        return;
+
+    while (xfer->sent < xfer->volume &&
+           backend_sendbuffer(sess->backend) < XFER_MAX_BACKLOG) {
+        size_t len = XFER_CHUNK;
+        if (len > xfer->volume - xfer->sent)
+            len = xfer->volume - xfer->sent;
+        backend_send(sess->backend, xfer_data, len);
+        xfer->sent += len;
+    }
+
+    if (xfer->sent == xfer->volume) {
+        backend_special(sess->backend, SS_EOF, 0);
+        xfer->eof_sent = true;
+    }
+}
+
+static bool xfer_continue(void *ctx, bool found_any_fd,
+                          bool ran_any_callback)
+{
+    BenchRun *run = (BenchRun *)ctx;
+    xfer_pump(run->xfer);
+    return run->active > 0;
+}
+
+static void report_xfer(BenchRun *run)
+{
+    XferRun *xfer = run->xfer;
+
+    printf("cipher %s, MAC %s, compression %s, %s: ",
+           xfer->cipher, xfer->mac ? xfer->mac : "(built in)",
+           xfer->comp, xfer->upload ? "upload" : "download");
+    if (!run->succeeded) {
+        printf("failed\n");
+        fflush(stdout);
+        return;
+    }
+
+    double elapsed = (xfer->end_time - xfer->start_time) / 1000000.0;
+    printf("%.1f MB in %.3f s = %.1f MB/s\n", xfer->volume / 1e6,
+           elapsed, elapsed > 0 ? xfer->volume / 1e6 / elapsed : 0.0);
+
+    /*
+     * The time spent waiting in poll() is left out of the breakdown,
+     * since it's mostly a measure of how long the server took, and
+     * would otherwise swamp everything else.
+     */
+    uint64_t total = 0;
+    for (int i = 0; i < PERF_NLAYERS; i++)
+        if (i != PERF_IDLE)
+            total += xfer->layers[i].ticks;
+    printf("  %-12s %12s %7s %10s %12s\n", "layer", perf_tick_unit,
+           "share", "calls", "MB handled");
+    for (int i = 0; i < PERF_NLAYERS; i++) {
+        PerfLayerStats *st = &xfer->layers[i];
+        if (i == PERF_IDLE)
+            continue;
+        printf("  %-12s %12.2f %6.1f%% %10llu %12.1f\n",
+               perf_layer_names[i], (double)st->ticks / xfer->volume,
+               total ? 100.0 * st->ticks / total : 0.0,
+               (unsigned long long)st->calls, st->bytes / 1e6);
+    }
+    printf("  %-12s %12.2f  (%s per byte of channel data)\n", "total",
+           (double)total / xfer->volume, perf_tick_unit);
+    printf("  %-12s %12.2f  (waiting in poll, not included above)\n",
+           perf_layer_names[PERF_IDLE],
+           (double)xfer->layers[PERF_IDLE].ticks / xfer->volume);
+
+    MemStats *ms = &xfer->mem;
+    double mb = xfer->volume / 1e6;
+    printf("  allocator: %.1f mallocs/MB, %.1f reallocs/MB, "
+           "%.1f slab allocs/MB (%.1f%% recycled)\n",
+           mb > 0 ? ms->mallocs / mb : 0.0,
+           mb > 0 ? ms->reallocs / mb : 0.0,
+           mb > 0 ? ms->slab_allocs / mb : 0.0,
+           ms->slab_allocs ? 100.0 * ms->slab_reuses / ms->slab_allocs : 0.0);
+    fflush(stdout);
+}
+
+static bool do_xfer_run(const char *kex, const char *hostkey,
+                        XferRun *xfer, int data_type)
+{
+    const char *dir = xfer->upload ? "cs" : "sc";
+    char *server_args[3];
+    server_args[0] = dupprintf("--kexinit-%scipher=%s", dir, xfer->cipher);
+    server_args[1] = dupprintf("--kexinit-%smac=%s", dir,
+                               xfer->mac ? xfer->mac : "hmac-sha2-256");
+    server_args[2] = dupprintf("--kexinit-%scomp=%s", dir, xfer->comp);
+
+    BenchRun run[1];
+    memset(run, 0, sizeof(run));
+    run->kex = kex;
+    run->hostkey = hostkey;
+    run->conf = conf_copy(base_conf);
+    run->xfer = xfer;
+    run->total = run->concurrency = 1;
+    for (int p = 0; p < NPHASES; p++)
+        run->phases[p] = snewn(1, uint64_t);
+
+    conf_set_bool(run->conf, CONF_compression, strcmp(xfer->comp, "none"));
+    conf_set_bool(run->conf, CONF_ssh_subsys, false);
+    char *cmd;
+    if (xfer->upload) {
+        cmd = dupstr("cat > /dev/null");
+    } else if (data_type == DATA_TEXT) {
+        char *line = dupstr(text_line);
+        line[strcspn(line, "\n")] = '\0';
+        cmd = dupprintf("yes '%s' | head -c %llu", line,
+                        (unsigned long long)xfer->volume);
+        sfree(line);
+    } else {
+        cmd = dupprintf("head -c %llu %s", (unsigned long long)xfer->volume,
+                        data_type == DATA_ZERO ? "/dev/zero" : "/dev/urandom");
+    }
+    conf_set_str(run->conf, CONF_remote_cmd, cmd);
+    sfree(cmd);
+
+    pid_t pid = start_server(kex, hostkey, server_args, lenof(server_args));
+
+    bench_session_start(run);
+    cli_main_loop(cliloop_no_pw_setup, cliloop_no_pw_check,
+                  xfer_continue, run);
+
+    stop_server(pid);
+    report_xfer(run);
+
+    for (int p = 0; p < NPHASES; p++)
+        sfree(run->phases[p]);
+    for (size_t i = 0; i < lenof(server_args); i++)
+        sfree(server_args[i]);
+    conf_free(run->conf);
+    return run->failed == 0;
+}
+
+static const ssh2_ciphers *const xfer_cipher_groups[] = {
+    &ssh2_aes, &ssh2_ccp,
+};
+
+static const ssh2_macalg *const xfer_macs[] = {
+    &ssh_hmac_sha256, &ssh_hmac_sha1, &ssh_hmac_sha1_96, &ssh_hmac_md5,
+};
+
+static const ssh_cipheralg *find_cipher(const char *name)
+{
+    for (size_t g = 0; g < lenof(xfer_cipher_groups); g++)
+        for (int i = 0; i < xfer_cipher_groups[g]->nciphers; i++)
+            if (!strcmp(xfer_cipher_groups[g]->list[i]->ssh2_id, name))
+                return xfer_cipher_groups[g]->list[i];
+    return NULL;
+}
+
+/*
+ * Add a comma-separated list of names to a dynamic array.
+ */
+static void add_names(const char ***names, size_t *n, size_t *size,
+                      const char *list)
+{
+    ptrlen pl = ptrlen_from_asciz(list), word;
+    while (word = ptrlen_get_word(&pl, ","), word.len != 0) {
+        sgrowarray(*names, *size, *n);
+        (*names)[(*n)++] = mkstr(word);
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Timer mode.
+ */
+
+typedef struct BenchTimer {
+    unsigned long when;
+    bool fired;
+} BenchTimer;
+
+static size_t timers_fired;
+
+static void bench_timer_fn(void *ctx, unsigned long now)
+{
+    BenchTimer *bt = (BenchTimer *)ctx;
+    if (now == bt->when && !bt->fired) {
+        bt->fired = true;
+        timers_fired++;
+    }
+}
+
+/* A small deterministic generator, so runs are comparable */
+static uint32_t bench_rand_state = 12345;
+static int bench_rand(int limit)
+{
+    bench_rand_state = bench_rand_state * 1103515245 + 12345;
+    return (bench_rand_state >> 8) % limit;
+}
+
+static void report_timer_op(const char *what, uint64_t usec, size_t n)
+{
+    printf("  %-32s %10zu ops %9.1f ns/op\n", what, n,
+           n ? usec * 1000.0 / n : 0.0);
+}
+
+static bool do_timer_run(int ntimers)
+{
+    BenchTimer *bts = snewn(ntimers, BenchTimer);
+    unsigned long next;
+    uint64_t t0;
+    int nfire = ntimers < 10000 ? ntimers : 10000;
+
+    printf("%d live timers:\n", ntimers);
+
+    /* Long-lived timers, between a second and an hour away */
+    t0 = now_usec();
+    for (int i = 0; i < ntimers; i++) {
+        bts[i].fired = false;
+        bts[i].when = schedule_timer(
+            TICKSPERSEC + bench_rand(3600 * TICKSPERSEC),
+            bench_timer_fn, &bts[i]);
+    }
+    report_timer_op("schedule", now_usec() - t0, ntimers);
+
+    /* Cancel and reschedule, as a keepalive being reset does */
+    t0 = now_usec();
+    for (int i = 0; i < ntimers; i++) {
+        BenchTimer *bt = &bts[bench_rand(ntimers)];
+        expire_timer_context(bt);
+        bt->when = schedule_timer(
+            TICKSPERSEC + bench_rand(3600 * TICKSPERSEC),
+            bench_timer_fn, bt);
+    }
+    report_timer_op("expire and reschedule", now_usec() - t0, ntimers);
+
+    /* The event loop's check for due timers, with nothing due */
+    t0 = now_usec();
+    for (int i = 0; i < ntimers; i++)
+        run_timers(GETTICKCOUNT(), &next);
+    report_timer_op("run_timers, none due", now_usec() - t0, ntimers);
+
+    /*
+     * Bring some of them forward to the next half second, and run
+     * the wheel until they've all gone off, counting only the time
+     * spent inside run_timers.
+     */
+    for (int i = 0; i < nfire; i++) {
+        BenchTimer *bt = &bts[i];
+        expire_timer_context(bt);
+        bt->when = schedule_timer(1 + bench_rand(TICKSPERSEC / 2),
+                                  bench_timer_fn, bt);
+    }
+    uint64_t run_usec = 0, deadline = now_usec() + 5000000;
+    timers_fired = 0;
+    while (timers_fired < nfire && now_usec() < deadline) {
+        t0 = now_usec();
+        run_timers(GETTICKCOUNT(), &next);
+        run_usec += now_usec() - t0;
+        usleep(1000);
+    }
+    report_timer_op("run_timers, firing", run_usec, timers_fired);
+
+    t0 = now_usec();
+    for (int i = 0; i < ntimers; i++)
+        expire_timer_context(&bts[i]);
+    report_timer_op("expire", now_usec() - t0, ntimers);
+    fflush(stdout);
+
+    bool ok = (timers_fired == nfire);
+    if (!ok)
+        printf("  only %zu of %d timers fired\n", timers_fired, nfire);
+    sfree(bts);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------
+ * Main program.
+ */
+
+static const char *const default_kexes[] = {
+    "curve25519-sha256@libssh.org",
+    "ecdh-sha2-nistp256",
+    "ecdh-sha2-nistp384",
+    "ecdh-sha2-nistp521",
+    "diffie-hellman-group14-sha256",
+    "diffie-hellman-group-exchange-sha256",
+};
+
+static void show_help(FILE *fp)
+{
+    fputs("usage:   sshbench [options] --hostkey KEY [--hostkey KEY...]\n"
+          "options: --server PATH        Uppity binary to run as the server "
+          "(default ./uppity)\n"
+          "         --hostkey KEY        host key file for the server; "
+          "one run is done\n"
+          "                                for each key type given\n"
+          "         --kex NAME[,NAME...] key exchange methods to test "
+          "(default: all\n"
+          "                                ECDH, group14 and group exchange "
+          "methods)\n"
+          "         --sessions N         connections per run (default 100)\n"
+          "         --concurrency N      connections in progress at once "
+          "(default 10)\n"
+          "         --workers N          server worker processes "
+          "(default 4)\n"
+          "         --kex-guess          have the client guess the kex "
+          "method\n"
+          "         --verbose            show client and server event logs\n"
+          "throughput mode:\n"
+          "         --throughput         measure bulk data transfer instead "
+          "of connection\n"
+          "                                setup\n"
+          "         --direction DIR      'up', 'down' or 'both' "
+          "(default up)\n"
+          "         --volume SIZE        data per run, with optional k/M/G "
+          "suffix\n"
+          "                                (default 16M)\n"
+          "         --data TYPE          'zero', 'text' or 'random' "
+          "(default random)\n"
+          "         --cipher NAME[,NAME...]  ciphers to test (default: all "
+          "AES and\n"
+          "                                ChaCha20-Poly1305)\n"
+          "         --mac NAME[,NAME...] MACs to test (default: all HMACs, "
+          "with and\n"
+          "                                without encrypt-then-MAC)\n"
+          "         --comp NAME[,NAME...]  compression methods to test "
+          "(default: none,zlib)\n"
+          "timer mode:\n"
+          "         --timers N           measure timing.c with N live "
+          "timers instead\n"
+          "                                (no host key or server "
+          "needed)\n"
+          "also:    sshbench --help      show this text\n"
+          "         sshbench --version   show version information\n", fp);
+}
+
+static void show_version_and_exit(void)
+{
+    char *buildinfo_text = buildinfo("\n");
+    printf("%s: %s\n%s\n", appname, ver, buildinfo_text);
+    sfree(buildinfo_text);
+    exit(0);
+}
+
+static bool longoptarg(const char *arg, const char *expected,
+                       const char **val, int *argcp, char ***argvp)
+{
+    int len = strlen(expected);
+    if (memcmp(arg, expected, len))
+        return false;
+    if (arg[len] == '=') {
+        *val = arg + len + 1;
+        return true;
+    } else if (arg[len] == '\0') {
+        if (--*argcp > 0) {
+            *val = *++*argvp;
+            return true;
+        } else {
+            fprintf(stderr, "%s: option %s expects an argument\n",
+                    appname, expected);
+            exit(1);
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    int sessions = 100, concurrency = 10, ntimers = 0;
+    const char **kexes = NULL;
+    size_t nkexes = 0, kexsize = 0;
+    char **hostkey_algs = NULL;
+    size_t nhostkey_algs = 0, hostkey_algs_size = 0;
+    bool throughput = false, up = true, down = false, kex_guess = false;
+    uint64_t volume = 16 << 20;
+    int data_type = DATA_RANDOM;
+    const char **ciphers = NULL, **macs = NULL, **comps = NULL;
+    size_t nciphers = 0, ciphersize = 0, nmacs = 0, macsize = 0;
+    size_t ncomps = 0, compsize = 0;
+
+    while (--argc > 0) {
+        const char *arg = *++argv;
+        const char *val;
+
+        if (!strcmp(arg, "--help")) {
+            show_help(stdout);
+            exit(0);
+        } else if (!strcmp(arg, "--version")) {
+            show_version_and_exit();
+        } else if (!strcmp(arg, "--verbose") || !strcmp(arg, "-v")) {
+            verbose = true;
+        } else if (longoptarg(arg, "--server", &val, &argc, &argv)) {
+            server_program = val;
+        } else if (longoptarg(arg, "--hostkey", &val, &argc, &argv)) {
+            Filename *keyfile = filename_from_str(val);
+            strbuf *blob = strbuf_new();
+            char *alg = NULL;
+            const char *error;
+            if (!ppk_loadpub_f(keyfile, &alg, BinarySink_UPCAST(blob),
+                               NULL, &error)) {
+                fprintf(stderr, "%s: unable to load host key '%s': %s\n",
+                        appname, val, error);
+                exit(1);
+            }
+            strbuf_free(blob);
+            filename_free(keyfile);
+            sgrowarray(server_hostkeys, server_hostkeys_size,
+                       n_server_hostkeys);
+            server_hostkeys[n_server_hostkeys++] = val;
+            sgrowarray(hostkey_algs, hostkey_algs_size, nhostkey_algs);
+            hostkey_algs[nhostkey_algs++] = alg;
+        } else if (longoptarg(arg, "--kex", &val, &argc, &argv)) {
+            add_names(&kexes, &nkexes, &kexsize, val);
+        } else if (!strcmp(arg, "--kex-guess")) {
+            kex_guess = true;
+        } else if (!strcmp(arg, "--throughput")) {
+            throughput = true;
+        } else if (longoptarg(arg, "--direction", &val, &argc, &argv)) {
+            up = !strcmp(val, "up") || !strcmp(val, "both");
+            down = !strcmp(val, "down") || !strcmp(val, "both");
+            if (!up && !down) {
+                fprintf(stderr, "%s: unrecognised direction '%s'\n",
+                        appname, val);
+                exit(1);
+            }
+        } else if (longoptarg(arg, "--volume", &val, &argc, &argv)) {
+            char *end;
+            volume = strtoull(val, &end, 10);
+            switch (*end) {
+              case 'G': case 'g': volume <<= 10; /* fall through */
+              case 'M': case 'm': volume <<= 10; /* fall through */
+              case 'K': case 'k': volume <<= 10; end++; break;
+            }
+            if (*end || !volume) {
+                fprintf(stderr, "%s: bad volume '%s'\n", appname, val);
+                exit(1);
+            }
+        } else if (longoptarg(arg, "--data", &val, &argc, &argv)) {
+            for (data_type = 0; data_type < lenof(data_names); data_type++)
+                if (!strcmp(val, data_names[data_type]))
+                    break;
+            if (data_type == lenof(data_names)) {
+                fprintf(stderr, "%s: unrecognised data type '%s'\n",
+                        appname, val);
+                exit(1);
+            }
+        } else if (longoptarg(arg, "--cipher", &val, &argc, &argv)) {
+            add_names(&ciphers, &nciphers, &ciphersize, val);
+        } else if (longoptarg(arg, "--mac", &val, &argc, &argv)) {
+            add_names(&macs, &nmacs, &macsize, val);
+        } else if (longoptarg(arg, "--comp", &val, &argc, &argv)) {
+            add_names(&comps, &ncomps, &compsize, val);
+        } else if (longoptarg(arg, "--timers", &val, &argc, &argv)) {
+            ntimers = atoi(val);
+            if (ntimers <= 0) {
+                fprintf(stderr, "%s: timer count must be positive\n",
+                        appname);
+                exit(1);
+            }
+        } else if (longoptarg(arg, "--sessions", &val, &argc, &argv)) {
+            sessions = atoi(val);
+        } else if (longoptarg(arg, "--concurrency", &val, &argc, &argv)) {
+            concurrency = atoi(val);
+        } else if (longoptarg(arg, "--workers", &val, &argc, &argv)) {
+            server_workers = atoi(val);
+        } else {
+            fprintf(stderr, "%s: unrecognised option '%s'\n", appname, arg);
+            exit(1);
+        }
+    }
+
+    if (ntimers)
+        return do_timer_run(ntimers) ? 0 : 1;
+
+    if (!n_server_hostkeys) {
+        fprintf(stderr, "%s: specify at least one host key\n", appname);
+        exit(1);
+    }
+    if (sessions <= 0 || concurrency <= 0 || server_workers <= 0) {
+        fprintf(stderr, "%s: session, concurrency and worker counts "
+                "must be positive\n", appname);
+        exit(1);
+    }
+    if (!nkexes) {
+        /* Throughput mode only needs one key exchange to get going */
+        size_t n = throughput ? 1 : lenof(default_kexes);
+        for (size_t i = 0; i < n; i++) {
+            sgrowarray(kexes, kexsize, nkexes);
+            kexes[nkexes++] = default_kexes[i];
+        }
+    }
+    if (!nciphers) {
+        for (size_t g = 0; g < lenof(xfer_cipher_groups); g++)
+            for (int i = 0; i < xfer_cipher_groups[g]->nciphers; i++) {
+                sgrowarray(ciphers, ciphersize, nciphers);
+                ciphers[nciphers++] = xfer_cipher_groups[g]->list[i]->ssh2_id;
+            }
+    }
+    if (!nmacs) {
+        for (size_t i = 0; i < lenof(xfer_macs); i++) {
+            sgrowarray(macs, macsize, nmacs);
+            macs[nmacs++] = xfer_macs[i]->name;
+            if (xfer_macs[i]->etm_name) {
+                sgrowarray(macs, macsize, nmacs);
+                macs[nmacs++] = xfer_macs[i]->etm_name;
+            }
+        }
+    }
+    if (!ncomps) {
+        add_names(&comps, &ncomps, &compsize, "none,zlib");
+    }
+
+    char tmpdir[] = "/tmp/sshbench-XXXXXX";
+    if (!mkdtemp(tmpdir)) {
+        fprintf(stderr, "%s: mkdtemp: %s\n", appname, strerror(errno));
+        exit(1);
+    }
+    char *sockpath = dupprintf("%s/socket", tmpdir);
+    server_socket_path = sockpath;
+
+    putty_signal(SIGPIPE, SIG_IGN);
+    sk_init();
+    uxsel_init();
+    random_ref();
+
+    base_conf = conf_new();
+    do_defaults(NULL, base_conf);
+    conf_set_str(base_conf, CONF_host, "localhost");
+    conf_set_int(base_conf, CONF_port, 22);
+    conf_set_int(base_conf, CONF_protocol, PROT_SSH);
+    conf_set_int(base_conf, CONF_sshprot, 3);
+    conf_set_str(base_conf, CONF_username, "sshbench");
+    conf_set_bool(base_conf, CONF_tryagent, false);
+    conf_set_bool(base_conf, CONF_try_ki_auth, false);
+    conf_set_bool(base_conf, CONF_try_tis_auth, false);
+    conf_set_bool(base_conf, CONF_try_gssapi_auth, false);
+    conf_set_bool(base_conf, CONF_try_gssapi_kex, false);
+    conf_set_bool(base_conf, CONF_ssh_kex_guess, kex_guess);
+    conf_set_bool(base_conf, CONF_ssh_connection_sharing, false);
+    conf_set_bool(base_conf, CONF_x11_forward, false);
+    conf_set_bool(base_conf, CONF_agentfwd, false);
+    /* An in-process SFTP server needs no subprocess on the server side */
+    conf_set_str(base_conf, CONF_remote_cmd, "sftp");
+    conf_set_bool(base_conf, CONF_ssh_subsys, true);
+    conf_set_bool(base_conf, CONF_nopty, true);
+    /* Route the connection through platform_new_connection above */
+    conf_set_int(base_conf, CONF_proxy_type, PROXY_CMD);
+    conf_set_bool(base_conf, CONF_even_proxy_localhost, true);
+
+    bool all_ok = true;
+    if (throughput) {
+        fill_xfer_data(data_type);
+        for (size_t c = 0; c < nciphers; c++) {
+            /* Ciphers with a built-in MAC ignore the negotiated one */
+            const ssh_cipheralg *alg = find_cipher(ciphers[c]);
+            bool builtin_mac = alg && alg->required_mac;
+            size_t nm = builtin_mac ? 1 : nmacs;
+            for (size_t m = 0; m < nm; m++)
+                for (size_t z = 0; z < ncomps; z++)
+                    for (int d = 0; d < 2; d++) {
+                        XferRun xfer[1];
+                        if (!(d ? down : up))
+                            continue;
+                        memset(xfer, 0, sizeof(xfer));
+                        xfer->cipher = ciphers[c];
+                        xfer->mac = builtin_mac ? NULL : macs[m];
+                        xfer->comp = comps[z];
+                        xfer->upload = !d;
+                        xfer->volume = volume;
+                        if (!do_xfer_run(kexes[0], hostkey_algs[0],
+                                         xfer, data_type))
+                            all_ok = false;
+                    }
+        }
+    } else {
+        for (size_t k = 0; k < nkexes; k++)
+            for (size_t h = 0; h < nhostkey_algs; h++)
+                if (!do_run(kexes[k], hostkey_algs[h], sessions, concurrency))
+                    all_ok = false;
+    }
+
+    conf_free(base_conf);
+    rmdir(tmpdir);
+    sfree(sockpath);
+    random_unref();
+    return all_ok ? 0 : 1;
+}
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pwd.h>
@@ -27,8 +28,8 @@
 #endif
 
 enum {
-    INDEX_DIR, INDEX_HOSTKEYS, INDEX_HOSTKEYS_TMP, INDEX_RANDSEED,
-    INDEX_SESSIONDIR, INDEX_SESSION,
+    INDEX_DIR, INDEX_HOSTKEYS, INDEX_HOSTKEYS_TMP, INDEX_HOSTKEYS_IDX,
+    INDEX_RANDSEED, INDEX_SESSIONDIR, INDEX_SESSION,
 };
 
 static const char hex[16] = "0123456789ABCDEF";
@@ -193,6 +194,12 @@ static char *make_filename(int index, const char *subname)
         sfree(tmp);
         return ret;
     }
+    if (index == INDEX_HOSTKEYS_IDX) {
+        tmp = make_filename(INDEX_HOSTKEYS, NULL);
+        ret = dupprintf("%s.idx", tmp);
+        sfree(tmp);
+        return ret;
+    }
     if (index == INDEX_RANDSEED) {
         env = getenv("PUTTYRANDOMSEED");
         if (env)
@@ -594,9 +601,414 @@ void enum_settings_finish(settings_e *handle)
  * e.g.
  *
  *   rsa@22:foovax.example.org 0x23,0x293487364395345345....2343
+ *
+ * That text file is the master copy, but people who connect to a
+ * great many hosts can end up with tens of thousands of lines in it,
+ * and we look things up in it several times per connection. So we
+ * also keep a hashed index of it next to it, in 'sshhostkeys.idx',
+ * which we can map into memory and search without reading the text
+ * at all. The index records the size, modification time and inode
+ * of the version of the text file it was built from, and whenever
+ * those don't match any more, we rebuild it.
+ *
+ * The index file is laid out as follows, with all integers
+ * big-endian:
+ *
+ *  - header: the magic string "PuTTYhki", then uint32s giving the
+ *    format version, the number of hash buckets (a power of 2) and
+ *    the number of entries, a zero uint32, then uint64s giving the
+ *    text file's size, modification time in seconds and nanoseconds,
+ *    inode number and device number.
+ *
+ *  - one uint32 per hash bucket, giving the file offset of the first
+ *    entry in that bucket's chain, or zero if the chain is empty.
+ *
+ *  - the entries, one for each line of the text file containing a
+ *    space, in the same order as the lines. Each one is a uint32
+ *    offset of the next entry in the same chain (or zero), a uint32
+ *    hash, a uint32 length and the text before the space, then a
+ *    uint32 length and the text after it.
+ *
+ * Chains list their entries in file order too, so that a lookup finds
+ * the same line that a linear scan of the text file would.
  */
-int verify_host_key(const char *hostname, int port,
-                    const char *keytype, const char *key)
+
+#define HKI_MAGIC "PuTTYhki"
+#define HKI_VERSION 1
+#define HKI_HEADER_LEN 64
+#define HKI_BUCKET_POS(i) (HKI_HEADER_LEN + 4 * (size_t)(i))
+
+/*
+ * Offsets in the index are 32-bit, so we don't index a text file
+ * bigger than this, and fall back to scanning it.
+ */
+#define HKI_MAX_SOURCE (256 * 1024 * 1024)
+
+struct hki_stamp {
+    uint64_t size, mtime, mtime_ns, ino, dev;
+};
+
+/*
+ * The index we're currently using, kept for the lifetime of the
+ * process so that we only have to stat the text file to know we can
+ * go on using it.
+ */
+static struct {
+    bool valid;
+    struct hki_stamp stamp;            /* of the text file */
+    const unsigned char *data;
+    size_t len;
+    unsigned nbuckets, nentries;
+    strbuf *built;            /* if we built it, rather than mapping it */
+} hki;
+
+enum { HKI_OK, HKI_NOFILE, HKI_UNINDEXED };
+
+static uint32_t hki_hash(ptrlen name)
+{
+    /* FNV-1a */
+    const unsigned char *p = name.ptr;
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < name.len; i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static void hki_stamp_from_stat(struct hki_stamp *stamp, const struct stat *st)
+{
+    stamp->size = st->st_size;
+    stamp->mtime = st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    stamp->mtime_ns = st->st_mtim.tv_nsec;
+#else
+    stamp->mtime_ns = 0;
+#endif
+    stamp->ino = st->st_ino;
+    stamp->dev = st->st_dev;
+}
+
+static bool hki_stamp_eq(const struct hki_stamp *a, const struct hki_stamp *b)
+{
+    return (a->size == b->size && a->mtime == b->mtime &&
+            a->mtime_ns == b->mtime_ns && a->ino == b->ino &&
+            a->dev == b->dev);
+}
+
+static void hki_drop(void)
+{
+    if (hki.built)
+        strbuf_free(hki.built);
+    else if (hki.data)
+        munmap((void *)hki.data, hki.len);
+    hki.valid = false;
+    hki.data = NULL;
+    hki.built = NULL;
+}
+
+/*
+ * Check an index's header, and make it current if it describes the
+ * text file we're looking at.
+ */
+static bool hki_use(const unsigned char *data, size_t len,
+                    const struct hki_stamp *want)
+{
+    BinarySource src[1];
+    struct hki_stamp stamp;
+    unsigned nbuckets, nentries;
+
+    BinarySource_BARE_INIT(src, data, len);
+    if (!ptrlen_eq_string(get_data(src, 8), HKI_MAGIC) ||
+        get_uint32(src) != HKI_VERSION)
+        return false;
+    nbuckets = get_uint32(src);
+    nentries = get_uint32(src);
+    get_uint32(src);
+    stamp.size = get_uint64(src);
+    stamp.mtime = get_uint64(src);
+    stamp.mtime_ns = get_uint64(src);
+    stamp.ino = get_uint64(src);
+    stamp.dev = get_uint64(src);
+    if (get_err(src) || !hki_stamp_eq(&stamp, want) ||
+        !nbuckets || (nbuckets & (nbuckets - 1)) ||
+        nbuckets > (len - HKI_HEADER_LEN) / 4)
+        return false;
+
+    hki.valid = true;
+    hki.stamp = stamp;
+    hki.data = data;
+    hki.len = len;
+    hki.nbuckets = nbuckets;
+    hki.nentries = nentries;
+    return true;
+}
+
+/*
+ * Build an index from the text file, given its contents.
+ */
+static strbuf *hki_build(const char *text, size_t textlen,
+                         const struct hki_stamp *stamp)
+{
+    strbuf *entries = strbuf_new(), *sb;
+    size_t *offsets = NULL, noffsets = 0, offsetsize = 0;
+    uint32_t *hashes = NULL, *tails;
+    unsigned nbuckets;
+
+    while (textlen > 0) {
+        const char *eol = memchr(text, '\n', textlen);
+        size_t linelen = eol ? eol - text : textlen;
+        const char *space = memchr(text, ' ', linelen);
+
+        if (space) {
+            ptrlen name = make_ptrlen(text, space - text);
+            ptrlen key = make_ptrlen(space + 1, linelen - (name.len + 1));
+
+            sgrowarray(offsets, offsetsize, noffsets);
+            hashes = sresize(hashes, offsetsize, uint32_t);
+            offsets[noffsets] = entries->len;
+            hashes[noffsets] = hki_hash(name);
+            put_uint32(entries, 0);
+            put_uint32(entries, hashes[noffsets]);
+            put_stringpl(entries, name);
+            put_stringpl(entries, key);
+            noffsets++;
+        }
+
+        text += linelen;
+        textlen -= linelen;
+        if (eol) {
+            text++;
+            textlen--;
+        }
+    }
+
+    /* Aim for an average chain length between 1/2 and 1 */
+    for (nbuckets = 16; nbuckets < noffsets; nbuckets *= 2);
+
+    sb = strbuf_new();
+    put_data(sb, HKI_MAGIC, 8);
+    put_uint32(sb, HKI_VERSION);
+    put_uint32(sb, nbuckets);
+    put_uint32(sb, noffsets);
+    put_uint32(sb, 0);
+    put_uint64(sb, stamp->size);
+    put_uint64(sb, stamp->mtime);
+    put_uint64(sb, stamp->mtime_ns);
+    put_uint64(sb, stamp->ino);
+    put_uint64(sb, stamp->dev);
+    assert(sb->len == HKI_HEADER_LEN);
+    memset(strbuf_append(sb, 4 * (size_t)nbuckets), 0, 4 * (size_t)nbuckets);
+    size_t entries_pos = sb->len;
+    put_datapl(sb, ptrlen_from_strbuf(entries));
+
+    /* Thread each entry on to the end of its bucket's chain. */
+    tails = snewn(nbuckets, uint32_t);
+    for (size_t i = 0; i < noffsets; i++) {
+        unsigned bucket = hashes[i] & (nbuckets - 1);
+        uint32_t pos = entries_pos + offsets[i];
+        if (!GET_32BIT_MSB_FIRST(sb->u + HKI_BUCKET_POS(bucket)))
+            PUT_32BIT_MSB_FIRST(sb->u + HKI_BUCKET_POS(bucket), pos);
+        else
+            PUT_32BIT_MSB_FIRST(sb->u + tails[bucket], pos);
+        tails[bucket] = pos;
+    }
+
+    sfree(tails);
+    sfree(hashes);
+    sfree(offsets);
+    strbuf_free(entries);
+    return sb;
+}
+
+/*
+ * Save an index we've just built, replacing the old one atomically.
+ * The index is only a cache, so if we can't write it, we just don't.
+ */
+static void hki_save(const strbuf *sb)
+{
+    char *filename = make_filename(INDEX_HOSTKEYS_IDX, NULL);
+    char *tmpfilename = dupprintf("%s.%lu.tmp", filename,
+                                  (unsigned long)getpid());
+    size_t done = 0;
+    int fd;
+
+    fd = open(tmpfilename, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd >= 0) {
+        while (done < sb->len) {
+            ssize_t ret = write(fd, sb->u + done, sb->len - done);
+            if (ret <= 0)
+                break;
+            done += ret;
+        }
+        if (close(fd) < 0 || done < sb->len ||
+            rename(tmpfilename, filename) < 0)
+            unlink(tmpfilename);
+    }
+
+    sfree(tmpfilename);
+    sfree(filename);
+}
+
+/*
+ * Make sure hki describes the current contents of the host keys
+ * file, loading or rebuilding the index if necessary.
+ */
+static int hki_load(void)
+{
+    char *filename;
+    struct stat st;
+    struct hki_stamp stamp;
+    int fd, ifd;
+
+    filename = make_filename(INDEX_HOSTKEYS, NULL);
+    fd = open(filename, O_RDONLY);
+    sfree(filename);
+    if (fd < 0)
+        return HKI_NOFILE;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return HKI_UNINDEXED;
+    }
+    hki_stamp_from_stat(&stamp, &st);
+
+    if (hki.valid && hki_stamp_eq(&hki.stamp, &stamp)) {
+        close(fd);
+        return HKI_OK;
+    }
+    hki_drop();
+
+    if (!S_ISREG(st.st_mode) || st.st_size > HKI_MAX_SOURCE) {
+        close(fd);
+        return HKI_UNINDEXED;
+    }
+
+    /*
+     * See if someone has already indexed this version of the file.
+     */
+    filename = make_filename(INDEX_HOSTKEYS_IDX, NULL);
+    ifd = open(filename, O_RDONLY);
+    sfree(filename);
+    if (ifd >= 0) {
+        struct stat ist;
+        if (fstat(ifd, &ist) == 0 && ist.st_size >= HKI_HEADER_LEN) {
+            void *map = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE,
+                             ifd, 0);
+            if (map != MAP_FAILED && !hki_use(map, ist.st_size, &stamp))
+                munmap(map, ist.st_size);
+        }
+        close(ifd);
+        if (hki.valid) {
+            close(fd);
+            return HKI_OK;
+        }
+    }
+
+    /*
+     * No: read the text file and index it ourselves.
+     */
+    strbuf *text = strbuf_new();
+    bool ok;
+    while (true) {
+        size_t oldlen = text->len;
+        ssize_t ret = read(fd, strbuf_append(text, 65536), 65536);
+        strbuf_shrink_to(text, oldlen + (ret > 0 ? ret : 0));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            ok = (ret == 0);
+            break;
+        }
+    }
+
+    /*
+     * If the file changed while we were reading it, what we read will
+     * do for this lookup, but we don't save an index of it for anyone
+     * else.
+     */
+    bool unchanged = false;
+    if (ok && fstat(fd, &st) == 0) {
+        struct hki_stamp after;
+        hki_stamp_from_stat(&after, &st);
+        unchanged = hki_stamp_eq(&stamp, &after);
+    }
+    close(fd);
+    if (!ok) {
+        strbuf_free(text);
+        return HKI_UNINDEXED;
+    }
+
+    strbuf *sb = hki_build(text->s, text->len, &stamp);
+    strbuf_free(text);
+    if (unchanged)
+        hki_save(sb);
+    bool used = hki_use(sb->u, sb->len, &stamp);
+    assert(used);
+    (void)used;
+    hki.built = sb;
+    return HKI_OK;
+}
+
+/*
+ * Find the first line in the host keys file starting with 'header'
+ * and a space, and return the rest of it. Returns 1 if we found one,
+ * 0 if there isn't one, or -1 if the index turned out to be corrupt.
+ */
+static int hki_find(const char *header, ptrlen *key)
+{
+    ptrlen name = ptrlen_from_asciz(header), rest = PTRLEN_LITERAL("");
+    const char *space = strchr(header, ' ');
+    BinarySource src[1];
+    uint32_t hash;
+    size_t pos;
+
+    /*
+     * Index entries are split at the first space in the line, so if
+     * there's a space in our header too (which would take an odd
+     * host name), the rest of it must match the start of the key
+     * text, followed by another space.
+     */
+    if (space) {
+        name = make_ptrlen(header, space - header);
+        rest = ptrlen_from_asciz(space + 1);
+    }
+
+    hash = hki_hash(name);
+    pos = GET_32BIT_MSB_FIRST(
+        hki.data + HKI_BUCKET_POS(hash & (hki.nbuckets - 1)));
+    BinarySource_BARE_INIT(src, hki.data, hki.len);
+
+    for (unsigned steps = 0; pos; steps++) {
+        uint32_t ehash;
+        ptrlen ename, ekey;
+
+        if (steps > hki.nentries || pos >= hki.len)
+            return -1;
+        src->pos = pos;
+        pos = get_uint32(src);
+        ehash = get_uint32(src);
+        ename = get_string(src);
+        ekey = get_string(src);
+        if (get_err(src))
+            return -1;
+
+        if (ehash != hash || !ptrlen_eq_ptrlen(ename, name))
+            continue;
+        if (space && !(ptrlen_startswith(ekey, rest, &ekey) &&
+                       ptrlen_startswith(ekey, PTRLEN_LITERAL(" "), &ekey)))
+            continue;
+
+        *key = ekey;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * The straightforward way to look up a host key, for when the file is
+ * too big to index or there's something wrong with the index.
+ */
+static int verify_host_key_scan(const char *hostname, int port,
+                                const char *keytype, const char *key)
 {
     FILE *fp;
     char *filename;
@@ -664,6 +1076,41 @@ int verify_host_key(const char *hostname, int port,
     return ret;
 }
 
+int verify_host_key(const char *hostname, int port,
+                    const char *keytype, const char *key)
+{
+    char *header, *filename;
+    ptrlen found;
+    int ret;
+
+    switch (hki_load()) {
+      case HKI_NOFILE:
+        return 1;                      /* key does not exist */
+      case HKI_OK:
+        header = dupprintf("%s@%d:%s", keytype, port, hostname);
+        ret = hki_find(header, &found);
+        sfree(header);
+        if (ret == 0)
+            return 1;                  /* key does not exist */
+        if (ret > 0)
+            return ptrlen_eq_string(found, key) ? 0 : 2;
+
+        /*
+         * The index is damaged. Delete it, so that the next lookup
+         * rebuilds it, and fall back to reading the text file.
+         */
+        if (!hki.built) {
+            filename = make_filename(INDEX_HOSTKEYS_IDX, NULL);
+            unlink(filename);
+            sfree(filename);
+        }
+        hki_drop();
+        break;
+    }
+
+    return verify_host_key_scan(hostname, port, keytype, key);
+}
+
 bool have_ssh_host_key(const char *hostname, int port,
                        const char *keytype)
 {
@@ -674,6 +1121,55 @@ bool have_ssh_host_key(const char *hostname, int port,
     return verify_host_key(hostname, port, keytype, "") != 1;
 }
 
+/*
+ * Add a line to the end of the host keys file. Returns false if the
+ * file doesn't exist yet, leaving the caller to create it.
+ */
+static bool append_host_key(const char *hostname, int port,
+                            const char *keytype, const char *key)
+{
+    char *filename;
+    strbuf *sb;
+    struct stat st;
+    size_t done = 0;
+    int fd;
+
+    filename = make_filename(INDEX_HOSTKEYS, NULL);
+    fd = open(filename, O_RDWR | O_APPEND);
+    if (fd < 0) {
+        sfree(filename);
+        return false;
+    }
+
+    sb = strbuf_new();
+
+    /* Don't run our line on to the end of an unterminated one */
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        char last;
+        if (pread(fd, &last, 1, st.st_size - 1) == 1 && last != '\n')
+            put_byte(sb, '\n');
+    }
+    strbuf_catf(sb, "%s@%d:%s %s\n", keytype, port, hostname, key);
+
+    while (done < sb->len) {
+        ssize_t ret = write(fd, sb->u + done, sb->len - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            nonfatal("Unable to store host key: write(\"%s\") "
+                     "returned '%s'", filename,
+                     ret < 0 ? strerror(errno) : "short write");
+            break;
+        }
+        done += ret;
+    }
+
+    close(fd);
+    strbuf_free(sb);
+    sfree(filename);
+    return true;
+}
+
 void store_host_key(const char *hostname, int port,
                     const char *keytype, const char *key)
 {
@@ -682,6 +1178,15 @@ void store_host_key(const char *hostname, int port,
     int headerlen;
     char *filename, *tmpfilename;
 
+    /*
+     * If the file has no line for this host key identifier already,
+     * there's nothing to take out of it, so we needn't copy the whole
+     * thing: we can just add the new line to the end.
+     */
+    if (!have_ssh_host_key(hostname, port, keytype) &&
+        append_host_key(hostname, port, keytype, key))
+        return;
+
     /*
      * Open both the old file and a new file.
      */
@@ -0,0 +1,634 @@
+/*
+ * uxuring.c: optional io_uring transport for uxnet.c's connected
+ * stream sockets.
+ *
+ * The poll-driven path in uxnet.c costs a poll wakeup plus a recv()
+ * or send() for every chunk of data that passes through a socket.
+ * Here, instead, each socket has a multishot receive armed in a
+ * single process-wide ring, which goes on delivering data into
+ * buffers from a pool we've registered with the kernel until told to
+ * stop; and sends are queued in the same ring and submitted in one
+ * batch at the end of each pass through the event loop. The ring's
+ * own fd goes into uxsel, so however many sockets are busy, the
+ * event loop sees one readable fd and reaps all their completions
+ * in one go.
+ *
+ * We talk to the kernel through the raw system calls, rather than
+ * depending on liburing. Multishot receive needs Linux 6.0; on
+ * anything older (or where io_uring is disabled altogether) the
+ * probe in uring_init fails and uring_socket_new returns NULL for
+ * the rest of the process's life. Setting PUTTY_NO_IO_URING in the
+ * environment to anything non-empty has the same effect, for when
+ * the ring is suspected of misbehaving or gets in the way of
+ * something like strace.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "uxconfig.h" /* leading space prevents mkfiles.pl trying to follow */
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "putty.h"
+#include "perfcount.h"
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 256
+
+/* Receive buffer pool, shared between all sockets. */
+#define URING_RBUF_COUNT 64            /* must be a power of 2 */
+#define URING_RBUF_SIZE 16384
+#define URING_BGID 0
+
+/* Per-socket send buffer, allocated on first use. */
+#define URING_SBUF_SIZE 65536
+
+/*
+ * Each SQE's user_data is a pointer to the UringSocket it belongs
+ * to, with the kind of operation in the bottom two bits.
+ */
+enum { URING_OP_RECV, URING_OP_SEND, URING_OP_CANCEL, URING_OP_PROBE };
+#define URING_OP_MASK 3
+
+struct UringSocket {
+    int fd;
+    const UringSocketCallbacks *cb;
+    void *ctx;
+
+    bool receiving;            /* our client wants data */
+    bool recv_armed;           /* a multishot receive is in the kernel */
+    bool recv_cancelling;      /* ... and we've asked for it to stop */
+    bool recv_finished;        /* EOF or error seen: never re-arm */
+
+    bool send_armed;
+    char *sbuf;
+    size_t slen, soff;
+    int sflags;
+
+    bool dead;                 /* freed by client, waiting for the kernel */
+};
+
+static enum { URING_UNTRIED, URING_OK, URING_UNAVAILABLE } uring_state;
+
+static struct {
+    int fd;
+    pid_t pid;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    unsigned *sq_head, *sq_tail, *sq_flags, *sq_array, sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_local_tail, sq_unsubmitted;
+
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    char *rbufs;
+    unsigned short br_tail;
+
+    IdempotentCallback flush;
+    UringSocket *dispatching;
+} ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_recycle_buffer(unsigned bid)
+{
+    struct io_uring_buf *buf =
+        &ring.br->bufs[ring.br_tail & (URING_RBUF_COUNT - 1)];
+    buf->addr = (uintptr_t)(ring.rbufs + (size_t)bid * URING_RBUF_SIZE);
+    buf->len = URING_RBUF_SIZE;
+    buf->bid = bid;
+    ring.br_tail++;
+    __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_submit(void)
+{
+    while (ring.sq_unsubmitted) {
+        perf_enter(PERF_SOCKET, 0);
+        int ret = sys_io_uring_enter(ring.fd, ring.sq_unsubmitted, 0, 0);
+        perf_leave(PERF_SOCKET);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            /*
+             * EAGAIN or EBUSY mean the kernel is short of resources
+             * or of CQ space; the SQEs stay in the ring, and we'll
+             * try again after the next batch of completions.
+             */
+            queue_idempotent_callback(&ring.flush);
+            return;
+        }
+        ring.sq_unsubmitted -= ret;
+    }
+}
+
+static void uring_flush(void *ignored)
+{
+    uring_submit();
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sq_local_tail - head >= ring.sq_entries) {
+        uring_submit();
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        /* Submission is synchronous without SQPOLL, so this can't fail */
+        assert(ring.sq_local_tail - head < ring.sq_entries);
+    }
+
+    unsigned index = ring.sq_local_tail & ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    return sqe;
+}
+
+static void uring_queue_sqe(void)
+{
+    ring.sq_local_tail++;
+    ring.sq_unsubmitted++;
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    queue_idempotent_callback(&ring.flush);
+}
+
+static uint64_t uring_user_data(UringSocket *us, int op)
+{
+    return (uintptr_t)us | op;
+}
+
+static void uring_arm_recv(UringSocket *us)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = us->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_user_data(us, URING_OP_RECV);
+    uring_queue_sqe();
+    us->recv_armed = true;
+}
+
+static void uring_arm_send(UringSocket *us)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = us->fd;
+    sqe->addr = (uintptr_t)(us->sbuf + us->soff);
+    sqe->len = us->slen - us->soff;
+    sqe->msg_flags = us->sflags;
+    sqe->user_data = uring_user_data(us, URING_OP_SEND);
+    uring_queue_sqe();
+    us->send_armed = true;
+}
+
+static void uring_cancel(UringSocket *us, int op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_user_data(us, op);
+    sqe->user_data = uring_user_data(NULL, URING_OP_CANCEL);
+    uring_queue_sqe();
+}
+
+static void uring_maybe_free(UringSocket *us)
+{
+    if (us->dead && !us->recv_armed && !us->send_armed &&
+        us != ring.dispatching) {
+        sfree(us->sbuf);
+        sfree(us);
+    }
+}
+
+static void uring_handle_cqe(const struct io_uring_cqe *cqe)
+{
+    UringSocket *us = (UringSocket *)(uintptr_t)
+        (cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    int op = cqe->user_data & URING_OP_MASK;
+
+    switch (op) {
+      case URING_OP_RECV: {
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        if (!more)
+            us->recv_armed = us->recv_cancelling = false;
+
+        ring.dispatching = us;
+        if (cqe->res > 0) {
+            assert(cqe->flags & IORING_CQE_F_BUFFER);
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            perf_count_bytes(PERF_SOCKET, cqe->res);
+            /*
+             * If our client has asked us to stop receiving, this is
+             * data the kernel had already delivered before the
+             * cancellation reached it. We pass it on anyway: there
+             * can't be more of it than fits in the buffer pool, and
+             * every Plug copes with a little data after freezing.
+             */
+            if (!us->dead)
+                us->cb->receive(us->ctx, ring.rbufs +
+                                (size_t)bid * URING_RBUF_SIZE, cqe->res);
+            uring_recycle_buffer(bid);
+        } else if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+            /* buffer pool ran dry, or we stopped it: re-arm if wanted */
+        } else {
+            us->recv_finished = true;
+            if (!us->dead)
+                us->cb->closing(us->ctx, -cqe->res);
+        }
+        ring.dispatching = NULL;
+
+        if (!us->recv_armed && us->receiving && !us->recv_finished &&
+            !us->dead)
+            uring_arm_recv(us);
+        uring_maybe_free(us);
+        break;
+      }
+
+      case URING_OP_SEND:
+        us->send_armed = false;
+        if (!us->dead) {
+            ring.dispatching = us;
+            if (cqe->res <= 0) {
+                us->cb->sent(us->ctx, cqe->res < 0 ? -cqe->res : EPIPE);
+            } else if ((us->soff += cqe->res) < us->slen) {
+                uring_arm_send(us);    /* short send: go round again */
+            } else {
+                us->cb->sent(us->ctx, 0);
+            }
+            ring.dispatching = NULL;
+        }
+        uring_maybe_free(us);
+        break;
+
+      default:
+        /* cancellation results tell us nothing we won't find out anyway */
+        break;
+    }
+}
+
+static void uring_reap(void)
+{
+    while (true) {
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            /*
+             * Take a copy and give the slot back before dispatching,
+             * so nothing a callback does can see a half-consumed
+             * ring.
+             */
+            struct io_uring_cqe cqe = ring.cqes[head & ring.cq_mask];
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            uring_handle_cqe(&cqe);
+        }
+
+        /*
+         * If the CQ ring filled up, the kernel keeps the excess
+         * completions on one side until we ask it to flush them
+         * through.
+         */
+        if (!(__atomic_load_n(ring.sq_flags, __ATOMIC_ACQUIRE) &
+              IORING_SQ_CQ_OVERFLOW))
+            break;
+        sys_io_uring_enter(ring.fd, 0, 0, IORING_ENTER_GETEVENTS);
+    }
+
+    /* Completions may have freed up room for anything left unsubmitted */
+    if (ring.sq_unsubmitted)
+        uring_submit();
+}
+
+static void uring_select_result(int fd, int event)
+{
+    uring_reap();
+}
+
+static void uring_teardown(void)
+{
+    if (ring.rbufs)
+        munmap(ring.rbufs, (size_t)URING_RBUF_COUNT * URING_RBUF_SIZE);
+    if (ring.br)
+        munmap(ring.br, ring.br_size);
+    if (ring.sqes)
+        munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_map && ring.cq_map != ring.sq_map)
+        munmap(ring.cq_map, ring.cq_map_size);
+    if (ring.sq_map)
+        munmap(ring.sq_map, ring.sq_map_size);
+    if (ring.fd >= 0)
+        close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+/*
+ * Find out whether the kernel really does multishot receive from a
+ * provided buffer ring, by trying it on a socketpair. Kernels that
+ * know about buffer rings but predate multishot receive fail the
+ * request with EINVAL.
+ */
+static bool uring_probe(void)
+{
+    int sv[2];
+    bool ok = false;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return false;
+    if (write(sv[1], "", 1) != 1)
+        goto out;
+
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_user_data(NULL, URING_OP_PROBE);
+    uring_queue_sqe();
+
+    /*
+     * Expect one CQE with our byte in it, then (once we close the
+     * other end) one reporting EOF and ending the multishot request.
+     */
+    for (int i = 0; i < 2; i++) {
+        if (i == 1) {
+            close(sv[1]);
+            sv[1] = -1;
+        }
+        if (sys_io_uring_enter(ring.fd, ring.sq_unsubmitted, 1,
+                               IORING_ENTER_GETEVENTS) < 0)
+            goto out;
+        ring.sq_unsubmitted = 0;
+
+        unsigned head = *ring.cq_head;
+        if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+            goto out;
+        struct io_uring_cqe cqe = ring.cqes[head & ring.cq_mask];
+        __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+            uring_recycle_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (i == 0 && (cqe.res != 1 || !(cqe.flags & IORING_CQE_F_MORE)))
+            goto out;
+        if (i == 1)
+            ok = (cqe.res == 0);
+    }
+
+  out:
+    close(sv[0]);
+    if (sv[1] >= 0)
+        close(sv[1]);
+    return ok;
+}
+
+static bool uring_init(void)
+{
+    struct io_uring_params p;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring.fd < 0)
+        goto fail;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        goto fail;                     /* older than we can use anyway */
+    cloexec(ring.fd);
+
+    ring.sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_map_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring.cq_map_size > ring.sq_map_size)
+        ring.sq_map_size = ring.cq_map_size;
+    ring.sq_map = mmap(NULL, ring.sq_map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_map == MAP_FAILED) {
+        ring.sq_map = NULL;
+        goto fail;
+    }
+    ring.cq_map = ring.sq_map;
+
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = ring.sq_map, *cq = ring.cq_map;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /*
+     * Set up the receive buffer pool and register it with the kernel
+     * as a provided buffer ring.
+     */
+    ring.br_size = URING_RBUF_COUNT * sizeof(struct io_uring_buf);
+    ring.br = mmap(NULL, ring.br_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.br == MAP_FAILED) {
+        ring.br = NULL;
+        goto fail;
+    }
+    ring.rbufs = mmap(NULL, (size_t)URING_RBUF_COUNT * URING_RBUF_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (ring.rbufs == MAP_FAILED) {
+        ring.rbufs = NULL;
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring.br;
+    reg.ring_entries = URING_RBUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING,
+                              &reg, 1) < 0)
+        goto fail;
+    for (unsigned bid = 0; bid < URING_RBUF_COUNT; bid++)
+        uring_recycle_buffer(bid);
+
+    ring.flush.fn = uring_flush;
+    ring.flush.ctx = NULL;
+    ring.flush.queued = false;
+
+    if (!uring_probe())
+        goto fail;
+
+    ring.pid = getpid();
+    uxsel_set(ring.fd, SELECT_R, uring_select_result);
+    return true;
+
+  fail:
+    uring_teardown();
+    return false;
+}
+
+static bool uring_available(void)
+{
+    if (uring_state == URING_UNTRIED) {
+        const char *env = getenv("PUTTY_NO_IO_URING");
+        if (env && *env)
+            uring_state = URING_UNAVAILABLE;
+        else
+            uring_state = uring_init() ? URING_OK : URING_UNAVAILABLE;
+    }
+
+    /*
+     * A ring can't usefully be shared with a forked child: both
+     * processes would be reaping the same completion queue. So a
+     * child that inherits one just does without.
+     */
+    if (uring_state == URING_OK && ring.pid != getpid())
+        uring_state = URING_UNAVAILABLE;
+
+    return uring_state == URING_OK;
+}
+
+UringSocket *uring_socket_new(int fd, const UringSocketCallbacks *cb,
+                              void *ctx)
+{
+    if (!uring_available())
+        return NULL;
+
+    UringSocket *us = snew(UringSocket);
+    memset(us, 0, sizeof(*us));
+    us->fd = fd;
+    us->cb = cb;
+    us->ctx = ctx;
+    return us;
+}
+
+void uring_socket_free(UringSocket *us)
+{
+    us->dead = true;
+    us->receiving = false;
+
+    /*
+     * Submit the cancellations straight away rather than at the end
+     * of this pass of the event loop, since the caller is about to
+     * close the fd, and until they reach the kernel the connection
+     * can't actually go away.
+     */
+    if (us->recv_armed && !us->recv_cancelling) {
+        uring_cancel(us, URING_OP_RECV);
+        us->recv_cancelling = true;
+    }
+    if (us->send_armed)
+        uring_cancel(us, URING_OP_SEND);
+    uring_submit();
+
+    uring_maybe_free(us);
+}
+
+void uring_socket_set_receiving(UringSocket *us, bool receiving)
+{
+    if (us->receiving == receiving)
+        return;
+    us->receiving = receiving;
+
+    if (receiving) {
+        /*
+         * If the last receive is still on its way out, the
+         * completion handler will re-arm it when it finishes.
+         */
+        if (!us->recv_armed && !us->recv_finished)
+            uring_arm_recv(us);
+    } else if (us->recv_armed && !us->recv_cancelling) {
+        uring_cancel(us, URING_OP_RECV);
+        us->recv_cancelling = true;
+        uring_submit();        /* limit what arrives after the freeze */
+    }
+}
+
+void *uring_socket_send_buffer(UringSocket *us, size_t *size)
+{
+    if (us->send_armed)
+        return NULL;
+    if (!us->sbuf)
+        us->sbuf = snewn(URING_SBUF_SIZE, char);
+    *size = URING_SBUF_SIZE;
+    return us->sbuf;
+}
+
+void uring_socket_send(UringSocket *us, size_t len, int flags)
+{
+    assert(!us->send_armed);
+    assert(len > 0 && len <= URING_SBUF_SIZE);
+    us->slen = len;
+    us->soff = 0;
+    us->sflags = flags;
+    perf_count_bytes(PERF_SOCKET, len);
+    uring_arm_send(us);
+}
+
+#else /* HAVE_IO_URING */
+
+UringSocket *uring_socket_new(int fd, const UringSocketCallbacks *cb,
+                              void *ctx)
+{
+    return NULL;
+}
+
+/*
+ * None of these can be called, since no UringSocket can exist.
+ */
+void uring_socket_free(UringSocket *us)
+{ unreachable("no io_uring support"); }
+void uring_socket_set_receiving(UringSocket *us, bool receiving)
+{ unreachable("no io_uring support"); }
+void *uring_socket_send_buffer(UringSocket *us, size_t *size)
+{ unreachable("no io_uring support"); }
+void uring_socket_send(UringSocket *us, size_t len, int flags)
+{ unreachable("no io_uring support"); }
+
+#endif /* HAVE_IO_URING */
@@ -654,12 +654,20 @@ int base64_decode_atom(const char *atom, unsigned char *out)
  *  - remove the first N bytes from the list
  *  - return a (pointer,length) pair giving some initial data in
  *    the list, suitable for passing to a send or write system
- *    call
+ *    call, or several such pairs for a writev-style call
  *  - retrieve a larger amount of initial data from the list
  *  - return the current size of the buffer chain in bytes
+ *
+ * Granules come from the slab allocator, so a chain that's streaming
+ * data recycles them rather than going back to malloc every time.
+ * Each chain also adapts its granule size: it doubles (up to
+ * max_granule) whenever a granule fills up while the data before it
+ * is still waiting to be consumed, and halves again when a chain
+ * drains having barely used its last granule.
  */
 
 #define BUFFER_MIN_GRANULE  512
+#define BUFFER_MAX_GRANULE  16384
 
 struct bufchain_granule {
     struct bufchain_granule *next;
@@ -675,6 +683,8 @@ void bufchain_init(bufchain *ch)
 {
     ch->head = ch->tail = NULL;
     ch->buffersize = 0;
+    ch->granule = BUFFER_MIN_GRANULE;
+    ch->max_granule = BUFFER_MAX_GRANULE;
     ch->ic = NULL;
     ch->queue_idempotent_callback = uninitialised_queue_idempotent_callback;
 }
@@ -685,8 +695,7 @@ void bufchain_clear(bufchain *ch)
     while (ch->head) {
         b = ch->head;
         ch->head = ch->head->next;
-        smemclr(b, sizeof(*b));
-        sfree(b);
+        slab_free(b);
     }
     ch->tail = NULL;
     ch->buffersize = 0;
@@ -697,6 +706,13 @@ size_t bufchain_size(bufchain *ch)
     return ch->buffersize;
 }
 
+void bufchain_set_max_granule(bufchain *ch, size_t max_granule)
+{
+    ch->max_granule = max(max_granule, BUFFER_MIN_GRANULE);
+    if (ch->granule > ch->max_granule)
+        ch->granule = ch->max_granule;
+}
+
 void bufchain_set_callback_inner(
     bufchain *ch, IdempotentCallback *ic,
     void (*queue_idempotent_callback)(IdempotentCallback *ic))
@@ -722,10 +738,15 @@ void bufchain_add(bufchain *ch, const void *data, size_t len)
             ch->tail->bufend += copylen;
         }
         if (len > 0) {
-            size_t grainlen =
-                max(sizeof(struct bufchain_granule) + len, BUFFER_MIN_GRANULE);
+            if (ch->tail && ch->granule < ch->max_granule) {
+                /* Data is backing up in this chain, so use bigger
+                 * granules for it from now on */
+                ch->granule = min(ch->granule * 2, ch->max_granule);
+            }
+            size_t grainlen = slab_good_size(
+                max(sizeof(struct bufchain_granule) + len, ch->granule));
             struct bufchain_granule *newbuf;
-            newbuf = smalloc(grainlen);
+            newbuf = slab_alloc(grainlen);
             newbuf->bufpos = newbuf->bufend =
                 (char *)newbuf + sizeof(struct bufchain_granule);
             newbuf->bufmax = (char *)newbuf + grainlen;
@@ -754,10 +775,18 @@ void bufchain_consume(bufchain *ch, size_t len)
             remlen = ch->head->bufend - ch->head->bufpos;
             tmp = ch->head;
             ch->head = tmp->next;
-            if (!ch->head)
+            if (!ch->head) {
                 ch->tail = NULL;
-            smemclr(tmp, sizeof(*tmp));
-            sfree(tmp);
+
+                /* If the chain has drained without even filling a
+                 * quarter of its last granule, it's not busy enough
+                 * to need granules that big */
+                size_t used = tmp->bufend -
+                    ((char *)tmp + sizeof(struct bufchain_granule));
+                if (used < ch->granule / 4)
+                    ch->granule = max(ch->granule / 2, BUFFER_MIN_GRANULE);
+            }
+            slab_free(tmp);
         } else
             ch->head->bufpos += remlen;
         ch->buffersize -= remlen;
@@ -770,6 +799,16 @@ ptrlen bufchain_prefix(bufchain *ch)
     return make_ptrlen(ch->head->bufpos, ch->head->bufend - ch->head->bufpos);
 }
 
+size_t bufchain_prefix_iov(bufchain *ch, ptrlen *iov, size_t maxiov)
+{
+    struct bufchain_granule *b;
+    size_t n = 0;
+
+    for (b = ch->head; b && n < maxiov; b = b->next)
+        iov[n++] = make_ptrlen(b->bufpos, b->bufend - b->bufpos);
+    return n;
+}
+
 void bufchain_fetch(bufchain *ch, void *data, size_t len)
 {
     struct bufchain_granule *tmp;
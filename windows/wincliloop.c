@@ -109,7 +109,7 @@ void cli_main_loop(cliloop_pre_t pre, cliloop_post_t post, void *ctx)
             extra_handle_index = n - (WAIT_OBJECT_0 + extra_base);
         }
 
-        run_toplevel_callbacks();
+        run_toplevel_callbacks_batch();
 
         if (n == WAIT_TIMEOUT) {
             now = next;
@@ -358,6 +358,7 @@ static const SeatVtable win_seat_vt = {
     win_seat_set_trust_status,
     nullseat_verbose_yes,
     nullseat_interactive_yes,
+    nullseat_kex_finished,
 };
 static WinGuiSeat wgs = { .seat.vt = &win_seat_vt,
                           .logpolicy.vt = &win_gui_logpolicy_vt };
@@ -78,6 +78,8 @@
 #define WINHELP_CTX_connection_nodelay "config-nodelay"
 #define WINHELP_CTX_connection_ipversion "config-address-family"
 #define WINHELP_CTX_connection_tcpkeepalive "config-tcp-keepalives"
+#define WINHELP_CTX_connection_delay "config-connect-delay"
+#define WINHELP_CTX_connection_namecache "config-name-cache"
 #define WINHELP_CTX_connection_loghost "config-loghost"
 #define WINHELP_CTX_proxy_type "config-proxy-type"
 #define WINHELP_CTX_proxy_main "config-proxy"
@@ -99,8 +101,10 @@
 #define WINHELP_CTX_ssh_protocol "config-ssh-prot"
 #define WINHELP_CTX_ssh_command "config-command"
 #define WINHELP_CTX_ssh_compress "config-ssh-comp"
+#define WINHELP_CTX_ssh_stats "config-ssh-stats"
 #define WINHELP_CTX_ssh_share "config-ssh-sharing"
 #define WINHELP_CTX_ssh_kexlist "config-ssh-kex-order"
+#define WINHELP_CTX_ssh_kex_guess "config-ssh-kex-guess"
 #define WINHELP_CTX_ssh_hklist "config-ssh-hostkey-order"
 #define WINHELP_CTX_ssh_gssapi_kex_delegation "config-ssh-kex-gssapi-delegation"
 #define WINHELP_CTX_ssh_kex_repeat "config-ssh-kex-rekey"
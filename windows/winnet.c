@@ -572,6 +572,65 @@ SockAddr *sk_nonamelookup(const char *host)
     return ret;
 }
 
+/*
+ * We don't yet have a resolver that runs in the background on
+ * Windows, so an asynchronous lookup just does a synchronous one
+ * from a toplevel callback. That at least gives callers the same
+ * sequence of events as on other platforms.
+ */
+struct NameLookup {
+    char *host;
+    int address_family;
+    namelookup_callback_fn_t callback;
+    void *ctx;
+};
+
+static void namelookup_free(NameLookup *nl)
+{
+    delete_callbacks_for_context(nl);
+    sfree(nl->host);
+    sfree(nl);
+}
+
+static void namelookup_deliver(void *vctx)
+{
+    NameLookup *nl = (NameLookup *)vctx;
+    SockAddr *addr;
+    char *canonicalname = NULL;
+
+    if (nl->address_family == ADDRTYPE_NAME) {
+        addr = sk_nonamelookup(nl->host);
+        canonicalname = dupstr(nl->host);
+    } else {
+        addr = sk_namelookup(nl->host, &canonicalname, nl->address_family);
+        if (sk_addr_error(addr)) {
+            sfree(canonicalname);
+            canonicalname = NULL;
+        }
+    }
+
+    nl->callback(nl->ctx, addr, canonicalname);
+    namelookup_free(nl);
+}
+
+NameLookup *sk_namelookup_async(const char *host, int address_family,
+                                int cache_time,
+                                namelookup_callback_fn_t callback, void *ctx)
+{
+    NameLookup *nl = snew(NameLookup);
+    nl->host = dupstr(host);
+    nl->address_family = address_family;
+    nl->callback = callback;
+    nl->ctx = ctx;
+    queue_toplevel_callback(namelookup_deliver, nl);
+    return nl;
+}
+
+void sk_namelookup_cancel(NameLookup *nl)
+{
+    namelookup_free(nl);
+}
+
 SockAddr *sk_namedpipe_addr(const char *pipename)
 {
     SockAddr *ret = snew(SockAddr);
@@ -1092,7 +1151,7 @@ static DWORD try_connect(NetSocket *sock)
 }
 
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
-               bool nodelay, bool keepalive, Plug *plug)
+               bool nodelay, bool keepalive, int connect_delay, Plug *plug)
 {
     NetSocket *ret;
     DWORD err;
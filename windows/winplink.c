@@ -101,6 +101,7 @@ static const SeatVtable plink_seat_vt = {
     console_set_trust_status,
     cmdline_seat_verbose,
     plink_seat_interactive,
+    nullseat_kex_finished,
 };
 static Seat plink_seat[1] = {{ &plink_seat_vt }};
 
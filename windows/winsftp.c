@@ -195,6 +195,22 @@ int write_to_file(WFile *f, void *buffer, int length)
         return written;
 }
 
+int write_to_file_at(WFile *f, uint64_t offset, void *buffer, int length)
+{
+    DWORD written;
+    OVERLAPPED ov;
+
+    /* On a synchronous handle, an OVERLAPPED structure just
+     * supplies the offset to write at. */
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = offset & 0xFFFFFFFFU;
+    ov.OffsetHigh = offset >> 32;
+    if (!WriteFile(f->h, buffer, length, &written, &ov))
+        return -1;                     /* error */
+    else
+        return written;
+}
+
 void set_file_times(WFile *f, unsigned long mtime, unsigned long atime)
 {
     FILETIME actime, wrtime;
@@ -635,6 +651,63 @@ void platform_psftp_pre_conn_setup(LogPolicy *lp)
     }
 }
 
+/*
+ * Background jobs. There's no worker thread on Windows yet, so each
+ * job is simply run when it's submitted.
+ */
+struct bgjob {
+    void *job;
+    struct bgjob *next;
+};
+
+struct BgWorker {
+    bgworker_fn_t fn;
+    struct bgjob *head, *tail;
+};
+
+BgWorker *bgworker_new(bgworker_fn_t fn)
+{
+    BgWorker *w = snew(BgWorker);
+    w->fn = fn;
+    w->head = w->tail = NULL;
+    return w;
+}
+
+void bgworker_submit(BgWorker *w, void *job)
+{
+    struct bgjob *j = snew(struct bgjob);
+
+    w->fn(job);
+    j->job = job;
+    j->next = NULL;
+    if (w->tail)
+        w->tail->next = j;
+    else
+        w->head = j;
+    w->tail = j;
+}
+
+void *bgworker_collect(BgWorker *w, bool wait)
+{
+    struct bgjob *j = w->head;
+    void *job;
+
+    if (!j)
+        return NULL;
+    w->head = j->next;
+    if (!w->head)
+        w->tail = NULL;
+    job = j->job;
+    sfree(j);
+    return job;
+}
+
+void bgworker_free(BgWorker *w)
+{
+    assert(!w->head);
+    sfree(w);
+}
+
 /* ----------------------------------------------------------------------
  * Main program. Parse arguments etc.
  */
@@ -311,7 +311,7 @@ struct X11Display *x11_setup_display(const char *display, Conf *conf,
             /* Create trial connection to see if there is a useful Unix-domain
              * socket */
             Socket *s = sk_new(sk_addr_dup(ux), 0, false, false,
-                               false, false, nullplug);
+                               false, false, 0, nullplug);
             err = sk_socket_error(s);
             sk_close(s);
         }